@@ -0,0 +1,752 @@
+#include "bdos.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ── Disk state ──────────────────────────────────────────────────── */
+
+#define REC      128    /* CP/M record */
+#define EXT_RECS 128    /* Records per 16K extent */
+#define MAP_MIN  16384  /* Length a file grows to on its first write */
+
+/* The disk a program that asks is told about: 2K blocks, DSM+1 of them,
+   64 directory entries in the first two blocks and EXM 0, so that one
+   directory entry is one 16K extent. The DPB and allocation vector are
+   written just above the BDOS entry when asked for. */
+#define DPB_ADDR (BDOS_BASE + 0x10)
+#define ALV_ADDR (BDOS_BASE + 0x20)
+#define BLOCK    2048
+#define DSM      511
+#define DIR_BLKS 2
+
+struct dir_entry {
+    char   name[11];  /* As in an FCB: upper case, blank padded */
+    char   host[13];
+    size_t size;
+    int    ro;
+};
+
+struct bdos_file {
+    char     name[11];  /* name[0] == 0: slot free */
+    int      fd;
+    int      writable;
+    uint8_t *map;
+    size_t   size;      /* Bytes in the file */
+    size_t   cap;       /* Bytes mapped, and the host file's length */
+};
+
+struct bdos_disk {
+    int      dirfd;
+    uint16_t dma;
+    uint8_t  drive, user;
+    uint16_t ro_vec;
+    struct bdos_file files[BDOS_MAX_FILES];
+    unsigned evict;  /* Next slot to close when all are in use */
+
+    /* The directory, sorted by name. Read on first use and by
+       DRV_ALLRESET; the BDOS's own changes keep it current. */
+    struct dir_entry *dir;
+    size_t   ndir, dir_cap;
+    int      dir_read;
+
+    /* F_SFIRST's FCB (drive, name, extent) and progress, for F_SNEXT */
+    uint8_t  pattern[13];
+    size_t   search_pos;
+    unsigned long search_ext;
+};
+
+/* CP/M machines never share memory with a snapshot, so the BDOS works
+   on memory[] directly, and tells the decode cache what it wrote */
+static void mem_get(machine_t *m, uint16_t addr, void *dst, size_t n) {
+    size_t first = 65536u - addr < n ? 65536u - addr : n;
+    memcpy(dst, m->memory + addr, first);
+    memcpy((uint8_t *)dst + first, m->memory, n - first);
+}
+
+static void mem_put(machine_t *m, uint16_t addr, const void *src, size_t n) {
+    size_t first = 65536u - addr < n ? 65536u - addr : n;
+    memcpy(m->memory + addr, src, first);
+    memcpy(m->memory, (const uint8_t *)src + first, n - first);
+    z80_invalidate(&m->cpu, addr, (uint32_t)n);
+}
+
+/* ── Names ───────────────────────────────────────────────────────── */
+
+static int name_char(int c) {
+    return c > 0 && c < 0x80 &&
+           (isalnum(c) || strchr("$#@!%&'()-_{}~^`+", c));
+}
+
+/* FCB form of a host file name, or -1 if it isn't 8.3 */
+static int cpm_name(const char *host, char name[11]) {
+    const char *dot = strchr(host, '.');
+    size_t base = dot ? (size_t)(dot - host) : strlen(host);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base == 0 || base > 8 || ext > 3 || (dot && !ext)) return -1;
+    memset(name, ' ', 11);
+    for (size_t i = 0; i < base; i++) {
+        if (!name_char((unsigned char)host[i])) return -1;
+        name[i] = (char)toupper((unsigned char)host[i]);
+    }
+    for (size_t i = 0; i < ext; i++) {
+        if (!name_char((unsigned char)dot[1 + i])) return -1;
+        name[8 + i] = (char)toupper((unsigned char)dot[1 + i]);
+    }
+    return 0;
+}
+
+/* Host name for a file the program makes or renames to, or -1 if the
+   FCB name can't be one (and be read back as the same name) */
+static int host_name(const char name[11], char host[13]) {
+    char *p = host, back[11];
+    for (int i = 0; i < 11; i++) {
+        if (i == 8 && memcmp(name + 8, "   ", 3) != 0) *p++ = '.';
+        if (name[i] != ' ') *p++ = (char)tolower((unsigned char)name[i]);
+    }
+    *p = '\0';
+    return cpm_name(host, back) == 0 && memcmp(back, name, 11) == 0 ? 0 : -1;
+}
+
+/* The name at fcb+1, attributes stripped */
+static void fcb_name(const uint8_t *fcb, char name[11]) {
+    for (int i = 0; i < 11; i++)
+        name[i] = (char)toupper(fcb[1 + i] & 0x7F);
+}
+
+static int wild(const char name[11]) {
+    return memchr(name, '?', 11) != NULL;
+}
+
+static int name_match(const uint8_t *pattern, const char name[11]) {
+    for (int i = 0; i < 11; i++) {
+        int c = toupper(pattern[i] & 0x7F);
+        if (c != '?' && c != name[i]) return 0;
+    }
+    return 1;
+}
+
+/* ── Directory cache ─────────────────────────────────────────────── */
+
+static int dir_cmp(const void *a, const void *b) {
+    return memcmp(a, b, 11);
+}
+
+static struct dir_entry *dir_add(struct bdos_disk *d,
+                                 const struct dir_entry *e) {
+    if (d->ndir == d->dir_cap) {
+        size_t cap = d->dir_cap ? d->dir_cap * 2 : 64;
+        struct dir_entry *dir = realloc(d->dir, cap * sizeof(*dir));
+        if (!dir) return NULL;
+        d->dir = dir;
+        d->dir_cap = cap;
+    }
+    size_t i = d->ndir;
+    while (i > 0 && memcmp(d->dir[i - 1].name, e->name, 11) > 0) i--;
+    memmove(&d->dir[i + 1], &d->dir[i], (d->ndir - i) * sizeof(*e));
+    d->dir[i] = *e;
+    d->ndir++;
+    return &d->dir[i];
+}
+
+static void dir_remove(struct bdos_disk *d, struct dir_entry *e) {
+    size_t i = (size_t)(e - d->dir);
+    memmove(e, e + 1, (d->ndir - i - 1) * sizeof(*e));
+    d->ndir--;
+}
+
+/* Read the host directory. Of host names that differ only in case,
+   one is kept. */
+static void dir_read(struct bdos_disk *d) {
+    d->ndir = 0;
+    d->dir_read = 1;
+    int fd = d->dirfd < 0 ? -1 : openat(d->dirfd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dp = fd < 0 ? NULL : fdopendir(fd);
+    if (!dp) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dp))) {
+        struct dir_entry e;
+        struct stat st;
+        if (strlen(de->d_name) >= sizeof(e.host) ||
+            cpm_name(de->d_name, e.name) < 0 ||
+            fstatat(d->dirfd, de->d_name, &st, 0) != 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+        strcpy(e.host, de->d_name);
+        e.size = (size_t)st.st_size;
+        e.ro = faccessat(d->dirfd, de->d_name, W_OK, 0) != 0;
+        dir_add(d, &e);
+    }
+    closedir(dp);
+    /* Sort order is the FCB name, so case twins are now neighbours */
+    for (size_t i = 1; i < d->ndir;) {
+        if (dir_cmp(&d->dir[i - 1], &d->dir[i]) == 0)
+            dir_remove(d, &d->dir[i]);
+        else
+            i++;
+    }
+}
+
+static struct dir_entry *dir_find(struct bdos_disk *d, const char name[11]) {
+    if (!d->dir_read) dir_read(d);
+    struct dir_entry *e = d->ndir ? bsearch(name, d->dir, d->ndir,
+                                            sizeof(*d->dir), dir_cmp)
+                                  : NULL;
+    return e;
+}
+
+/* First entry matching a name that may have '?' in it */
+static struct dir_entry *dir_match(struct bdos_disk *d, const char name[11]) {
+    if (!wild(name)) return dir_find(d, name);
+    if (!d->dir_read) dir_read(d);
+    for (size_t i = 0; i < d->ndir; i++)
+        if (name_match((const uint8_t *)name, d->dir[i].name))
+            return &d->dir[i];
+    return NULL;
+}
+
+/* ── Open files ──────────────────────────────────────────────────── */
+
+static struct bdos_file *file_find(struct bdos_disk *d, const char name[11]) {
+    for (int i = 0; i < BDOS_MAX_FILES; i++)
+        if (d->files[i].name[0] && !memcmp(d->files[i].name, name, 11))
+            return &d->files[i];
+    return NULL;
+}
+
+/* Length of name as the program sees it now */
+static size_t file_size(struct bdos_disk *d, const struct dir_entry *e) {
+    struct bdos_file *f = file_find(d, e->name);
+    return f ? f->size : e->size;
+}
+
+static void file_close(struct bdos_disk *d, struct bdos_file *f) {
+    if (f->map) munmap(f->map, f->cap);
+    if (f->cap != f->size && ftruncate(f->fd, (off_t)f->size) != 0)
+        perror("ftruncate");
+    close(f->fd);
+    struct dir_entry *e = dir_find(d, f->name);
+    if (e) e->size = f->size;
+    f->name[0] = '\0';
+}
+
+/* The slot for name, opening and mapping the host file if it isn't
+   already. NULL if there is no such file. */
+static struct bdos_file *file_open(struct bdos_disk *d, const char name[11]) {
+    struct bdos_file *f = file_find(d, name);
+    if (f) return f;
+    struct dir_entry *e = dir_find(d, name);
+    if (!e) return NULL;
+
+    int writable = 1;
+    int fd = openat(d->dirfd, e->host, O_RDWR);
+    if (fd < 0) {
+        writable = 0;
+        fd = openat(d->dirfd, e->host, O_RDONLY);
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    uint8_t *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size,
+                   writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                   fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < BDOS_MAX_FILES && !f; i++)
+        if (!d->files[i].name[0]) f = &d->files[i];
+    if (!f) {
+        f = &d->files[d->evict++ % BDOS_MAX_FILES];
+        file_close(d, f);
+    }
+    memcpy(f->name, name, 11);
+    f->fd = fd;
+    f->writable = writable;
+    f->map = map;
+    f->size = f->cap = (size_t)st.st_size;
+    return f;
+}
+
+/* Make f at least end bytes long, doubling the mapping each time so
+   sequential writes remap O(log n) times. Returns -1 if it can't. */
+static int file_grow(struct bdos_file *f, size_t end) {
+    if (end <= f->cap) return 0;
+    size_t cap = f->cap < MAP_MIN ? MAP_MIN : f->cap;
+    while (cap < end) cap *= 2;
+    if (ftruncate(f->fd, (off_t)cap) != 0) return -1;
+    uint8_t *map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        f->fd, 0);
+    if (map == MAP_FAILED) {
+        if (ftruncate(f->fd, (off_t)f->cap) != 0) perror("ftruncate");
+        return -1;
+    }
+    if (f->map) munmap(f->map, f->cap);
+    f->map = map;
+    f->cap = cap;
+    return 0;
+}
+
+/* Record rec of f to the DMA address, a short last record padded with
+   ^Z. Returns 1 past the end of the file. */
+static int rec_read(machine_t *m, struct bdos_file *f, unsigned long rec) {
+    size_t off = rec * REC;
+    if (off >= f->size) return 1;
+    if (f->size - off >= REC) {
+        mem_put(m, m->disk->dma, f->map + off, REC);
+    } else {
+        uint8_t buf[REC];
+        memcpy(buf, f->map + off, f->size - off);
+        memset(buf + (f->size - off), 0x1A, REC - (f->size - off));
+        mem_put(m, m->disk->dma, buf, REC);
+    }
+    return 0;
+}
+
+/* The DMA buffer to record rec of f. Returns 2 (disk full) if the file
+   is read-only or can't grow. */
+static int rec_write(machine_t *m, struct bdos_file *f, unsigned long rec) {
+    size_t end = (rec + 1) * REC;
+    if (!f->writable || file_grow(f, end) < 0) return 2;
+    mem_get(m, m->disk->dma, f->map + rec * REC, REC);
+    if (end > f->size) f->size = end;
+    return 0;
+}
+
+/* ── FCB positions ───────────────────────────────────────────────── */
+
+/* Extent number from EX and S2, record in the file from those and CR */
+static unsigned long fcb_ext(const uint8_t *fcb) {
+    return (unsigned long)(fcb[14] & 0x3F) << 5 | (fcb[12] & 0x1F);
+}
+
+static unsigned long fcb_rec(const uint8_t *fcb) {
+    return fcb_ext(fcb) * EXT_RECS + fcb[32];
+}
+
+/* Records of a size-byte file in extent ext, for RC */
+static uint8_t ext_rc(size_t size, unsigned long ext) {
+    unsigned long recs = (unsigned long)((size + REC - 1) / REC);
+    if (recs <= ext * EXT_RECS) return 0;
+    recs -= ext * EXT_RECS;
+    return (uint8_t)(recs > EXT_RECS ? EXT_RECS : recs);
+}
+
+static void fcb_seek(uint8_t *fcb, unsigned long rec, size_t size) {
+    unsigned long ext = rec / EXT_RECS;
+    fcb[12] = ext & 0x1F;
+    fcb[14] = (uint8_t)(ext >> 5);
+    fcb[15] = ext_rc(size, ext);
+    fcb[32] = rec % EXT_RECS;
+}
+
+/* Write fcb[from] to fcb[to], inclusive, back to the FCB at addr. The
+   program's FCB may be 33 bytes, so only what changed is stored. */
+static void fcb_store(machine_t *m, uint16_t addr, const uint8_t *fcb,
+                      int from, int to) {
+    mem_put(m, (uint16_t)(addr + from), fcb + from, (size_t)(to - from + 1));
+}
+
+/* ── Functions ───────────────────────────────────────────────────── */
+
+static struct bdos_disk *disk_get(machine_t *m) {
+    if (m->disk) return m->disk;
+    struct bdos_disk *d = calloc(1, sizeof(*d));
+    if (!d) return NULL;
+    const char *dir = m->disk_dir ? m->disk_dir : ".";
+    d->dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (d->dirfd < 0) perror(dir);  /* Then every drive is empty */
+    d->dma = 0x0080;
+    m->disk = d;
+    return d;
+}
+
+/* A directory code (always 0) with the entry for extent ext of e in a
+   128-byte directory record at the DMA address */
+static void put_dir_entry(machine_t *m, const struct dir_entry *e,
+                          unsigned long ext, size_t size) {
+    struct bdos_disk *d = m->disk;
+    uint8_t buf[REC];
+    memset(buf, 0xE5, sizeof(buf));  /* The other three slots are empty */
+    buf[0] = d->user;
+    memcpy(buf + 1, e->name, 11);
+    if (e->ro) buf[9] |= 0x80;
+    buf[12] = ext & 0x1F;
+    buf[13] = 0;
+    buf[14] = (uint8_t)(ext >> 5);
+    buf[15] = ext_rc(size, ext);
+    memset(buf + 16, 0, 16);
+    /* Eight 16-bit block numbers, one per 2K in use */
+    unsigned blocks = (buf[15] * REC + BLOCK - 1) / BLOCK;
+    for (unsigned i = 0; i < blocks; i++) {
+        unsigned block = DIR_BLKS + (unsigned)(ext * 8 + i) % (DSM - 1);
+        buf[16 + 2 * i] = (uint8_t)block;
+        buf[17 + 2 * i] = (uint8_t)(block >> 8);
+    }
+    mem_put(m, d->dma, buf, sizeof(buf));
+}
+
+/* F_SFIRST / F_SNEXT: one directory entry per extent. An EX of '?'
+   matches every extent, and a drive byte of '?' every file. */
+static int f_search(machine_t *m, const uint8_t *fcb, int first) {
+    struct bdos_disk *d = m->disk;
+    if (first) {
+        if (!d->dir_read) dir_read(d);
+        memcpy(d->pattern, fcb, sizeof(d->pattern));
+        d->search_pos = 0;
+        d->search_ext = 0;
+    }
+    int any = d->pattern[0] == '?';
+    for (; d->search_pos < d->ndir; d->search_pos++, d->search_ext = 0) {
+        struct dir_entry *e = &d->dir[d->search_pos];
+        if (!any && !name_match(d->pattern + 1, e->name)) continue;
+        size_t size = file_size(d, e);
+        unsigned long exts = ((size + REC - 1) / REC + EXT_RECS - 1) / EXT_RECS;
+        if (!exts) exts = 1;
+        while (d->search_ext < exts) {
+            unsigned long ext = d->search_ext++;
+            if (any || d->pattern[12] == '?' ||
+                (d->pattern[12] & 0x1F) == (ext & 0x1F)) {
+                put_dir_entry(m, e, ext, size);
+                return 0;
+            }
+        }
+    }
+    return 0xFF;
+}
+
+static int f_open(machine_t *m, uint8_t *fcb, const char *name) {
+    struct bdos_disk *d = m->disk;
+    struct dir_entry *e = dir_match(d, name);
+    struct bdos_file *f = e ? file_open(d, e->name) : NULL;
+    if (!f) return 0xFF;
+    memcpy(fcb + 1, e->name, 11);
+    fcb[14] = 0;
+    fcb[15] = ext_rc(f->size, fcb[12] & 0x1F);
+    return 0;
+}
+
+static int f_delete(machine_t *m, const char *name) {
+    struct bdos_disk *d = m->disk;
+    int a = 0xFF;
+    if (!d->dir_read) dir_read(d);
+    for (size_t i = 0; i < d->ndir;) {
+        struct dir_entry *e = &d->dir[i];
+        if (!name_match((const uint8_t *)name, e->name)) {
+            i++;
+            continue;
+        }
+        struct bdos_file *f = file_find(d, e->name);
+        if (f) file_close(d, f);
+        if (unlinkat(d->dirfd, e->host, 0) != 0) {
+            i++;
+            continue;
+        }
+        dir_remove(d, e);
+        a = 0;
+    }
+    return a;
+}
+
+static int f_make(machine_t *m, uint8_t *fcb, const char *name) {
+    struct bdos_disk *d = m->disk;
+    struct dir_entry *e = dir_find(d, name), ne;
+    if (wild(name)) return 0xFF;
+    if (!e) {
+        memcpy(ne.name, name, 11);
+        if (host_name(name, ne.host) < 0) return 0xFF;
+        ne.size = 0;
+        ne.ro = 0;
+    }
+    struct bdos_file *f = file_find(d, name);
+    if (f) file_close(d, f);
+    /* Making a later extent of a file (as CP/M 1 programs do) keeps it */
+    int trunc = (fcb[12] & 0x1F) == 0;
+    int fd = openat(d->dirfd, e ? e->host : ne.host,
+                    O_RDWR | O_CREAT | (trunc ? O_TRUNC : 0), 0666);
+    if (fd < 0) return 0xFF;
+    close(fd);
+    if (!e && !(e = dir_add(d, &ne))) return 0xFF;
+    if (trunc) e->size = 0;
+    if (!(f = file_open(d, name))) return 0xFF;
+    fcb[14] = 0;
+    fcb[15] = ext_rc(f->size, fcb[12] & 0x1F);
+    memset(fcb + 16, 0, 16);
+    return 0;
+}
+
+/* New name at fcb+17 */
+static int f_rename(machine_t *m, const uint8_t *fcb, const char *name) {
+    struct bdos_disk *d = m->disk;
+    char to[11];
+    fcb_name(fcb + 16, to);
+    struct dir_entry *e = dir_find(d, name), ne;
+    if (!e || wild(to)) return 0xFF;
+    ne = *e;
+    memcpy(ne.name, to, 11);
+    if (host_name(to, ne.host) < 0) return 0xFF;
+    struct bdos_file *f = file_find(d, name);
+    if (f) file_close(d, f);
+    struct dir_entry *old = dir_find(d, to);
+    if (old && old != e) {
+        if ((f = file_find(d, to))) file_close(d, f);
+        if (strcmp(old->host, ne.host) != 0) unlinkat(d->dirfd, old->host, 0);
+    }
+    if (renameat(d->dirfd, e->host, d->dirfd, ne.host) != 0) return 0xFF;
+    if (old && old != e) {
+        dir_remove(d, old);
+        if (old < e) e--;
+    }
+    dir_remove(d, e);
+    dir_add(d, &ne);
+    return 0;
+}
+
+/* F_READ / F_WRITE at the FCB's position, moving it on a record */
+static int f_sequential(machine_t *m, uint8_t *fcb, const char *name,
+                        int write) {
+    struct bdos_file *f = file_open(m->disk, name);
+    if (!f) return 1;  /* Read: end of file. Write: no directory space. */
+    unsigned long rec = fcb_rec(fcb);
+    int a = write ? rec_write(m, f, rec) : rec_read(m, f, rec);
+    if (!a) fcb_seek(fcb, rec + 1, f->size);
+    return a;
+}
+
+/* F_READRAND / F_WRITERAND / F_WRITEZF at the random record R0-R2. The
+   FCB is left positioned at that record, for sequential I/O from it. */
+static int f_random(machine_t *m, uint8_t *fcb, const char *name,
+                    int write) {
+    if (fcb[35]) return 6;  /* Past the 8 MB end of the disk */
+    unsigned long rec = fcb[33] | (unsigned long)fcb[34] << 8;
+    struct bdos_file *f = file_open(m->disk, name);
+    if (!f) return write ? 5 : 4;
+    fcb_seek(fcb, rec, f->size);
+    if (write) return rec_write(m, f, rec);
+    if (rec_read(m, f, rec) == 0) return 0;
+    /* A record past the end is in an extent with no data, or not */
+    return ext_rc(f->size, rec / EXT_RECS) ? 1 : 4;
+}
+
+/* DRV_ALLOCVEC: blocks in use are the directory's and each file's */
+static uint16_t put_alloc_vector(machine_t *m) {
+    struct bdos_disk *d = m->disk;
+    uint8_t alv[(DSM + 8) / 8];
+    if (!d->dir_read) dir_read(d);
+    unsigned long used = DIR_BLKS;
+    for (size_t i = 0; i < d->ndir; i++)
+        used += (file_size(d, &d->dir[i]) + BLOCK - 1) / BLOCK;
+    if (used > DSM + 1) used = DSM + 1;
+    memset(alv, 0, sizeof(alv));
+    for (unsigned long b = 0; b < used; b++) alv[b / 8] |= 0x80 >> b % 8;
+    mem_put(m, ALV_ADDR, alv, sizeof(alv));
+    return ALV_ADDR;
+}
+
+static uint16_t put_dpb(machine_t *m) {
+    static const uint8_t dpb[15] = {
+        64, 0,                      /* SPT: 128-byte records per track */
+        4, 15, 0,                   /* BSH, BLM: 2K blocks; EXM */
+        DSM & 0xFF, DSM >> 8,       /* DSM: blocks - 1 */
+        63, 0,                      /* DRM: directory entries - 1 */
+        0xC0, 0x00,                 /* AL0, AL1: directory blocks */
+        0, 0,                       /* CKS: fixed disk */
+        0, 0,                       /* OFF: no reserved tracks */
+    };
+    mem_put(m, DPB_ADDR, dpb, sizeof(dpb));
+    return DPB_ADDR;
+}
+
+int bdos_disk(machine_t *m) {
+    z80_t *cpu = &m->cpu;
+    uint8_t fn = cpu->C;
+    if (fn < 13 || fn > 40) return 0;
+    struct bdos_disk *d = disk_get(m);
+    if (!d) {
+        cpu->A = cpu->L = 0xFF;
+        return 1;
+    }
+    uint8_t fcb[36];
+    char name[11];
+    mem_get(m, cpu->DE, fcb, sizeof(fcb));
+    fcb_name(fcb, name);
+    int a = 0, hl = -1;  /* Result for A and L, or for HL */
+
+    switch (fn) {
+    case 13: /* DRV_ALLRESET: drive A, DMA at 0080h, directory reread */
+        d->dma = 0x0080;
+        d->drive = 0;
+        d->ro_vec = 0;
+        d->dir_read = 0;
+        break;
+    case 14: /* DRV_SET: E = drive */
+        d->drive = cpu->E & 0x0F;
+        break;
+    case 15: /* F_OPEN */
+        if ((a = f_open(m, fcb, name)) == 0) fcb_store(m, cpu->DE, fcb, 1, 15);
+        break;
+    case 16: /* F_CLOSE */
+        {
+            struct bdos_file *f = file_find(d, name);
+            if (f) file_close(d, f);
+            a = f || dir_find(d, name) ? 0 : 0xFF;
+        }
+        break;
+    case 17: /* F_SFIRST */
+    case 18: /* F_SNEXT */
+        a = f_search(m, fcb, fn == 17);
+        break;
+    case 19: /* F_DELETE */
+        a = f_delete(m, name);
+        break;
+    case 20: /* F_READ */
+    case 21: /* F_WRITE */
+        a = f_sequential(m, fcb, name, fn == 21);
+        fcb_store(m, cpu->DE, fcb, 12, 15);
+        fcb_store(m, cpu->DE, fcb, 32, 32);
+        break;
+    case 22: /* F_MAKE */
+        if ((a = f_make(m, fcb, name)) == 0) fcb_store(m, cpu->DE, fcb, 12, 31);
+        break;
+    case 23: /* F_RENAME */
+        a = f_rename(m, fcb, name);
+        break;
+    case 24: /* DRV_LOGINVEC */
+        hl = 1 | 1 << d->drive;
+        break;
+    case 25: /* DRV_GET */
+        a = d->drive;
+        break;
+    case 26: /* F_DMAOFF */
+        d->dma = cpu->DE;
+        break;
+    case 27: /* DRV_ALLOCVEC */
+        hl = put_alloc_vector(m);
+        break;
+    case 28: /* DRV_SETRO: noted for DRV_ROVEC, not enforced */
+        d->ro_vec |= (uint16_t)(1 << d->drive);
+        break;
+    case 29: /* DRV_ROVEC */
+        hl = d->ro_vec;
+        break;
+    case 30: /* F_ATTRIB: attributes are not kept */
+        a = dir_match(d, name) ? 0 : 0xFF;
+        break;
+    case 31: /* DRV_DPB */
+        hl = put_dpb(m);
+        break;
+    case 32: /* F_USERNUM: E = FF to get */
+        if (cpu->E == 0xFF) a = d->user;
+        else d->user = cpu->E & 0x0F;
+        break;
+    case 33: /* F_READRAND */
+    case 34: /* F_WRITERAND */
+    case 40: /* F_WRITEZF: gaps read as zeros anyway */
+        a = f_random(m, fcb, name, fn != 33);
+        if (a != 6) {
+            fcb_store(m, cpu->DE, fcb, 12, 15);
+            fcb_store(m, cpu->DE, fcb, 32, 32);
+        }
+        break;
+    case 35: /* F_SIZE: records in R0-R2 */
+        {
+            struct dir_entry *e = dir_find(d, name);
+            unsigned long recs = e ? (file_size(d, e) + REC - 1) / REC : 0;
+            fcb[33] = (uint8_t)recs;
+            fcb[34] = (uint8_t)(recs >> 8);
+            fcb[35] = (uint8_t)(recs >> 16);
+            fcb_store(m, cpu->DE, fcb, 33, 35);
+            a = e ? 0 : 0xFF;
+        }
+        break;
+    case 36: /* F_RANDREC: R0-R2 from the sequential position */
+        {
+            unsigned long rec = fcb_rec(fcb);
+            fcb[33] = (uint8_t)rec;
+            fcb[34] = (uint8_t)(rec >> 8);
+            fcb[35] = (uint8_t)(rec >> 16);
+            fcb_store(m, cpu->DE, fcb, 33, 35);
+        }
+        break;
+    default: /* 37 DRV_RESET; 38 and 39 are not CP/M 2.2 calls */
+        break;
+    }
+
+    if (hl >= 0) {
+        cpu->HL = (uint16_t)hl;
+        cpu->A = cpu->L;
+    } else {
+        cpu->A = cpu->L = (uint8_t)a;
+    }
+    return 1;
+}
+
+void bdos_disk_free(machine_t *m) {
+    struct bdos_disk *d = m->disk;
+    if (!d) return;
+    for (int i = 0; i < BDOS_MAX_FILES; i++)
+        if (d->files[i].name[0]) file_close(d, &d->files[i]);
+    if (d->dirfd >= 0) close(d->dirfd);
+    free(d->dir);
+    free(d);
+    m->disk = NULL;
+}
+
+/* ── Command line ────────────────────────────────────────────────── */
+
+/* One part of a file name into len bytes at dst: '*' fills the rest
+   with '?'. Returns where it stopped. */
+static const char *parse_part(uint8_t *dst, int len, const char *s) {
+    for (int i = 0; *s && !strchr(" .=_:;<>,", *s); s++) {
+        if (*s == '*') {
+            while (i < len) dst[i++] = '?';
+        } else if (i < len) {
+            dst[i++] = (uint8_t)toupper((unsigned char)*s);
+        }
+    }
+    return s;
+}
+
+/* The next word of s into a 16-byte default FCB. Returns the rest. */
+static const char *parse_fcb(uint8_t *fcb, const char *s) {
+    memset(fcb, 0, 16);
+    memset(fcb + 1, ' ', 11);
+    while (*s == ' ') s++;
+    int drive = toupper((unsigned char)s[0]);
+    if (drive >= 'A' && drive <= 'P' && s[1] == ':') {
+        fcb[0] = (uint8_t)(drive - 'A' + 1);
+        s += 2;
+    }
+    s = parse_part(fcb + 1, 8, s);
+    if (*s == '.') s = parse_part(fcb + 9, 3, s + 1);
+    while (*s && *s != ' ') s++;
+    return s;
+}
+
+void bdos_command_tail(machine_t *m, const char *args) {
+    uint8_t tail[REC], fcbs[36] = { 0 };  /* 005Ch to 007Fh */
+    size_t n = 0;
+    if (*args) tail[1 + n++] = ' ';
+    for (; *args && n < REC - 2; args++)
+        tail[1 + n++] = (uint8_t)toupper((unsigned char)*args);
+    tail[0] = (uint8_t)n;
+    tail[1 + n] = 0;
+    parse_fcb(fcbs + 16, parse_fcb(fcbs, (const char *)tail + 1));
+    mem_put(m, 0x005C, fcbs, sizeof(fcbs));
+    mem_put(m, 0x0080, tail, n + 2);
+}
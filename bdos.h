@@ -0,0 +1,32 @@
+#ifndef BDOS_H
+#define BDOS_H
+
+#include "machine.h"
+
+/* ── CP/M disk and file services ─────────────────────────────────── */
+
+/* Every drive is one host directory, m->disk_dir or the current one.
+   Files whose names fit 8.3 show up under their upper-cased names, and
+   files the program makes are created in lower case. An open file is
+   mmap()ed, so a 128-byte record read or write is a memcpy() to or from
+   the DMA address. Positions live in the FCB, as in CP/M, so a program
+   may copy or abandon FCBs freely; host files stay open until the FCB is
+   closed or the slot is needed for another. */
+
+#define BDOS_MAX_FILES 16     /* Host files open at once */
+#define BDOS_BASE      0xFE00 /* BDOS entry at 0005h jumps here: TPA top */
+
+/* BDOS functions 13 to 40 with the function in C and the argument in
+   DE, results in A and L, or HL, as CP/M 2.2 returns them. Returns 0 if
+   C is not one of them. */
+int  bdos_disk(machine_t *m);
+/* Close m's host files, trimming each to its final length.
+   machine_free() calls it. */
+void bdos_disk_free(machine_t *m);
+
+/* What the CCP leaves for a command line: args upper-cased as the
+   command tail at 0080h, and its first two words parsed into the
+   default FCBs at 005Ch and 006Ch */
+void bdos_command_tail(machine_t *m, const char *args);
+
+#endif /* BDOS_H */
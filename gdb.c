@@ -0,0 +1,559 @@
+#include "gdb.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* ── Stub state ──────────────────────────────────────────────────── */
+
+#define PACKET_MAX 4096  /* Longest packet either way, told to gdb */
+#define NREGS      13
+
+/* Signal numbers as gdb has them */
+enum { SIGNAL_INT = 2, SIGNAL_TRAP = 5 };
+
+struct gdb_stub {
+    int      fd;
+    int      running;       /* gdb is waiting for a stop reply */
+    int      stop_pending;  /* stop_event() is scheduled */
+    int      stepping;      /* In single_step(): stops need no event */
+    int      signal;        /* For the next stop reply */
+    int32_t  resume_pc;     /* Breakpoint to run through on resuming */
+
+    /* The watch hit that stopped the machine, if any */
+    int      watched;
+    uint16_t watch_addr;
+    int      watch_kind;
+
+    /* Breakpoints, and the traps they were set over */
+    struct { uint16_t addr; z80_trap_fn prev; } brk[GDB_MAX_BREAKS];
+    int      nbrk;
+    struct { uint16_t addr; uint32_t len; int kind; } watch[Z80_MAX_WATCHES];
+    int      nwatch;
+
+    uint8_t  in[PACKET_MAX];
+    size_t   in_pos, in_len;
+    char     pkt[PACKET_MAX + 1];
+    char     reply[PACKET_MAX + 1];
+};
+
+static void stop_event(machine_t *m, void *arg);
+
+/* ── Packets ─────────────────────────────────────────────────────── */
+
+/* Next byte from gdb; -1 once it has gone. With nowait, -2 if none has
+   arrived. */
+static int get_byte(gdb_stub_t *g, int nowait) {
+    if (g->in_pos == g->in_len) {
+        ssize_t n;
+        do {
+            n = recv(g->fd, g->in, sizeof(g->in), nowait ? MSG_DONTWAIT : 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && nowait && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -2;
+        if (n <= 0) return -1;
+        g->in_pos = 0;
+        g->in_len = (size_t)n;
+    }
+    return g->in[g->in_pos++];
+}
+
+static int send_all(gdb_stub_t *g, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(g->fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Send data as a packet and wait for gdb's acknowledgement, resending on
+   a NAK. Returns -1 if gdb has gone. */
+static int put_packet(gdb_stub_t *g, const char *data) {
+    static const char hex[] = "0123456789abcdef";
+    char frame[PACKET_MAX + 4];
+    size_t n = strlen(data);
+    uint8_t sum = 0;
+    frame[0] = '$';
+    for (size_t i = 0; i < n; i++) sum += (uint8_t)data[i];
+    memcpy(frame + 1, data, n);
+    frame[n + 1] = '#';
+    frame[n + 2] = hex[sum >> 4];
+    frame[n + 3] = hex[sum & 15];
+    for (;;) {
+        if (send_all(g, frame, n + 4) < 0) return -1;
+        int c;
+        while ((c = get_byte(g, 0)) != '+' && c != '-')
+            if (c < 0) return -1;
+        if (c == '+') return 0;
+    }
+}
+
+/* Read the next packet into g->pkt, acknowledging it. Stray bytes
+   between packets (a Ctrl-C while stopped) are dropped. Returns its
+   length, or -1 if gdb has gone. */
+static int get_packet(gdb_stub_t *g) {
+    for (;;) {
+        int c;
+        while ((c = get_byte(g, 0)) != '$')
+            if (c < 0) return -1;
+        size_t n = 0;
+        uint8_t sum = 0;
+        while ((c = get_byte(g, 0)) != '#') {
+            if (c < 0) return -1;
+            if (n < PACKET_MAX) g->pkt[n] = (char)c;
+            n++;
+            sum += (uint8_t)c;
+        }
+        int hi = get_byte(g, 0), lo = get_byte(g, 0);
+        if (hi < 0 || lo < 0) return -1;
+        if (n <= PACKET_MAX && hex_digit(hi) * 16 + hex_digit(lo) == sum) {
+            if (send_all(g, "+", 1) < 0) return -1;
+            g->pkt[n] = 0;
+            return (int)n;
+        }
+        if (send_all(g, "-", 1) < 0) return -1;
+    }
+}
+
+/* Hex number at *s, moving *s past it; -1 if there is none */
+static long get_hex(const char **s) {
+    long v = 0;
+    int n = 0, d;
+    while (n < 8 && (d = hex_digit(**s)) >= 0) {
+        v = v * 16 + d;
+        (*s)++;
+        n++;
+    }
+    return n ? v : -1;
+}
+
+/* Byte as two hex digits at *s, moving *s past them; -1 if not there */
+static int get_byte_hex(const char **s) {
+    int hi = hex_digit((*s)[0]), lo = hi < 0 ? -1 : hex_digit((*s)[1]);
+    if (lo < 0) return -1;
+    *s += 2;
+    return hi * 16 + lo;
+}
+
+/* ── Registers and memory ────────────────────────────────────────── */
+
+static void regs_get(machine_t *m, uint16_t *r) {
+    z80_state_t st;
+    z80_save_state(&m->cpu, &st);
+    uint16_t regs[NREGS] = {
+        st.af, st.bc, st.de, st.hl, st.sp, st.pc, st.ix, st.iy,
+        st.af_, st.bc_, st.de_, st.hl_, (uint16_t)(st.i << 8 | st.r),
+    };
+    memcpy(r, regs, sizeof(regs));
+}
+
+static void regs_set(machine_t *m, const uint16_t *r) {
+    z80_state_t st;
+    z80_save_state(&m->cpu, &st);
+    st.af = r[0];  st.bc = r[1];  st.de = r[2];   st.hl = r[3];
+    st.sp = r[4];  st.pc = r[5];  st.ix = r[6];   st.iy = r[7];
+    st.af_ = r[8]; st.bc_ = r[9]; st.de_ = r[10]; st.hl_ = r[11];
+    st.i = r[12] >> 8;
+    st.r = r[12] & 0xFF;
+    z80_load_state(&m->cpu, &st);
+}
+
+/* Registers go over the wire low byte first */
+static char *put_reg(char *out, uint16_t v) {
+    sprintf(out, "%02x%02x", v & 0xFF, v >> 8);
+    return out + 4;
+}
+
+static int get_reg(const char **s, uint16_t *v) {
+    int lo = get_byte_hex(s), hi = lo < 0 ? -1 : get_byte_hex(s);
+    if (hi < 0) return -1;
+    *v = (uint16_t)(hi << 8 | lo);
+    return 0;
+}
+
+/* gdb's reads and writes go to m->memory behind the CPU's back, so they
+   trip no watches */
+static void mem_dump(machine_t *m, char *out, uint16_t addr, long len) {
+    for (long i = 0; i < len; i++)
+        out += sprintf(out, "%02x", m->memory[(uint16_t)(addr + i)]);
+}
+
+/* All of the data or none of it: a short or bad payload changes nothing */
+static int mem_load(machine_t *m, uint16_t addr, long len, const char *s) {
+    uint8_t buf[PACKET_MAX / 2];  /* The caller keeps len within it */
+    for (long i = 0; i < len; i++) {
+        int b = get_byte_hex(&s);
+        if (b < 0) return -1;
+        buf[i] = (uint8_t)b;
+    }
+    for (long i = 0; i < len; i++) m->memory[(uint16_t)(addr + i)] = buf[i];
+    z80_invalidate(&m->cpu, addr, (uint32_t)len);
+    return 0;
+}
+
+/* ── Breakpoints and watches ─────────────────────────────────────── */
+
+static int find_break(const gdb_stub_t *g, uint16_t addr) {
+    for (int i = 0; i < g->nbrk; i++)
+        if (g->brk[i].addr == addr) return i;
+    return -1;
+}
+
+/* Have the machine stop once the current instruction is done, and serve
+   gdb from there */
+static void want_stop(machine_t *m, int signal) {
+    gdb_stub_t *g = m->gdb;
+    g->signal = signal;
+    z80_break(&m->cpu);
+    if (g->stepping || g->stop_pending) return;
+    if (machine_schedule(m, m->cpu.t_states, stop_event, NULL) == 0)
+        g->stop_pending = 1;
+}
+
+/* A breakpoint's trap: stop before the instruction, unless it is the one
+   being resumed from, which runs the trap the breakpoint hides instead */
+static int on_break(z80_t *cpu, uint16_t addr) {
+    machine_t *m = cpu->ctx;
+    gdb_stub_t *g = m->gdb;
+    if (g->resume_pc == addr) {
+        z80_trap_fn prev = g->brk[find_break(g, addr)].prev;
+        g->resume_pc = -1;
+        return prev ? prev(cpu, addr) : 0;
+    }
+    want_stop(m, SIGNAL_TRAP);
+    return 1;
+}
+
+static void on_watch(z80_t *cpu, uint16_t addr, uint8_t val, int kind) {
+    machine_t *m = cpu->ctx;
+    gdb_stub_t *g = m->gdb;
+    (void)val;
+    if (g->watched) return;  /* The first hit is the one reported */
+    g->watched = 1;
+    g->watch_addr = addr;
+    g->watch_kind = kind;
+    want_stop(m, SIGNAL_TRAP);
+}
+
+/* Z and z packets: type 0 and 1 are breakpoints, 2 to 4 write, read and
+   access watches with kind their length. Returns -1 if unsupported or
+   out of room. */
+static int set_point(machine_t *m, int insert, const char *s) {
+    gdb_stub_t *g = m->gdb;
+    z80_t *cpu = &m->cpu;
+    long type = get_hex(&s), addr = -1, len = -1;
+    if (*s == ',') { s++; addr = get_hex(&s); }
+    if (*s == ',') { s++; len = get_hex(&s); }
+    if (type < 0 || type > 4 || addr < 0 || addr > 0xFFFF) return -1;
+
+    if (type <= 1) {
+        int i = find_break(g, (uint16_t)addr);
+        if (insert) {
+            if (i >= 0) return 0;
+            if (g->nbrk == GDB_MAX_BREAKS) return -1;
+            z80_trap_fn prev = z80_get_trap(cpu, (uint16_t)addr);
+            if (z80_set_trap(cpu, (uint16_t)addr, on_break) < 0) return -1;
+            g->brk[g->nbrk].addr = (uint16_t)addr;
+            g->brk[g->nbrk++].prev = prev;
+        } else if (i >= 0) {
+            z80_set_trap(cpu, (uint16_t)addr, g->brk[i].prev);
+            g->brk[i] = g->brk[--g->nbrk];
+        }
+        return 0;
+    }
+
+    int kind = type == 2 ? Z80_WATCH_WRITE :
+               type == 3 ? Z80_WATCH_READ : Z80_WATCH_READ | Z80_WATCH_WRITE;
+    if (len < 1) len = 1;
+    if (len > 65536) return -1;
+    int i;
+    for (i = 0; i < g->nwatch; i++)
+        if (g->watch[i].addr == addr && g->watch[i].len == (uint32_t)len &&
+            g->watch[i].kind == kind) break;
+    if (insert) {
+        if (i < g->nwatch) return 0;
+        if (z80_set_watch(cpu, (uint16_t)addr, (uint32_t)len, kind,
+                          on_watch) < 0) return -1;
+        g->watch[g->nwatch].addr = (uint16_t)addr;
+        g->watch[g->nwatch].len = (uint32_t)len;
+        g->watch[g->nwatch++].kind = kind;
+    } else if (i < g->nwatch) {
+        z80_set_watch(cpu, (uint16_t)addr, (uint32_t)len, kind, NULL);
+        g->watch[i] = g->watch[--g->nwatch];
+    }
+    return 0;
+}
+
+/* ── Session ─────────────────────────────────────────────────────── */
+
+/* Forget gdb: its breakpoints and watches go, hidden traps come back */
+static void drop(machine_t *m) {
+    gdb_stub_t *g = m->gdb;
+    for (int i = 0; i < g->nbrk; i++)
+        z80_set_trap(&m->cpu, g->brk[i].addr, g->brk[i].prev);
+    for (int i = 0; i < g->nwatch; i++)
+        z80_set_watch(&m->cpu, g->watch[i].addr, g->watch[i].len,
+                      g->watch[i].kind, NULL);
+    close(g->fd);
+    free(g);
+    m->gdb = NULL;
+}
+
+static void stop_reply(const gdb_stub_t *g, char *out) {
+    if (!g->watched) {
+        sprintf(out, "S%02x", g->signal);
+        return;
+    }
+    /* An access watch holding the byte reports as one */
+    const char *what = g->watch_kind == Z80_WATCH_WRITE ? "watch" : "rwatch";
+    for (int i = 0; i < g->nwatch; i++)
+        if ((uint16_t)(g->watch_addr - g->watch[i].addr) < g->watch[i].len &&
+            g->watch[i].kind == (Z80_WATCH_READ | Z80_WATCH_WRITE))
+            what = "awatch";
+    sprintf(out, "T%02x%s:%04x;", g->signal, what, g->watch_addr);
+}
+
+/* Run one instruction for an s packet, through a breakpoint at PC */
+static void single_step(machine_t *m) {
+    gdb_stub_t *g = m->gdb;
+    g->watched = 0;
+    g->signal = SIGNAL_TRAP;
+    if (find_break(g, m->cpu.PC) >= 0) g->resume_pc = m->cpu.PC;
+    g->stepping = 1;
+    z80_step(&m->cpu);
+    g->stepping = 0;
+    g->resume_pc = -1;
+}
+
+/* Move PC to the address a c or s packet may carry */
+static void resume_at(machine_t *m, const char *s) {
+    long addr = get_hex(&s);
+    if (addr >= 0) m->cpu.PC = (uint16_t)addr;
+}
+
+/* Answer gdb until it resumes the machine, kills it or goes. The
+   machine is between instructions. */
+static void serve(machine_t *m) {
+    gdb_stub_t *g = m->gdb;
+    char *out = g->reply;
+    g->resume_pc = -1;
+    machine_flush(m);  /* Output so far goes before gdb's prompt */
+    if (g->running) {
+        g->running = 0;
+        stop_reply(g, out);
+        if (put_packet(g, out) < 0) goto gone;
+    }
+
+    for (;;) {
+        if (get_packet(g) < 0) goto gone;
+        const char *s = g->pkt + 1;
+        uint16_t r[NREGS];
+        long addr, len, n;
+        out[0] = 0;
+        switch (g->pkt[0]) {
+        case '?':
+            stop_reply(g, out);
+            break;
+        case 'g': {
+            char *p = out;
+            regs_get(m, r);
+            for (int i = 0; i < NREGS; i++) p = put_reg(p, r[i]);
+            break;
+        }
+        case 'G':
+            for (n = 0; n < NREGS && get_reg(&s, &r[n]) == 0; n++)
+                ;
+            if (n < NREGS) {
+                strcpy(out, "E01");
+            } else {
+                regs_set(m, r);
+                strcpy(out, "OK");
+            }
+            break;
+        case 'p':
+            n = get_hex(&s);
+            regs_get(m, r);
+            if (n >= 0 && n < NREGS)
+                put_reg(out, r[n]);
+            else
+                strcpy(out, "E01");
+            break;
+        case 'P': {
+            uint16_t v;
+            n = get_hex(&s);
+            if (n < 0 || n >= NREGS || *s++ != '=' || get_reg(&s, &v) < 0) {
+                strcpy(out, "E01");
+                break;
+            }
+            regs_get(m, r);
+            r[n] = v;
+            regs_set(m, r);
+            strcpy(out, "OK");
+            break;
+        }
+        case 'm':
+            addr = get_hex(&s);
+            len = *s++ == ',' ? get_hex(&s) : -1;
+            if (addr < 0 || len < 0 || len > PACKET_MAX / 2)
+                strcpy(out, "E01");
+            else
+                mem_dump(m, out, (uint16_t)addr, len);
+            break;
+        case 'M':
+            addr = get_hex(&s);
+            len = *s++ == ',' ? get_hex(&s) : -1;
+            if (addr < 0 || len < 0 || len > PACKET_MAX / 2 || *s++ != ':' ||
+                mem_load(m, (uint16_t)addr, len, s) < 0)
+                strcpy(out, "E01");
+            else
+                strcpy(out, "OK");
+            break;
+        case 'c':
+            resume_at(m, s);
+            if (find_break(g, m->cpu.PC) >= 0) g->resume_pc = m->cpu.PC;
+            g->watched = 0;
+            g->signal = SIGNAL_TRAP;
+            g->running = 1;
+            return;
+        case 's':
+            resume_at(m, s);
+            single_step(m);
+            if (m->quit) {
+                /* Stepped into the program's exit */
+                put_packet(g, "W00");
+                drop(m);
+                return;
+            }
+            stop_reply(g, out);
+            break;
+        case 'Z':
+        case 'z':
+            strcpy(out, set_point(m, g->pkt[0] == 'Z', s) == 0 ? "OK" : "E01");
+            break;
+        case 'k':
+            m->quit = 1;
+            drop(m);
+            return;
+        case 'D':
+            put_packet(g, "OK");
+            drop(m);
+            return;
+        case 'H':
+        case 'T':
+            strcpy(out, "OK");
+            break;
+        case 'q':
+            if (strncmp(s, "Supported", 9) == 0)
+                sprintf(out, "PacketSize=%x", PACKET_MAX);
+            else if (strncmp(s, "Attached", 8) == 0)
+                strcpy(out, "1");
+            break;
+        default:
+            break;  /* Unsupported: the empty reply */
+        }
+        if (put_packet(g, out) < 0) goto gone;
+    }
+
+gone:
+    fprintf(stderr, "\r\ngdb disconnected\r\n");
+    drop(m);
+}
+
+static void stop_event(machine_t *m, void *arg) {
+    (void)arg;
+    if (!m->gdb) return;
+    m->gdb->stop_pending = 0;
+    serve(m);
+}
+
+/* While the machine runs, all gdb may send is Ctrl-C */
+static void poll_event(machine_t *m, void *arg) {
+    gdb_stub_t *g = m->gdb;
+    if (!g) return;
+    machine_schedule(m, m->cpu.t_states + GDB_POLL, poll_event, arg);
+    for (;;) {
+        int c = get_byte(g, 1);
+        if (c == -2) return;
+        if (c < 0) {
+            fprintf(stderr, "\r\ngdb disconnected\r\n");
+            drop(m);
+            return;
+        }
+        if (c == 0x03) {
+            want_stop(m, SIGNAL_INT);
+            return;
+        }
+    }
+}
+
+/* ── Public API ──────────────────────────────────────────────────── */
+
+int gdb_attach(machine_t *m, int port) {
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0) {
+        perror("listen");
+        close(lfd);
+        return -1;
+    }
+    fprintf(stderr, "Waiting for gdb: target remote :%d\n", port);
+    int fd;
+    do {
+        fd = accept(lfd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    close(lfd);
+    if (fd < 0) {
+        perror("accept");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    gdb_stub_t *g = calloc(1, sizeof(*g));
+    if (!g) {
+        perror("calloc");
+        close(fd);
+        return -1;
+    }
+    g->fd = fd;
+    g->resume_pc = -1;
+    g->signal = SIGNAL_TRAP;
+    m->gdb = g;
+    g->stop_pending = 1;
+    machine_schedule(m, m->cpu.t_states, stop_event, NULL);
+    machine_schedule(m, m->cpu.t_states + GDB_POLL, poll_event, NULL);
+    fprintf(stderr, "gdb connected\n");
+    return 0;
+}
+
+void gdb_detach(machine_t *m) {
+    gdb_stub_t *g = m->gdb;
+    if (!g) return;
+    if (g->running) put_packet(g, "W00");
+    drop(m);
+}
@@ -0,0 +1,30 @@
+#ifndef GDB_H
+#define GDB_H
+
+#include "machine.h"
+
+/* ── GDB remote stub ─────────────────────────────────────────────── */
+
+/* Debug a machine from gdb (one built for z80, GDB 11 or later) over the
+   remote serial protocol: "target remote :PORT". The stub runs on the
+   emulation thread, between instructions, from machine events. Software
+   and hardware breakpoints are PC traps; watchpoints are z80_set_watch()
+   ranges, so code that touches no watched page runs at full speed, and
+   with nothing set only the check for Ctrl-C every GDB_POLL T-states is
+   left. Registers are AF BC DE HL SP PC IX IY AF' BC' DE' HL' IR, in
+   the order of gdb's z80 target. */
+
+#define GDB_PORT_DEFAULT 1234
+#define GDB_MAX_BREAKS   16
+#define GDB_POLL         (1ul << 20)  /* T-states between Ctrl-C checks */
+
+/* Listen on 127.0.0.1:port and wait for gdb to connect, then leave m
+   stopped at its next instruction for gdb to look at. Call once m is
+   loaded and before machine_run(). Returns 0, or -1 with a message on
+   stderr. */
+int  gdb_attach(machine_t *m, int port);
+/* Tell a gdb that is waiting on m that the program has exited, and drop
+   the connection with all its breakpoints and watches */
+void gdb_detach(machine_t *m);
+
+#endif /* GDB_H */
@@ -0,0 +1,1630 @@
+#include "machine.h"
+#include "bdos.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ── Host I/O thread ──────────────────────────────────────────────── */
+
+/* With machine_io_start(), a host thread owns in_fd and out_fd and the
+   CPU's thread makes no console syscalls of its own. Bytes cross in two
+   single-producer, single-consumer rings: rx from the I/O thread to the
+   CPU, tx the other way. The I/O thread sleeps in poll() on in_fd and
+   tx_wake; the CPU writes tx_wake only when it finds the thread asleep,
+   so a busy console costs it nothing but the copy into the ring. Input
+   arriving also goes down rx_wake, for an idle CPU to sleep on. */
+
+#define IO_RING 65536  /* Bytes, a power of two */
+
+struct io_ring {
+    uint8_t buf[IO_RING];
+    _Atomic size_t head;  /* Count written by the producer */
+    _Atomic size_t tail;  /* Count taken by the consumer */
+};
+
+struct machine_io {
+    struct io_ring rx, tx;
+    int        in_fd, out_fd;   /* The thread's own copies */
+    int        rx_wake[2];      /* Pipe: input arrived */
+    int        tx_wake[2];      /* Pipe: output queued, or stop */
+    atomic_int sleeping;        /* The thread is in (or near) poll() */
+    atomic_int eof;             /* in_fd has ended */
+    atomic_int stop;
+    pthread_t  thread;
+};
+
+static size_t ring_used(struct io_ring *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+           atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/* Producer: copy in up to len bytes, as many as fit. Returns how many. */
+static size_t ring_put(struct io_ring *r, const void *buf, size_t len) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t room = IO_RING -
+        (head - atomic_load_explicit(&r->tail, memory_order_acquire));
+    if (len > room) len = room;
+    size_t at = head & (IO_RING - 1), first = IO_RING - at;
+    if (first > len) first = len;
+    memcpy(r->buf + at, buf, first);
+    memcpy(r->buf, (const uint8_t *)buf + first, len - first);
+    atomic_store(&r->head, head + len);  /* seq_cst: see io_kick() */
+    return len;
+}
+
+/* Consumer: copy out up to len bytes. Returns how many. */
+static size_t ring_get(struct io_ring *r, void *buf, size_t len) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t used = atomic_load_explicit(&r->head, memory_order_acquire) - tail;
+    if (len > used) len = used;
+    size_t at = tail & (IO_RING - 1), first = IO_RING - at;
+    if (first > len) first = len;
+    memcpy(buf, r->buf + at, first);
+    memcpy((uint8_t *)buf + first, r->buf, len - first);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+    return len;
+}
+
+static void pipe_poke(int fd) {
+    char b = 0;
+    (void)!write(fd, &b, 1);  /* A full pipe is already a wakeup */
+}
+
+static void pipe_drain(int fd) {
+    char b[64];
+    while (read(fd, b, sizeof(b)) > 0) {}
+}
+
+/* Wake the I/O thread if it is asleep. It sets sleeping before its last
+   look at the tx ring, and ring_put() stores head before this load, both
+   seq_cst: either it sees the bytes or we see it asleep. */
+static void io_kick(struct machine_io *io) {
+    if (atomic_load(&io->sleeping)) pipe_poke(io->tx_wake[1]);
+}
+
+/* Write out all of tx. out_fd gone: drop it. */
+static void io_send(struct machine_io *io) {
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = ring_get(&io->tx, buf, sizeof(buf))) > 0) {
+        size_t done = 0;
+        while (done < n && io->out_fd >= 0) {
+            ssize_t w = write(io->out_fd, buf + done, n - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            done += (size_t)w;
+        }
+    }
+}
+
+/* Read what in_fd has into rx, as far as there is room */
+static void io_receive(struct machine_io *io) {
+    uint8_t buf[4096];
+    size_t room = IO_RING - ring_used(&io->rx);
+    if (room > sizeof(buf)) room = sizeof(buf);
+    ssize_t n = read(io->in_fd, buf, room);
+    if (n > 0) {
+        ring_put(&io->rx, buf, (size_t)n);
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+        io->in_fd = -1;
+        atomic_store(&io->eof, 1);
+    } else {
+        return;
+    }
+    pipe_poke(io->rx_wake[1]);
+}
+
+/* Poll period while rx is full, waiting for the CPU to make room */
+#define IO_FULL_WAIT_MS 10
+
+static void *io_thread(void *arg) {
+    struct machine_io *io = arg;
+    for (;;) {
+        io_send(io);
+        atomic_store(&io->sleeping, 1);
+        if (ring_used(&io->tx)) {
+            atomic_store(&io->sleeping, 0);
+            continue;
+        }
+        if (atomic_load(&io->stop)) break;
+        int rx_room = ring_used(&io->rx) < IO_RING;
+        struct pollfd pfd[2] = {
+            { .fd = io->tx_wake[0], .events = POLLIN },
+            { .fd = rx_room ? io->in_fd : -1, .events = POLLIN },
+        };
+        int ready = poll(pfd, 2, rx_room || io->in_fd < 0 ? -1
+                                                         : IO_FULL_WAIT_MS);
+        atomic_store(&io->sleeping, 0);
+        if (ready <= 0) continue;
+        if (pfd[0].revents) pipe_drain(io->tx_wake[0]);
+        if (pfd[1].revents) io_receive(io);
+    }
+    return NULL;
+}
+
+int machine_io_start(machine_t *m) {
+    struct machine_io *io = calloc(1, sizeof(*io));
+    if (!io) return -1;
+    io->in_fd = m->in_fd;
+    io->out_fd = m->out_fd;
+    if (pipe(io->rx_wake) < 0) goto fail_rx;
+    if (pipe(io->tx_wake) < 0) goto fail_tx;
+    for (int i = 0; i < 2; i++) {
+        fcntl(io->rx_wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(io->tx_wake[i], F_SETFL, O_NONBLOCK);
+    }
+    if (pthread_create(&io->thread, NULL, io_thread, io) != 0) goto fail;
+    if (m->out_pend_len) machine_flush(m);
+    m->io = io;
+    return 0;
+fail:
+    close(io->tx_wake[0]);
+    close(io->tx_wake[1]);
+fail_tx:
+    close(io->rx_wake[0]);
+    close(io->rx_wake[1]);
+fail_rx:
+    free(io);
+    return -1;
+}
+
+void machine_io_stop(machine_t *m) {
+    struct machine_io *io = m->io;
+    if (!io) return;
+    atomic_store(&io->stop, 1);
+    pipe_poke(io->tx_wake[1]);
+    pthread_join(io->thread, NULL);  /* After writing out all of tx */
+    for (int i = 0; i < 2; i++) {
+        close(io->rx_wake[i]);
+        close(io->tx_wake[i]);
+    }
+    free(io);
+    m->io = NULL;
+}
+
+/* Output the CPU can queue now without waiting */
+static int io_tx_ready(machine_t *m) {
+    return !m->io || ring_used(&m->io->tx) < IO_RING;
+}
+
+/* Queue output for the I/O thread. If the terminal has fallen a whole
+   ring behind, the CPU waits for it, as it would on a serial line. */
+static void io_write(machine_t *m, const void *buf, size_t len) {
+    struct machine_io *io = m->io;
+    const uint8_t *p = buf;
+    while (len) {
+        size_t n = ring_put(&io->tx, p, len);
+        io_kick(io);
+        p += n;
+        len -= n;
+        if (len) nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+    }
+}
+
+/* ── Record and replay ───────────────────────────────────────────── */
+
+/* After the header, a recording is a stream of records, each a tag
+   byte. Timed ones (input, idle, end of input, end) go on with a varint
+   of the cycles since the previous timed one, and input, idle and output
+   with their varint length or advance and contents. Output is held back
+   and written as one record before the next timed one. Nothing else the
+   machine does depends on the host, so in a replay the next record is
+   always the next thing to happen; the transcript is checked in the same
+   stream. */
+
+enum { LOG_INPUT = 1, LOG_IDLE, LOG_EOF, LOG_OUTPUT, LOG_END };
+
+#define LOG_HEADER 20  /* Magic, version, sys, rx_flow, start state hash */
+
+struct log_rec {
+    uint8_t       tag;
+    uint8_t       ready;     /* LOG_IDLE: input was waiting */
+    unsigned long t;         /* Timed records */
+    unsigned long cycles;    /* LOG_IDLE: t_states moved on by */
+    size_t        off, len;  /* LOG_INPUT, LOG_OUTPUT: bytes in buf */
+};
+
+struct machine_log {
+    int      replay;
+    unsigned long t;         /* Stamp of the last timed record */
+
+    /* Recording */
+    FILE    *f;
+    uint8_t  out[MACHINE_OUT_BUF];  /* Output not written yet */
+    size_t   out_len;
+
+    /* Replay: the whole file, parsed up front */
+    uint8_t *buf;
+    struct log_rec *recs;
+    size_t   nrecs, next;
+    size_t   out_pos;        /* Bytes of recs[next] matched so far */
+    unsigned long end_t;
+    int      diverged;
+};
+
+static void log_varint(FILE *f, unsigned long v) {
+    while (v >= 0x80) {
+        putc((int)(v & 0x7F) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int)v, f);
+}
+
+static void log_put_output(struct machine_log *l) {
+    if (!l->out_len) return;
+    putc(LOG_OUTPUT, l->f);
+    log_varint(l->f, l->out_len);
+    fwrite(l->out, 1, l->out_len, l->f);
+    l->out_len = 0;
+}
+
+/* Begin a timed record at t */
+static void log_stamp(struct machine_log *l, int tag, unsigned long t) {
+    log_put_output(l);
+    putc(tag, l->f);
+    log_varint(l->f, t - l->t);
+    l->t = t;
+}
+
+/* The run has left the recording: stop it there */
+static void replay_diverged(machine_t *m, const char *why) {
+    if (!m->log->diverged)
+        fprintf(stderr, "\r\nReplay diverged at T-state %lu: %s\r\n",
+                m->cpu.t_states, why);
+    m->log->diverged = 1;
+    m->quit = 1;
+    z80_break(&m->cpu);
+}
+
+/* rx_fill() from the recording: the input read at this cycle, if any */
+static void replay_fill(machine_t *m) {
+    struct machine_log *l = m->log;
+    if (l->next == l->nrecs) return;
+    struct log_rec *r = &l->recs[l->next];
+    if (r->tag != LOG_INPUT && r->tag != LOG_EOF) return;
+    if (r->t > m->cpu.t_states) return;
+    if (r->t < m->cpu.t_states) {
+        replay_diverged(m, "input was not read when recorded");
+        return;
+    }
+    l->next++;
+    if (r->tag == LOG_EOF) {
+        m->in_fd = -1;
+        return;
+    }
+    memcpy(m->rx_fifo, l->buf + r->off, r->len);
+    m->rx_head = 0;
+    m->rx_len = r->len;
+}
+
+/* idle_wait() from the recording: skip what it slept. Returns whether
+   input was ready. */
+static int replay_idle(machine_t *m) {
+    struct machine_log *l = m->log;
+    struct log_rec *r = l->next < l->nrecs ? &l->recs[l->next] : NULL;
+    if (!r || r->tag == LOG_END) {
+        m->quit = 1;  /* Waiting where the recording stopped */
+        return 0;
+    }
+    if (r->tag != LOG_IDLE || r->t != m->cpu.t_states) {
+        replay_diverged(m, "idle when the recording was not");
+        return 0;
+    }
+    l->next++;
+    m->cpu.t_states += r->cycles;
+    return r->ready;
+}
+
+/* Console output: add it to the transcript, or check it against it */
+static void log_output(machine_t *m, const void *buf, size_t len) {
+    struct machine_log *l = m->log;
+    const uint8_t *p = buf;
+    if (!l->replay) {
+        while (len) {
+            size_t n = sizeof(l->out) - l->out_len;
+            if (n > len) n = len;
+            memcpy(l->out + l->out_len, p, n);
+            l->out_len += n;
+            p += n;
+            len -= n;
+            if (l->out_len == sizeof(l->out)) log_put_output(l);
+        }
+        return;
+    }
+    while (len && !l->diverged) {
+        struct log_rec *r = l->next < l->nrecs ? &l->recs[l->next] : NULL;
+        if (!r || r->tag != LOG_OUTPUT) {
+            replay_diverged(m, "output the recording does not have");
+            return;
+        }
+        size_t n = r->len - l->out_pos;
+        if (n > len) n = len;
+        if (memcmp(l->buf + r->off + l->out_pos, p, n) != 0) {
+            replay_diverged(m, "output differs from the recording");
+            return;
+        }
+        p += n;
+        len -= n;
+        l->out_pos += n;
+        if (l->out_pos == r->len) {
+            l->next++;
+            l->out_pos = 0;
+        }
+    }
+}
+
+static void replay_stop(machine_t *m, void *arg) {
+    (void)arg;
+    m->quit = 1;
+}
+
+/* The recording ran out here */
+static int replay_over(const machine_t *m) {
+    return m->log && m->log->replay && m->cpu.t_states >= m->log->end_t;
+}
+
+static void log_free(machine_t *m) {
+    struct machine_log *l = m->log;
+    if (!l) return;
+    if (l->f) fclose(l->f);
+    free(l->buf);
+    free(l->recs);
+    free(l);
+    m->log = NULL;
+}
+
+/* ── Console ─────────────────────────────────────────────────────── */
+
+/* Write out everything staged for out_fd. With the I/O thread, wait
+   until it has written what is queued. */
+void machine_flush(machine_t *m) {
+    if (m->io) {
+        while (ring_used(&m->io->tx)) {
+            io_kick(m->io);
+            nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+        }
+        return;
+    }
+    size_t done = 0;
+    while (done < m->out_pend_len) {
+        ssize_t n = write(m->out_fd, m->out_pend + done,
+                          m->out_pend_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;  /* Output gone: drop the rest */
+        done += (size_t)n;
+    }
+    m->out_pend_len = 0;
+}
+
+/* Output to out_fd is staged in out_pend and leaves in one write() when
+   it fills, before console input is read, once OUT_FLUSH_CYCLES have
+   passed since the oldest byte was staged and when the machine stops */
+#define OUT_FLUSH_CYCLES (1ul << 20)
+
+static void console_write(machine_t *m, const void *buf, size_t len) {
+    m->idle_polls = 0;  /* Output means the program is not waiting */
+    m->status_spins = 0;
+    if (m->log) log_output(m, buf, len);
+    if (m->io) {
+        io_write(m, buf, len);
+        return;
+    }
+    if (m->out_fd >= 0) {
+        const char *p = buf;
+        while (len) {
+            size_t n = sizeof(m->out_pend) - m->out_pend_len;
+            if (n > len) n = len;
+            if (!m->out_pend_len)
+                m->out_deadline = m->cpu.t_states + OUT_FLUSH_CYCLES;
+            memcpy(m->out_pend + m->out_pend_len, p, n);
+            m->out_pend_len += n;
+            p += n;
+            len -= n;
+            if (m->out_pend_len == sizeof(m->out_pend)) machine_flush(m);
+        }
+        return;
+    }
+    if (m->out_len + len > m->out_cap) {
+        size_t cap = m->out_cap ? m->out_cap * 2 : 4096;
+        while (cap < m->out_len + len) cap *= 2;
+        char *p = realloc(m->out_buf, cap);
+        if (!p) return;
+        m->out_buf = p;
+        m->out_cap = cap;
+    }
+    memcpy(m->out_buf + m->out_len, buf, len);
+    m->out_len += len;
+}
+
+/* Top up the RX FIFO from in_fd. Only called once the FIFO has drained,
+   and read() only runs when poll() says there is something to read, so a
+   quiet line costs one poll() per console poll and never blocks. With
+   the I/O thread it is a copy out of the rx ring instead. */
+static void rx_read(machine_t *m) {
+    if (m->io) {
+        m->rx_head = 0;
+        m->rx_len = ring_get(&m->io->rx, m->rx_fifo, sizeof(m->rx_fifo));
+        if (!m->rx_len && atomic_load(&m->io->eof) && !ring_used(&m->io->rx))
+            m->in_fd = -1;  /* End of input */
+        return;
+    }
+    struct pollfd pfd = { .fd = m->in_fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) <= 0) return;
+    ssize_t n = read(m->in_fd, m->rx_fifo, sizeof(m->rx_fifo));
+    if (n > 0) {
+        m->rx_head = 0;
+        m->rx_len = (size_t)n;
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+        m->in_fd = -1;  /* End of input */
+    }
+}
+
+/* rx_read(), logging what it got, or the recording's input instead */
+static void rx_fill(machine_t *m) {
+    struct machine_log *l = m->log;
+    if (l && l->replay) {
+        replay_fill(m);
+        return;
+    }
+    rx_read(m);
+    if (!l) return;
+    if (m->rx_head < m->rx_len) {
+        log_stamp(l, LOG_INPUT, m->cpu.t_states);
+        log_varint(l->f, m->rx_len);
+        fwrite(m->rx_fifo, 1, m->rx_len, l->f);
+    } else if (m->in_fd < 0) {
+        log_stamp(l, LOG_EOF, m->cpu.t_states);
+    }
+}
+
+/* Next console byte without taking it, or -1 if there is none yet */
+static int rx_peek(machine_t *m) {
+    if (m->rx_head == m->rx_len) {
+        if (m->in_fd < 0) return -1;
+        /* Echo and prompts must be visible before we wait on the user */
+        if (m->out_pend_len) machine_flush(m);
+        rx_fill(m);
+        if (m->rx_head == m->rx_len) return -1;
+    }
+    return m->rx_fifo[m->rx_head];
+}
+
+/* ── Event scheduler ─────────────────────────────────────────────── */
+
+/* Binary min-heap on when; events[0] is always the next one due */
+
+static void heap_swap(machine_t *m, int a, int b) {
+    struct machine_event t = m->events[a];
+    m->events[a] = m->events[b];
+    m->events[b] = t;
+}
+
+int machine_schedule(machine_t *m, unsigned long when, machine_event_fn fn,
+                     void *arg) {
+    if (m->nevents == MACHINE_MAX_EVENTS) return -1;
+    int i = m->nevents++;
+    m->events[i] = (struct machine_event){ when, fn, arg };
+    while (i > 0 && m->events[(i - 1) / 2].when > m->events[i].when) {
+        heap_swap(m, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+static struct machine_event pop_event(machine_t *m) {
+    struct machine_event ev = m->events[0];
+    m->events[0] = m->events[--m->nevents];
+    for (int i = 0;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < m->nevents && m->events[l].when < m->events[min].when) min = l;
+        if (r < m->nevents && m->events[r].when < m->events[min].when) min = r;
+        if (min == i) break;
+        heap_swap(m, i, min);
+        i = min;
+    }
+    return ev;
+}
+
+/* Fire every event that is due. Handlers may schedule more. */
+static void dispatch_events(machine_t *m) {
+    while (m->nevents && m->events[0].when <= m->cpu.t_states) {
+        struct machine_event ev = pop_event(m);
+        ev.fn(m, ev.arg);
+    }
+}
+
+/* Cycles per second of emulated time */
+static unsigned long machine_hz(const machine_t *m) {
+    return m->clock_hz ? m->clock_hz : MACHINE_CLOCK_HZ;
+}
+
+/* ── Pacing ──────────────────────────────────────────────────────── */
+
+/* With clock_hz set the machine runs in real time. Every PACE_NS of
+   emulated time the host clock is compared with where t_states says it
+   should be, and the CPU sleeps to that absolute deadline, so rounding
+   never adds up to drift. A machine more than PACE_RESYNC_NS behind (a
+   stopped process, a host too slow for the clock) writes that time off
+   rather than racing to make it up. */
+#define PACE_NS        1000000ull   /* 1ms */
+#define PACE_RESYNC_NS 50000000ull
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pace_start(machine_t *m) {
+    m->pace_base_ns = now_ns();
+    m->pace_base_t = m->cpu.t_states;
+}
+
+/* Sleep until the host clock catches up with t_states */
+static void pace(machine_t *m) {
+    unsigned long d = m->cpu.t_states - m->pace_base_t;
+    unsigned long long due = m->pace_base_ns +
+        (unsigned long long)(d / m->clock_hz) * 1000000000ull +
+        (unsigned long long)(d % m->clock_hz) * 1000000000ull / m->clock_hz;
+    unsigned long long now = now_ns();
+    m->pace_batches++;
+    if (now < due) {
+        struct timespec ts = { (time_t)(due / 1000000000ull),
+                               (long)(due % 1000000000ull) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR) {}
+        return;
+    }
+    unsigned long long lag = now - due;
+    if (lag > m->pace_lag_max_ns) m->pace_lag_max_ns = lag;
+    if (lag > PACE_NS) m->pace_late++;
+    if (lag > PACE_RESYNC_NS) {
+        m->pace_resyncs++;
+        pace_start(m);
+    }
+}
+
+static unsigned long pace_cycles(const machine_t *m) {
+    return (unsigned long)(m->clock_hz * PACE_NS / 1000000000ull) + 1;
+}
+
+static void pace_event(machine_t *m, void *arg) {
+    pace(m);
+    machine_schedule(m, m->cpu.t_states + pace_cycles(m), pace_event, arg);
+}
+
+/* ── Idle detection ──────────────────────────────────────────────── */
+
+/* A program waiting for the console either spins on an input status
+   check or halts until the receive interrupt. Once that is seen, the host
+   thread sleeps in poll() instead of emulating the wait, and t_states is
+   moved on by the time slept so emulated time stays in step. */
+
+#define IDLE_SPIN_GAP 2000  /* Max cycles between status checks of a spin */
+
+/* The registers an idle check compares: BC DE HL IX IY SP */
+static void idle_snapshot(const z80_t *cpu, uint16_t regs[6]) {
+    regs[0] = cpu->BC; regs[1] = cpu->DE; regs[2] = cpu->HL;
+    regs[3] = cpu->IX; regs[4] = cpu->IY; regs[5] = cpu->SP;
+}
+
+/* An input status check made from where found nothing. Checks from one
+   place in quick succession, with the registers as they were at the last
+   one, are a spin: nothing but the wait loop ran in between. The same check
+   made between bursts of work (BASIC looking for a break key after each
+   statement, a program polling for a key as it counts) is not. */
+static void note_empty_status(machine_t *m, uint16_t where) {
+    z80_t *cpu = &m->cpu;
+    uint16_t regs[6];
+    idle_snapshot(cpu, regs);
+    if (where == m->status_pc &&
+        cpu->t_states - m->status_time < IDLE_SPIN_GAP &&
+        memcmp(regs, m->status_regs, sizeof(regs)) == 0) {
+        m->status_spins++;
+    } else {
+        m->status_pc = where;
+        memcpy(m->status_regs, regs, sizeof(regs));
+        m->status_spins = 1;
+    }
+    m->status_time = cpu->t_states;
+}
+
+/* The default machine_sleep_fn: poll() fd, timing the wait */
+static int host_sleep(machine_t *m, int fd, unsigned long long ns,
+                      unsigned long long *slept) {
+    (void)m;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ready = poll(&pfd, fd >= 0, (int)(ns / 1000000)) > 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    *slept = (t1.tv_sec - t0.tv_sec) * 1000000000ull +
+             t1.tv_nsec - t0.tv_nsec;
+    return ready;
+}
+
+/* Sleep until console input arrives or t_states would reach until,
+   whichever is first, and advance t_states by the time slept. Returns 1
+   if input is ready. After input has ended the machine still sleeps here
+   rather than spins; C_READ, which would wait for ever, ends its own wait. */
+static int idle_wait(machine_t *m, unsigned long until) {
+    z80_t *cpu = &m->cpu;
+    if (until <= cpu->t_states) return 0;
+    if (m->out_pend_len) machine_flush(m);
+    if (m->log && m->log->replay) return replay_idle(m);
+
+    unsigned long cycles = until - cpu->t_states;
+    unsigned long hz = machine_hz(m);
+    /* The I/O thread reads in_fd and says so on rx_wake */
+    int fd = m->in_fd < 0 ? -1 : m->io ? m->io->rx_wake[0] : m->in_fd;
+    machine_sleep_fn sleep_fn = m->idle_sleep ? m->idle_sleep : host_sleep;
+    unsigned long long ns;
+    int ready = sleep_fn(m, fd, cycles * 1000000000ull / hz, &ns);
+    if (ready && m->io) pipe_drain(fd);
+
+    unsigned long long slept = ns * hz / 1000000000ull;
+    if (slept > cycles) slept = cycles;
+    if (m->log) {
+        log_stamp(m->log, LOG_IDLE, cpu->t_states);
+        log_varint(m->log->f, (unsigned long)slept);
+        putc(ready, m->log->f);
+    }
+    cpu->t_states += slept;
+    return ready;
+}
+
+/* ── Memory callbacks ────────────────────────────────────────────── */
+
+static uint8_t mem_read(void *ctx, uint16_t addr) {
+    machine_t *m = ctx;
+    return m->memory[addr];
+}
+
+/* A machine from machine_init_shared() reads blocks of its snapshot's
+   memory in place, mapped read-only. The first write to a block copies
+   it into memory[] and maps that instead, so blocks never written (the
+   ROM) are never copied. */
+#define COW_BLOCK 4096  /* A host page */
+
+static int is_shared(const machine_t *m, uint16_t addr) {
+    return m->shared_blocks >> (addr / COW_BLOCK) & 1;
+}
+
+static void unshare(machine_t *m, uint16_t addr) {
+    uint16_t base = addr & ~(COW_BLOCK - 1);
+    memcpy(m->memory + base, m->shared + base, COW_BLOCK);
+    m->shared_blocks &= ~(1u << (addr / COW_BLOCK));
+    z80_map(&m->cpu, base, COW_BLOCK, m->memory + base, Z80_MAP_RAM);
+}
+
+/* Memory as the machine itself reads it, shared or not */
+static uint8_t mem_peek(const machine_t *m, uint16_t addr) {
+    return is_shared(m, addr) ? m->shared[addr] : m->memory[addr];
+}
+
+static void mem_write(void *ctx, uint16_t addr, uint8_t val) {
+    machine_t *m = ctx;
+    if (is_shared(m, addr)) unshare(m, addr);
+    m->memory[addr] = val;
+}
+
+/* ── BASIC SBC I/O callbacks ─────────────────────────────────────── */
+
+/* The ACIA holds its IRQ line low while a received byte is waiting with
+   the receive interrupt enabled; the CPU takes it once it can */
+static void acia_irq(machine_t *m) {
+    z80_set_int(&m->cpu, m->acia_rx_ready && m->acia_irq_enabled,
+                0xFF); /* RST 38h */
+}
+
+static uint8_t basic_io_in(void *ctx, uint16_t port) {
+    machine_t *m = ctx;
+    uint8_t p = port & 0xFF;
+    if (p == m->serial_base) {
+        /* ACIA status register */
+        /* TDRE unless the I/O thread is a whole ring behind */
+        uint8_t status = io_tx_ready(m) ? 0x02 : 0x00;
+        if (m->acia_rx_ready)
+            status |= 0x01; /* RDRF */
+        else
+            note_empty_status(m, m->cpu.PC);
+        return status;
+    }
+    if (p == (uint8_t)(m->serial_base + 1)) {
+        /* ACIA data register */
+        m->acia_rx_ready = 0;
+        acia_irq(m);
+        return m->acia_rx_data;
+    }
+    return 0xFF;
+}
+
+static void basic_io_out(void *ctx, uint16_t port, uint8_t val) {
+    machine_t *m = ctx;
+    uint8_t p = port & 0xFF;
+    if (p == m->serial_base) {
+        /* ACIA control register */
+        if (val == 0x03) {
+            /* Master reset */
+            m->acia_rx_ready = 0;
+            m->acia_irq_enabled = 0;
+            m->acia_reset = 1;
+        } else {
+            m->acia_reset = 0;
+            /* Check if receive interrupt enabled (bit 7) */
+            m->acia_irq_enabled = (val & 0x80) ? 1 : 0;
+            /* Bits 6-5 = 10: RTS high, the ROM's input buffer is full */
+            m->acia_rts_high = (val & 0x60) == 0x40;
+        }
+        acia_irq(m);
+        return;
+    }
+    if (p == (uint8_t)(m->serial_base + 1)) {
+        /* ACIA data register - transmit */
+        m->acia_tx_time = m->cpu.t_states;
+        if (val == '\r') {
+            console_write(m, "\r\n", 2);
+        } else {
+            char ch = val;
+            console_write(m, &ch, 1);
+        }
+        return;
+    }
+}
+
+
+/* ── CP/M I/O callbacks ──────────────────────────────────────────── */
+
+static uint8_t cpm_io_in(void *ctx, uint16_t port) {
+    (void)ctx; (void)port;
+    return 0xFF;
+}
+
+static void cpm_io_out(void *ctx, uint16_t port, uint8_t val) {
+    (void)ctx; (void)port; (void)val;
+}
+
+/* ── File loading ────────────────────────────────────────────────── */
+
+static int load_binary(machine_t *m, const char *path, uint16_t addr) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); return -1; }
+    fseek(f, 0, SEEK_END);
+    long sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (sz > 65536 - addr) sz = 65536 - addr;
+    fread(&m->memory[addr], 1, sz, f);
+    fclose(f);
+    return (int)sz;
+}
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static int hex_byte(const char *s) {
+    int hi = hex_nibble(s[0]);
+    int lo = hex_nibble(s[1]);
+    if (hi < 0 || lo < 0) return -1;
+    return (hi << 4) | lo;
+}
+
+static int load_hex(machine_t *m, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+
+    char line[600];
+    int total = 0;
+    while (fgets(line, sizeof(line), f)) {
+        /* Skip lines that don't start with : */
+        if (line[0] != ':') continue;
+
+        int len = hex_byte(&line[1]);
+        if (len < 0) continue;
+
+        int addr_hi = hex_byte(&line[3]);
+        int addr_lo = hex_byte(&line[5]);
+        if (addr_hi < 0 || addr_lo < 0) continue;
+        uint16_t addr = (addr_hi << 8) | addr_lo;
+
+        int type = hex_byte(&line[7]);
+        if (type < 0) continue;
+
+        if (type == 0x01) break; /* EOF record */
+        if (type != 0x00) continue; /* Only process data records */
+
+        for (int i = 0; i < len; i++) {
+            int b = hex_byte(&line[9 + i * 2]);
+            if (b < 0) break;
+            m->memory[addr + i] = (uint8_t)b;
+            total++;
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+static int is_hex_file(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return 0;
+    if (strcasecmp(ext, ".hex") == 0) return 1;
+
+    /* Check if file starts with : (Intel HEX format) */
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int ch = fgetc(f);
+    fclose(f);
+    return ch == ':';
+}
+
+/* ── Serial port auto-detection ──────────────────────────────────── */
+
+static uint16_t detect_serial_port(const machine_t *m, int rom_size) {
+    /* Scan ROM for IN A,(n) [DB xx] and OUT (n),A [D3 xx] patterns */
+    int in_count[256] = {0};
+    int out_count[256] = {0};
+
+    for (int i = 0; i < rom_size - 1; i++) {
+        if (m->memory[i] == 0xDB)
+            in_count[m->memory[i + 1]]++;
+        else if (m->memory[i] == 0xD3)
+            out_count[m->memory[i + 1]]++;
+    }
+
+    /* Look for adjacent port pairs where both IN and OUT appear.
+       ACIA pattern: IN on status port + OUT on both ports.
+       Score pairs that have both IN and OUT activity. */
+    int best_port = 0x80;
+    int best_score = 0;
+
+    for (int p = 0; p < 255; p++) {
+        /* Need both IN and OUT on the pair to be a serial port */
+        int has_in  = in_count[p] + in_count[p + 1];
+        int has_out = out_count[p] + out_count[p + 1];
+        if (has_in == 0 || has_out == 0) continue;
+
+        int score = has_in + has_out;
+        if (score > best_score) {
+            best_score = score;
+            best_port = p;
+        }
+    }
+
+    if (best_score > 0)
+        return (uint16_t)best_port;
+    return 0x80; /* Default */
+}
+
+/* ── System detection ────────────────────────────────────────────── */
+
+static enum system_type detect_system(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return SYS_BASIC;
+
+    if (strcasecmp(ext, ".com") == 0) return SYS_CPM;
+    if (strcasecmp(ext, ".cim") == 0) return SYS_CPM;
+    return SYS_BASIC;
+}
+
+/* ── BDOS emulation ──────────────────────────────────────────────── */
+
+/* Console input for CP/M comes from the same RX FIFO as for BASIC. A
+   program waiting on it either blocks in C_READ or loops on C_STAT; the
+   loop counts as idle after CPM_IDLE_SPINS empty checks in a row from one
+   call (the return address on the stack) with nothing changed between
+   them. Either way the host sleeps up to CPM_IDLE_WAIT cycles at a time. */
+#define CPM_IDLE_SPINS 64
+#define CPM_IDLE_WAIT  (MACHINE_CLOCK_HZ / 10)
+
+/* Next console byte, or -1 if there is none yet */
+static int cpm_con_status(machine_t *m) {
+    int ch = rx_peek(m);
+    if (ch < 0) {
+        uint16_t sp = m->cpu.SP;
+        note_empty_status(m, mem_peek(m, sp) |
+                             (uint16_t)(mem_peek(m, (uint16_t)(sp + 1)) << 8));
+        if (m->status_spins >= CPM_IDLE_SPINS)
+            idle_wait(m, m->cpu.t_states + CPM_IDLE_WAIT);
+    }
+    return ch;
+}
+
+static int handle_bdos(machine_t *m) {
+    z80_t *cpu = &m->cpu;
+    uint8_t fn = cpu->C;
+    switch (fn) {
+        case 1: /* C_READ: wait for a character, echo it, return it in A */
+            {
+                int ch;
+                while ((ch = rx_peek(m)) < 0 && m->in_fd >= 0 && !m->quit)
+                    idle_wait(m, cpu->t_states + CPM_IDLE_WAIT);
+                if (ch < 0) {
+                    ch = 0x1A; /* End of input reads as ^Z */
+                } else {
+                    char echo = (char)ch;
+                    m->rx_head++;
+                    console_write(m, &echo, 1);
+                }
+                cpu->A = cpu->L = (uint8_t)ch;
+            }
+            break;
+        case 2: /* C_WRITE: output character in E */
+            {
+                char ch = cpu->E;
+                console_write(m, &ch, 1);
+            }
+            break;
+        case 9: /* C_WRITESTR: output $-terminated string at DE */
+            {
+                uint16_t addr = cpu->DE;
+                while (1) {
+                    uint8_t ch = mem_peek(m, addr++);
+                    if (ch == '$') break;
+                    console_write(m, &ch, 1);
+                    if (addr == 0) break; /* Wrapped */
+                }
+            }
+            break;
+        case 6: /* C_RAWIO: E=FF read (0 if none), E=FE status, else write E */
+            if (cpu->E == 0xFF) {
+                int ch = cpm_con_status(m);
+                if (ch >= 0) m->rx_head++;
+                cpu->A = cpu->L = ch < 0 ? 0 : (uint8_t)ch;
+            } else if (cpu->E == 0xFE) {
+                cpu->A = cpu->L = cpm_con_status(m) < 0 ? 0x00 : 0xFF;
+            } else {
+                char ch = cpu->E;
+                console_write(m, &ch, 1);
+            }
+            break;
+        case 11: /* C_STAT: A=FF if a character is waiting */
+            cpu->A = cpu->L = cpm_con_status(m) < 0 ? 0x00 : 0xFF;
+            break;
+        case 12: /* S_BDOSVER: CP/M 2.2 */
+            cpu->A = cpu->L = 0x22;
+            cpu->B = cpu->H = 0x00;
+            break;
+        case 0: /* P_TERMCPM: terminate */
+            return 1;
+        default: /* Disk and file functions, or unimplemented */
+            bdos_disk(m);
+            break;
+    }
+    /* Execute RET to return from CALL 5 */
+    cpu->PC = mem_peek(m, cpu->SP) |
+              ((uint16_t)mem_peek(m, (uint16_t)(cpu->SP + 1)) << 8);
+    cpu->SP += 2;
+    return 0;
+}
+
+/* ── Run modes ───────────────────────────────────────────────────── */
+
+/* Console input is polled as an event. While the RX FIFO holds bytes it
+   comes round every rx_gap cycles and hands the ACIA the next one as soon
+   as the ROM has read the last, so pasted and piped input is not limited
+   to one byte per slice. The ACIA holds the CPU's INT line for a byte
+   the ROM has not read yet, so it is taken as soon as the ROM enables
+   interrupts, however long the slice. Once the FIFO is empty the host fd is checked every
+   CONSOLE_POLL_MIN cycles while input is flowing; on a quiet line that
+   period doubles, up to CONSOLE_POLL_MAX, so an idle machine runs long
+   uninterrupted slices. */
+#define CONSOLE_POLL_MIN 7373       /* 1ms at MACHINE_CLOCK_HZ */
+#define CONSOLE_POLL_MAX (1ul << 20)
+
+/* With rx_flow on, input is held while the ACIA is in master reset, while
+   the ROM holds RTS high because its buffer is full, and until the ROM
+   has sent nothing for RX_TX_QUIET cycles. BASIC polls the ACIA for a
+   break key while it prints, so bytes typed ahead of the sign-on, a
+   program's output or the echo of the previous byte are lost. */
+#define RX_TX_QUIET      20000
+
+/* Upper bound on one z80_run() call, so quit is noticed with nothing
+   scheduled */
+#define RUN_SLICE_MAX    (1ul << 22)
+
+/* Idle evidence at a console poll that found no input: the CPU is
+   halted, spinning on the ACIA status port, or still inside the same few
+   bytes of code as at the last poll with every register but AF the same
+   (an interrupt-driven ROM waiting on its receive buffer count). It takes
+   IDLE_POLLS of these in a row with no console output in between before
+   the machine is treated as idle. */
+#define IDLE_POLLS  4
+#define IDLE_WINDOW 16
+
+static int looks_idle(machine_t *m) {
+    z80_t *cpu = &m->cpu;
+    uint16_t regs[6];
+    idle_snapshot(cpu, regs);
+    uint16_t d = cpu->PC - m->idle_pc;
+    int idle = cpu->halted || m->status_spins > 1 ||
+               ((d < IDLE_WINDOW || (uint16_t)-d < IDLE_WINDOW) &&
+                memcmp(regs, m->idle_regs, sizeof(regs)) == 0);
+    m->idle_pc = cpu->PC;
+    memcpy(m->idle_regs, regs, sizeof(regs));
+    m->status_spins = 0;
+    if (!idle) return m->idle_polls = 0;
+    return ++m->idle_polls >= IDLE_POLLS;
+}
+
+/* Whether ch has to wait. Ctrl+C and Ctrl+] never do. */
+static int rx_held(machine_t *m, uint8_t ch) {
+    if (!m->rx_flow || ch == 0x03 || ch == 0x1D) return 0;
+    return m->acia_reset || m->acia_rts_high ||
+           m->cpu.t_states - m->acia_tx_time < RX_TX_QUIET;
+}
+
+static void console_poll(machine_t *m, void *arg) {
+    if (m->out_pend_len && m->cpu.t_states >= m->out_deadline)
+        machine_flush(m);
+    int ch;
+    if (m->acia_rx_ready) {
+        m->poll_interval = m->rx_gap;
+        m->idle_polls = 0;
+    } else if ((ch = rx_peek(m)) < 0) {
+        if (m->poll_interval < CONSOLE_POLL_MAX) m->poll_interval *= 2;
+        if (looks_idle(m)) {
+            /* Sleep through what the CPU would have spent waiting, up to
+               the next poll or event. One more slice is emulated before
+               the next sleep, so a busy program that merely looked idle
+               still makes progress. */
+            unsigned long until = m->cpu.t_states + m->poll_interval;
+            if (m->nevents && m->events[0].when < until)
+                until = m->events[0].when;
+            if (m->park)
+                m->parked = 1;  /* machine_run_for(): hand the wait back */
+            else if (idle_wait(m, until))
+                m->poll_interval = m->rx_gap;
+            m->idle_polls = IDLE_POLLS - 1;
+        }
+    } else if (rx_held(m, (uint8_t)ch)) {
+        m->poll_interval = m->rx_gap;
+    } else {
+        m->rx_head++;
+        if (ch == 0x1D) /* Ctrl+] exits emulator */
+            m->quit = 1;
+        else
+            machine_rx(m, (uint8_t)ch);
+        m->poll_interval = m->rx_head < m->rx_len ? m->rx_gap
+                                                  : CONSOLE_POLL_MIN;
+    }
+    machine_schedule(m, m->cpu.t_states + m->poll_interval, console_poll, arg);
+}
+
+/* Run until quit, or until end or the machine parks. The console poll
+   is scheduled on the first call and then keeps itself going. */
+static void run_basic(machine_t *m, unsigned long end) {
+    z80_t *cpu = &m->cpu;
+
+    if (!m->poll_interval) {
+        m->poll_interval = CONSOLE_POLL_MIN;
+        machine_schedule(m, cpu->t_states, console_poll, NULL);
+    }
+    while (!m->quit && !m->parked && cpu->t_states < end) {
+        /* Run exactly up to the next deadline */
+        unsigned long slice = end - cpu->t_states;
+        if (slice > RUN_SLICE_MAX) slice = RUN_SLICE_MAX;
+        if (m->nevents) {
+            unsigned long when = m->events[0].when;
+            if (when < cpu->t_states + slice)
+                slice = when > cpu->t_states ? when - cpu->t_states : 0;
+        }
+        if (slice) z80_run(cpu, slice);
+        dispatch_events(m);
+    }
+}
+
+/* Warm boot and BDOS entry are PC traps, so the program runs in whole
+   z80_run() slices between calls */
+#define CPM_SLICE 65536
+
+static int cpm_warm_boot(z80_t *cpu, uint16_t addr) {
+    machine_t *m = cpu->ctx;
+    (void)addr;
+    m->quit = 1;
+    z80_break(cpu);
+    return 1;
+}
+
+static int cpm_bdos(z80_t *cpu, uint16_t addr) {
+    machine_t *m = cpu->ctx;
+    (void)addr;
+    if (handle_bdos(m)) {
+        m->quit = 1;
+        z80_break(cpu);
+    }
+    return 1;
+}
+
+static void run_cpm(machine_t *m) {
+    z80_t *cpu = &m->cpu;
+    unsigned long slice = CPM_SLICE;
+    if (m->clock_hz && pace_cycles(m) < slice) slice = pace_cycles(m);
+
+    while (!m->quit && !cpu->halted && !replay_over(m)) {
+        if (m->out_pend_len && cpu->t_states >= m->out_deadline)
+            machine_flush(m);
+        if (m->nevents) {
+            /* Only a debugger schedules any, and it may end the run */
+            dispatch_events(m);
+            if (m->quit) break;
+        }
+        z80_run(cpu, slice);
+        if (m->clock_hz) pace(m);
+    }
+}
+
+/* ── Public API ──────────────────────────────────────────────────── */
+
+/* All of machine_init() but memory, which is left untouched */
+static void init_common(machine_t *m, int cpu_flags) {
+    size_t ram = offsetof(machine_t, memory), end = ram + sizeof(m->memory);
+    memset(m, 0, ram);
+    memset((char *)m + end, 0, sizeof(*m) - end);
+    z80_init_ex(&m->cpu, cpu_flags);
+    m->cpu.mem_read = mem_read;
+    m->cpu.mem_write = mem_write;
+    m->cpu.io_in = cpm_io_in;
+    m->cpu.io_out = cpm_io_out;
+    m->cpu.ctx = m;
+    /* Plain 64K RAM: every access takes the page-table fast path */
+    z80_map(&m->cpu, 0x0000, sizeof(m->memory), m->memory, Z80_MAP_RAM);
+    m->cpu.mem = m->memory;  /* The same array, for -DZ80_FLAT_MEMORY */
+    m->serial_base = 0x80;
+    m->acia_reset = 1;
+    m->rx_gap = MACHINE_RX_GAP;
+    m->rx_flow = 1;
+    m->in_fd = STDIN_FILENO;
+    m->out_fd = STDOUT_FILENO;
+}
+
+void machine_init(machine_t *m, int cpu_flags) {
+    init_common(m, cpu_flags);
+    memset(m->memory, 0, sizeof(m->memory));
+}
+
+void machine_free(machine_t *m) {
+    machine_io_stop(m);
+    log_free(m);
+    bdos_disk_free(m);
+    z80_free(&m->cpu);
+    free(m->out_buf);
+    m->out_buf = NULL;
+    m->out_len = m->out_cap = 0;
+}
+
+int machine_load(machine_t *m, const char *path, enum system_type *sys,
+                 int verbose) {
+    int loaded;
+    if (is_hex_file(path)) {
+        loaded = load_hex(m, path);
+        if (loaded < 0) return -1;
+        if (verbose)
+            fprintf(stderr, "Loaded %d bytes from HEX file\n", loaded);
+    } else {
+        /* Detect system for loading address */
+        if (*sys == SYS_AUTO) *sys = detect_system(path);
+        uint16_t load_addr = (*sys == SYS_CPM) ? 0x0100 : 0x0000;
+        loaded = load_binary(m, path, load_addr);
+        if (loaded < 0) return -1;
+        if (verbose)
+            fprintf(stderr, "Loaded %d bytes at 0x%04X\n", loaded, load_addr);
+    }
+
+    /* Auto-detect system if needed */
+    if (*sys == SYS_AUTO) *sys = detect_system(path);
+    return loaded;
+}
+
+/* I/O callbacks and traps for m->sys */
+static void wire_system(machine_t *m) {
+    z80_t *cpu = &m->cpu;
+    if (m->sys == SYS_BASIC) {
+        cpu->io_in = basic_io_in;
+        cpu->io_out = basic_io_out;
+    } else {
+        cpu->io_in = cpm_io_in;
+        cpu->io_out = cpm_io_out;
+        z80_set_trap(cpu, 0x0000, cpm_warm_boot);
+        z80_set_trap(cpu, 0x0005, cpm_bdos);
+        z80_set_trap(cpu, BDOS_BASE, cpm_bdos);  /* Called through (0006h) */
+    }
+}
+
+void machine_start(machine_t *m, enum system_type sys, int port_override,
+                   int loaded) {
+    z80_t *cpu = &m->cpu;
+
+    m->sys = sys;
+    if (sys == SYS_BASIC) {
+        if (port_override >= 0) {
+            m->serial_base = (uint16_t)port_override;
+        } else {
+            m->serial_base = detect_serial_port(m, loaded);
+        }
+        wire_system(m);
+        cpu->PC = 0x0000;
+    } else {
+        wire_system(m);
+        /* JP BDOS_BASE at 0005h: programs take the top of the TPA from it */
+        m->memory[0x0005] = 0xC3;
+        m->memory[0x0006] = BDOS_BASE & 0xFF;
+        m->memory[0x0007] = BDOS_BASE >> 8;
+        bdos_command_tail(m, "");
+        cpu->PC = 0x0100;
+        cpu->SP = 0xFFFE;
+        /* Push return address 0x0000 for clean exit */
+        cpu->SP -= 2;
+        m->memory[cpu->SP] = 0x00;
+        m->memory[cpu->SP + 1] = 0x00;
+    }
+}
+
+void machine_rx(machine_t *m, uint8_t ch) {
+    m->acia_rx_data = ch;
+    m->acia_rx_ready = 1;
+    acia_irq(m);
+}
+
+/* Bring the pending fn event forward to now */
+static void expedite(machine_t *m, machine_event_fn fn) {
+    for (int i = 0; i < m->nevents; i++) {
+        if (m->events[i].fn != fn) continue;
+        m->events[i].when = m->cpu.t_states;
+        while (i > 0 && m->events[(i - 1) / 2].when > m->events[i].when) {
+            heap_swap(m, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+}
+
+size_t machine_feed(machine_t *m, const void *buf, size_t len) {
+    if (m->rx_head) {
+        memmove(m->rx_fifo, m->rx_fifo + m->rx_head, m->rx_len - m->rx_head);
+        m->rx_len -= m->rx_head;
+        m->rx_head = 0;
+    }
+    size_t room = sizeof(m->rx_fifo) - m->rx_len;
+    if (len > room) len = room;
+    memcpy(m->rx_fifo + m->rx_len, buf, len);
+    m->rx_len += len;
+    /* A parked machine's next poll may be a long way off */
+    if (len && m->parked) expedite(m, console_poll);
+    return len;
+}
+
+int machine_run_for(machine_t *m, unsigned long budget) {
+    m->park = 1;
+    m->parked = 0;
+    run_basic(m, m->cpu.t_states + budget);
+    m->park = 0;
+    if (m->quit) return MACHINE_QUIT;
+    return m->parked ? MACHINE_IDLE : MACHINE_BUSY;
+}
+
+void machine_set_clock(machine_t *m, unsigned long hz) {
+    m->clock_hz = hz;
+}
+
+void machine_run(machine_t *m) {
+    if (m->clock_hz) {
+        pace_start(m);
+        if (m->sys == SYS_BASIC)
+            machine_schedule(m, m->cpu.t_states, pace_event, NULL);
+    }
+    if (m->log && m->log->replay && m->sys == SYS_BASIC)
+        machine_schedule(m, m->log->end_t, replay_stop, NULL);
+    if (m->sys == SYS_BASIC)
+        run_basic(m, ULONG_MAX);
+    else
+        run_cpm(m);
+    machine_flush(m);
+}
+
+/* ── Recordings ──────────────────────────────────────────────────── */
+
+/* FNV-1a of the CPU state and memory, to tell whether a replay starts
+   where its recording did */
+static uint32_t start_hash(machine_t *m) {
+    z80_state_t st;
+    memset(&st, 0, sizeof(st));
+    z80_save_state(&m->cpu, &st);
+    uint32_t h = 2166136261u;
+    const uint8_t *p = (const uint8_t *)&st;
+    for (size_t i = 0; i < sizeof(st); i++) h = (h ^ p[i]) * 16777619u;
+    for (unsigned a = 0; a < sizeof(m->memory); a++)
+        h = (h ^ mem_peek(m, (uint16_t)a)) * 16777619u;
+    return h;
+}
+
+static void log_header(machine_t *m, uint8_t *head) {
+    uint32_t h = start_hash(m);
+    memset(head, 0, LOG_HEADER);
+    memcpy(head, MACHINE_LOG_MAGIC, sizeof(MACHINE_LOG_MAGIC));
+    head[8] = MACHINE_LOG_VERSION;
+    head[12] = (uint8_t)m->sys;
+    head[13] = (uint8_t)m->rx_flow;
+    for (int i = 0; i < 4; i++) head[16 + i] = (uint8_t)(h >> 8 * i);
+}
+
+int machine_record(machine_t *m, const char *path) {
+    struct machine_log *l = calloc(1, sizeof(*l));
+    if (!l) { perror("calloc"); return -1; }
+    l->f = fopen(path, "wb");
+    if (!l->f) {
+        perror(path);
+        free(l);
+        return -1;
+    }
+    uint8_t head[LOG_HEADER];
+    log_header(m, head);
+    fwrite(head, 1, sizeof(head), l->f);
+    l->t = m->cpu.t_states;
+    m->log = l;
+    return 0;
+}
+
+static int get_varint(const uint8_t *buf, size_t len, size_t *pos,
+                      unsigned long *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+        uint8_t b = buf[(*pos)++];
+        *v |= (unsigned long)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+/* Split buf into records. Returns -1 if it is cut short or malformed. */
+static int log_parse(struct machine_log *l, size_t len, unsigned long t) {
+    size_t pos = LOG_HEADER, cap = 0;
+    while (pos < len) {
+        if (l->nrecs == cap) {
+            cap = cap ? cap * 2 : 1024;
+            struct log_rec *recs = realloc(l->recs, cap * sizeof(*recs));
+            if (!recs) return -1;
+            l->recs = recs;
+        }
+        struct log_rec *r = &l->recs[l->nrecs++];
+        unsigned long v;
+        memset(r, 0, sizeof(*r));
+        r->tag = l->buf[pos++];
+        if (r->tag != LOG_OUTPUT) {
+            if (get_varint(l->buf, len, &pos, &v) < 0) return -1;
+            r->t = t += v;
+        }
+        switch (r->tag) {
+        case LOG_INPUT:
+        case LOG_OUTPUT:
+            if (get_varint(l->buf, len, &pos, &v) < 0 || !v ||
+                v > len - pos || (r->tag == LOG_INPUT && v > MACHINE_RX_FIFO))
+                return -1;
+            r->off = pos;
+            r->len = v;
+            pos += v;
+            break;
+        case LOG_IDLE:
+            if (get_varint(l->buf, len, &pos, &r->cycles) < 0 || pos == len)
+                return -1;
+            r->ready = l->buf[pos++];
+            break;
+        case LOG_EOF:
+            break;
+        case LOG_END:
+            l->end_t = t;
+            return pos == len ? 0 : -1;
+        default:
+            return -1;
+        }
+    }
+    return -1;  /* No LOG_END: the recording was cut off */
+}
+
+/* Why the len bytes at buf can't be replayed from m, or NULL. Takes
+   rx_flow from the recording, since input is held back by it. */
+static const char *log_mismatch(machine_t *m, const uint8_t *buf,
+                                size_t len) {
+    if (len < LOG_HEADER ||
+        memcmp(buf, MACHINE_LOG_MAGIC, sizeof(MACHINE_LOG_MAGIC)))
+        return "not a recording";
+    if (buf[8] != MACHINE_LOG_VERSION)
+        return "not a recording from this version";
+    m->rx_flow = buf[13];
+    uint8_t head[LOG_HEADER];
+    log_header(m, head);
+    if (memcmp(buf, head, LOG_HEADER))
+        return "recorded from a different image or snapshot";
+    return NULL;
+}
+
+int machine_replay(machine_t *m, const char *path) {
+    struct machine_log *l = calloc(1, sizeof(*l));
+    if (!l) { perror("calloc"); return -1; }
+    l->replay = 1;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        !(l->buf = malloc((size_t)st.st_size + 1))) {
+        perror(path);
+        goto fail;
+    }
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = read(fd, l->buf + len, (size_t)st.st_size - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    const char *why = log_mismatch(m, l->buf, len);
+    if (!why && log_parse(l, len, m->cpu.t_states) < 0) why = "truncated";
+    if (why) {
+        fprintf(stderr, "%s: %s\n", path, why);
+        goto fail;
+    }
+    close(fd);
+    m->log = l;
+    return 0;
+fail:
+    if (fd >= 0) close(fd);
+    free(l->buf);
+    free(l->recs);
+    free(l);
+    return -1;
+}
+
+int machine_log_close(machine_t *m) {
+    struct machine_log *l = m->log;
+    if (!l) return 0;
+    int rc = 0;
+    if (!l->replay) {
+        log_stamp(l, LOG_END, m->cpu.t_states);
+        if (ferror(l->f) | fclose(l->f)) {
+            perror("recording");
+            rc = -1;
+        }
+        l->f = NULL;
+    } else if (l->diverged) {
+        rc = 1;
+    } else if (l->recs[l->next].tag != LOG_END) {
+        fprintf(stderr, "\r\nReplay stopped at T-state %lu, short of the "
+                "recording's end at %lu\r\n", m->cpu.t_states, l->end_t);
+        rc = 1;
+    }
+    log_free(m);
+    return rc;
+}
+
+/* ── Snapshots ───────────────────────────────────────────────────── */
+
+void machine_save(machine_t *m, machine_snapshot_t *snap) {
+    if (m->out_pend_len) machine_flush(m);
+    memset(snap, 0, sizeof(*snap));
+    memcpy(snap->magic, MACHINE_SNAP_MAGIC, sizeof(MACHINE_SNAP_MAGIC));
+    snap->version = MACHINE_SNAP_VERSION;
+    snap->size = sizeof(*snap);
+    z80_save_state(&m->cpu, &snap->cpu);
+    snap->sys = m->sys;
+    snap->serial_base = m->serial_base;
+    snap->acia_rx_data = m->acia_rx_data;
+    snap->acia_rx_ready = (uint8_t)m->acia_rx_ready;
+    snap->acia_irq_enabled = (uint8_t)m->acia_irq_enabled;
+    snap->acia_reset = (uint8_t)m->acia_reset;
+    snap->acia_rts_high = (uint8_t)m->acia_rts_high;
+    snap->acia_tx_time = m->acia_tx_time;
+    for (unsigned a = 0; a < sizeof(snap->memory); a += COW_BLOCK)
+        memcpy(snap->memory + a, is_shared(m, a) ? m->shared + a : m->memory + a,
+               COW_BLOCK);
+}
+
+static int snap_valid(const machine_snapshot_t *snap) {
+    return memcmp(snap->magic, MACHINE_SNAP_MAGIC,
+                  sizeof(MACHINE_SNAP_MAGIC)) == 0 &&
+           snap->version == MACHINE_SNAP_VERSION &&
+           snap->size == sizeof(*snap) &&
+           (snap->sys == SYS_BASIC || snap->sys == SYS_CPM);
+}
+
+/* All of the snapshot but memory */
+static void restore_state(machine_t *m, const machine_snapshot_t *snap) {
+    z80_load_state(&m->cpu, &snap->cpu);
+    m->sys = (enum system_type)snap->sys;
+    m->serial_base = snap->serial_base;
+    m->acia_rx_data = snap->acia_rx_data;
+    m->acia_rx_ready = snap->acia_rx_ready;
+    m->acia_irq_enabled = snap->acia_irq_enabled;
+    m->acia_reset = snap->acia_reset;
+    m->acia_rts_high = snap->acia_rts_high;
+    m->acia_tx_time = (unsigned long)snap->acia_tx_time;
+    wire_system(m);
+}
+
+int machine_restore(machine_t *m, const machine_snapshot_t *snap) {
+    if (!snap_valid(snap)) return -1;
+    memcpy(m->memory, snap->memory, sizeof(m->memory));
+    if (m->shared) {
+        m->shared = NULL;
+        m->shared_blocks = 0;
+        z80_map(&m->cpu, 0x0000, sizeof(m->memory), m->memory, Z80_MAP_RAM);
+    }
+    z80_invalidate(&m->cpu, 0x0000, sizeof(m->memory));
+    restore_state(m, snap);
+    return 0;
+}
+
+int machine_init_shared(machine_t *m, int cpu_flags,
+                        const machine_snapshot_t *snap) {
+    init_common(m, cpu_flags);
+    if (!snap_valid(snap)) return -1;
+#ifdef Z80_FLAT_MEMORY
+    /* Every access goes to memory[]: nothing to share */
+    memcpy(m->memory, snap->memory, sizeof(m->memory));
+#else
+    m->shared = snap->memory;
+    m->shared_blocks = 0xFFFF;
+    z80_map(&m->cpu, 0x0000, sizeof(m->memory), (uint8_t *)snap->memory,
+            Z80_MAP_READ);
+#endif
+    restore_state(m, snap);
+    return 0;
+}
+
+int machine_save_file(machine_t *m, const char *path) {
+    machine_snapshot_t *snap = malloc(sizeof(*snap));
+    if (!snap) { perror("malloc"); return -1; }
+    machine_save(m, snap);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); free(snap); return -1; }
+    const char *p = (const char *)snap;
+    size_t done = 0;
+    while (done < sizeof(*snap)) {
+        ssize_t n = write(fd, p + done, sizeof(*snap) - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    int ok = done == sizeof(*snap);
+    free(snap);
+    if (close(fd) != 0) ok = 0;
+    if (!ok) { perror(path); return -1; }
+    return 0;
+}
+
+const machine_snapshot_t *machine_map_snapshot(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { perror(path); return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size != sizeof(machine_snapshot_t)) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(machine_snapshot_t), PROT_READ, MAP_PRIVATE,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) { perror(path); return NULL; }
+    if (!snap_valid(p)) {
+        fprintf(stderr, "%s: not a snapshot from this version\n", path);
+        munmap(p, sizeof(machine_snapshot_t));
+        return NULL;
+    }
+    return p;
+}
+
+void machine_unmap_snapshot(const machine_snapshot_t *snap) {
+    munmap((void *)snap, sizeof(*snap));
+}
@@ -0,0 +1,258 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include "z80.h"
+#include <signal.h>
+#include <stddef.h>
+
+/* ── System types ────────────────────────────────────────────────── */
+
+enum system_type { SYS_AUTO, SYS_BASIC, SYS_CPM };
+
+/* ── Event scheduler ─────────────────────────────────────────────── */
+
+typedef struct machine machine_t;
+typedef struct machine_io machine_io_t;
+typedef struct machine_log machine_log_t;
+typedef struct bdos_disk bdos_disk_t;
+typedef struct gdb_stub gdb_stub_t;
+
+/* Called once cpu.t_states has reached the time it was scheduled for */
+typedef void (*machine_event_fn)(machine_t *m, void *arg);
+
+/* An idle machine's host sleep: wait up to ns for fd (-1: none) to be
+   readable, set *slept to how long it took, and return nonzero if fd is
+   ready. NULL in machine_t.idle_sleep: poll(). */
+typedef int (*machine_sleep_fn)(machine_t *m, int fd, unsigned long long ns,
+                                unsigned long long *slept);
+
+struct machine_event {
+    unsigned long    when;  /* Absolute cpu.t_states */
+    machine_event_fn fn;
+    void            *arg;
+};
+
+#define MACHINE_MAX_EVENTS 16
+
+/* ── Emulated system ─────────────────────────────────────────────── */
+
+#define MACHINE_CLOCK_HZ 7372800  /* Emulated CPU clock, for idle sleeps
+                                     without machine_set_clock() */
+#define MACHINE_OUT_BUF  4096     /* Console output staged per write() */
+#define MACHINE_RX_FIFO  4096     /* Console input taken per read() */
+#define MACHINE_RX_GAP   640      /* 10 bits at 115200 baud */
+
+/* One complete emulated computer. Everything the system model touches
+   lives here and reaches the callbacks through cpu.ctx, so any number of
+   machines can run side by side, one per thread. */
+struct machine {
+    z80_t    cpu;
+    uint8_t  memory[65536];
+    enum system_type sys;
+
+    /* From machine_init_shared(): the snapshot memory that blocks whose
+       shared_blocks bit is set (4K each) are still read from */
+    const uint8_t *shared;
+    uint16_t shared_blocks;
+
+    /* ACIA state */
+    uint8_t  acia_rx_data;
+    int      acia_rx_ready;
+    int      acia_irq_enabled;
+    int      acia_reset;    /* Master reset: nothing received until cleared */
+    int      acia_rts_high; /* ROM deasserted RTS: hold off sending */
+    unsigned long acia_tx_time;  /* t_states of the last byte sent */
+    uint16_t serial_base;   /* Status port; data port = base+1 */
+
+    /* Console: input is read from in_fd (-1 = none) into rx_fifo and
+       handed to the ACIA from there. Output goes to
+       out_fd through out_pend, or is collected in out_buf when out_fd
+       is -1. With io, both fds belong to the I/O thread, rx_fifo is
+       filled from its ring and output goes straight into the other. */
+    int      in_fd;
+    int      out_fd;
+    char    *out_buf;
+    size_t   out_len, out_cap;
+    uint8_t  rx_fifo[MACHINE_RX_FIFO];
+    size_t   rx_head, rx_len;
+    unsigned long rx_gap;  /* Min cycles between bytes to the ACIA */
+    int      rx_flow;      /* Honour ACIA reset and RTS (default on) */
+    size_t   out_pend_len;
+    unsigned long out_deadline;  /* t_states by which out_pend is written */
+    char     out_pend[MACHINE_OUT_BUF];
+    machine_io_t *io;      /* Host I/O thread, NULL: I/O done inline */
+    machine_log_t *log;    /* Recording or replay, NULL: neither */
+
+    /* CP/M drives: host files in disk_dir (NULL: the current directory),
+       set up by the first disk BDOS call. See bdos.h. */
+    const char  *disk_dir;
+    bdos_disk_t *disk;
+
+    /* Remote debugger attached by gdb_attach(), NULL: none. See gdb.h. */
+    gdb_stub_t *gdb;
+
+    /* Pending events, a min-heap on when */
+    struct machine_event events[MACHINE_MAX_EVENTS];
+    int      nevents;
+    unsigned long poll_interval;  /* Current console poll period */
+
+    /* Idle detection */
+    uint16_t idle_pc;        /* PC at the last console poll */
+    uint16_t idle_regs[6];   /* BC DE HL IX IY SP at the last console poll */
+    int      idle_polls;     /* Polls in a row that looked idle */
+    uint16_t status_pc;      /* Where input status last read as empty */
+    uint16_t status_regs[6]; /* BC DE HL IX IY SP at that read */
+    unsigned long status_time;   /* t_states of that read */
+    unsigned long status_spins;  /* Empty reads in a row from status_pc */
+
+    /* Real-time pacing, when clock_hz is set (0 runs flat out) */
+    unsigned long clock_hz;
+    unsigned long long pace_base_ns;  /* Host time of pace_base_t */
+    unsigned long pace_base_t;
+    unsigned long pace_batches;       /* Deadlines checked */
+    unsigned long pace_late;          /* Found more than 1ms behind */
+    unsigned long pace_resyncs;       /* So far behind it gave up */
+    unsigned long long pace_lag_max_ns;
+
+    machine_sleep_fn idle_sleep;  /* NULL: poll() on the console */
+
+    int      park;     /* In machine_run_for(): return when idle */
+    int      parked;   /* It did */
+
+    volatile sig_atomic_t quit;  /* Ends machine_run() */
+};
+
+/* Reset to an empty 64K RAM machine on stdin/stdout. cpu_flags are
+   passed to z80_init_ex(). */
+void machine_init(machine_t *m, int cpu_flags);
+void machine_free(machine_t *m);    /* Release captured output and CPU */
+
+/* Load an Intel HEX or raw binary image. *sys is resolved from the file
+   name if SYS_AUTO. Returns bytes loaded, or -1. With verbose, reports
+   what was loaded on stderr. */
+int  machine_load(machine_t *m, const char *path, enum system_type *sys,
+                  int verbose);
+
+/* Wire up I/O and entry point for sys. port_override < 0 scans the first
+   loaded bytes of ROM for the serial port. */
+void machine_start(machine_t *m, enum system_type sys, int port_override,
+                   int loaded);
+
+/* Latch a received byte into the ACIA and hold its interrupt line if the
+   ROM enabled it. machine_run() feeds console input through here. */
+void machine_rx(machine_t *m, uint8_t ch);
+
+/* Hand in_fd and out_fd to a host thread, so terminal syscalls never
+   stall emulation: the ACIA and BDOS reach it only through lock-free
+   rings. Output already staged is written first. Returns -1 if the
+   thread can't be started, and I/O stays inline. machine_free() stops
+   it; machine_io_stop() does so early, after queued output is written. */
+int  machine_io_start(machine_t *m);
+void machine_io_stop(machine_t *m);
+
+/* Write out console output still staged for out_fd. machine_run() does
+   this before reading input and before it returns; call it after output
+   produced outside machine_run(). */
+void machine_flush(machine_t *m);
+
+/* Have fn(m, arg) called when cpu.t_states reaches when (or right away if
+   it already has). machine_run() runs the CPU exactly up to the earliest
+   pending event. Returns -1 if MACHINE_MAX_EVENTS are already pending. */
+int  machine_schedule(machine_t *m, unsigned long when, machine_event_fn fn,
+                      void *arg);
+
+/* Run machine_run() at hz cycles per second of host time instead of
+   flat out (0, the default), sleeping off whatever the host gets ahead
+   by. Idle sleeps then move t_states on at this rate too. */
+void machine_set_clock(machine_t *m, unsigned long hz);
+
+/* Run until the program exits (CP/M) or quit is set (BASIC) */
+void machine_run(machine_t *m);
+
+/* For hosts that schedule many machines themselves: run a BASIC machine
+   for up to budget T-states. Where machine_run() would sleep waiting for
+   input, it parks instead and returns MACHINE_IDLE; t_states stands
+   still until it next runs. Console input comes from machine_feed(),
+   and with out_fd -1 output collects in out_buf. */
+enum { MACHINE_BUSY, MACHINE_IDLE, MACHINE_QUIT };
+int  machine_run_for(machine_t *m, unsigned long budget);
+
+/* Queue len bytes of console input, as much as fits in the RX FIFO.
+   Returns how many were taken. */
+size_t machine_feed(machine_t *m, const void *buf, size_t len);
+
+/* ── Record and replay ───────────────────────────────────────────── */
+
+#define MACHINE_LOG_MAGIC   "ZXSREC"
+#define MACHINE_LOG_VERSION 1
+
+/* Record everything the host contributes to m's run to path: console
+   input, stamped with the t_states it reached the machine, how far each
+   idle sleep moved t_states on, and the console output, as a transcript.
+   Call once m is loaded or restored and before machine_run(). I/O must
+   be inline (no machine_io_start()), since the I/O thread's output
+   backpressure depends on the host too. Returns 0, or -1 with a message
+   on stderr. */
+int  machine_record(machine_t *m, const char *path);
+/* Run m from the recording at path instead of in_fd: the same input
+   arrives at the same cycles and idle time is skipped without sleeping,
+   so the run is cycle for cycle the recorded one, at full speed. Output
+   still goes out as usual and is checked against the transcript as it
+   is made; on the first difference the replay stops with a message on
+   stderr. m must be in the state the recording started from. Returns
+   -1 with a message on stderr if path isn't such a recording. */
+int  machine_replay(machine_t *m, const char *path);
+/* Finish a recording or replay. Returns 0; 1 if the replay diverged or
+   stopped short of the recording's end; -1 if the recording could not be
+   written. machine_free() drops one left open. */
+int  machine_log_close(machine_t *m);
+
+/* ── Snapshots ───────────────────────────────────────────────────── */
+
+#define MACHINE_SNAP_MAGIC   "ZXSSNAP"
+#define MACHINE_SNAP_VERSION 1
+
+/* A machine frozen between runs: CPU state, memory and ACIA state, with
+   no pointers, so it is written to disk as is and mapped straight back
+   in. Fields are in host byte order; a file from a host of the other
+   order fails the version check. Pending events, console buffers and
+   idle tracking are not kept: machine_run() starts those afresh. */
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    size;          /* sizeof(machine_snapshot_t) */
+    z80_state_t cpu;
+    uint32_t    sys;
+    uint16_t    serial_base;
+    uint8_t     acia_rx_data, acia_rx_ready, acia_irq_enabled;
+    uint8_t     acia_reset, acia_rts_high, reserved;
+    uint64_t    acia_tx_time;
+    uint8_t     memory[65536];
+} machine_snapshot_t;
+
+/* Freeze m into snap, writing out staged console output first */
+void machine_save(machine_t *m, machine_snapshot_t *snap);
+/* Put a machine fresh from machine_init() into snap's state, wired up
+   as machine_start() would have left it. snap is only read, so it can be
+   restored into any number of machines at once, one per thread: forking
+   a booted machine costs a 64K copy. Returns -1 if snap fails the header
+   check. */
+int  machine_restore(machine_t *m, const machine_snapshot_t *snap);
+/* machine_init() and machine_restore() in one, for many machines forked
+   from one snapshot: memory is shared with snap, and each 4K block is
+   copied into m->memory on the machine's first write to it. Blocks
+   never written, such as the ROM, are never copied, and memory[] is
+   not touched until then: a machine in fresh zeroed memory (calloc())
+   costs only the pages its program writes. snap must stay mapped and
+   unchanged while m lives. Returns -1 if snap fails the header check. */
+int  machine_init_shared(machine_t *m, int cpu_flags,
+                         const machine_snapshot_t *snap);
+/* Write m's snapshot to path. Returns 0, or -1 with a message on stderr. */
+int  machine_save_file(machine_t *m, const char *path);
+/* Map the snapshot at path read-only and copy-on-write. Returns NULL with
+   a message on stderr if it can't be read or fails the header check.
+   Release with machine_unmap_snapshot(). */
+const machine_snapshot_t *machine_map_snapshot(const char *path);
+void machine_unmap_snapshot(const machine_snapshot_t *snap);
+
+#endif /* MACHINE_H */
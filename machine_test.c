@@ -0,0 +1,111 @@
+#include "machine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Tests of the system model around the core. z80_test covers the CPU
+   itself and builds without any of this. */
+
+/* ── Test framework ──────────────────────────────────────────────── */
+
+static int tests_run = 0;
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+#define ASSERT(cond, msg) do { \
+    if (!(cond)) { \
+        printf("  FAIL: %s (line %d)\n", msg, __LINE__); \
+        return 0; \
+    } \
+} while(0)
+
+#define RUN_TEST(fn) do { \
+    tests_run++; \
+    printf("%-60s", #fn); \
+    if (fn()) { tests_passed++; printf("PASS\n"); } \
+    else { tests_failed++; printf("FAILED\n"); } \
+} while(0)
+
+/* ── Idle ────────────────────────────────────────────────────────── */
+
+/* Long enough for the console poll to decide the machine is idle */
+#define IDLE_RUN (1ul << 24)
+
+static unsigned long idle_spins;       /* Passes of the wait loop stepped */
+static unsigned long long idle_ns;     /* Host time idle sleeps skipped */
+static int idle_fd;                    /* fd the last idle sleep was on */
+
+static int count_spin(z80_t *cpu, uint16_t addr) {
+    (void)cpu; (void)addr;
+    idle_spins++;
+    return 0;
+}
+
+/* Sleeps the whole wait at once, without the host sleeping */
+static int skip_sleep(machine_t *m, int fd, unsigned long long ns,
+                      unsigned long long *slept) {
+    (void)m;
+    idle_fd = fd;
+    idle_ns += ns;
+    *slept = ns;
+    return 0;
+}
+
+static void stop_machine(machine_t *m, void *arg) {
+    (void)arg;
+    m->quit = 1;
+}
+
+/* With input at end of file, a program waiting on the ACIA still gets
+   its wait slept through rather than stepped, with no fd to wait on */
+static int test_idle_after_eof(void) {
+    static const uint8_t wait_code[] = {
+        0xDB, 0x80,  /* 0000  IN A,(80h)    */
+        0x0F,        /* 0002  RRCA          */
+        0x30, 0xFB,  /* 0003  JR NC,0000h   */
+        0x76,        /* 0005  HALT          */
+    };
+    machine_t *m = malloc(sizeof(*m));
+    ASSERT(m != NULL, "allocate machine");
+    machine_init(m, 0);
+    memcpy(m->memory, wait_code, sizeof(wait_code));
+    machine_start(m, SYS_BASIC, 0x80, (int)sizeof(wait_code));
+    m->in_fd = -1;   /* Input has ended */
+    m->out_fd = -1;
+    m->idle_sleep = skip_sleep;
+    idle_spins = 0;
+    idle_ns = 0;
+    idle_fd = 0;
+    z80_set_trap(&m->cpu, 0x0000, count_spin);
+    machine_schedule(m, IDLE_RUN, stop_machine, NULL);
+    machine_run(m);
+    unsigned long t = m->cpu.t_states;
+    machine_free(m);
+    free(m);
+
+    unsigned long slept = (unsigned long)(idle_ns * MACHINE_CLOCK_HZ /
+                                          1000000000ull);
+    ASSERT(t >= IDLE_RUN, "machine ran to the stop event");
+    ASSERT(idle_fd == -1, "idle sleep waits on no fd");
+    ASSERT(slept > IDLE_RUN / 4, "wait slept");
+    /* 27 T-states a pass; stepped all the way, the loop would fill the run */
+    ASSERT(idle_spins * 27 < IDLE_RUN / 4 * 3, "wait not stepped");
+    return 1;
+}
+
+/* ── Main ────────────────────────────────────────────────────────── */
+
+int main(void) {
+    printf("Machine Test Suite\n");
+    printf("==================\n\n");
+
+    /* Idle */
+    RUN_TEST(test_idle_after_eof);
+
+    printf("\n==================\n");
+    printf("Results: %d/%d passed", tests_passed, tests_run);
+    if (tests_failed) printf(", %d FAILED", tests_failed);
+    printf("\n");
+
+    return tests_failed ? 1 : 0;
+}
@@ -0,0 +1,540 @@
+#ifdef __linux__
+#define _GNU_SOURCE  /* accept4() */
+#endif
+
+#include "server.h"
+#include <stdio.h>
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* ── Sessions ────────────────────────────────────────────────────── */
+
+/* A session is in exactly one state. Only the worker that took it off a
+   queue touches its machine, and only while RUNNING; everything else is
+   under the session's lock. The epoll thread alone frees sessions, once
+   they are DEAD, after the batch of events that may still name them. */
+enum {
+    S_PARKED,   /* Idle machine, waiting for input */
+    S_QUEUED,   /* On a worker's queue */
+    S_RUNNING,  /* On a worker */
+    S_BLOCKED,  /* Too much output unsent: waiting for the socket */
+    S_DEAD      /* Quit or peer gone: waiting to be freed */
+};
+
+#define SESSION_INBOX   4096
+#define SESSION_OUT_MAX 65536  /* Unsent output that blocks the machine */
+
+/* Telnet input filter states */
+enum { TN_DATA, TN_IAC, TN_OPT, TN_SB, TN_SB_IAC, TN_CR };
+
+struct session {
+    machine_t       m;
+    int             fd;
+    unsigned        id;
+    int             home;      /* Worker it last ran on */
+    pthread_mutex_t lock;      /* Guards everything below */
+    int             state;
+    int             closing;   /* Peer gone: finish the turn, then die */
+    uint32_t        events;    /* What epoll is watching for */
+    int             tn;        /* Telnet filter state */
+    uint8_t         in[SESSION_INBOX];
+    size_t          in_len;
+    char           *out;
+    size_t          out_len, out_sent, out_cap;
+    struct session *next_dead;
+    struct session *prev, *next;  /* All sessions, for the epoll thread */
+};
+
+/* Per-worker run queue: a ring of sessions. The owner takes from the
+   head, idle workers steal from the tail. A session is on at most one
+   queue, so none holds more than SERVER_MAX_SESSIONS. */
+struct worker {
+    pthread_mutex_t  lock;
+    struct session  *q[SERVER_MAX_SESSIONS];
+    unsigned         head, tail;
+    pthread_t        thread;
+    struct server   *srv;
+    int              index;
+};
+
+struct server {
+    const machine_snapshot_t *boot;
+    int              cpu_flags;
+    int              epfd, listen_fd;
+    int              wake[2];     /* Pipe: sessions died */
+    struct worker   *workers;
+    int              nworkers;
+    unsigned         next_worker;
+    atomic_int       queued;      /* Sessions on any queue */
+    atomic_int       stopping;
+    pthread_mutex_t  idle_lock;   /* Workers with nothing to steal sleep */
+    pthread_cond_t   idle_cond;
+    pthread_mutex_t  dead_lock;
+    struct session  *dead;
+    struct session  *all;
+    int              nsessions;
+    unsigned         next_id;
+};
+
+static void rearm(struct server *srv, struct session *s);
+
+/* ── Run queues ──────────────────────────────────────────────────── */
+
+static void enqueue(struct server *srv, struct session *s) {
+    struct worker *w = &srv->workers[s->home];
+    pthread_mutex_lock(&w->lock);
+    w->q[w->tail++ % SERVER_MAX_SESSIONS] = s;
+    pthread_mutex_unlock(&w->lock);
+    atomic_fetch_add(&srv->queued, 1);
+    pthread_mutex_lock(&srv->idle_lock);
+    pthread_cond_signal(&srv->idle_cond);
+    pthread_mutex_unlock(&srv->idle_lock);
+}
+
+static struct session *take(struct worker *w, int steal) {
+    struct session *s = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail)
+        s = steal ? w->q[--w->tail % SERVER_MAX_SESSIONS]
+                  : w->q[w->head++ % SERVER_MAX_SESSIONS];
+    pthread_mutex_unlock(&w->lock);
+    return s;
+}
+
+/* Own queue first, then the others' */
+static struct session *next_session(struct worker *w) {
+    struct server *srv = w->srv;
+    struct session *s = take(w, 0);
+    for (int i = 1; !s && i < srv->nworkers; i++)
+        s = take(&srv->workers[(w->index + i) % srv->nworkers], 1);
+    if (s) atomic_fetch_sub(&srv->queued, 1);
+    return s;
+}
+
+/* ── Output ──────────────────────────────────────────────────────── */
+
+/* Send what the socket takes now; watch for room if anything is left.
+   Called with s->lock held. */
+static void session_send(struct server *srv, struct session *s) {
+    while (s->out_sent < s->out_len) {
+        ssize_t n = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            s->closing = 1;  /* Peer gone: drop the rest */
+            s->out_sent = s->out_len;
+            break;
+        }
+        s->out_sent += (size_t)n;
+    }
+    if (s->out_sent == s->out_len) s->out_len = s->out_sent = 0;
+    rearm(srv, s);
+}
+
+/* Move the machine's collected console output onto the session's */
+static void session_collect(struct session *s) {
+    machine_t *m = &s->m;
+    if (!m->out_len) return;
+    if (s->out_len + m->out_len > s->out_cap) {
+        size_t cap = s->out_cap ? s->out_cap * 2 : 4096;
+        while (cap < s->out_len + m->out_len) cap *= 2;
+        char *p = realloc(s->out, cap);
+        if (!p) {
+            m->out_len = 0;  /* Out of memory: drop it */
+            return;
+        }
+        s->out = p;
+        s->out_cap = cap;
+    }
+    memcpy(s->out + s->out_len, m->out_buf, m->out_len);
+    s->out_len += m->out_len;
+    m->out_len = 0;
+}
+
+/* ── Workers ─────────────────────────────────────────────────────── */
+
+static void post_dead(struct server *srv, struct session *s) {
+    s->state = S_DEAD;
+    pthread_mutex_lock(&srv->dead_lock);
+    s->next_dead = srv->dead;
+    srv->dead = s;
+    pthread_mutex_unlock(&srv->dead_lock);
+    char b = 0;
+    (void)!write(srv->wake[1], &b, 1);
+}
+
+/* One turn: feed input, run a slice, send output, decide what next */
+static void session_turn(struct worker *w, struct session *s) {
+    struct server *srv = w->srv;
+    pthread_mutex_lock(&s->lock);
+    size_t fed = machine_feed(&s->m, s->in, s->in_len);
+    memmove(s->in, s->in + fed, s->in_len - fed);
+    s->in_len -= fed;
+    if (fed) rearm(srv, s);  /* Room again if the inbox was full */
+    s->state = S_RUNNING;
+    s->home = w->index;
+    pthread_mutex_unlock(&s->lock);
+
+    int r = machine_run_for(&s->m, SERVER_SLICE);
+
+    pthread_mutex_lock(&s->lock);
+    session_collect(s);
+    session_send(srv, s);
+    int requeue = 0;
+    if (r == MACHINE_QUIT || s->closing) {
+        post_dead(srv, s);
+    } else if (s->out_len - s->out_sent > SESSION_OUT_MAX) {
+        s->state = S_BLOCKED;
+    } else if (r == MACHINE_BUSY || s->in_len) {
+        s->state = S_QUEUED;
+        requeue = 1;
+    } else {
+        s->state = S_PARKED;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (requeue) enqueue(srv, s);
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    struct server *srv = w->srv;
+    while (!atomic_load(&srv->stopping)) {
+        struct session *s = next_session(w);
+        if (s) {
+            session_turn(w, s);
+            continue;
+        }
+        pthread_mutex_lock(&srv->idle_lock);
+        while (!atomic_load(&srv->queued) && !atomic_load(&srv->stopping))
+            pthread_cond_wait(&srv->idle_cond, &srv->idle_lock);
+        pthread_mutex_unlock(&srv->idle_lock);
+    }
+    return NULL;
+}
+
+/* ── Event loop ──────────────────────────────────────────────────── */
+
+/* Watch for input unless the inbox is full, and for room to send while
+   output is waiting. Called with s->lock held. */
+static void rearm(struct server *srv, struct session *s) {
+    uint32_t ev = EPOLLRDHUP;
+    if (s->in_len < sizeof(s->in)) ev |= EPOLLIN;
+    if (s->out_len) ev |= EPOLLOUT;
+    if (ev == s->events || s->state == S_DEAD) return;
+    s->events = ev;
+    struct epoll_event e = { .events = ev, .data.ptr = s };
+    epoll_ctl(srv->epfd, EPOLL_CTL_MOD, s->fd, &e);
+}
+
+/* Telnet's option negotiation is dropped and its line ends (CR LF,
+   CR NUL) become the CR BASIC expects, as does a bare LF from a raw
+   client. Returns the bytes of buf left in place. */
+static size_t telnet_filter(struct session *s, uint8_t *buf, size_t len) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        switch (s->tn) {
+        case TN_IAC:
+            s->tn = c == 250 ? TN_SB : c >= 251 ? TN_OPT : TN_DATA;
+            if (c == 255) buf[out++] = c;  /* Escaped 0xFF */
+            continue;
+        case TN_OPT:
+            s->tn = TN_DATA;
+            continue;
+        case TN_SB:
+            if (c == 255) s->tn = TN_SB_IAC;
+            continue;
+        case TN_SB_IAC:
+            s->tn = c == 240 ? TN_DATA : TN_SB;
+            continue;
+        case TN_CR:
+            s->tn = TN_DATA;
+            if (c == '\n' || c == 0) continue;
+            break;
+        }
+        if (c == 255) {
+            s->tn = TN_IAC;
+        } else if (c == '\r') {
+            s->tn = TN_CR;
+            buf[out++] = c;
+        } else {
+            buf[out++] = c == '\n' ? '\r' : c;
+        }
+    }
+    return out;
+}
+
+/* Input arrived or the peer went: a parked machine gets a turn, and a
+   session no worker holds can die now. Called with s->lock held. */
+static void session_wake(struct server *srv, struct session *s) {
+    if (s->closing && (s->state == S_PARKED || s->state == S_BLOCKED)) {
+        post_dead(srv, s);
+    } else if (s->state == S_PARKED) {
+        s->state = S_QUEUED;
+        enqueue(srv, s);
+    }
+}
+
+static void session_input(struct server *srv, struct session *s) {
+    pthread_mutex_lock(&s->lock);
+    while (s->state != S_DEAD && s->in_len < sizeof(s->in)) {
+        ssize_t n = recv(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len,
+                         0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            s->closing = 1;
+            break;
+        }
+        s->in_len += telnet_filter(s, s->in + s->in_len, (size_t)n);
+    }
+    rearm(srv, s);
+    if (s->in_len || s->closing) session_wake(srv, s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void session_output(struct server *srv, struct session *s) {
+    pthread_mutex_lock(&s->lock);
+    if (s->state != S_DEAD) session_send(srv, s);
+    if (s->state == S_BLOCKED && !s->closing &&
+        s->out_len - s->out_sent <= SESSION_OUT_MAX) {
+        s->state = S_QUEUED;
+        enqueue(srv, s);
+    }
+    if (s->closing) session_wake(srv, s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Client to character mode: we echo, and no line buffering */
+static const uint8_t telnet_hello[] = {
+    255, 251, 1,   /* IAC WILL ECHO */
+    255, 251, 3,   /* IAC WILL SUPPRESS-GO-AHEAD */
+};
+
+static void session_open(struct server *srv, int fd,
+                         const struct sockaddr_in *peer) {
+    /* Sessions are mapped rather than allocated so their pages are
+       zero and untouched: a machine's memory[] costs nothing until the
+       machine writes it, and the ROM is never copied */
+    struct session *s = MAP_FAILED;
+    if (srv->nsessions < SERVER_MAX_SESSIONS)
+        s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+        static const char full[] = "Server full\r\n";
+        (void)!send(fd, full, sizeof(full) - 1, MSG_NOSIGNAL);
+        close(fd);
+        return;
+    }
+    machine_init_shared(&s->m, srv->cpu_flags, srv->boot);
+    s->m.in_fd = -1;
+    s->m.out_fd = -1;  /* Collect output */
+    s->fd = fd;
+    s->id = ++srv->next_id;
+    s->home = (int)(srv->next_worker++ % srv->nworkers);
+    pthread_mutex_init(&s->lock, NULL);
+    s->state = S_QUEUED;  /* To boot */
+    s->events = EPOLLIN | EPOLLRDHUP;
+    struct epoll_event e = { .events = s->events, .data.ptr = s };
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+        perror("epoll_ctl");
+        machine_free(&s->m);
+        pthread_mutex_destroy(&s->lock);
+        munmap(s, sizeof(*s));
+        close(fd);
+        return;
+    }
+    (void)!send(fd, telnet_hello, sizeof(telnet_hello), MSG_NOSIGNAL);
+    s->next = srv->all;
+    if (srv->all) srv->all->prev = s;
+    srv->all = s;
+    srv->nsessions++;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer->sin_addr, ip, sizeof(ip));
+    fprintf(stderr, "Session %u: %s:%d (%d open)\n", s->id, ip,
+            ntohs(peer->sin_port), srv->nsessions);
+    enqueue(srv, s);
+}
+
+static void session_free(struct server *srv, struct session *s) {
+    /* A worker that posted it dead may not have unlocked yet */
+    pthread_mutex_lock(&s->lock);
+    pthread_mutex_unlock(&s->lock);
+    if (s->prev) s->prev->next = s->next;
+    else srv->all = s->next;
+    if (s->next) s->next->prev = s->prev;
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    srv->nsessions--;
+    fprintf(stderr, "Session %u closed (%d open)\n", s->id, srv->nsessions);
+    machine_free(&s->m);
+    pthread_mutex_destroy(&s->lock);
+    free(s->out);
+    munmap(s, sizeof(*s));
+}
+
+static void accept_all(struct server *srv) {
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = accept4(srv->listen_fd, (struct sockaddr *)&peer, &len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        session_open(srv, fd, &peer);
+    }
+}
+
+/* Free the sessions workers have given up on */
+static void reap(struct server *srv) {
+    char b[64];
+    while (read(srv->wake[0], b, sizeof(b)) > 0) {}
+    pthread_mutex_lock(&srv->dead_lock);
+    struct session *s = srv->dead;
+    srv->dead = NULL;
+    pthread_mutex_unlock(&srv->dead_lock);
+    while (s) {
+        struct session *next = s->next_dead;
+        session_free(srv, s);
+        s = next;
+    }
+}
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const machine_snapshot_t *boot, int port, int workers,
+               int cpu_flags, volatile sig_atomic_t *stop) {
+    struct server *srv = calloc(1, sizeof(*srv));
+    if (!srv) {
+        perror("calloc");
+        return 1;
+    }
+    srv->boot = boot;
+    srv->cpu_flags = cpu_flags;
+    srv->nworkers = workers < 1 ? 1 : workers;
+    srv->workers = calloc(srv->nworkers, sizeof(*srv->workers));
+    if (!srv->workers || (srv->listen_fd = listen_on(port)) < 0 ||
+        pipe(srv->wake) < 0 || (srv->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(srv->workers);
+        free(srv);
+        return 1;
+    }
+    fcntl(srv->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(srv->wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&srv->idle_lock, NULL);
+    pthread_cond_init(&srv->idle_cond, NULL);
+    pthread_mutex_init(&srv->dead_lock, NULL);
+
+    /* The listening socket and the wake pipe carry NULL and srv */
+    struct epoll_event e = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->listen_fd, &e);
+    e.data.ptr = srv;
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->wake[0], &e);
+
+    /* Every queue is ready before any worker can steal from it. Queues
+       of workers that failed to start are drained by the others. */
+    for (int i = 0; i < srv->nworkers; i++) {
+        struct worker *w = &srv->workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->srv = srv;
+        w->index = i;
+    }
+    int started = 0;
+    for (; started < srv->nworkers; started++) {
+        struct worker *w = &srv->workers[started];
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) break;
+    }
+    if (!started) {
+        fprintf(stderr, "can't start worker threads\n");
+        *stop = 1;
+    } else {
+        fprintf(stderr, "Listening on port %d, %d worker%s (Ctrl+C to "
+                "stop)\n", port, started, started == 1 ? "" : "s");
+    }
+
+    struct epoll_event ev[64];
+    while (!*stop) {
+        int n = epoll_wait(srv->epfd, ev, 64, 1000);
+        for (int i = 0; i < n; i++) {
+            struct session *s = ev[i].data.ptr;
+            if (!s) {
+                accept_all(srv);
+            } else if ((void *)s == srv) {
+                continue;  /* Reaped below */
+            } else {
+                if (ev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    session_input(srv, s);
+                if (ev[i].events & EPOLLOUT)
+                    session_output(srv, s);
+            }
+        }
+        reap(srv);
+    }
+
+    /* Workers finish their turn; then every session goes */
+    atomic_store(&srv->stopping, 1);
+    pthread_mutex_lock(&srv->idle_lock);
+    pthread_cond_broadcast(&srv->idle_cond);
+    pthread_mutex_unlock(&srv->idle_lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(srv->workers[i].thread, NULL);
+    reap(srv);
+    int left = srv->nsessions;
+    while (srv->all) session_free(srv, srv->all);
+    close(srv->listen_fd);
+    close(srv->epfd);
+    close(srv->wake[0]);
+    close(srv->wake[1]);
+    free(srv->workers);
+    free(srv);
+    if (left) fprintf(stderr, "%d session%s dropped\n", left,
+                      left == 1 ? "" : "s");
+    return 0;
+}
+
+#else
+
+int server_run(const machine_snapshot_t *boot, int port, int workers,
+               int cpu_flags, volatile sig_atomic_t *stop) {
+    (void)boot; (void)port; (void)workers; (void)cpu_flags; (void)stop;
+    fprintf(stderr, "--listen needs epoll (Linux)\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "machine.h"
+
+/* ── Multi-session TCP server ────────────────────────────────────── */
+
+#define SERVER_MAX_SESSIONS 1024
+#define SERVER_SLICE        (1ul << 20)  /* T-states per turn on a worker */
+
+/* Serve BASIC consoles on TCP port until *stop is set. Every connection
+   gets its own machine, restored from boot, with the ACIA bound to the
+   socket (telnet or a raw client such as nc). One epoll thread owns all
+   sockets; worker threads run machines that have work, a slice at a
+   time, and idle machines are parked until input arrives. Returns the
+   exit status. */
+int server_run(const machine_snapshot_t *boot, int port, int workers,
+               int cpu_flags, volatile sig_atomic_t *stop);
+
+#endif /* SERVER_H */
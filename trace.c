@@ -0,0 +1,250 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ── Codec ───────────────────────────────────────────────────────── */
+
+/* Register pairs in TRACE_* bit order, skipping TRACE_OP */
+static uint16_t *rec_reg(z80_trace_rec_t *r, int bit) {
+    switch (bit) {
+    case 0:  return &r->af;
+    case 1:  return &r->hl;
+    case 2:  return &r->bc;
+    case 3:  return &r->de;
+    case 5:  return &r->sp;
+    case 6:  return &r->ix;
+    case 7:  return &r->iy;
+    case 8:  return &r->af_;
+    case 9:  return &r->bc_;
+    case 10: return &r->de_;
+    case 11: return &r->hl_;
+    default: return NULL;
+    }
+}
+
+/* R after prev, if nothing but opcode fetches touched it */
+static uint8_t predict_r(const z80_trace_rec_t *prev) {
+    uint8_t op = prev->op[0];
+    int n = (op == 0xCB || op == 0xED || op == 0xDD || op == 0xFD) ? 2 : 1;
+    return (prev->r & 0x80) | ((prev->r + n) & 0x7F);
+}
+
+static int op_seen(const trace_codec_t *c, uint16_t pc, const uint8_t *op) {
+    return (c->seen[pc >> 3] >> (pc & 7) & 1) && !memcmp(c->op[pc], op, 4);
+}
+
+static void op_remember(trace_codec_t *c, uint16_t pc, const uint8_t *op) {
+    c->seen[pc >> 3] |= 1 << (pc & 7);
+    memcpy(c->op[pc], op, 4);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Encode rec after c->prev into p (TRACE_REC_MAX bytes). Returns the end. */
+static uint8_t *encode(trace_codec_t *c, z80_trace_rec_t *rec, uint8_t *p) {
+    z80_trace_rec_t *prev = &c->prev;
+    unsigned mask = 0;
+    for (int bit = 0; bit < 12; bit++) {
+        uint16_t *reg = rec_reg(rec, bit);
+        if (reg && *reg != *rec_reg(prev, bit)) mask |= 1u << bit;
+    }
+    if (!op_seen(c, rec->pc, rec->op)) mask |= TRACE_OP;
+    if (rec->i != prev->i || rec->iff != prev->iff || rec->im != prev->im ||
+        rec->r != predict_r(prev))
+        mask |= TRACE_STATUS;
+
+    int16_t dpc = (int16_t)(rec->pc - prev->pc);
+    p = put_varint(p, mask);
+    p = put_varint(p, (uint16_t)(dpc * 2) ^ (uint16_t)(dpc >> 15));
+    p = put_varint(p, rec->t_states - prev->t_states);
+    for (int bit = 0; bit < 12; bit++) {
+        if (!(mask >> bit & 1) || bit == 4) continue;
+        uint16_t v = *rec_reg(rec, bit);
+        *p++ = (uint8_t)v;
+        *p++ = (uint8_t)(v >> 8);
+    }
+    if (mask & TRACE_OP) {
+        memcpy(p, rec->op, 4);
+        p += 4;
+        op_remember(c, rec->pc, rec->op);
+    }
+    if (mask & TRACE_STATUS) {
+        *p++ = rec->i;
+        *p++ = rec->r;
+        *p++ = rec->iff;
+        *p++ = rec->im;
+    }
+    *prev = *rec;
+    return p;
+}
+
+/* ── Writer ──────────────────────────────────────────────────────── */
+
+static void *writer_thread(void *arg) {
+    trace_writer_t *w = arg;
+    for (;;) {
+        /* stop is set after the CPU's last record, so once it is seen an
+           empty ring means everything has been taken */
+        int stopping = atomic_load(&w->stop);
+        uint32_t n = z80_trace_read(&w->ring, w->batch, TRACE_BATCH);
+        if (!n) {
+            if (stopping) break;
+            nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+            continue;
+        }
+        uint8_t *p = w->out;
+        for (uint32_t i = 0; i < n; i++)
+            p = encode(&w->codec, &w->batch[i], p);
+        fwrite(w->out, 1, (size_t)(p - w->out), w->f);
+        w->records += n;
+    }
+    return NULL;
+}
+
+/* The CPU got ahead of the writer: give it a moment */
+static void writer_wait(z80_trace_t *tr) {
+    (void)tr;
+    nanosleep(&(struct timespec){ 0, 100000 }, NULL);
+}
+
+trace_writer_t *trace_writer_open(z80_t *cpu, const char *path) {
+    if (z80_set_trace(cpu, NULL) < 0) {
+        fprintf(stderr, "tracing needs an instrumented build "
+                        "(make zxs_prof)\n");
+        return NULL;
+    }
+    trace_writer_t *w = calloc(1, sizeof(*w));
+    if (!w || z80_trace_init(&w->ring, TRACE_RING) < 0) {
+        fprintf(stderr, "out of memory for the trace ring\n");
+        free(w);
+        return NULL;
+    }
+    w->ring.wait = writer_wait;
+    w->f = fopen(path, "wb");
+    if (!w->f) {
+        perror(path);
+        goto fail;
+    }
+    uint8_t version[4] = { TRACE_VERSION, 0, 0, 0 };
+    fwrite(TRACE_MAGIC, 1, 8, w->f);
+    fwrite(version, 1, 4, w->f);
+    atomic_init(&w->stop, 0);
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        fprintf(stderr, "can't start the trace writer\n");
+        fclose(w->f);
+        goto fail;
+    }
+    z80_set_trace(cpu, &w->ring);
+    return w;
+fail:
+    z80_trace_free(&w->ring);
+    free(w);
+    return NULL;
+}
+
+long trace_writer_close(trace_writer_t *w, z80_t *cpu) {
+    z80_set_trace(cpu, NULL);
+    atomic_store(&w->stop, 1);
+    pthread_join(w->thread, NULL);
+    long n = (long)w->records;
+    if (ferror(w->f) | fclose(w->f)) {
+        perror("trace");
+        n = -1;
+    }
+    z80_trace_free(&w->ring);
+    free(w);
+    return n;
+}
+
+/* ── Reader ──────────────────────────────────────────────────────── */
+
+trace_reader_t *trace_reader_open(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    uint8_t head[12];
+    if (fread(head, 1, 12, f) != 12 || memcmp(head, TRACE_MAGIC, 8)) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(f);
+        return NULL;
+    }
+    if (head[8] != TRACE_VERSION) {
+        fprintf(stderr, "%s: trace version %d, expected %d\n",
+                path, head[8], TRACE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+    trace_reader_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        fclose(f);
+        return NULL;
+    }
+    r->f = f;
+    return r;
+}
+
+/* -1 at the end of the file */
+static int get_varint(FILE *f, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int b = getc(f);
+        if (b == EOF) return -1;
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+int trace_reader_next(trace_reader_t *r, z80_trace_rec_t *rec) {
+    trace_codec_t *c = &r->codec;
+    uint64_t mask, zpc, dt;
+    int b = getc(r->f);
+    if (b == EOF) return 0;
+    ungetc(b, r->f);
+    if (get_varint(r->f, &mask) < 0 || get_varint(r->f, &zpc) < 0 ||
+        get_varint(r->f, &dt) < 0)
+        return -1;
+
+    *rec = c->prev;
+    rec->pc = c->prev.pc + (uint16_t)((zpc >> 1) ^ -(zpc & 1));
+    rec->t_states += dt;
+    for (int bit = 0; bit < 12; bit++) {
+        if (!(mask >> bit & 1) || bit == 4) continue;
+        uint8_t v[2];
+        if (fread(v, 1, 2, r->f) != 2) return -1;
+        *rec_reg(rec, bit) = (uint16_t)(v[0] | v[1] << 8);
+    }
+    if (mask & TRACE_OP) {
+        if (fread(rec->op, 1, 4, r->f) != 4) return -1;
+        op_remember(c, rec->pc, rec->op);
+    } else {
+        memcpy(rec->op, c->op[rec->pc], 4);
+    }
+    if (mask & TRACE_STATUS) {
+        uint8_t s[4];
+        if (fread(s, 1, 4, r->f) != 4) return -1;
+        rec->i = s[0];
+        rec->r = s[1];
+        rec->iff = s[2];
+        rec->im = s[3];
+    } else {
+        rec->r = predict_r(&c->prev);
+    }
+    c->prev = *rec;
+    return 1;
+}
+
+void trace_reader_close(trace_reader_t *r) {
+    fclose(r->f);
+    free(r);
+}
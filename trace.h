@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "z80.h"
+#include <pthread.h>
+#include <stdio.h>
+
+/* ── Trace files ─────────────────────────────────────────────────── */
+
+/* A trace file is TRACE_MAGIC, a 32-bit TRACE_VERSION, then one record
+   per instruction, each stored as its difference from the one before:
+
+     mask    varint, TRACE_* bits for what follows
+     pc      zigzag varint, PC minus the previous PC
+     t       varint, t_states minus the previous t_states
+     regs    16-bit little-endian values, for each register bit in mask
+     op      4 bytes, if TRACE_OP: PC's bytes differ from last time there
+     status  I, R, IFF, IM, if TRACE_STATUS; otherwise I, IFF and IM are
+             unchanged and R went up by one fetch per opcode byte the
+             previous instruction's prefix chain used (1 or 2)
+
+   A straight-line instruction that touches one register pair takes
+   5 bytes instead of the 40 of a z80_trace_rec_t. */
+
+#define TRACE_MAGIC   "ZXSTRACE"
+#define TRACE_VERSION 1
+
+enum {
+    TRACE_AF  = 1 << 0,  TRACE_HL  = 1 << 1,  TRACE_BC  = 1 << 2,
+    TRACE_DE  = 1 << 3,  TRACE_OP  = 1 << 4,  TRACE_SP  = 1 << 5,
+    TRACE_IX  = 1 << 6,  TRACE_IY  = 1 << 7,  TRACE_AF_ = 1 << 8,
+    TRACE_BC_ = 1 << 9,  TRACE_DE_ = 1 << 10, TRACE_HL_ = 1 << 11,
+    TRACE_STATUS = 1 << 12
+};
+
+/* What encoder and decoder both remember: the previous record and the
+   bytes last seen at each PC */
+typedef struct {
+    z80_trace_rec_t prev;
+    uint8_t op[65536][4];
+    uint8_t seen[65536 / 8];
+} trace_codec_t;
+
+#define TRACE_RING    65536  /* Records between the CPU and the writer */
+#define TRACE_BATCH   4096   /* Records the writer takes at a time */
+#define TRACE_REC_MAX 64     /* Longest encoded record */
+
+typedef struct {
+    z80_trace_t   ring;    /* Set its triggers before running the CPU */
+    FILE         *f;
+    pthread_t     thread;
+    atomic_int    stop;
+    unsigned long records;
+    trace_codec_t codec;
+    z80_trace_rec_t batch[TRACE_BATCH];        /* The writer thread's */
+    uint8_t         out[TRACE_BATCH * TRACE_REC_MAX];
+} trace_writer_t;
+
+/* Create path, attach a ring to cpu and start the thread that drains it
+   into the file. The CPU waits for the writer when the ring fills, so
+   nothing is dropped. Returns NULL with a message on stderr if cpu is
+   not a -DZ80_TRACE build or the file can't be created. */
+trace_writer_t *trace_writer_open(z80_t *cpu, const char *path);
+/* Detach from cpu, write out what is left and close. Returns the number
+   of records written, or -1 (with a message) on a write error. */
+long trace_writer_close(trace_writer_t *w, z80_t *cpu);
+
+typedef struct {
+    FILE         *f;
+    trace_codec_t codec;
+} trace_reader_t;
+
+/* NULL with a message on stderr if path is not a trace file */
+trace_reader_t *trace_reader_open(const char *path);
+/* 1 with the next record in *rec, 0 at the end, -1 if truncated */
+int  trace_reader_next(trace_reader_t *r, z80_trace_rec_t *rec);
+void trace_reader_close(trace_reader_t *r);
+
+#endif /* TRACE_H */
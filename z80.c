@@ -1,8 +1,11 @@
 #include "z80.h"
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Forward declarations */
 static int exec_main_op(z80_t *c, uint8_t op);
+static void dc_flush_page(z80_t *c, unsigned page);
 
 /* ── Parity lookup table ─────────────────────────────────────────── */
 
@@ -20,28 +23,614 @@ static void init_parity(void) {
     parity_inited = 1;
 }
 
+/* ── Flag lookup tables ──────────────────────────────────────────── */
+
+static uint8_t sz53_table[256];     /* S, Z, F5, F3 of a result */
+static uint8_t sz53p_table[256];    /* ... plus parity */
+static uint8_t inc8_table[256];     /* INC flags (all but C), by result */
+static uint8_t dec8_table[256];     /* DEC flags (all but C), by result */
+
+/* Half-carry and overflow for 8-bit add/sub, indexed by bit 3 (for H) or
+   bit 7 (for P/V) of operand A, operand B and the result: see hv_index() */
+static uint8_t add_hf_table[8], add_vf_table[8];
+static uint8_t sub_hf_table[8], sub_vf_table[8];
+
+/* DAA result (A << 8 | F), indexed by A | C << 8 | H << 9 | N << 10 */
+static uint16_t daa_table[2048];
+
+static inline int hv_index(uint8_t a, uint8_t b, uint8_t r, int bit) {
+    return ((a >> bit) & 1) | (((b >> bit) & 1) << 1) | (((r >> bit) & 1) << 2);
+}
+
+static void init_flag_tables(void) {
+    static int inited = 0;
+    if (inited) return;
+
+    for (int i = 0; i < 256; i++) {
+        uint8_t r = (uint8_t)i;
+        sz53_table[i] = (r & (Z80_SF | Z80_F5 | Z80_F3)) | (r == 0 ? Z80_ZF : 0);
+        sz53p_table[i] = sz53_table[i] | parity_table[i];
+        inc8_table[i] = sz53_table[i] |
+                        (r == 0x80 ? Z80_PF : 0) |
+                        ((r & 0x0F) == 0 ? Z80_HF : 0);
+        dec8_table[i] = sz53_table[i] | Z80_NF |
+                        (r == 0x7F ? Z80_PF : 0) |
+                        ((r & 0x0F) == 0x0F ? Z80_HF : 0);
+    }
+
+    /* Derive H and P/V from the carry-chain definitions, enumerating every
+       operand pair (with and without carry in) */
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            for (int cin = 0; cin < 2; cin++) {
+                uint16_t r = a + b + cin;
+                add_hf_table[hv_index(a, b, r, 3)] = ((a ^ b ^ r) & 0x10) ? Z80_HF : 0;
+                add_vf_table[hv_index(a, b, r, 7)] =
+                    (((a ^ b ^ 0x80) & (a ^ r)) & 0x80) ? Z80_PF : 0;
+                r = a - b - cin;
+                sub_hf_table[hv_index(a, b, r, 3)] = ((a ^ b ^ r) & 0x10) ? Z80_HF : 0;
+                sub_vf_table[hv_index(a, b, r, 7)] =
+                    (((a ^ b) & (a ^ r)) & 0x80) ? Z80_PF : 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2048; i++) {
+        uint8_t a = i & 0xFF;
+        uint8_t f = ((i & 0x100) ? Z80_CF : 0) | ((i & 0x200) ? Z80_HF : 0) |
+                    ((i & 0x400) ? Z80_NF : 0);
+        uint8_t correction = 0;
+        uint8_t carry = f & Z80_CF;
+
+        if ((f & Z80_HF) || (a & 0x0F) > 9)
+            correction |= 0x06;
+        if (carry || a > 0x99) {
+            correction |= 0x60;
+            carry = Z80_CF;
+        }
+
+        uint8_t r = (f & Z80_NF) ? a - correction : a + correction;
+        f = sz53p_table[r] | carry | (f & Z80_NF) | ((a ^ r) & Z80_HF);
+        daa_table[i] = ((uint16_t)r << 8) | f;
+    }
+
+    inited = 1;
+}
+
+/* ── Lazy flags ──────────────────────────────────────────────────── */
+/*
+ * The 8-bit ALU, INC/DEC and rotate/shift helpers set F through
+ * SET_FLAGS(). Normally that stores the flags there and then. With
+ * -DZ80_LAZY_FLAGS it only records the op, its operands and the result in
+ * lf_op/lf_a/lf_b/lf_r, and F is worked out the next time something reads
+ * it through get_f(): a condition that needs P/V, PUSH AF, EX AF,AF', DAA,
+ * or an op that keeps some of the old flags. Z, S and C come straight from
+ * the recorded result (get_z(), get_s(), get_c()), which covers most
+ * branches and ADC/SBC. Everything else in the core reads and writes F
+ * through these helpers too.
+ */
+
+/* Flag-setting op kinds; LF_NONE means F is up to date */
+enum { LF_NONE, LF_ADD, LF_SUB, LF_CP, LF_AND, LF_SZP, LF_INC, LF_DEC };
+
+/* Flags of an 8-bit add, subtract or compare of a and b. r is the result
+   with the carry out in bit 8. */
+static inline uint8_t add_flags(uint8_t a, uint8_t b, uint16_t r) {
+    return sz53_table[(uint8_t)r] | ((r >> 8) & Z80_CF) |
+           add_hf_table[hv_index(a, b, r, 3)] | add_vf_table[hv_index(a, b, r, 7)];
+}
+
+static inline uint8_t sub_flags(uint8_t a, uint8_t b, uint16_t r) {
+    return sz53_table[(uint8_t)r] | Z80_NF | ((r >> 8) & Z80_CF) |
+           sub_hf_table[hv_index(a, b, r, 3)] | sub_vf_table[hv_index(a, b, r, 7)];
+}
+
+static inline uint8_t cp_flags(uint8_t a, uint8_t b, uint16_t r) {
+    /* Note: F3 and F5 come from the operand, not the result */
+    return (sz53_table[(uint8_t)r] & (Z80_SF | Z80_ZF)) | Z80_NF |
+           (b & (Z80_F5 | Z80_F3)) | ((r >> 8) & Z80_CF) |
+           sub_hf_table[hv_index(a, b, r, 3)] | sub_vf_table[hv_index(a, b, r, 7)];
+}
+
+/* SET_FLAGS(c, op, a, b, r, f): f is what F becomes, in terms of the
+   operands a, b and the result r (for INC/DEC and rotates, r carries the
+   new C in bit 8 and a, b are unused) */
+#ifdef Z80_LAZY_FLAGS
+#define SET_FLAGS(c, op, a, b, r, f) \
+    ((c)->lf_op = (op), (c)->lf_a = (a), (c)->lf_b = (b), (c)->lf_r = (r))
+
+static void sync_flags(z80_t *c) {
+    uint8_t a = c->lf_a, b = c->lf_b, r8 = (uint8_t)c->lf_r;
+    uint16_t r = c->lf_r;
+    uint8_t cf = (r >> 8) & Z80_CF;
+    switch (c->lf_op) {
+    case LF_ADD: c->F = add_flags(a, b, r); break;
+    case LF_SUB: c->F = sub_flags(a, b, r); break;
+    case LF_CP:  c->F = cp_flags(a, b, r); break;
+    case LF_AND: c->F = sz53p_table[r8] | Z80_HF; break;
+    case LF_SZP: c->F = sz53p_table[r8] | cf; break;
+    case LF_INC: c->F = inc8_table[r8] | cf; break;
+    case LF_DEC: c->F = dec8_table[r8] | cf; break;
+    }
+    c->lf_op = LF_NONE;
+}
+#else
+#define SET_FLAGS(c, op, a, b, r, f) ((c)->F = (f))
+#endif
+
+static inline uint8_t get_f(z80_t *c) {
+#ifdef Z80_LAZY_FLAGS
+    if (c->lf_op) sync_flags(c);
+#endif
+    return c->F;
+}
+
+static inline void set_f(z80_t *c, uint8_t f) {
+#ifdef Z80_LAZY_FLAGS
+    c->lf_op = LF_NONE;
+#endif
+    c->F = f;
+}
+
+/* Single flags without working out the rest: C as 0 or 1, Z and S as
+   nonzero if set */
+static inline int get_c(const z80_t *c) {
+#ifdef Z80_LAZY_FLAGS
+    if (c->lf_op) return (c->lf_r >> 8) & Z80_CF;
+#endif
+    return c->F & Z80_CF;
+}
+
+static inline int get_z(const z80_t *c) {
+#ifdef Z80_LAZY_FLAGS
+    if (c->lf_op) return !(uint8_t)c->lf_r;
+#endif
+    return c->F & Z80_ZF;
+}
+
+static inline int get_s(const z80_t *c) {
+#ifdef Z80_LAZY_FLAGS
+    if (c->lf_op) return c->lf_r & 0x80;
+#endif
+    return c->F & Z80_SF;
+}
+
 /* ── Register pair helpers ───────────────────────────────────────── */
 
-static inline uint16_t rp_bc(z80_t *c) { return ((uint16_t)c->B << 8) | c->C; }
-static inline uint16_t rp_de(z80_t *c) { return ((uint16_t)c->D << 8) | c->E; }
-static inline uint16_t rp_hl(z80_t *c) { return ((uint16_t)c->H << 8) | c->L; }
-static inline uint16_t rp_af(z80_t *c) { return ((uint16_t)c->A << 8) | c->F; }
+/* The pairs are unions over their halves (see Z80_PAIR), so these are
+   plain 16-bit loads and stores */
+static inline uint16_t rp_bc(z80_t *c) { return c->BC; }
+static inline uint16_t rp_de(z80_t *c) { return c->DE; }
+static inline uint16_t rp_hl(z80_t *c) { return c->HL; }
+static inline uint16_t rp_af(z80_t *c) { get_f(c); return c->AF; }
+
+static inline void set_bc(z80_t *c, uint16_t v) { c->BC = v; }
+static inline void set_de(z80_t *c, uint16_t v) { c->DE = v; }
+static inline void set_hl(z80_t *c, uint16_t v) { c->HL = v; }
+static inline void set_af(z80_t *c, uint16_t v) { c->A = v >> 8; set_f(c, v & 0xFF); }
+
+/* ── Refresh register ────────────────────────────────────────────── */
+
+/* Advance R by n opcode fetches; bit 7 only changes through LD R,A. The
+   -DZ80_FAST tier doesn't keep R at all. */
+static inline void add_r(z80_t *c, unsigned n) {
+#ifndef Z80_FAST
+    c->R = (c->R & 0x80) | ((c->R + n) & 0x7F);
+#else
+    (void)c;
+    (void)n;
+#endif
+}
+
+/* ── Decode cache ────────────────────────────────────────────────── */
+
+/* Optional, enabled with z80_init_ex(cpu, Z80_INIT_DCACHE). One entry per
+   address records what the instruction there decodes to: the handler
+   table and opcode the prefix chain ends in, how many bytes the prefixes
+   and opcode take and how many the operands add, the R increments and
+   prefix T-states charged on the way, and the operand bytes themselves.
+   A hit moves PC past the whole instruction and jumps straight to the
+   final handler, which takes its immediate or displacement from the
+   entry instead of fetching it. (Function table builds still fetch
+   operands: their handlers only see the CPU.)
+
+   Only instructions whose decoded bytes all come from mapped pages are
+   cached. Those pages get Z80_PAGE_CODE and lose their direct write
+   pointer, so the first write to one takes wb()'s slow path, which drops
+   the page's entries (and those of instructions straddling into it from
+   the page before) and puts the pointer back. A page that keeps getting
+   flushed that way (code sharing a page with busy variables) is left out
+   of the cache after DC_MAX_FLUSHES. */
+
+/* The reference decoder, flat memory, profiling and tracing builds have
+   none: z80_init_ex() leaves it off */
+#if defined(Z80_SWITCH_DISPATCH) || defined(Z80_FLAT_MEMORY) || \
+    defined(Z80_PROFILE) || defined(Z80_TRACE)
+#define DC_ENABLED 0
+#else
+#define DC_ENABLED 1
+#endif
+
+/* Handlers read operands from the entry where they are labels in one
+   function that can be given it */
+#if defined(__GNUC__) && !defined(Z80_NO_COMPUTED_GOTO)
+#define DC_OPERANDS 1
+#else
+#define DC_OPERANDS 0
+#endif
+
+/* DC_DDCB and DC_FDCB run the same handlers, at IX+d and IY+d */
+enum { DC_MAIN, DC_CB, DC_ED, DC_DD, DC_FD, DC_DDCB, DC_FDCB };
+
+#define DC_MAX_LEN 4  /* DD CB d op, ED 43 nn; longer ones are not cached */
+#define DC_MAX_FLUSHES 32
+
+struct dc_entry {
+    union {
+        const void *label;                   /* Computed goto */
+        int (*fn)(z80_t *c);                 /* Function tables */
+        int (*fnx)(z80_t *c, uint16_t addr); /* ... DDCB handlers */
+    } h;
+    uint16_t imm;     /* Operand bytes, little-endian: n, nn, d, or d n */
+    uint8_t len;      /* Prefix and opcode bytes; 0 = empty */
+    uint8_t size;     /* len plus the operand bytes */
+    uint8_t tab, op;  /* Handler table and opcode the chain ends in */
+    uint8_t r;        /* R increments, the first opcode fetch included */
+    uint8_t t;        /* T-states charged by the prefixes */
+};
+
+/* Basic block tier, enabled with Z80_INIT_BLOCKS on top of the decode cache.
+   z80_run() counts how often each address starts an instruction there;
+   at Z80_BLOCK_THRESHOLD visits the straight-line run of instructions from
+   that address is collected into a block: a copy of each decode with the
+   address of the instruction after it. bb_exec() then runs the block on
+   a second copy of the handlers that jump straight to the next
+   instruction instead of returning. It leaves when PC is not where the
+   block expects (a branch was taken, an interrupt hook moved it), when
+   z80_run() would stop, or when a write flushed a code page. HALT, EI
+   and the repeating block instructions always end a block, so within one
+   the CPU is never halted, ei_delay is clear and blk_op is 0.
+
+   This is threaded code, not a JIT: no host code is generated, and the
+   registers stay in z80_t.
+
+   Blocks are carved out of one arena and dropped with the decode entries
+   of any page they cover; a full arena drops them all. */
+
+#ifndef Z80_BLOCK_THRESHOLD
+#define Z80_BLOCK_THRESHOLD 16  /* 1..255 */
+#endif
+#define BB_MAX_INSNS  32
+#define BB_MAX_BYTES  128
+#define BB_ARENA_SIZE (512 * 1024)
+
+struct bb_insn {
+    struct dc_entry e;
+    uint16_t next;    /* Address of the following instruction */
+};
+
+struct bb_block {
+    uint16_t pc, len; /* First byte and bytes covered */
+    uint8_t  n;       /* Instructions; 0 once dropped */
+    uint8_t  linked;  /* Handlers resolved for bb_exec() */
+    struct bb_insn insn[];
+};
+
+struct bb_tier {
+    struct bb_block *block[65536];   /* By start address */
+    uint8_t heat[65536];             /* Visits as a block head */
+    size_t used;                     /* Arena bytes handed out */
+    void *arena[BB_ARENA_SIZE / sizeof(void *)];
+};
+
+struct z80_dcache {
+    struct dc_entry entry[65536];
+    uint8_t *page_write[Z80_PAGES];  /* Write pointers of Z80_PAGE_CODE pages */
+    uint8_t write_flushes[Z80_PAGES]; /* Up to DC_MAX_FLUSHES */
+    struct bb_tier *bb;              /* NULL unless Z80_INIT_BLOCKS */
+    z80_dcache_stats_t stats;
+};
+
+/* Drop the blocks with bytes in page */
+static void bb_drop_page(struct bb_tier *j, unsigned page) {
+    uint16_t start = (uint16_t)(page << Z80_PAGE_SHIFT);
+    uint16_t first = (uint16_t)(start - (BB_MAX_BYTES - 1));
+    for (unsigned i = 0; i < Z80_PAGE_SIZE + BB_MAX_BYTES - 1; i++) {
+        uint16_t pc = (uint16_t)(first + i);
+        struct bb_block *b = j->block[pc];
+        if (b && (i >= BB_MAX_BYTES - 1 || (uint16_t)(start - pc) < b->len)) {
+            b->n = 0;  /* Stops bb_exec() if it is running b */
+            j->block[pc] = NULL;
+        }
+    }
+}
+
+static void dc_flush_page(z80_t *c, unsigned page) {
+    z80_dcache_t *dc = c->dcache;
+    uint16_t first = (uint16_t)((page << Z80_PAGE_SHIFT) - (DC_MAX_LEN - 1));
+    for (unsigned i = 0; i < Z80_PAGE_SIZE + DC_MAX_LEN - 1; i++) {
+        dc->entry[(uint16_t)(first + i)].len = 0;
+        if (dc->bb) dc->bb->heat[(uint16_t)(first + i)] = 0;
+    }
+    if (dc->bb) bb_drop_page(dc->bb, page);
+    c->page_write[page] = dc->page_write[page];
+    c->page_flags[page] &= ~Z80_PAGE_CODE;
+    dc->stats.invalidations++;
+}
+
+#ifndef Z80_SWITCH_DISPATCH
+/* Operand bytes after the decoded prefix and opcode bytes */
+static unsigned dc_operand_len(const struct dc_entry *e) {
+    uint8_t op = e->op;
+    unsigned n = 0, hl_mem;
+    switch (e->tab) {
+    case DC_ED:
+        return (op & 0xC7) == 0x43 ? 2 : 0;      /* LD (nn),rr / LD rr,(nn) */
+    case DC_MAIN: case DC_DD: case DC_FD:
+        if (op < 0x40) {
+            if ((op & 0x07) == 0x06) n = 1;      /* LD r,n */
+            else if ((op & 0x07) == 0x00 && op >= 0x10) n = 1; /* DJNZ, JR */
+            else if ((op & 0x0F) == 0x01) n = 2; /* LD rr,nn */
+            else if ((op & 0xE7) == 0x22) n = 2; /* LD (nn),HL/A etc. */
+        } else if (op >= 0xC0) {
+            if ((op & 0x07) == 0x06) n = 1;      /* ALU A,n */
+            else if (op == 0xD3 || op == 0xDB) n = 1; /* OUT/IN (n),A */
+            else if ((op & 0x07) == 0x02 || (op & 0x07) == 0x04 ||
+                     op == 0xC3 || op == 0xCD) n = 2;  /* JP, CALL */
+        }
+        if (e->tab == DC_MAIN) return n;
+        /* (HL) operands become (IX+d) */
+        hl_mem = op == 0x34 || op == 0x35 || op == 0x36 ||
+                 (op >= 0x40 && op < 0xC0 && op != 0x76 &&
+                  ((op & 0x07) == 0x06 || (op >= 0x70 && op < 0x78)));
+        return n + hl_mem;
+    default:
+        return 0;
+    }
+}
+
+/* Decode the instruction at pc into e. Returns 0 (e left empty) if the
+   bytes are not all in mapped, cacheable memory or there are more than
+   DC_MAX_LEN of them. */
+static int dc_fill(z80_t *c, struct dc_entry *e, uint16_t pc) {
+    uint8_t b[DC_MAX_LEN];
+    unsigned avail = 0, n = 1;
+
+    while (avail < DC_MAX_LEN) {
+        uint16_t a = pc + avail;
+        unsigned pg = a >> Z80_PAGE_SHIFT;
+        const uint8_t *page = c->page_read[pg];
+        if (!page || c->dcache->write_flushes[pg] >= DC_MAX_FLUSHES) break;
+        b[avail++] = page[a & Z80_PAGE_MASK];
+    }
+    if (avail == 0) return 0;
+
+    /* Mirrors the prefix handlers in z80_ops.inc */
+    uint8_t op = b[0], r = 1, t = 0, tab = DC_MAIN;
+    uint16_t imm = 0;
+    if (op == 0xCB || op == 0xED) {
+        if (n >= avail) return 0;
+        tab = op == 0xCB ? DC_CB : DC_ED;
+        op = b[n++];
+    } else if (op == 0xDD || op == 0xFD) {
+        tab = op == 0xDD ? DC_DD : DC_FD;
+        r++;
+        for (;;) {
+            if (n >= avail) return 0;
+            op = b[n++];
+            if (op == 0xDD || op == 0xFD) {
+                tab = op == 0xDD ? DC_DD : DC_FD;
+                r++;
+                t += 4;
+                continue;
+            }
+            if (op == 0xED) {
+                if (n >= avail) return 0;
+                tab = DC_ED;
+                r++;
+                t += 4;
+                op = b[n++];
+            } else if (op == 0xCB) {
+                if (n + 2 > avail) return 0;
+                imm = b[n];  /* d */
+                op = b[n + 1];
+                n += 2;
+                tab = tab == DC_DD ? DC_DDCB : DC_FDCB;
+            }
+            break;
+        }
+    }
+
+    e->tab = tab; e->op = op;
+    unsigned size = n + dc_operand_len(e);
+    if (size > avail) return 0;
+    if (size > n) imm = b[n];
+    if (size > n + 1) imm |= (uint16_t)b[n + 1] << 8;
+    e->r = r; e->t = t;
+    e->imm = imm;
+    e->size = size;
+    e->len = n;
+
+    /* Watch the pages the decoded bytes came from, operands included */
+    for (unsigned i = 0; i < size; i++) {
+        unsigned page = (uint16_t)(pc + i) >> Z80_PAGE_SHIFT;
+        if (c->page_flags[page] & Z80_PAGE_CODE) continue;
+        c->dcache->page_write[page] = c->page_write[page];
+        c->page_write[page] = NULL;
+        c->page_flags[page] |= Z80_PAGE_CODE;
+    }
+    c->dcache->stats.misses++;
+    return 1;
+}
+
+/* Consume the decoded bytes as the prefix handlers would have, and the
+   operands too where the handler takes them from e */
+static inline void dc_enter(z80_t *c, const struct dc_entry *e) {
+    c->PC += DC_OPERANDS ? e->size : e->len;
+    add_r(c, e->r);
+}
+
+static inline uint16_t dc_addr(z80_t *c, const struct dc_entry *e) {
+    return (e->tab == DC_DDCB ? c->IX : c->IY) + (int8_t)e->imm;
+}
+#endif
+
+/* ── PC traps and watches ────────────────────────────────────────── */
+
+/* A page holding a trap or watching reads loses its read pointer, and a
+   page watching writes its write pointer, so the checks only happen once
+   an access would have left the fast path anyway. The pointers are kept
+   in traps->page_read and page_write, and accesses to the page's
+   unwatched bytes still go straight to them. */
+
+#define DEBUG_PAGE (Z80_PAGE_TRAP | Z80_PAGE_RWATCH | Z80_PAGE_WWATCH)
+
+struct z80_traps {
+    unsigned n, nwatch;
+    struct {
+        uint16_t    addr;
+        z80_trap_fn fn;
+    } trap[Z80_MAX_TRAPS];
+    struct {
+        uint16_t     addr;
+        uint8_t      kind;
+        uint32_t     len;
+        z80_watch_fn fn;
+    } watch[Z80_MAX_WATCHES];
+    uint8_t *page_read[Z80_PAGES];   /* Read pointers of hidden pages */
+    uint8_t *page_write[Z80_PAGES];  /* Write pointers of Z80_PAGE_WWATCH pages */
+};
+
+/* PC is on a trap page: run its trap, if PC has one. Returns nonzero if
+   the trap took over the instruction. */
+static int run_trap(z80_t *c) {
+    const z80_traps_t *tr = c->traps;
+    for (unsigned i = 0; i < tr->n; i++)
+        if (tr->trap[i].addr == c->PC) {
+            get_f(c);  /* Handlers see the exact F */
+            return tr->trap[i].fn(c, c->PC);
+        }
+    return 0;
+}
 
-static inline void set_bc(z80_t *c, uint16_t v) { c->B = v >> 8; c->C = v & 0xFF; }
-static inline void set_de(z80_t *c, uint16_t v) { c->D = v >> 8; c->E = v & 0xFF; }
-static inline void set_hl(z80_t *c, uint16_t v) { c->H = v >> 8; c->L = v & 0xFF; }
-static inline void set_af(z80_t *c, uint16_t v) { c->A = v >> 8; c->F = v & 0xFF; }
+#ifndef Z80_FLAT_MEMORY
+/* An access of kind on a watching page has been made: call the first
+   watch holding addr. Nothing touches traps after fn, which may remove
+   watches. */
+static void run_watch(z80_t *c, uint16_t addr, uint8_t val, int kind) {
+    const z80_traps_t *tr = c->traps;
+    for (unsigned i = 0; i < tr->nwatch; i++)
+        if ((tr->watch[i].kind & kind) &&
+            (uint16_t)(addr - tr->watch[i].addr) < tr->watch[i].len) {
+            tr->watch[i].fn(c, addr, val, kind);
+            return;
+        }
+}
+
+/* wb() on a page watching writes: the write as wb() would have made it,
+   then the watch */
+static void watch_write(z80_t *c, uint16_t addr, uint8_t val) {
+    unsigned pg = addr >> Z80_PAGE_SHIFT;
+    uint8_t flags = c->page_flags[pg];
+    if (flags & Z80_PAGE_CODE) {
+        uint8_t *n = &c->dcache->write_flushes[pg];
+        dc_flush_page(c, pg);
+        if (*n < DC_MAX_FLUSHES) (*n)++;
+    }
+    if (!(flags & Z80_PAGE_RO)) {
+        uint8_t *page = c->traps->page_write[pg];
+        if (page)
+            page[addr & Z80_PAGE_MASK] = val;
+        else
+            c->mem_write(c->ctx, addr, val);
+    }
+    run_watch(c, addr, val, Z80_WATCH_WRITE);
+}
+#endif
 
 /* ── Memory access helpers ───────────────────────────────────────── */
 
+/* Every step reads the registers, t_states, dcache and mem or the page
+   table base: keep them in z80_t's first cache line (see z80.h) */
+_Static_assert(offsetof(z80_t, mem) + sizeof(uint8_t *) <= 64,
+               "z80_t.mem outside the first cache line");
+_Static_assert(offsetof(z80_t, t_states) + sizeof(unsigned long) <= 64,
+               "z80_t.t_states outside the first cache line");
+_Static_assert(offsetof(z80_t, dcache) + sizeof(z80_dcache_t *) <= 64,
+               "z80_t.dcache outside the first cache line");
+_Static_assert(offsetof(z80_t, page_read) <= 64,
+               "z80_t page table does not follow the first cache line");
+
+#ifdef Z80_FLAT_MEMORY
+/* -DZ80_FLAT_MEMORY: all 64K is cpu.mem, with no page table, callbacks
+   or write protection in the way */
 static inline uint8_t rb(z80_t *c, uint16_t addr) {
+    return c->mem[addr];
+}
+
+static inline void wb(z80_t *c, uint16_t addr, uint8_t val) {
+    c->mem[addr] = val;
+}
+
+static inline const uint8_t *read_page(z80_t *c, uint16_t addr) {
+    return c->mem + (addr & ~Z80_PAGE_MASK);
+}
+
+static inline uint8_t *write_page(z80_t *c, uint16_t addr) {
+    return c->mem + (addr & ~Z80_PAGE_MASK);
+}
+#else
+static inline uint8_t rb(z80_t *c, uint16_t addr) {
+    const uint8_t *page = c->page_read[addr >> Z80_PAGE_SHIFT];
+    if (page) return page[addr & Z80_PAGE_MASK];
+    uint8_t flags = c->page_flags[addr >> Z80_PAGE_SHIFT];
+    if (flags & (Z80_PAGE_TRAP | Z80_PAGE_RWATCH)) {
+        page = c->traps->page_read[addr >> Z80_PAGE_SHIFT];
+        uint8_t val = page ? page[addr & Z80_PAGE_MASK]
+                           : c->mem_read(c->ctx, addr);
+        if (flags & Z80_PAGE_RWATCH) run_watch(c, addr, val, Z80_WATCH_READ);
+        return val;
+    }
     return c->mem_read(c->ctx, addr);
 }
 
 static inline void wb(z80_t *c, uint16_t addr, uint8_t val) {
+    uint8_t *page = c->page_write[addr >> Z80_PAGE_SHIFT];
+    if (page) {
+        page[addr & Z80_PAGE_MASK] = val;
+        return;
+    }
+    uint8_t flags = c->page_flags[addr >> Z80_PAGE_SHIFT];
+    if (flags & Z80_PAGE_WWATCH) {
+        watch_write(c, addr, val);
+        return;
+    }
+    if (flags & Z80_PAGE_RO) return;
+    if (flags & Z80_PAGE_CODE) {
+        /* First write to a page with cached decodes: drop them */
+        uint8_t *n = &c->dcache->write_flushes[addr >> Z80_PAGE_SHIFT];
+        dc_flush_page(c, addr >> Z80_PAGE_SHIFT);
+        if (*n < DC_MAX_FLUSHES) (*n)++;
+        page = c->page_write[addr >> Z80_PAGE_SHIFT];
+        if (page) {
+            page[addr & Z80_PAGE_MASK] = val;
+            return;
+        }
+    }
     c->mem_write(c->ctx, addr, val);
 }
 
+/* Host copy of the page holding addr, for the block fast paths; NULL if
+   accesses to it must go through rb()/wb() */
+static inline const uint8_t *read_page(z80_t *c, uint16_t addr) {
+    return c->page_read[addr >> Z80_PAGE_SHIFT];
+}
+
+static inline uint8_t *write_page(z80_t *c, uint16_t addr) {
+    return c->page_write[addr >> Z80_PAGE_SHIFT];
+}
+#endif
+
 static inline uint16_t rw(z80_t *c, uint16_t addr) {
     return rb(c, addr) | ((uint16_t)rb(c, addr + 1) << 8);
 }
@@ -61,6 +650,155 @@ static inline uint16_t fetch16(z80_t *c) {
     return (hi << 8) | lo;
 }
 
+/* ── Profiler ────────────────────────────────────────────────────── */
+
+#if defined(Z80_PROFILE) || defined(Z80_TRACE)
+/* Byte at addr, for the profiler and the trace to tell what ran, without
+   going through mem_read: -1 if it is only reachable through it */
+static int peek(z80_t *c, uint16_t addr) {
+    const uint8_t *page = read_page(c, addr);
+#ifndef Z80_FLAT_MEMORY
+    if (!page && (c->page_flags[addr >> Z80_PAGE_SHIFT] &
+                  (Z80_PAGE_TRAP | Z80_PAGE_RWATCH)))
+        page = c->traps->page_read[addr >> Z80_PAGE_SHIFT];
+#endif
+    return page ? page[addr & Z80_PAGE_MASK] : -1;
+}
+#endif
+
+#ifdef Z80_PROFILE
+/* The table and opcode the prefix chain at pc ends in; 0 if unknown, as
+   for code fetched through the callbacks, which is only counted by PC */
+static int prof_decode(z80_t *c, uint16_t pc, unsigned *tab, unsigned *op) {
+    int b = peek(c, pc);
+    *tab = Z80_PROF_MAIN;
+    if (b == 0xCB || b == 0xED) {
+        *tab = b == 0xCB ? Z80_PROF_CB : Z80_PROF_ED;
+        b = peek(c, pc + 1);
+    } else if (b == 0xDD || b == 0xFD) {
+        *tab = b == 0xDD ? Z80_PROF_DD : Z80_PROF_FD;
+        b = peek(c, pc + 1);
+        if (b == 0xCB) {
+            *tab = Z80_PROF_DDCB;
+            b = peek(c, pc + 3);
+        }
+    }
+    if (b < 0) return 0;
+    *op = (unsigned)b;
+    return 1;
+}
+
+/* Charge n runs of the instruction at pc, t T-states in all, to it, its
+   opcode and the routine it is in */
+static void prof_count(z80_t *c, uint16_t pc, unsigned long n,
+                       unsigned long t) {
+    z80_profile_t *p = c->prof;
+    unsigned tab, op;
+    p->pc_count[pc] += n;
+    p->pc_tstates[pc] += t;
+    if (prof_decode(c, pc, &tab, &op)) {
+        p->op_count[tab][op] += n;
+        p->op_tstates[tab][op] += t;
+    }
+    p->node[p->depth ? p->stack[p->depth - 1].node : 0].tstates += t;
+}
+
+/* Enter the routine at addr, with its return address at sp */
+static void prof_call(z80_profile_t *p, uint16_t addr, uint16_t sp) {
+    if (p->depth == Z80_PROF_DEPTH) return;
+    uint32_t parent = p->depth ? p->stack[p->depth - 1].node : 0;
+    uint32_t n = p->node[parent].child;
+    while (n && p->node[n].addr != addr) n = p->node[n].next;
+    if (!n) {
+        if (p->nnodes == p->cap) {
+            z80_prof_node_t *node = realloc(p->node,
+                                            2 * p->cap * sizeof(*node));
+            if (!node) return;
+            p->node = node;
+            p->cap *= 2;
+        }
+        n = p->nnodes++;
+        p->node[n] = (z80_prof_node_t){
+            .addr = addr, .parent = parent, .next = p->node[parent].child
+        };
+        p->node[parent].child = n;
+    }
+    p->node[n].calls++;
+    p->stack[p->depth].node = n;
+    p->stack[p->depth].sp = sp;
+    p->depth++;
+}
+
+/* The instruction at pc has run, from SP sp, in t T-states. Frames whose
+   return address is now above SP have ended; a CALL or RST that pushed
+   one starts a new frame. Returns t. */
+static int prof_insn(z80_t *c, uint16_t pc, uint16_t sp, int t) {
+    z80_profile_t *p = c->prof;
+    prof_count(c, pc, 1, (unsigned long)t);
+    while (p->depth && c->SP > p->stack[p->depth - 1].sp) p->depth--;
+    if (c->SP == (uint16_t)(sp - 2)) {
+        int op = peek(c, pc);  /* -1 for code only mem_read() can reach */
+        if (op >= 0 && (op == 0xCD || (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC7))
+            prof_call(p, c->PC, c->SP);
+    }
+    return t;
+}
+
+#define PROF_INSN(c, pc, sp, t)  ((c)->prof ? prof_insn(c, pc, sp, t) : (t))
+#define PROF_COUNT(c, pc, n, t) \
+    do { if ((c)->prof) prof_count(c, pc, n, t); } while (0)
+#else
+#define PROF_INSN(c, pc, sp, t)  ((void)(pc), (void)(sp), (t))
+#define PROF_COUNT(c, pc, n, t)  ((void)0)
+#endif
+
+/* ── Instruction trace ───────────────────────────────────────────── */
+
+#ifdef Z80_TRACE
+/* Record the instruction at PC, if the triggers say so */
+static void trace_insn(z80_t *c) {
+    z80_trace_t *tr = c->trace;
+    if (tr->state == Z80_TRACE_ARMED) {
+        if ((tr->start_pc >= 0 && c->PC != tr->start_pc) ||
+            c->t_states < tr->start_t)
+            return;
+        tr->state = Z80_TRACE_ON;
+    } else if (tr->state == Z80_TRACE_ON) {
+        if (c->PC == tr->stop_pc || c->t_states >= tr->stop_t) {
+            tr->state = Z80_TRACE_DONE;
+            return;
+        }
+    } else {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&tr->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&tr->tail, memory_order_acquire) ==
+           tr->size) {
+        if (!tr->wait) {
+            tr->dropped++;
+            return;
+        }
+        tr->wait(tr);
+    }
+    z80_trace_rec_t *r = &tr->rec[head & (tr->size - 1)];
+    r->t_states = c->t_states;
+    r->pc = c->PC;   r->sp = c->SP;
+    r->af = rp_af(c); r->bc = c->BC; r->de = c->DE; r->hl = c->HL;
+    r->ix = c->IX;   r->iy = c->IY;
+    r->af_ = c->AF_; r->bc_ = c->BC_; r->de_ = c->DE_; r->hl_ = c->HL_;
+    for (int i = 0; i < 4; i++) {
+        int b = peek(c, c->PC + i);
+        r->op[i] = b < 0 ? 0 : (uint8_t)b;
+    }
+    r->i = c->I;
+    r->r = c->R;
+    r->iff = c->IFF1 | c->IFF2 << 1;
+    r->im = c->IM;
+    atomic_store_explicit(&tr->head, head + 1, memory_order_release);
+}
+#endif
+
 /* ── Stack helpers ───────────────────────────────────────────────── */
 
 static inline void push16(z80_t *c, uint16_t val) {
@@ -87,84 +825,57 @@ static inline void io_out(z80_t *c, uint16_t port, uint8_t val) {
 /* ── Flag helpers ────────────────────────────────────────────────── */
 
 static inline uint8_t sz53(uint8_t val) {
-    return (val & (Z80_SF | Z80_F5 | Z80_F3)) | (val == 0 ? Z80_ZF : 0);
+    return sz53_table[val];
 }
 
 static inline uint8_t sz53p(uint8_t val) {
-    return sz53(val) | parity_table[val];
+    return sz53p_table[val];
 }
 
+#ifdef Z80_SWITCH_DISPATCH
+/* Operand decoding for the reference switch decoder */
+
 /* ── 8-bit register access by index ──────────────────────────────── */
 /* Index: 0=B 1=C 2=D 3=E 4=H 5=L 6=(HL) 7=A */
 
+/* Operand index to z80_t.reg[] slot; 6 is (HL) and never looked up */
+static const uint8_t reg8_slot[8] = {
+    Z80_REG_B, Z80_REG_C, Z80_REG_D, Z80_REG_E,
+    Z80_REG_H, Z80_REG_L, 0, Z80_REG_A
+};
+
 static uint8_t get_reg8(z80_t *c, int idx) {
-    switch (idx) {
-        case 0: return c->B;
-        case 1: return c->C;
-        case 2: return c->D;
-        case 3: return c->E;
-        case 4: return c->H;
-        case 5: return c->L;
-        case 6: return rb(c, rp_hl(c));
-        case 7: return c->A;
-    }
-    return 0;
+    if (idx == 6) return rb(c, c->HL);
+    return c->reg[reg8_slot[idx]];
 }
 
 static void set_reg8(z80_t *c, int idx, uint8_t val) {
-    switch (idx) {
-        case 0: c->B = val; break;
-        case 1: c->C = val; break;
-        case 2: c->D = val; break;
-        case 3: c->E = val; break;
-        case 4: c->H = val; break;
-        case 5: c->L = val; break;
-        case 6: wb(c, rp_hl(c), val); break;
-        case 7: c->A = val; break;
-    }
+    if (idx == 6) wb(c, c->HL, val);
+    else c->reg[reg8_slot[idx]] = val;
 }
 
 
 /* ── 16-bit register pair access ─────────────────────────────────── */
-/* p index: 0=BC 1=DE 2=HL 3=SP */
+/* p index: 0=BC 1=DE 2=HL 3=SP, which are pair[0..2] and SP */
 
 static uint16_t get_rp(z80_t *c, int p) {
-    switch (p) {
-        case 0: return rp_bc(c);
-        case 1: return rp_de(c);
-        case 2: return rp_hl(c);
-        case 3: return c->SP;
-    }
-    return 0;
+    return p == 3 ? c->SP : c->pair[p];
 }
 
 static void set_rp(z80_t *c, int p, uint16_t val) {
-    switch (p) {
-        case 0: set_bc(c, val); break;
-        case 1: set_de(c, val); break;
-        case 2: set_hl(c, val); break;
-        case 3: c->SP = val; break;
-    }
+    if (p == 3) c->SP = val;
+    else c->pair[p] = val;
 }
 
-/* p2 index: 0=BC 1=DE 2=HL 3=AF */
+/* p2 index: 0=BC 1=DE 2=HL 3=AF, all of pair[] */
 static uint16_t get_rp2(z80_t *c, int p) {
-    switch (p) {
-        case 0: return rp_bc(c);
-        case 1: return rp_de(c);
-        case 2: return rp_hl(c);
-        case 3: return rp_af(c);
-    }
-    return 0;
+    get_f(c);
+    return c->pair[p];
 }
 
 static void set_rp2(z80_t *c, int p, uint16_t val) {
-    switch (p) {
-        case 0: set_bc(c, val); break;
-        case 1: set_de(c, val); break;
-        case 2: set_hl(c, val); break;
-        case 3: set_af(c, val); break;
-    }
+    if (p == 3) set_af(c, val);
+    else c->pair[p] = val;
 }
 
 /* ── Condition code evaluation ───────────────────────────────────── */
@@ -172,79 +883,66 @@ static void set_rp2(z80_t *c, int p, uint16_t val) {
 
 static int eval_cc(z80_t *c, int cc) {
     switch (cc) {
-        case 0: return !(c->F & Z80_ZF);
-        case 1: return  (c->F & Z80_ZF);
-        case 2: return !(c->F & Z80_CF);
-        case 3: return  (c->F & Z80_CF);
-        case 4: return !(c->F & Z80_PF);
-        case 5: return  (c->F & Z80_PF);
-        case 6: return !(c->F & Z80_SF);
-        case 7: return  (c->F & Z80_SF);
+        case 0: return !get_z(c);
+        case 1: return  get_z(c);
+        case 2: return !get_c(c);
+        case 3: return  get_c(c);
+        case 4: return !(get_f(c) & Z80_PF);
+        case 5: return  (get_f(c) & Z80_PF);
+        case 6: return !get_s(c);
+        case 7: return  get_s(c);
     }
     return 0;
 }
+#endif /* Z80_SWITCH_DISPATCH */
 
 /* ── ALU operations ──────────────────────────────────────────────── */
 
-static void alu_add(z80_t *c, uint8_t val) {
+static inline void alu_add(z80_t *c, uint8_t val) {
     uint16_t r = c->A + val;
-    uint8_t h = (c->A ^ val ^ r) & 0x10;
-    uint8_t v = ((c->A ^ val ^ 0x80) & (c->A ^ r)) & 0x80;
+    SET_FLAGS(c, LF_ADD, c->A, val, r, add_flags(c->A, val, r));
     c->A = (uint8_t)r;
-    c->F = sz53(c->A) | (r & 0x100 ? Z80_CF : 0) | (h ? Z80_HF : 0) | (v ? Z80_PF : 0);
 }
 
-static void alu_adc(z80_t *c, uint8_t val) {
-    uint8_t carry = c->F & Z80_CF ? 1 : 0;
-    uint16_t r = c->A + val + carry;
-    uint8_t h = (c->A ^ val ^ r) & 0x10;
-    uint8_t v = ((c->A ^ val ^ 0x80) & (c->A ^ r)) & 0x80;
+static inline void alu_adc(z80_t *c, uint8_t val) {
+    uint16_t r = c->A + val + get_c(c);
+    SET_FLAGS(c, LF_ADD, c->A, val, r, add_flags(c->A, val, r));
     c->A = (uint8_t)r;
-    c->F = sz53(c->A) | (r & 0x100 ? Z80_CF : 0) | (h ? Z80_HF : 0) | (v ? Z80_PF : 0);
 }
 
-static void alu_sub(z80_t *c, uint8_t val) {
+static inline void alu_sub(z80_t *c, uint8_t val) {
     uint16_t r = c->A - val;
-    uint8_t h = (c->A ^ val ^ r) & 0x10;
-    uint8_t v = ((c->A ^ val) & (c->A ^ r)) & 0x80;
+    SET_FLAGS(c, LF_SUB, c->A, val, r, sub_flags(c->A, val, r));
     c->A = (uint8_t)r;
-    c->F = sz53(c->A) | Z80_NF | (r & 0x100 ? Z80_CF : 0) | (h ? Z80_HF : 0) | (v ? Z80_PF : 0);
 }
 
-static void alu_sbc(z80_t *c, uint8_t val) {
-    uint8_t carry = c->F & Z80_CF ? 1 : 0;
-    uint16_t r = c->A - val - carry;
-    uint8_t h = (c->A ^ val ^ r) & 0x10;
-    uint8_t v = ((c->A ^ val) & (c->A ^ r)) & 0x80;
+static inline void alu_sbc(z80_t *c, uint8_t val) {
+    uint16_t r = c->A - val - get_c(c);
+    SET_FLAGS(c, LF_SUB, c->A, val, r, sub_flags(c->A, val, r));
     c->A = (uint8_t)r;
-    c->F = sz53(c->A) | Z80_NF | (r & 0x100 ? Z80_CF : 0) | (h ? Z80_HF : 0) | (v ? Z80_PF : 0);
 }
 
 static void alu_and(z80_t *c, uint8_t val) {
     c->A &= val;
-    c->F = sz53p(c->A) | Z80_HF;
+    SET_FLAGS(c, LF_AND, 0, 0, c->A, sz53p(c->A) | Z80_HF);
 }
 
 static void alu_xor(z80_t *c, uint8_t val) {
     c->A ^= val;
-    c->F = sz53p(c->A);
+    SET_FLAGS(c, LF_SZP, 0, 0, c->A, sz53p(c->A));
 }
 
 static void alu_or(z80_t *c, uint8_t val) {
     c->A |= val;
-    c->F = sz53p(c->A);
+    SET_FLAGS(c, LF_SZP, 0, 0, c->A, sz53p(c->A));
 }
 
-static void alu_cp(z80_t *c, uint8_t val) {
+static inline void alu_cp(z80_t *c, uint8_t val) {
     uint16_t r = c->A - val;
-    uint8_t h = (c->A ^ val ^ r) & 0x10;
-    uint8_t v = ((c->A ^ val) & (c->A ^ r)) & 0x80;
-    /* Note: F3 and F5 come from the operand, not the result */
-    c->F = (r & 0xFF ? 0 : Z80_ZF) | ((uint8_t)r & Z80_SF) | Z80_NF |
-           (val & (Z80_F5 | Z80_F3)) |
-           (r & 0x100 ? Z80_CF : 0) | (h ? Z80_HF : 0) | (v ? Z80_PF : 0);
+    SET_FLAGS(c, LF_CP, c->A, val, r, cp_flags(c->A, val, r));
 }
 
+#ifdef Z80_SWITCH_DISPATCH
 static void do_alu(z80_t *c, int op, uint8_t val) {
     switch (op) {
         case 0: alu_add(c, val); break;
@@ -257,22 +955,21 @@ static void do_alu(z80_t *c, int op, uint8_t val) {
         case 7: alu_cp(c, val);  break;
     }
 }
+#endif
 
 /* ── INC/DEC 8-bit ───────────────────────────────────────────────── */
 
 static uint8_t inc8(z80_t *c, uint8_t val) {
     uint8_t r = val + 1;
-    c->F = (c->F & Z80_CF) | sz53(r) |
-           (r == 0x80 ? Z80_PF : 0) |
-           ((r & 0x0F) == 0 ? Z80_HF : 0);
+    uint8_t carry = get_c(c);
+    SET_FLAGS(c, LF_INC, 0, 0, r | (carry << 8), carry | inc8_table[r]);
     return r;
 }
 
 static uint8_t dec8(z80_t *c, uint8_t val) {
     uint8_t r = val - 1;
-    c->F = (c->F & Z80_CF) | sz53(r) | Z80_NF |
-           (val == 0x80 ? Z80_PF : 0) |
-           ((val & 0x0F) == 0 ? Z80_HF : 0);
+    uint8_t carry = get_c(c);
+    SET_FLAGS(c, LF_DEC, 0, 0, r | (carry << 8), carry | dec8_table[r]);
     return r;
 }
 
@@ -281,10 +978,10 @@ static uint8_t dec8(z80_t *c, uint8_t val) {
 static void add_hl(z80_t *c, uint16_t *hl, uint16_t val) {
     uint32_t r = *hl + val;
     uint16_t h = (*hl ^ val ^ r) & 0x1000;
-    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-           ((r >> 8) & (Z80_F5 | Z80_F3)) |
-           (r & 0x10000 ? Z80_CF : 0) |
-           (h ? Z80_HF : 0);
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+             ((r >> 8) & (Z80_F5 | Z80_F3)) |
+             (r & 0x10000 ? Z80_CF : 0) |
+             (h ? Z80_HF : 0));
     *hl = (uint16_t)r;
 }
 
@@ -293,42 +990,42 @@ static void add_hl(z80_t *c, uint16_t *hl, uint16_t val) {
 static uint8_t rlc(z80_t *c, uint8_t val) {
     uint8_t carry = val >> 7;
     uint8_t r = (val << 1) | carry;
-    c->F = sz53p(r) | carry;
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
 static uint8_t rrc(z80_t *c, uint8_t val) {
     uint8_t carry = val & 1;
     uint8_t r = (val >> 1) | (carry << 7);
-    c->F = sz53p(r) | carry;
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
 static uint8_t rl(z80_t *c, uint8_t val) {
     uint8_t carry = val >> 7;
-    uint8_t r = (val << 1) | (c->F & Z80_CF);
-    c->F = sz53p(r) | carry;
+    uint8_t r = (val << 1) | get_c(c);
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
 static uint8_t rr(z80_t *c, uint8_t val) {
     uint8_t carry = val & 1;
-    uint8_t r = (val >> 1) | ((c->F & Z80_CF) << 7);
-    c->F = sz53p(r) | carry;
+    uint8_t r = (val >> 1) | (get_c(c) << 7);
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
 static uint8_t sla(z80_t *c, uint8_t val) {
     uint8_t carry = val >> 7;
     uint8_t r = val << 1;
-    c->F = sz53p(r) | carry;
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
 static uint8_t sra(z80_t *c, uint8_t val) {
     uint8_t carry = val & 1;
     uint8_t r = (val >> 1) | (val & 0x80);
-    c->F = sz53p(r) | carry;
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
@@ -336,17 +1033,18 @@ static uint8_t sll(z80_t *c, uint8_t val) {
     /* Undocumented: shifts left, bit 0 = 1 */
     uint8_t carry = val >> 7;
     uint8_t r = (val << 1) | 1;
-    c->F = sz53p(r) | carry;
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
 static uint8_t srl(z80_t *c, uint8_t val) {
     uint8_t carry = val & 1;
     uint8_t r = val >> 1;
-    c->F = sz53p(r) | carry;
+    SET_FLAGS(c, LF_SZP, 0, 0, r | (carry << 8), sz53p(r) | carry);
     return r;
 }
 
+#ifdef Z80_SWITCH_DISPATCH
 static uint8_t do_rot(z80_t *c, int op, uint8_t val) {
     switch (op) {
         case 0: return rlc(c, val);
@@ -360,37 +1058,46 @@ static uint8_t do_rot(z80_t *c, int op, uint8_t val) {
     }
     return val;
 }
+#endif
 
 /* ── Increment R register (lower 7 bits only) ────────────────────── */
 
 static inline void inc_r(z80_t *c) {
-    c->R = (c->R & 0x80) | ((c->R + 1) & 0x7F);
+    add_r(c, 1);
+}
+
+/* Would the next instruction boundary take an interrupt? */
+static inline int irq_ready(const z80_t *cpu) {
+    return (cpu->irq & Z80_IRQ_NMI) ||
+           ((cpu->irq & Z80_IRQ_INT) && cpu->IFF1 && !cpu->ei_delay);
 }
 
 /* ── DAA ─────────────────────────────────────────────────────────── */
 
 static void daa(z80_t *c) {
-    uint8_t a = c->A;
-    uint8_t correction = 0;
-    uint8_t carry = c->F & Z80_CF;
-
-    if ((c->F & Z80_HF) || (a & 0x0F) > 9)
-        correction |= 0x06;
-    if (carry || a > 0x99) {
-        correction |= 0x60;
-        carry = Z80_CF;
-    }
+    uint16_t r = daa_table[c->A | (get_c(c) << 8) |
+                           ((get_f(c) & Z80_HF) << 5) | ((get_f(c) & Z80_NF) << 9)];
+    c->A = r >> 8;
+    set_f(c, r & 0xFF);
+}
 
-    if (c->F & Z80_NF)
-        c->A -= correction;
-    else
-        c->A += correction;
+/* ── Opcode dispatch ─────────────────────────────────────────────── */
+/*
+ * Default build: every opcode of every prefix table has its own handler in
+ * z80_ops.inc, so no x/y/z field decoding or operand switches run at
+ * execution time. The handler text compiles one of two ways:
+ *
+ *   - GCC/Clang: labels inside exec_main_op(), reached by computed goto
+ *     through one label table per prefix;
+ *   - other compilers, or -DZ80_NO_COMPUTED_GOTO: one static function per
+ *     handler, reached through function-pointer tables.
+ *
+ * -DZ80_SWITCH_DISPATCH builds the original x/y/z switch decoder below
+ * instead. It is kept as the reference for differential testing.
+ */
 
-    c->F = sz53p(c->A) | carry | (c->F & Z80_NF) |
-           ((a ^ c->A) & Z80_HF);
-}
+#ifdef Z80_SWITCH_DISPATCH
 
-/* ── Main instruction execution ──────────────────────────────────── */
 
 /* T-state tables for unprefixed opcodes */
 static const int t_states_main[256] = {
@@ -431,13 +1138,13 @@ static int exec_cb(z80_t *c) {
             t = (z == 6) ? 12 : 8;
             {
                 uint8_t result = val & (1 << y);
-                c->F = (c->F & Z80_CF) | Z80_HF | (result ? 0 : (Z80_ZF | Z80_PF));
-                if (result & Z80_SF) c->F |= Z80_SF;
+                set_f(c, get_c(c) | Z80_HF | (result ? 0 : (Z80_ZF | Z80_PF)) |
+                         (result & Z80_SF));
                 if (z == 6) {
                     /* Bits 3,5 come from high byte of address for (HL) */
                     /* For normal CB prefix this is just H */
                 } else {
-                    c->F = (c->F & ~(Z80_F3 | Z80_F5)) | (val & (Z80_F3 | Z80_F5));
+                    set_f(c, (get_f(c) & ~(Z80_F3 | Z80_F5)) | (val & (Z80_F3 | Z80_F5)));
                 }
             }
             break;
@@ -471,10 +1178,10 @@ static int exec_ddfd_cb(z80_t *c, uint16_t ixiy) {
         case 1: /* BIT y, (IX+d)/(IY+d) */
             {
                 uint8_t result = val & (1 << y);
-                c->F = (c->F & Z80_CF) | Z80_HF | (result ? 0 : (Z80_ZF | Z80_PF));
-                if (result & Z80_SF) c->F |= Z80_SF;
+                set_f(c, get_c(c) | Z80_HF | (result ? 0 : (Z80_ZF | Z80_PF)) |
+                         (result & Z80_SF));
                 /* Bits 3,5 come from high byte of (IX+d) address */
-                c->F = (c->F & ~(Z80_F3 | Z80_F5)) | ((addr >> 8) & (Z80_F3 | Z80_F5));
+                set_f(c, (get_f(c) & ~(Z80_F3 | Z80_F5)) | ((addr >> 8) & (Z80_F3 | Z80_F5)));
             }
             return 20;
         case 2: /* RES y, (IX+d)/(IY+d) */
@@ -503,15 +1210,15 @@ static int exec_ed(z80_t *c) {
         switch (z) {
             case 0: /* IN r[y], (C) / IN (C) if y==6 */
                 {
-                    uint16_t port = ((uint16_t)c->B << 8) | c->C;
+                    uint16_t port = c->BC;
                     uint8_t val = io_in(c, port);
                     if (y != 6) set_reg8(c, y, val);
-                    c->F = (c->F & Z80_CF) | sz53p(val);
+                    set_f(c, get_c(c) | sz53p(val));
                 }
                 return 12;
             case 1: /* OUT (C), r[y] / OUT (C),0 if y==6 */
                 {
-                    uint16_t port = ((uint16_t)c->B << 8) | c->C;
+                    uint16_t port = c->BC;
                     uint8_t val = (y == 6) ? 0 : get_reg8(c, y);
                     io_out(c, port, val);
                 }
@@ -522,27 +1229,27 @@ static int exec_ed(z80_t *c) {
                     uint16_t val = get_rp(c, p);
                     if (q == 0) {
                         /* SBC HL, rp */
-                        uint8_t carry = c->F & Z80_CF ? 1 : 0;
+                        uint8_t carry = get_c(c);
                         uint32_t r = (uint32_t)hl - val - carry;
                         uint16_t h = (hl ^ val ^ r) & 0x1000;
                         uint8_t v = ((hl ^ val) & (hl ^ r) & 0x8000) ? Z80_PF : 0;
                         uint16_t result = (uint16_t)r;
-                        c->F = ((result >> 8) & (Z80_SF | Z80_F5 | Z80_F3)) |
-                               (result == 0 ? Z80_ZF : 0) | Z80_NF |
-                               (r & 0x10000 ? Z80_CF : 0) |
-                               (h ? Z80_HF : 0) | v;
+                        set_f(c, ((result >> 8) & (Z80_SF | Z80_F5 | Z80_F3)) |
+                                 (result == 0 ? Z80_ZF : 0) | Z80_NF |
+                                 (r & 0x10000 ? Z80_CF : 0) |
+                                 (h ? Z80_HF : 0) | v);
                         set_hl(c, result);
                     } else {
                         /* ADC HL, rp */
-                        uint8_t carry = c->F & Z80_CF ? 1 : 0;
+                        uint8_t carry = get_c(c);
                         uint32_t r = (uint32_t)hl + val + carry;
                         uint16_t h = (hl ^ val ^ r) & 0x1000;
                         uint8_t v = ((hl ^ val ^ 0x8000) & (hl ^ r) & 0x8000) ? Z80_PF : 0;
                         uint16_t result = (uint16_t)r;
-                        c->F = ((result >> 8) & (Z80_SF | Z80_F5 | Z80_F3)) |
-                               (result == 0 ? Z80_ZF : 0) |
-                               (r & 0x10000 ? Z80_CF : 0) |
-                               (h ? Z80_HF : 0) | v;
+                        set_f(c, ((result >> 8) & (Z80_SF | Z80_F5 | Z80_F3)) |
+                                 (result == 0 ? Z80_ZF : 0) |
+                                 (r & 0x10000 ? Z80_CF : 0) |
+                                 (h ? Z80_HF : 0) | v);
                         set_hl(c, result);
                     }
                 }
@@ -581,11 +1288,11 @@ static int exec_ed(z80_t *c) {
                     case 1: c->R = c->A; return 9;
                     case 2: /* LD A, I */
                         c->A = c->I;
-                        c->F = (c->F & Z80_CF) | sz53(c->A) | (c->IFF2 ? Z80_PF : 0);
+                        set_f(c, get_c(c) | sz53(c->A) | (c->IFF2 ? Z80_PF : 0));
                         return 9;
                     case 3: /* LD A, R */
                         c->A = c->R;
-                        c->F = (c->F & Z80_CF) | sz53(c->A) | (c->IFF2 ? Z80_PF : 0);
+                        set_f(c, get_c(c) | sz53(c->A) | (c->IFF2 ? Z80_PF : 0));
                         return 9;
                     case 4: /* RRD */
                         {
@@ -594,7 +1301,7 @@ static int exec_ed(z80_t *c) {
                             c->A = (c->A & 0xF0) | (m & 0x0F);
                             m = (m >> 4) | (lo_a << 4);
                             wb(c, rp_hl(c), m);
-                            c->F = (c->F & Z80_CF) | sz53p(c->A);
+                            set_f(c, get_c(c) | sz53p(c->A));
                         }
                         return 18;
                     case 5: /* RLD */
@@ -604,7 +1311,7 @@ static int exec_ed(z80_t *c) {
                             c->A = (c->A & 0xF0) | (m >> 4);
                             m = (m << 4) | lo_a;
                             wb(c, rp_hl(c), m);
-                            c->F = (c->F & Z80_CF) | sz53p(c->A);
+                            set_f(c, get_c(c) | sz53p(c->A));
                         }
                         return 18;
                     default: return 8; /* NOP (ED-prefixed) */
@@ -629,10 +1336,10 @@ static int exec_ed(z80_t *c) {
                     }
                     set_bc(c, rp_bc(c) - 1);
                     uint8_t n = val + c->A;
-                    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_CF)) |
-                           (rp_bc(c) != 0 ? Z80_PF : 0) |
-                           (n & Z80_F3) |
-                           ((n & 0x02) ? Z80_F5 : 0);
+                    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_CF)) |
+                             (rp_bc(c) != 0 ? Z80_PF : 0) |
+                             (n & Z80_F3) |
+                             ((n & 0x02) ? Z80_F5 : 0));
                     if (y >= 6 && rp_bc(c) != 0) {
                         c->PC -= 2;
                         repeat = 1;
@@ -651,13 +1358,13 @@ static int exec_ed(z80_t *c) {
                         set_hl(c, rp_hl(c) - 1);
                     set_bc(c, rp_bc(c) - 1);
                     uint8_t n = result - (hf ? 1 : 0);
-                    c->F = (c->F & Z80_CF) | Z80_NF |
-                           (result & Z80_SF) |
-                           (result == 0 ? Z80_ZF : 0) |
-                           (hf ? Z80_HF : 0) |
-                           (rp_bc(c) != 0 ? Z80_PF : 0) |
-                           (n & Z80_F3) |
-                           ((n & 0x02) ? Z80_F5 : 0);
+                    set_f(c, get_c(c) | Z80_NF |
+                             (result & Z80_SF) |
+                             (result == 0 ? Z80_ZF : 0) |
+                             (hf ? Z80_HF : 0) |
+                             (rp_bc(c) != 0 ? Z80_PF : 0) |
+                             (n & Z80_F3) |
+                             ((n & 0x02) ? Z80_F5 : 0));
                     if (y >= 6 && rp_bc(c) != 0 && result != 0) {
                         c->PC -= 2;
                         repeat = 1;
@@ -667,7 +1374,7 @@ static int exec_ed(z80_t *c) {
 
             case 2: /* INI/IND/INIR/INDR */
                 {
-                    uint16_t port = ((uint16_t)c->B << 8) | c->C;
+                    uint16_t port = c->BC;
                     uint8_t val = io_in(c, port);
                     wb(c, rp_hl(c), val);
                     c->B--;
@@ -675,9 +1382,9 @@ static int exec_ed(z80_t *c) {
                         set_hl(c, rp_hl(c) + 1);
                     else
                         set_hl(c, rp_hl(c) - 1);
-                    c->F = (c->F & ~(Z80_ZF | Z80_NF)) |
-                           (c->B == 0 ? Z80_ZF : 0) | Z80_NF |
-                           (c->B & (Z80_SF | Z80_F5 | Z80_F3));
+                    set_f(c, (get_f(c) & ~(Z80_ZF | Z80_NF)) |
+                             (c->B == 0 ? Z80_ZF : 0) | Z80_NF |
+                             (c->B & (Z80_SF | Z80_F5 | Z80_F3)));
                     if (y >= 6 && c->B != 0) {
                         c->PC -= 2;
                         repeat = 1;
@@ -689,15 +1396,15 @@ static int exec_ed(z80_t *c) {
                 {
                     uint8_t val = rb(c, rp_hl(c));
                     c->B--;
-                    uint16_t port = ((uint16_t)c->B << 8) | c->C;
+                    uint16_t port = c->BC;
                     io_out(c, port, val);
                     if (y == 4 || y == 6)
                         set_hl(c, rp_hl(c) + 1);
                     else
                         set_hl(c, rp_hl(c) - 1);
-                    c->F = (c->F & ~(Z80_ZF | Z80_NF)) |
-                           (c->B == 0 ? Z80_ZF : 0) | Z80_NF |
-                           (c->B & (Z80_SF | Z80_F5 | Z80_F3));
+                    set_f(c, (get_f(c) & ~(Z80_ZF | Z80_NF)) |
+                             (c->B == 0 ? Z80_ZF : 0) | Z80_NF |
+                             (c->B & (Z80_SF | Z80_F5 | Z80_F3)));
                     if (y >= 6 && c->B != 0) {
                         c->PC -= 2;
                         repeat = 1;
@@ -730,7 +1437,7 @@ static int exec_ddfd(z80_t *c, uint16_t *ixiy) {
        re-entering. But the simplest approach: re-process. */
     if (op == 0xDD || op == 0xFD) {
         /* Another prefix; PC already points past it */
-        c->R = (c->R & 0x80) | ((c->R + 1) & 0x7F);
+        inc_r(c);
         uint16_t *new_ixiy = (op == 0xDD) ? &c->IX : &c->IY;
         return 4 + exec_ddfd(c, new_ixiy);
     }
@@ -953,8 +1660,7 @@ static int exec_main_op(z80_t *c, uint8_t op) {
             case 0: /* NOP */
                 break;
             case 1: /* EX AF, AF' */
-                { uint8_t ta = c->A; c->A = c->A_; c->A_ = ta; }
-                { uint8_t tf = c->F; c->F = c->F_; c->F_ = tf; }
+                { uint16_t tmp = rp_af(c); c->AF = c->AF_; c->AF_ = tmp; }
                 break;
             case 2: /* DJNZ d */
                 {
@@ -1042,32 +1748,32 @@ static int exec_main_op(z80_t *c, uint8_t op) {
                 {
                     uint8_t carry = c->A >> 7;
                     c->A = (c->A << 1) | carry;
-                    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-                           (c->A & (Z80_F5 | Z80_F3)) | carry;
+                    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+                             (c->A & (Z80_F5 | Z80_F3)) | carry);
                 }
                 break;
             case 1: /* RRCA */
                 {
                     uint8_t carry = c->A & 1;
                     c->A = (c->A >> 1) | (carry << 7);
-                    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-                           (c->A & (Z80_F5 | Z80_F3)) | carry;
+                    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+                             (c->A & (Z80_F5 | Z80_F3)) | carry);
                 }
                 break;
             case 2: /* RLA */
                 {
                     uint8_t carry = c->A >> 7;
-                    c->A = (c->A << 1) | (c->F & Z80_CF);
-                    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-                           (c->A & (Z80_F5 | Z80_F3)) | carry;
+                    c->A = (c->A << 1) | get_c(c);
+                    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+                             (c->A & (Z80_F5 | Z80_F3)) | carry);
                 }
                 break;
             case 3: /* RRA */
                 {
                     uint8_t carry = c->A & 1;
-                    c->A = (c->A >> 1) | ((c->F & Z80_CF) << 7);
-                    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-                           (c->A & (Z80_F5 | Z80_F3)) | carry;
+                    c->A = (c->A >> 1) | (get_c(c) << 7);
+                    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+                             (c->A & (Z80_F5 | Z80_F3)) | carry);
                 }
                 break;
             case 4: /* DAA */
@@ -1075,19 +1781,19 @@ static int exec_main_op(z80_t *c, uint8_t op) {
                 break;
             case 5: /* CPL */
                 c->A = ~c->A;
-                c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF | Z80_CF)) |
-                       (c->A & (Z80_F5 | Z80_F3)) | Z80_HF | Z80_NF;
+                set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF | Z80_CF)) |
+                         (c->A & (Z80_F5 | Z80_F3)) | Z80_HF | Z80_NF);
                 break;
             case 6: /* SCF */
-                c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-                       (c->A & (Z80_F5 | Z80_F3)) | Z80_CF;
+                set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+                         (c->A & (Z80_F5 | Z80_F3)) | Z80_CF);
                 break;
             case 7: /* CCF */
                 {
-                    uint8_t hf = (c->F & Z80_CF) ? Z80_HF : 0;
-                    c->F = (c->F & (Z80_SF | Z80_ZF | Z80_PF)) |
-                           (c->A & (Z80_F5 | Z80_F3)) |
-                           hf | ((c->F & Z80_CF) ^ Z80_CF);
+                    uint8_t hf = get_c(c) ? Z80_HF : 0;
+                    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) |
+                             (c->A & (Z80_F5 | Z80_F3)) |
+                             hf | (get_c(c) ^ Z80_CF));
                 }
                 break;
             }
@@ -1131,13 +1837,10 @@ static int exec_main_op(z80_t *c, uint8_t op) {
                     c->PC = pop16(c);
                     break;
                 case 1: /* EXX */
-                    { uint8_t tmp;
-                      tmp = c->B; c->B = c->B_; c->B_ = tmp;
-                      tmp = c->C; c->C = c->C_; c->C_ = tmp;
-                      tmp = c->D; c->D = c->D_; c->D_ = tmp;
-                      tmp = c->E; c->E = c->E_; c->E_ = tmp;
-                      tmp = c->H; c->H = c->H_; c->H_ = tmp;
-                      tmp = c->L; c->L = c->L_; c->L_ = tmp;
+                    { uint16_t tmp;
+                      tmp = c->BC; c->BC = c->BC_; c->BC_ = tmp;
+                      tmp = c->DE; c->DE = c->DE_; c->DE_ = tmp;
+                      tmp = c->HL; c->HL = c->HL_; c->HL_ = tmp;
                     }
                     break;
                 case 2: /* JP (HL) */
@@ -1259,10 +1962,791 @@ static int exec_main_op(z80_t *c, uint8_t op) {
     return t;
 }
 
+/* The reference decoder has no decode cache: z80_init_ex() leaves it off */
+static int exec_decoded(z80_t *c, struct dc_entry *e) {
+    (void)e;
+    inc_r(c);
+    return exec_main_op(c, fetch8(c));
+}
+
+/* The reference decoder never sets blk_op: no block fast path */
+static inline void blk_repeat(z80_t *c, unsigned long end) {
+    (void)c;
+    (void)end;
+}
+
+/* ... nor a basic block tier, which needs the decode cache */
+static struct bb_block *bb_build(z80_t *c) {
+    (void)c;
+    return NULL;
+}
+
+static void bb_exec(z80_t *c, struct bb_block *b, unsigned long end) {
+    (void)c;
+    (void)b;
+    (void)end;
+}
+
+#else /* handler tables */
+
+/* ── Helpers for the handler tables ────────────────────────────── */
+
+static inline uint16_t disp(z80_t *c, uint16_t ixiy) {
+    return ixiy + (int8_t)fetch8(c);
+}
+
+/* The branch helpers take their operand from the handler, which has
+   fetched it or has it from the decode cache */
+static inline int jr_cc(z80_t *c, int cond, uint8_t d) {
+    if (!cond) return 7;
+    c->PC += (int8_t)d;
+    return 12;
+}
+
+static inline int djnz(z80_t *c, uint8_t d) {
+    if (--c->B == 0) return 8;
+    c->PC += (int8_t)d;
+    return 13;
+}
+
+static inline void jp_cc(z80_t *c, int cond, uint16_t addr) {
+    if (cond) c->PC = addr;
+}
+
+static inline int call_cc(z80_t *c, int cond, uint16_t addr) {
+    if (!cond) return 10;
+    push16(c, c->PC);
+    c->PC = addr;
+    return 17;
+}
+
+static inline int ret_cc(z80_t *c, int cond) {
+    if (!cond) return 5;
+    c->PC = pop16(c);
+    return 11;
+}
+
+static inline void add_hl_rr(z80_t *c, uint16_t val) {
+    uint16_t hl = rp_hl(c);
+    add_hl(c, &hl, val);
+    set_hl(c, hl);
+}
+
+static inline void rlca(z80_t *c) {
+    uint8_t carry = c->A >> 7;
+    c->A = (c->A << 1) | carry;
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) | (c->A & (Z80_F5 | Z80_F3)) | carry);
+}
+
+static inline void rrca(z80_t *c) {
+    uint8_t carry = c->A & 1;
+    c->A = (c->A >> 1) | (carry << 7);
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) | (c->A & (Z80_F5 | Z80_F3)) | carry);
+}
+
+static inline void rla(z80_t *c) {
+    uint8_t carry = c->A >> 7;
+    c->A = (c->A << 1) | get_c(c);
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) | (c->A & (Z80_F5 | Z80_F3)) | carry);
+}
+
+static inline void rra(z80_t *c) {
+    uint8_t carry = c->A & 1;
+    c->A = (c->A >> 1) | (get_c(c) << 7);
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) | (c->A & (Z80_F5 | Z80_F3)) | carry);
+}
+
+static inline void cpl(z80_t *c) {
+    c->A = ~c->A;
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF | Z80_CF)) |
+             (c->A & (Z80_F5 | Z80_F3)) | Z80_HF | Z80_NF);
+}
+
+static inline void scf(z80_t *c) {
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) | (c->A & (Z80_F5 | Z80_F3)) | Z80_CF);
+}
+
+static inline void ccf(z80_t *c) {
+    uint8_t hf = get_c(c) ? Z80_HF : 0;
+    set_f(c, (get_f(c) & (Z80_SF | Z80_ZF | Z80_PF)) | (c->A & (Z80_F5 | Z80_F3)) |
+             hf | (get_c(c) ^ Z80_CF));
+}
+
+static inline void ex_af(z80_t *c) {
+    uint16_t tmp = rp_af(c);
+    c->AF = c->AF_;
+    c->AF_ = tmp;
+}
+
+static inline void exx(z80_t *c) {
+    uint16_t tmp;
+    tmp = c->BC; c->BC = c->BC_; c->BC_ = tmp;
+    tmp = c->DE; c->DE = c->DE_; c->DE_ = tmp;
+    tmp = c->HL; c->HL = c->HL_; c->HL_ = tmp;
+}
+
+/* BIT n: result is the tested bit, f35 the source of F3/F5 */
+static inline void bit_op(z80_t *c, uint8_t result, uint8_t f35) {
+    set_f(c, get_c(c) | Z80_HF | (result ? 0 : (Z80_ZF | Z80_PF)) |
+             (result & Z80_SF) | f35);
+}
+
+/* BIT n,(IX+d): F3/F5 come from the high byte of the address */
+static inline void ddcb_bit(z80_t *c, uint16_t addr, uint8_t mask) {
+    bit_op(c, rb(c, addr) & mask, (addr >> 8) & (Z80_F5 | Z80_F3));
+}
+
+static inline uint8_t in_c(z80_t *c) {
+    uint8_t val = io_in(c, rp_bc(c));
+    set_f(c, get_c(c) | sz53p(val));
+    return val;
+}
+
+static inline void sbc_hl(z80_t *c, uint16_t val) {
+    uint16_t hl = rp_hl(c);
+    uint32_t r = (uint32_t)hl - val - get_c(c);
+    uint16_t h = (hl ^ val ^ r) & 0x1000;
+    uint8_t v = ((hl ^ val) & (hl ^ r) & 0x8000) ? Z80_PF : 0;
+    uint16_t result = (uint16_t)r;
+    set_f(c, ((result >> 8) & (Z80_SF | Z80_F5 | Z80_F3)) |
+             (result == 0 ? Z80_ZF : 0) | Z80_NF |
+             (r & 0x10000 ? Z80_CF : 0) | (h ? Z80_HF : 0) | v);
+    set_hl(c, result);
+}
+
+static inline void adc_hl(z80_t *c, uint16_t val) {
+    uint16_t hl = rp_hl(c);
+    uint32_t r = (uint32_t)hl + val + get_c(c);
+    uint16_t h = (hl ^ val ^ r) & 0x1000;
+    uint8_t v = ((hl ^ val ^ 0x8000) & (hl ^ r) & 0x8000) ? Z80_PF : 0;
+    uint16_t result = (uint16_t)r;
+    set_f(c, ((result >> 8) & (Z80_SF | Z80_F5 | Z80_F3)) |
+             (result == 0 ? Z80_ZF : 0) |
+             (r & 0x10000 ? Z80_CF : 0) | (h ? Z80_HF : 0) | v);
+    set_hl(c, result);
+}
+
+static inline void neg(z80_t *c) {
+    uint8_t a = c->A;
+    c->A = 0;
+    alu_sub(c, a);
+}
+
+static inline void ld_a_ir(z80_t *c, uint8_t val) {
+    c->A = val;
+    set_f(c, get_c(c) | sz53(c->A) | (c->IFF2 ? Z80_PF : 0));
+}
+
+static inline void rrd(z80_t *c) {
+    uint16_t hl = rp_hl(c);
+    uint8_t m = rb(c, hl);
+    uint8_t lo_a = c->A & 0x0F;
+    c->A = (c->A & 0xF0) | (m & 0x0F);
+    wb(c, hl, (m >> 4) | (lo_a << 4));
+    set_f(c, get_c(c) | sz53p(c->A));
+}
+
+static inline void rld(z80_t *c) {
+    uint16_t hl = rp_hl(c);
+    uint8_t m = rb(c, hl);
+    uint8_t lo_a = c->A & 0x0F;
+    c->A = (c->A & 0xF0) | (m >> 4);
+    wb(c, hl, (m << 4) | lo_a);
+    set_f(c, get_c(c) | sz53p(c->A));
+}
+
+/* Block instructions: dir is +1/-1, repeat selects the xxIR/xxDR form.
+   A repeating instruction rewinds PC to run again, notes its opcode in
+   blk_op for z80_run() and returns 21. */
+
+/* Flags after LDI/LDD moved val; BC already decremented */
+static inline uint8_t ld_blk_flags(z80_t *c, uint8_t val) {
+    uint8_t n = val + c->A;
+    return (get_f(c) & (Z80_SF | Z80_ZF | Z80_CF)) |
+           (rp_bc(c) != 0 ? Z80_PF : 0) |
+           (n & Z80_F3) | ((n & 0x02) ? Z80_F5 : 0);
+}
+
+/* Flags after CPI/CPD compared val; BC already decremented */
+static inline uint8_t cp_blk_flags(z80_t *c, uint8_t val) {
+    uint8_t result = c->A - val;
+    uint8_t hf = (c->A ^ val ^ result) & 0x10;
+    uint8_t n = result - (hf ? 1 : 0);
+    return get_c(c) | Z80_NF |
+           (result & Z80_SF) | (result == 0 ? Z80_ZF : 0) |
+           (hf ? Z80_HF : 0) | (rp_bc(c) != 0 ? Z80_PF : 0) |
+           (n & Z80_F3) | ((n & 0x02) ? Z80_F5 : 0);
+}
+
+static inline int blk_ld(z80_t *c, int dir, int repeat) {
+    uint8_t val = rb(c, rp_hl(c));
+    wb(c, rp_de(c), val);
+    set_hl(c, rp_hl(c) + dir);
+    set_de(c, rp_de(c) + dir);
+    set_bc(c, rp_bc(c) - 1);
+    set_f(c, ld_blk_flags(c, val));
+    if (repeat && rp_bc(c) != 0) {
+        c->PC -= 2;
+        c->blk_op = dir > 0 ? 0xB0 : 0xB8;
+        return 21;
+    }
+    return 16;
+}
+
+static inline int blk_cp(z80_t *c, int dir, int repeat) {
+    uint8_t val = rb(c, rp_hl(c));
+    set_hl(c, rp_hl(c) + dir);
+    set_bc(c, rp_bc(c) - 1);
+    set_f(c, cp_blk_flags(c, val));
+    if (repeat && rp_bc(c) != 0 && val != c->A) {
+        c->PC -= 2;
+        c->blk_op = dir > 0 ? 0xB1 : 0xB9;
+        return 21;
+    }
+    return 16;
+}
+
+static inline int blk_in(z80_t *c, int dir, int repeat) {
+    uint8_t val = io_in(c, rp_bc(c));
+    wb(c, rp_hl(c), val);
+    c->B--;
+    set_hl(c, rp_hl(c) + dir);
+    set_f(c, (get_f(c) & ~(Z80_ZF | Z80_NF)) |
+             (c->B == 0 ? Z80_ZF : 0) | Z80_NF |
+             (c->B & (Z80_SF | Z80_F5 | Z80_F3)));
+    if (repeat && c->B != 0) {
+        c->PC -= 2;
+        c->blk_op = dir > 0 ? 0xB2 : 0xBA;
+        return 21;
+    }
+    return 16;
+}
+
+static inline int blk_out(z80_t *c, int dir, int repeat) {
+    uint8_t val = rb(c, rp_hl(c));
+    c->B--;
+    io_out(c, rp_bc(c), val);
+    set_hl(c, rp_hl(c) + dir);
+    set_f(c, (get_f(c) & ~(Z80_ZF | Z80_NF)) |
+             (c->B == 0 ? Z80_ZF : 0) | Z80_NF |
+             (c->B & (Z80_SF | Z80_F5 | Z80_F3)));
+    if (repeat && c->B != 0) {
+        c->PC -= 2;
+        c->blk_op = dir > 0 ? 0xB3 : 0xBB;
+        return 21;
+    }
+    return 16;
+}
+
+/* ── Handler tables ──────────────────────────────────────────────── */
+
+/* Z80_TABLE(main_) lists main_0x00 ... main_0xFF through Z80_ENTRY() */
+#define Z80_ROW(p, h) \
+    Z80_ENTRY(p##h##0), Z80_ENTRY(p##h##1), Z80_ENTRY(p##h##2), Z80_ENTRY(p##h##3), \
+    Z80_ENTRY(p##h##4), Z80_ENTRY(p##h##5), Z80_ENTRY(p##h##6), Z80_ENTRY(p##h##7), \
+    Z80_ENTRY(p##h##8), Z80_ENTRY(p##h##9), Z80_ENTRY(p##h##A), Z80_ENTRY(p##h##B), \
+    Z80_ENTRY(p##h##C), Z80_ENTRY(p##h##D), Z80_ENTRY(p##h##E), Z80_ENTRY(p##h##F)
+#define Z80_TABLE(p) { \
+    Z80_ROW(p, 0x0), Z80_ROW(p, 0x1), Z80_ROW(p, 0x2), Z80_ROW(p, 0x3), \
+    Z80_ROW(p, 0x4), Z80_ROW(p, 0x5), Z80_ROW(p, 0x6), Z80_ROW(p, 0x7), \
+    Z80_ROW(p, 0x8), Z80_ROW(p, 0x9), Z80_ROW(p, 0xA), Z80_ROW(p, 0xB), \
+    Z80_ROW(p, 0xC), Z80_ROW(p, 0xD), Z80_ROW(p, 0xE), Z80_ROW(p, 0xF) }
+
+#if defined(__GNUC__) && !defined(Z80_NO_COMPUTED_GOTO)
+
+/* Computed goto: handlers are labels; t accumulates prefix T-states */
+#define Z80_ENTRY(name) &&name
+#define OP(name)        name:
+#define OPX(name)       name:
+#define T(n)            return t + (n)
+#define PREFIX(n, tab)  do { t += (n); op = fetch8(c); goto *tab[op]; } while (0)
+#define PREFIX_CB(ixiy) do { addr = disp(c, ixiy); op = fetch8(c); \
+                             goto *ddcb_table[op]; } while (0)
+#define PASS(n, name)   do { t += (n); goto name; } while (0)
+
+/* The interpreter's copy of the handlers fetches operands through PC */
+#define IMM8()          fetch8(c)
+#define IMM16()         fetch16(c)
+#define DISP(ix)        disp(c, ix)
+#define DISP_N()        fetch8(c)
+
+/* Run the instruction whose opcode, op, has been fetched already */
+static int exec_main_op(z80_t *c, uint8_t op) {
+    static const void *const main_table[256] = Z80_TABLE(main_);
+    static const void *const cb_table[256]   = Z80_TABLE(cb_);
+    static const void *const ed_table[256]   = Z80_TABLE(ed_);
+    static const void *const dd_table[256]   = Z80_TABLE(dd_);
+    static const void *const fd_table[256]   = Z80_TABLE(fd_);
+    static const void *const ddcb_table[256] = Z80_TABLE(ddcb_);
+    int t = 0;
+    uint16_t addr = 0;
+
+    goto *main_table[op];
+#include "z80_ops.inc"
+}
+
+#undef IMM8
+#undef IMM16
+#undef DISP
+#undef DISP_N
+
+/* The decode cache's copy takes them from the entry, e. PC is already
+   past them. */
+#define IMM8()          ((uint8_t)e->imm)
+#define IMM16()         (e->imm)
+#define DISP(ix)        ((uint16_t)((ix) + (int8_t)e->imm))
+#define DISP_N()        ((uint8_t)(e->imm >> 8))
+
+/* Run the instruction at PC from its decode cache entry, filling it first
+   if empty */
+static int exec_decoded(z80_t *c, struct dc_entry *e) {
+    static const void *const main_table[256] = Z80_TABLE(main_);
+    static const void *const cb_table[256]   = Z80_TABLE(cb_);
+    static const void *const ed_table[256]   = Z80_TABLE(ed_);
+    static const void *const dd_table[256]   = Z80_TABLE(dd_);
+    static const void *const fd_table[256]   = Z80_TABLE(fd_);
+    static const void *const ddcb_table[256] = Z80_TABLE(ddcb_);
+    static const void *const *const dc_tables[5] = {
+        main_table, cb_table, ed_table, dd_table, fd_table
+    };
+    int t;
+    uint16_t addr = 0;
+    uint8_t op;
+
+    if (e->len) {
+        c->dcache->stats.hits++;
+    } else if (dc_fill(c, e, c->PC)) {
+        e->h.label = e->tab >= DC_DDCB ? &&dc_ddcb : dc_tables[e->tab][e->op];
+    } else {
+        inc_r(c);
+        return exec_main_op(c, fetch8(c));
+    }
+    dc_enter(c, e);
+    t = e->t;
+    goto *e->h.label;
+dc_ddcb:
+    addr = dc_addr(c, e);
+    goto *ddcb_table[e->op];
+#include "z80_ops.inc"
+}
+
+#undef IMM8
+#undef IMM16
+#undef DISP
+#undef DISP_N
+
+#else
+
+/* Function tables: one static function per handler */
+typedef int (*op_fn)(z80_t *c);
+typedef int (*opx_fn)(z80_t *c, uint16_t addr);
+
+static op_fn const cb_table[256], ed_table[256], dd_table[256], fd_table[256];
+static opx_fn const ddcb_table[256];
+
+#define Z80_ENTRY(name) name
+#define OP(name)        static int name(z80_t *c)
+#define OPX(name)       static int name(z80_t *c, uint16_t addr)
+#define T(n)            return ((void)c, (n))
+#define PREFIX(n, tab)  return (n) + tab[fetch8(c)](c)
+#define PREFIX_CB(ixiy) do { uint16_t a_ = disp(c, ixiy); \
+                             return ddcb_table[fetch8(c)](c, a_); } while (0)
+#define PASS(n, name)   return (n) + name(c)
+#define IMM8()          fetch8(c)
+#define IMM16()         fetch16(c)
+#define DISP(ix)        disp(c, ix)
+#define DISP_N()        fetch8(c)
+
+#include "z80_ops.inc"
+
+#undef IMM8
+#undef IMM16
+#undef DISP
+#undef DISP_N
+
+static op_fn const main_table[256]  = Z80_TABLE(main_);
+static op_fn const cb_table[256]    = Z80_TABLE(cb_);
+static op_fn const ed_table[256]    = Z80_TABLE(ed_);
+static op_fn const dd_table[256]    = Z80_TABLE(dd_);
+static op_fn const fd_table[256]    = Z80_TABLE(fd_);
+static opx_fn const ddcb_table[256] = Z80_TABLE(ddcb_);
+
+static int exec_main_op(z80_t *c, uint8_t op) {
+    return main_table[op](c);
+}
+
+static op_fn const *const dc_tables[5] = {
+    main_table, cb_table, ed_table, dd_table, fd_table
+};
+
+/* Run the instruction at PC from its decode cache entry, filling it first
+   if empty */
+static int exec_decoded(z80_t *c, struct dc_entry *e) {
+    if (e->len) {
+        c->dcache->stats.hits++;
+    } else if (dc_fill(c, e, c->PC)) {
+        if (e->tab >= DC_DDCB)
+            e->h.fnx = ddcb_table[e->op];
+        else
+            e->h.fn = dc_tables[e->tab][e->op];
+    } else {
+        inc_r(c);
+        return exec_main_op(c, fetch8(c));
+    }
+    dc_enter(c, e);
+    if (e->tab >= DC_DDCB) return e->t + e->h.fnx(c, dc_addr(c, e));
+    return e->t + e->h.fn(c);
+}
+
+#endif
+
+#undef Z80_ENTRY
+#undef OP
+#undef OPX
+#undef T
+#undef PREFIX
+#undef PREFIX_CB
+#undef PASS
+
+/* ── Block instruction fast path ─────────────────────────────────── */
+
+/* A repeating LDIR/CPIR/INIR/OTIR (or a decrementing form) rewinds PC and
+   comes back through fetch and dispatch for every byte. z80_run() hands the
+   repeat to blk_repeat() instead, which keeps it going in place for exactly
+   the iterations z80_run() would have stepped: each must start before end
+   with no z80_break() pending, and the ED xx bytes must still be there in
+   mapped memory, so skipping their fetch is unobservable and a block that
+   overwrites itself drops back to dispatch. Every iteration is charged the
+   one R increment of its opcode fetch and 21 T-states, the last one 16.
+
+   LDIR/LDDR and CPIR/CPDR between mapped pages move or scan a whole page
+   run at once; anything else repeats through the ordinary helpers. */
+
+/* Iterations that can still start before end, at most count */
+static inline unsigned blk_slots(z80_t *c, unsigned long end, unsigned count) {
+    unsigned long n = 1 + (end - c->t_states - 1) / 21;
+    return n < count ? (unsigned)n : count;
+}
+
+/* Bytes from addr to the edge of its page, going in direction dir */
+static inline unsigned blk_room(uint16_t addr, int dir) {
+    return dir > 0 ? (unsigned)(Z80_PAGE_SIZE - (addr & Z80_PAGE_MASK))
+                   : (addr & Z80_PAGE_MASK) + 1u;
+}
+
+/* Charge n iterations; more says whether the last one repeated */
+static inline void blk_account(z80_t *c, unsigned n, int more) {
+    unsigned long t = 21ul * n - (more ? 0 : 5);
+    c->t_states += t;
+    PROF_COUNT(c, c->PC, n, t);
+    add_r(c, n);
+    if (!more) c->PC += 2;
+}
+
+/* One page run of LDIR/LDDR; 0 if either side is not mapped. ip points at
+   the host copies of the ED xx bytes. */
+static int ldxr_bulk(z80_t *c, int dir, unsigned long end,
+                     const uint8_t *const ip[2]) {
+    uint16_t hl = rp_hl(c), de = rp_de(c), bc = rp_bc(c);
+    const uint8_t *src = read_page(c, hl);
+    uint8_t *dst = write_page(c, de);
+    if (!src || !dst) return 0;
+
+    unsigned len = blk_slots(c, end, bc ? bc : 65536u);
+    if (len > blk_room(hl, dir)) len = blk_room(hl, dir);
+    if (len > blk_room(de, dir)) len = blk_room(de, dir);
+    src += hl & Z80_PAGE_MASK;
+    dst += de & Z80_PAGE_MASK;
+
+    /* Stop right after a write over the instruction itself */
+    for (int k = 0; k < 2; k++) {
+        uintptr_t d = dir > 0 ? (uintptr_t)ip[k] - (uintptr_t)dst
+                              : (uintptr_t)dst - (uintptr_t)ip[k];
+        if (d < len) len = (unsigned)d + 1;
+    }
+
+    /* A destination just ahead of the source replicates bytes (the usual
+       LDIR fill idiom), which memmove would not */
+    uint8_t val;
+    if (dir > 0) {
+        uintptr_t gap = (uintptr_t)dst - (uintptr_t)src;
+        if (gap != 0 && gap < len) {
+            for (unsigned i = 0; i < len; i++) dst[i] = src[i];
+        } else {
+            memmove(dst, src, len);
+        }
+        val = dst[len - 1];
+    } else {
+        uintptr_t gap = (uintptr_t)src - (uintptr_t)dst;
+        if (gap != 0 && gap < len) {
+            for (unsigned i = 0; i < len; i++) *(dst - i) = *(src - i);
+        } else {
+            memmove(dst - (len - 1), src - (len - 1), len);
+        }
+        val = *(dst - (len - 1));
+    }
+
+    set_hl(c, hl + dir * (int)len);
+    set_de(c, de + dir * (int)len);
+    set_bc(c, bc - len);
+    set_f(c, ld_blk_flags(c, val));
+    blk_account(c, len, rp_bc(c) != 0);
+    return 1;
+}
+
+/* One page run of CPIR/CPDR; 0 if the source is not mapped */
+static int cpxr_bulk(z80_t *c, int dir, unsigned long end) {
+    uint16_t hl = rp_hl(c), bc = rp_bc(c);
+    const uint8_t *src = read_page(c, hl);
+    if (!src) return 0;
+
+    unsigned len = blk_slots(c, end, bc ? bc : 65536u);
+    if (len > blk_room(hl, dir)) len = blk_room(hl, dir);
+    src += hl & Z80_PAGE_MASK;
+
+    unsigned n;
+    uint8_t val;
+    if (dir > 0) {
+        const uint8_t *hit = memchr(src, c->A, len);
+        n = hit ? (unsigned)(hit - src) + 1 : len;
+        val = src[n - 1];
+    } else {
+        for (n = 1; n < len && *(src - (n - 1)) != c->A; n++)
+            ;
+        val = *(src - (n - 1));
+    }
+
+    set_hl(c, hl + dir * (int)n);
+    set_bc(c, bc - n);
+    set_f(c, cp_blk_flags(c, val));
+    blk_account(c, n, rp_bc(c) != 0 && val != c->A);
+    return 1;
+}
+
+static void blk_repeat(z80_t *c, unsigned long end) {
+    uint8_t op = c->blk_op;
+    uint16_t pc = c->PC;
+    const uint8_t *p0 = read_page(c, pc);
+    const uint8_t *p1 = read_page(c, pc + 1);
+    int dir = (op & 0x08) ? -1 : 1;
+
+    c->blk_op = 0;
+#ifdef Z80_TRACE
+    if (c->trace) return;  /* Every iteration is stepped, and recorded */
+#endif
+    if (!p0 || !p1) return;
+    const uint8_t *const ip[2] = { p0 + (pc & Z80_PAGE_MASK),
+                                   p1 + ((pc + 1) & Z80_PAGE_MASK) };
+
+    while (c->PC == pc && c->t_states < end && !c->break_req &&
+           !irq_ready(c) && *ip[0] == 0xED && *ip[1] == op) {
+        c->ei_delay = 0;
+        if ((op & 0x03) == 0 && ldxr_bulk(c, dir, end, ip)) continue;
+        if ((op & 0x03) == 1 && cpxr_bulk(c, dir, end)) continue;
+
+        /* One iteration through the ordinary helper, as step() would */
+        inc_r(c);
+        c->PC = pc + 2;
+        int t = 0;
+        switch (op & 0x03) {
+        case 0: t = blk_ld(c, dir, 1); break;
+        case 1: t = blk_cp(c, dir, 1); break;
+        case 2: t = blk_in(c, dir, 1); break;
+        case 3: t = blk_out(c, dir, 1); break;
+        }
+        c->t_states += t;
+        PROF_COUNT(c, pc, 1, t);
+    }
+    c->blk_op = 0;
+}
+
+/* ── Basic block tier ────────────────────────────────────────────── */
+
+/* Instructions that never fall through end a block, and so do HALT, EI
+   and the repeating block instructions */
+static int bb_ends_block(const struct dc_entry *e) {
+    uint8_t op = e->op;
+    switch (e->tab) {
+    case DC_ED:
+        return (op & 0xC7) == 0x45 ||            /* RETN, RETI */
+               (op & 0xF4) == 0xB0;                 /* LDIR ... OTDR */
+    case DC_MAIN: case DC_DD: case DC_FD:
+        return op == 0x18 || op == 0x76 || op == 0xC3 || op == 0xC9 ||
+               op == 0xCD || op == 0xE9 || op == 0xFB ||
+               (op & 0xC7) == 0xC7;
+    default:
+        return 0;
+    }
+}
+
+/* Build a block from the run of instructions at PC; NULL if the first one
+   is not cacheable. The arena is emptied first if a full-size block might
+   not fit, so a block stays valid until the next one is built. */
+static struct bb_block *bb_build(z80_t *c) {
+    struct bb_tier *j = c->dcache->bb;
+    size_t max = sizeof(struct bb_block) + BB_MAX_INSNS * sizeof(struct bb_insn);
+    if (j->used + max > sizeof(j->arena)) {
+        memset(j->block, 0, sizeof(j->block));
+        j->used = 0;
+    }
+
+    struct bb_block *b = (struct bb_block *)((char *)j->arena + j->used);
+    uint16_t pc = c->PC;
+    unsigned n = 0, len = 0;
+    while (n < BB_MAX_INSNS) {
+        struct dc_entry *e = &b->insn[n].e;
+        if (!dc_fill(c, e, pc)) break;
+        unsigned ilen = e->size;
+        if (len + ilen > BB_MAX_BYTES) break;
+        pc += ilen;
+        len += ilen;
+        b->insn[n++].next = pc;
+        if (bb_ends_block(e)) break;
+    }
+    if (n == 0) return NULL;
+
+    b->pc = c->PC;
+    b->len = len;
+    b->n = n;
+    b->linked = 0;
+    size_t size = sizeof(struct bb_block) + n * sizeof(struct bb_insn);
+    j->used += (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    j->block[c->PC] = b;
+    c->dcache->stats.blocks++;
+    return b;
+}
+
+/* After an instruction of b: keep going with the next one? */
+static inline int bb_more(const z80_t *c, const struct bb_block *b,
+                          const struct bb_insn *done, unsigned long end) {
+    return done + 1 < b->insn + b->n && c->PC == done->next &&
+           !(c->break_req | c->irq) && c->t_states < end;
+}
+
+/* After leaving a block: the one to go on with, if z80_run() would enter
+   it next anyway. Saves the trip back for blocks that end in a branch. */
+static inline struct bb_block *bb_chain(const z80_t *c, unsigned long end) {
+    if (c->halted || c->break_req || c->irq || c->blk_op || c->t_states >= end)
+        return NULL;
+    return c->dcache->bb->block[c->PC];
+}
+
+#if defined(__GNUC__) && !defined(Z80_NO_COMPUTED_GOTO)
+
+/* A second copy of the handlers in which every instruction ends by
+   jumping to the next one in the block */
+#define Z80_ENTRY(name) &&name
+#define OP(name)        name:
+#define OPX(name)       name:
+#define T(n)            do { t += (n); goto bb_done; } while (0)
+#define PREFIX(n, tab)  do { t += (n); op = fetch8(c); goto *tab[op]; } while (0)
+#define PREFIX_CB(ixiy) do { addr = disp(c, ixiy); op = fetch8(c); \
+                             goto *ddcb_table[op]; } while (0)
+#define PASS(n, name)   do { t += (n); goto name; } while (0)
+#define IMM8()          ((uint8_t)e->imm)
+#define IMM16()         (e->imm)
+#define DISP(ix)        ((uint16_t)((ix) + (int8_t)e->imm))
+#define DISP_N()        ((uint8_t)(e->imm >> 8))
+
+/* Run b from its first instruction, which PC points at, and the blocks
+   it chains to */
+static void bb_exec(z80_t *c, struct bb_block *b, unsigned long end) {
+    static const void *const main_table[256] = Z80_TABLE(main_);
+    static const void *const cb_table[256]   = Z80_TABLE(cb_);
+    static const void *const ed_table[256]   = Z80_TABLE(ed_);
+    static const void *const dd_table[256]   = Z80_TABLE(dd_);
+    static const void *const fd_table[256]   = Z80_TABLE(fd_);
+    static const void *const ddcb_table[256] = Z80_TABLE(ddcb_);
+    static const void *const *const dc_tables[5] = {
+        main_table, cb_table, ed_table, dd_table, fd_table
+    };
+    const struct bb_insn *i;
+    const struct dc_entry *e;
+    int t;
+    uint16_t addr = 0;
+    uint8_t op;
+
+bb_block:
+    if (!b->linked) {
+        for (unsigned k = 0; k < b->n; k++) {
+            struct dc_entry *ke = &b->insn[k].e;
+            ke->h.label = ke->tab >= DC_DDCB ? &&dc_ddcb
+                                             : dc_tables[ke->tab][ke->op];
+        }
+        b->linked = 1;
+    }
+    c->ei_delay = 0;
+    i = b->insn;
+bb_next:
+    e = &i->e;
+    dc_enter(c, e);
+    t = e->t;
+    goto *e->h.label;
+dc_ddcb:
+    addr = dc_addr(c, e);
+    goto *ddcb_table[e->op];
+#include "z80_ops.inc"
+bb_done:
+    c->t_states += t;
+    if (bb_more(c, b, i, end)) {
+        i++;
+        goto bb_next;
+    }
+    c->dcache->stats.block_insns += (unsigned long)(i - b->insn) + 1;
+    if ((b = bb_chain(c, end)) != NULL) goto bb_block;
+}
+
+#undef Z80_ENTRY
+#undef OP
+#undef OPX
+#undef T
+#undef PREFIX
+#undef PREFIX_CB
+#undef PASS
+#undef IMM8
+#undef IMM16
+#undef DISP
+#undef DISP_N
+
+#else
+
+/* Run b from its first instruction, which PC points at, and the blocks
+   it chains to */
+static void bb_exec(z80_t *c, struct bb_block *b, unsigned long end) {
+    do {
+        const struct bb_insn *i = b->insn;
+        if (!b->linked) {
+            for (unsigned k = 0; k < b->n; k++) {
+                struct dc_entry *e = &b->insn[k].e;
+                if (e->tab >= DC_DDCB)
+                    e->h.fnx = ddcb_table[e->op];
+                else
+                    e->h.fn = dc_tables[e->tab][e->op];
+            }
+            b->linked = 1;
+        }
+        c->ei_delay = 0;
+        for (;;) {
+            dc_enter(c, &i->e);
+            if (i->e.tab >= DC_DDCB)
+                c->t_states += i->e.t + i->e.h.fnx(c, dc_addr(c, &i->e));
+            else
+                c->t_states += i->e.t + i->e.h.fn(c);
+            if (!bb_more(c, b, i, end)) break;
+            i++;
+        }
+        c->dcache->stats.block_insns += (unsigned long)(i - b->insn) + 1;
+    } while ((b = bb_chain(c, end)) != NULL);
+}
+
+#endif
+#endif /* Z80_SWITCH_DISPATCH */
+
 /* ── Public API ──────────────────────────────────────────────────── */
 
 void z80_init(z80_t *cpu) {
     init_parity();
+    init_flag_tables();
     memset(cpu, 0, sizeof(*cpu));
     cpu->PC = 0x0000;
     cpu->SP = 0xFFFF;
@@ -1270,24 +2754,327 @@ void z80_init(z80_t *cpu) {
     cpu->F = 0xFF;
 }
 
-int z80_step(z80_t *cpu) {
+int z80_init_ex(z80_t *cpu, int flags) {
+    z80_init(cpu);
+#if DC_ENABLED
+    if (flags & (Z80_INIT_DCACHE | Z80_INIT_BLOCKS)) {
+        cpu->dcache = calloc(1, sizeof(*cpu->dcache));
+        if (!cpu->dcache) return -1;
+    }
+    if (flags & Z80_INIT_BLOCKS) {
+        cpu->dcache->bb = calloc(1, sizeof(*cpu->dcache->bb));
+        if (!cpu->dcache->bb) return -1;
+    }
+#else
+    (void)flags;
+#endif
+    return 0;
+}
+
+/* Set page's trap and watch flags from the lists in traps, and move its
+   pointers on or off the fast path to match */
+static void debug_page(z80_t *cpu, unsigned page) {
+    z80_traps_t *tr = cpu->traps;
+    uint16_t base = (uint16_t)(page << Z80_PAGE_SHIFT);
+    uint8_t want = 0, had = cpu->page_flags[page] & DEBUG_PAGE;
+    for (unsigned i = 0; i < tr->n; i++)
+        if ((tr->trap[i].addr >> Z80_PAGE_SHIFT) == page) want |= Z80_PAGE_TRAP;
+    for (unsigned i = 0; i < tr->nwatch; i++) {
+        uint16_t a = tr->watch[i].addr;
+        if ((uint16_t)(base - a) >= tr->watch[i].len &&
+            (uint16_t)(a - base) >= Z80_PAGE_SIZE) continue;
+        if (tr->watch[i].kind & Z80_WATCH_READ)  want |= Z80_PAGE_RWATCH;
+        if (tr->watch[i].kind & Z80_WATCH_WRITE) want |= Z80_PAGE_WWATCH;
+    }
+    if (want == had) return;
+
+    /* Decodes cached from the page would skip the checks, and the cache
+       holds its write pointer */
+    if (cpu->page_flags[page] & Z80_PAGE_CODE) dc_flush_page(cpu, page);
+    int hide = (want & (Z80_PAGE_TRAP | Z80_PAGE_RWATCH)) != 0;
+    int hid = (had & (Z80_PAGE_TRAP | Z80_PAGE_RWATCH)) != 0;
+    if (hide && !hid) {
+        tr->page_read[page] = cpu->page_read[page];
+        cpu->page_read[page] = NULL;
+    } else if (!hide && hid) {
+        cpu->page_read[page] = tr->page_read[page];
+    }
+    if ((want & Z80_PAGE_WWATCH) && !(had & Z80_PAGE_WWATCH)) {
+        tr->page_write[page] = cpu->page_write[page];
+        cpu->page_write[page] = NULL;
+    } else if (!(want & Z80_PAGE_WWATCH) && (had & Z80_PAGE_WWATCH)) {
+        cpu->page_write[page] = tr->page_write[page];
+    }
+    cpu->page_flags[page] = (cpu->page_flags[page] & ~DEBUG_PAGE) | want;
+}
+
+void z80_free(z80_t *cpu) {
+    if (cpu->traps) {
+        /* Trap and watch pages get their pointers back */
+        cpu->traps->n = cpu->traps->nwatch = 0;
+        for (unsigned p = 0; p < Z80_PAGES; p++)
+            if (cpu->page_flags[p] & DEBUG_PAGE) debug_page(cpu, p);
+        free(cpu->traps);
+        cpu->traps = NULL;
+    }
+    if (cpu->prof) {
+        free(cpu->prof->node);
+        free(cpu->prof);
+        cpu->prof = NULL;
+    }
+    if (cpu->dcache) {
+        /* Give cached pages their write pointers back */
+        for (unsigned p = 0; p < Z80_PAGES; p++)
+            if (cpu->page_flags[p] & Z80_PAGE_CODE) dc_flush_page(cpu, p);
+        free(cpu->dcache->bb);
+        free(cpu->dcache);
+        cpu->dcache = NULL;
+    }
+}
+
+static int take_irq(z80_t *cpu);
+
+/* step() for an instruction starting on a page without a read pointer:
+   the only place a trap can be */
+static int step_unmapped(z80_t *cpu) {
+    if (cpu->page_flags[cpu->PC >> Z80_PAGE_SHIFT] & Z80_PAGE_TRAP) {
+        unsigned long t0 = cpu->t_states;
+        if (run_trap(cpu)) return (int)(cpu->t_states - t0);
+    }
+    inc_r(cpu);
+    int t = exec_main_op(cpu, fetch8(cpu));
+    cpu->t_states += t;
+    return t;
+}
+
+static inline int step(z80_t *cpu) {
+    int ack = 0;
     if (cpu->ei_delay) {
         cpu->ei_delay = 0;
+    } else if (cpu->irq) {
+        ack = take_irq(cpu);
+#ifdef Z80_PROFILE
+        if (ack && cpu->prof) prof_call(cpu->prof, cpu->PC, cpu->SP);
+#endif
     }
+    uint16_t pc = cpu->PC, sp = cpu->SP;
 
     if (cpu->halted) {
         inc_r(cpu);
         cpu->t_states += 4;
-        return 4;
+        return PROF_INSN(cpu, pc, sp, ack + 4);
+    }
+#ifdef Z80_TRACE
+    if (cpu->trace) trace_insn(cpu);
+#endif
+
+#ifdef Z80_FLAT_MEMORY
+    if (cpu->page_flags[cpu->PC >> Z80_PAGE_SHIFT] & Z80_PAGE_TRAP)
+        return PROF_INSN(cpu, pc, sp, ack + step_unmapped(cpu));
+    const uint8_t *page = read_page(cpu, cpu->PC);
+#else
+    const uint8_t *page = cpu->page_read[cpu->PC >> Z80_PAGE_SHIFT];
+    if (!page) return PROF_INSN(cpu, pc, sp, ack + step_unmapped(cpu));
+#endif
+
+    int t;
+    if (DC_ENABLED && cpu->dcache) {
+        t = exec_decoded(cpu, &cpu->dcache->entry[cpu->PC]);
+    } else {
+        inc_r(cpu);
+        uint8_t op = page[cpu->PC++ & Z80_PAGE_MASK];
+        t = exec_main_op(cpu, op);
     }
-
-    inc_r(cpu);
-    uint8_t op = fetch8(cpu);
-    int t = exec_main_op(cpu, op);
     cpu->t_states += t;
+    return PROF_INSN(cpu, pc, sp, ack + t);
+}
+
+/* step() by way of the basic block tier: run the block at PC if there is
+   one (or PC just got hot enough to build it) */
+static inline void bb_step(z80_t *cpu, unsigned long end) {
+    if (irq_ready(cpu)) {
+        /* Interrupt boundaries go through the interpreter */
+        step(cpu);
+        return;
+    }
+    struct bb_tier *j = cpu->dcache->bb;
+    struct bb_block *b = j->block[cpu->PC];
+    if (!b && ++j->heat[cpu->PC] == Z80_BLOCK_THRESHOLD)
+        b = bb_build(cpu);
+    if (b)
+        bb_exec(cpu, b, end);
+    else
+        step(cpu);
+}
+
+void z80_map(z80_t *cpu, uint16_t addr, uint32_t len, uint8_t *mem, int flags) {
+    unsigned first = addr >> Z80_PAGE_SHIFT;
+    unsigned count = len >> Z80_PAGE_SHIFT;
+    for (unsigned i = 0; i < count && first + i < Z80_PAGES; i++) {
+        uint8_t *page = mem ? mem + ((size_t)i << Z80_PAGE_SHIFT) : NULL;
+        if (cpu->page_flags[first + i] & Z80_PAGE_CODE)
+            dc_flush_page(cpu, first + i);
+        if (cpu->dcache) cpu->dcache->write_flushes[first + i] = 0;
+        cpu->page_read[first + i]  = (flags & Z80_MAP_READ)  ? page : NULL;
+        cpu->page_write[first + i] = (flags & Z80_MAP_WRITE) ? page : NULL;
+        if (cpu->page_flags[first + i] & (Z80_PAGE_TRAP | Z80_PAGE_RWATCH)) {
+            cpu->traps->page_read[first + i] = cpu->page_read[first + i];
+            cpu->page_read[first + i] = NULL;
+        }
+        if (cpu->page_flags[first + i] & Z80_PAGE_WWATCH) {
+            cpu->traps->page_write[first + i] = cpu->page_write[first + i];
+            cpu->page_write[first + i] = NULL;
+        }
+        cpu->page_flags[first + i] = (cpu->page_flags[first + i] & ~Z80_PAGE_RO) |
+                                     ((flags & Z80_MAP_NOWRITE) ? Z80_PAGE_RO : 0);
+    }
+}
+
+int z80_set_trap(z80_t *cpu, uint16_t addr, z80_trap_fn fn) {
+    z80_traps_t *tr = cpu->traps;
+    unsigned page = addr >> Z80_PAGE_SHIFT, i;
+    if (!tr) {
+        if (!fn) return 0;
+        tr = cpu->traps = calloc(1, sizeof(*tr));
+        if (!tr) return -1;
+    }
+
+    for (i = 0; i < tr->n && tr->trap[i].addr != addr; i++)
+        ;
+    if (fn) {
+        if (i == Z80_MAX_TRAPS) return -1;
+        if (i == tr->n) tr->n++;
+        tr->trap[i].addr = addr;
+        tr->trap[i].fn = fn;
+    } else if (i < tr->n) {
+        tr->trap[i] = tr->trap[--tr->n];
+    }
+
+    debug_page(cpu, page);
+    if (tr->n == 0 && tr->nwatch == 0) {
+        free(tr);
+        cpu->traps = NULL;
+    }
+    return 0;
+}
+
+z80_trap_fn z80_get_trap(const z80_t *cpu, uint16_t addr) {
+    const z80_traps_t *tr = cpu->traps;
+    for (unsigned i = 0; tr && i < tr->n; i++)
+        if (tr->trap[i].addr == addr) return tr->trap[i].fn;
+    return NULL;
+}
+
+int z80_set_watch(z80_t *cpu, uint16_t addr, uint32_t len, int kind,
+                  z80_watch_fn fn) {
+#ifdef Z80_FLAT_MEMORY
+    (void)cpu; (void)addr; (void)len; (void)kind; (void)fn;
+    return -1;
+#else
+    z80_traps_t *tr = cpu->traps;
+    unsigned i;
+    kind &= Z80_WATCH_READ | Z80_WATCH_WRITE;
+    if (len == 0 || len > 65536 || !kind) return -1;
+    if (!tr) {
+        if (!fn) return 0;
+        tr = cpu->traps = calloc(1, sizeof(*tr));
+        if (!tr) return -1;
+    }
+
+    for (i = 0; i < tr->nwatch; i++)
+        if (tr->watch[i].addr == addr && tr->watch[i].len == len &&
+            tr->watch[i].kind == kind) break;
+    if (fn) {
+        if (i == Z80_MAX_WATCHES) return -1;
+        if (i == tr->nwatch) tr->nwatch++;
+        tr->watch[i].addr = addr;
+        tr->watch[i].len = len;
+        tr->watch[i].kind = (uint8_t)kind;
+        tr->watch[i].fn = fn;
+    } else if (i < tr->nwatch) {
+        tr->watch[i] = tr->watch[--tr->nwatch];
+    }
+
+    uint32_t first = addr >> Z80_PAGE_SHIFT;
+    uint32_t last = ((uint32_t)addr + len - 1) >> Z80_PAGE_SHIFT;
+    for (uint32_t p = first; p <= last && p < first + Z80_PAGES; p++)
+        debug_page(cpu, p % Z80_PAGES);
+    if (tr->n == 0 && tr->nwatch == 0) {
+        free(tr);
+        cpu->traps = NULL;
+    }
+    return 0;
+#endif
+}
+
+void z80_invalidate(z80_t *cpu, uint16_t addr, uint32_t len) {
+    if (!cpu->dcache || len == 0) return;
+    uint32_t first = addr >> Z80_PAGE_SHIFT;
+    uint32_t last = ((uint32_t)addr + len - 1) >> Z80_PAGE_SHIFT;
+    for (uint32_t p = first; p <= last; p++) {
+        unsigned page = p % Z80_PAGES;
+        if (cpu->page_flags[page] & Z80_PAGE_CODE) dc_flush_page(cpu, page);
+    }
+}
+
+int z80_dcache_stats(const z80_t *cpu, z80_dcache_stats_t *stats) {
+    if (!cpu->dcache) return -1;
+    *stats = cpu->dcache->stats;
+    return 0;
+}
+
+int z80_step(z80_t *cpu) {
+    int t;
+    if (cpu->dcache && cpu->dcache->bb && !cpu->halted) {
+        /* A budget of one T-state ends the block after one instruction */
+        unsigned long start = cpu->t_states;
+        bb_step(cpu, start + 1);
+        t = (int)(cpu->t_states - start);
+    } else {
+        t = step(cpu);
+    }
+    get_f(cpu);
     return t;
 }
 
+unsigned long z80_run(z80_t *cpu, unsigned long tstate_budget) {
+    unsigned long start = cpu->t_states;
+    unsigned long end = start + tstate_budget;
+
+    if (cpu->halted && !irq_ready(cpu)) {
+        /* Already waiting for an interrupt: skip to the end of the budget.
+           Stepping would run one 4T refresh cycle at a time, each bumping
+           R, so take as many as that would and end on the same T-state. */
+        if (end > cpu->t_states) {
+            unsigned long n = (end - cpu->t_states + 3) / 4;
+            add_r(cpu, n);
+            cpu->t_states += 4 * n;
+            PROF_COUNT(cpu, cpu->PC, n, 4 * n);
+            cpu->ei_delay = 0;
+        }
+    } else if (DC_ENABLED && cpu->dcache && cpu->dcache->bb) {
+        while (cpu->t_states < end) {
+            bb_step(cpu, end);
+            if (cpu->blk_op) blk_repeat(cpu, end);
+            if (cpu->halted || cpu->break_req) break;
+        }
+    } else {
+        while (cpu->t_states < end) {
+            step(cpu);
+            if (cpu->blk_op) blk_repeat(cpu, end);
+            if (cpu->halted || cpu->break_req) break;
+        }
+    }
+
+    cpu->break_req = 0;
+    get_f(cpu);
+    return cpu->t_states - start;
+}
+
+void z80_break(z80_t *cpu) {
+    cpu->break_req = 1;
+}
+
 void z80_interrupt(z80_t *cpu, uint8_t data) {
     if (!cpu->IFF1 || cpu->ei_delay) return;
 
@@ -1326,3 +3113,135 @@ void z80_nmi(z80_t *cpu) {
     cpu->PC = 0x0066;
     cpu->t_states += 11;
 }
+
+void z80_set_int(z80_t *cpu, int level, uint8_t data) {
+    cpu->int_data = data;
+    if (level)
+        cpu->irq |= Z80_IRQ_INT;
+    else
+        cpu->irq &= ~Z80_IRQ_INT;
+}
+
+void z80_set_nmi(z80_t *cpu, int level) {
+    if (level && !cpu->nmi_line) cpu->irq |= Z80_IRQ_NMI;
+    cpu->nmi_line = level != 0;
+}
+
+uint8_t z80_get_f(z80_t *cpu) {
+    return get_f(cpu);
+}
+
+void z80_set_f(z80_t *cpu, uint8_t f) {
+    set_f(cpu, f);
+}
+
+int z80_trace_init(z80_trace_t *tr, uint32_t size) {
+    uint32_t n = 1;
+    while (n < size && n < 0x80000000u) n <<= 1;
+    memset(tr, 0, sizeof(*tr));
+    tr->rec = malloc((size_t)n * sizeof(*tr->rec));
+    if (!tr->rec) return -1;
+    tr->size = n;
+    tr->start_pc = tr->stop_pc = -1;
+    tr->stop_t = UINT64_MAX;
+    return 0;
+}
+
+void z80_trace_free(z80_trace_t *tr) {
+    free(tr->rec);
+    tr->rec = NULL;
+}
+
+int z80_set_trace(z80_t *cpu, z80_trace_t *tr) {
+#ifdef Z80_TRACE
+    cpu->trace = tr;
+    return 0;
+#else
+    (void)cpu;
+    (void)tr;
+    return -1;
+#endif
+}
+
+uint32_t z80_trace_read(z80_trace_t *tr, z80_trace_rec_t *out, uint32_t max) {
+    uint32_t tail = atomic_load_explicit(&tr->tail, memory_order_relaxed);
+    uint32_t n = atomic_load_explicit(&tr->head, memory_order_acquire) - tail;
+    if (n > max) n = max;
+    for (uint32_t i = 0; i < n; i++)
+        out[i] = tr->rec[(tail + i) & (tr->size - 1)];
+    atomic_store_explicit(&tr->tail, tail + n, memory_order_release);
+    return n;
+}
+
+int z80_profile_start(z80_t *cpu) {
+#ifdef Z80_PROFILE
+    z80_profile_t *p = cpu->prof;
+    if (!p) {
+        p = calloc(1, sizeof(*p));
+        if (!p) return -1;
+        p->cap = 256;
+        p->node = calloc(p->cap, sizeof(*p->node));
+        if (!p->node) {
+            free(p);
+            return -1;
+        }
+        p->nnodes = 1;
+        p->node[0].addr = cpu->PC;
+        cpu->prof = p;
+    }
+    return 0;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+void z80_save_state(z80_t *cpu, z80_state_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->af = rp_af(cpu);
+    st->bc = cpu->BC;  st->de = cpu->DE;  st->hl = cpu->HL;
+    st->af_ = cpu->AF_; st->bc_ = cpu->BC_; st->de_ = cpu->DE_; st->hl_ = cpu->HL_;
+    st->ix = cpu->IX;  st->iy = cpu->IY;
+    st->sp = cpu->SP;  st->pc = cpu->PC;
+    st->i = cpu->I;    st->r = cpu->R;
+    st->iff1 = cpu->IFF1; st->iff2 = cpu->IFF2; st->im = cpu->IM;
+    st->halted = cpu->halted;
+    st->ei_delay = cpu->ei_delay;
+    st->blk_op = cpu->blk_op;
+    st->irq = cpu->irq;
+    st->int_data = cpu->int_data;
+    st->nmi_line = cpu->nmi_line;
+    st->t_states = cpu->t_states;
+}
+
+void z80_load_state(z80_t *cpu, const z80_state_t *st) {
+    set_af(cpu, st->af);
+    cpu->BC = st->bc;  cpu->DE = st->de;  cpu->HL = st->hl;
+    cpu->AF_ = st->af_; cpu->BC_ = st->bc_; cpu->DE_ = st->de_; cpu->HL_ = st->hl_;
+    cpu->IX = st->ix;  cpu->IY = st->iy;
+    cpu->SP = st->sp;  cpu->PC = st->pc;
+    cpu->I = st->i;    cpu->R = st->r;
+    cpu->IFF1 = st->iff1; cpu->IFF2 = st->iff2; cpu->IM = st->im;
+    cpu->halted = st->halted;
+    cpu->ei_delay = st->ei_delay;
+    cpu->blk_op = st->blk_op;
+    cpu->irq = st->irq;
+    cpu->int_data = st->int_data;
+    cpu->nmi_line = st->nmi_line;
+    cpu->break_req = 0;
+    cpu->t_states = (unsigned long)st->t_states;
+}
+
+/* At an instruction boundary with irq set and no EI pending: take what
+   the lines ask for. Returns the T-states of the acknowledge, 0 if INT is
+   masked. */
+static int take_irq(z80_t *cpu) {
+    unsigned long t0 = cpu->t_states;
+    if (cpu->irq & Z80_IRQ_NMI) {
+        cpu->irq &= ~Z80_IRQ_NMI;
+        z80_nmi(cpu);
+    } else if (cpu->IFF1) {
+        z80_interrupt(cpu, cpu->int_data);
+    }
+    return (int)(cpu->t_states - t0);
+}
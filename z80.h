@@ -1,6 +1,7 @@
 #ifndef Z80_H
 #define Z80_H
 
+#include <stdatomic.h>
 #include <stdint.h>
 
 typedef uint8_t  (*z80_read_fn)(void *ctx, uint16_t addr);
@@ -8,21 +9,169 @@ typedef void     (*z80_write_fn)(void *ctx, uint16_t addr, uint8_t val);
 typedef uint8_t  (*z80_in_fn)(void *ctx, uint16_t port);
 typedef void     (*z80_out_fn)(void *ctx, uint16_t port, uint8_t val);
 
+/* Memory page table geometry: 256 pages of 256 bytes */
+#define Z80_PAGE_SHIFT  8
+#define Z80_PAGE_SIZE   (1 << Z80_PAGE_SHIFT)
+#define Z80_PAGE_MASK   (Z80_PAGE_SIZE - 1)
+#define Z80_PAGES       (65536 >> Z80_PAGE_SHIFT)
+
+/* Page flags */
+#define Z80_PAGE_RO     0x01  /* Writes to an unmapped-for-write page are dropped */
+#define Z80_PAGE_CODE   0x02  /* Decode cache holds entries from this page */
+#define Z80_PAGE_TRAP   0x04  /* Has a z80_set_trap() address */
+#define Z80_PAGE_RWATCH 0x08  /* Has bytes whose reads z80_set_watch() watches */
+#define Z80_PAGE_WWATCH 0x10  /* Has bytes whose writes are watched */
+
+#define Z80_MAX_TRAPS   32
+#define Z80_MAX_WATCHES 16
+
+/* z80_set_watch() kinds */
+#define Z80_WATCH_READ  0x01
+#define Z80_WATCH_WRITE 0x02
+
+/* Decode cache statistics, see z80_dcache_stats() */
+typedef struct {
+    unsigned long hits;           /* Instructions run from a cached decode */
+    unsigned long misses;         /* Instructions decoded into the cache */
+    unsigned long invalidations;  /* Pages flushed by a write or z80_map() */
+    unsigned long blocks;         /* Basic blocks built (Z80_INIT_BLOCKS) */
+    unsigned long block_insns;    /* Instructions run from blocks */
+} z80_dcache_stats_t;
+
+/* Everything about the CPU that is not memory, callbacks or caches:
+   registers, interrupt state and t_states. Plain data with a fixed
+   layout, for snapshots; see z80_save_state(). */
+typedef struct {
+    uint16_t af, bc, de, hl;
+    uint16_t af_, bc_, de_, hl_;
+    uint16_t ix, iy, sp, pc;
+    uint8_t  i, r, iff1, iff2, im, halted, ei_delay, blk_op;
+    uint8_t  irq, int_data, nmi_line, reserved[5];
+    uint64_t t_states;
+} z80_state_t;
+
+/* Execution profile, kept by -DZ80_PROFILE builds once z80_profile_start()
+   has been called. Counts are instructions run; T-states include those of
+   interrupt acknowledges. Per-opcode counts are split by the table the
+   prefix chain ends in (DDCB also holds FDCB). */
+enum {
+    Z80_PROF_MAIN, Z80_PROF_CB, Z80_PROF_ED, Z80_PROF_DD, Z80_PROF_FD,
+    Z80_PROF_DDCB, Z80_PROF_TABLES
+};
+
+#define Z80_PROF_DEPTH 64  /* Deeper calls are charged to their caller */
+
+/* One node of the calling context tree: a routine, as reached through
+   the chain of its parents. Calls are CALL, RST and interrupts; a frame
+   ends once SP rises above its return address, however it was popped. */
+typedef struct {
+    uint16_t addr;         /* Entry point; node 0: PC at z80_profile_start() */
+    uint32_t parent;       /* Indices into z80_profile_t.node, 0 = none */
+    uint32_t child, next;
+    unsigned long calls;
+    unsigned long tstates; /* Spent in the routine itself, not its callees */
+} z80_prof_node_t;
+
+typedef struct {
+    unsigned long pc_count[65536], pc_tstates[65536];
+    unsigned long op_count[Z80_PROF_TABLES][256];
+    unsigned long op_tstates[Z80_PROF_TABLES][256];
+    z80_prof_node_t *node;
+    uint32_t nnodes, cap;
+    struct { uint32_t node; uint16_t sp; } stack[Z80_PROF_DEPTH];
+    unsigned depth;
+} z80_profile_t;
+
+/* Instruction trace, kept by -DZ80_TRACE builds once z80_set_trace() has
+   attached a ring. One record per instruction, taken as it is about to
+   run (after any interrupt acknowledge, so at the handler's first
+   instruction). */
 typedef struct {
-    /* Main registers */
-    uint8_t  A, F;
-    uint8_t  B, C;
-    uint8_t  D, E;
-    uint8_t  H, L;
+    uint64_t t_states;
+    uint16_t pc, sp, af, bc, de, hl, ix, iy;
+    uint16_t af_, bc_, de_, hl_;
+    uint8_t  op[4];    /* Bytes at PC; unmapped pages read as 00 */
+    uint8_t  i, r;
+    uint8_t  iff;      /* IFF1 | IFF2 << 1 */
+    uint8_t  im;
+} z80_trace_rec_t;
+
+enum { Z80_TRACE_ARMED, Z80_TRACE_ON, Z80_TRACE_DONE };
+
+/* Single-producer, single-consumer ring of trace records: the CPU's
+   thread writes, one other thread drains with z80_trace_read(). Tracing
+   starts at the first instruction with PC == start_pc (any PC if < 0)
+   once t_states >= start_t, and stops for good before the first later
+   instruction with PC == stop_pc or t_states >= stop_t. */
+typedef struct z80_trace {
+    z80_trace_rec_t *rec;
+    uint32_t size;               /* Records, a power of two */
+    _Atomic uint32_t head;       /* Count written by the CPU */
+    _Atomic uint32_t tail;       /* Count taken by the reader */
+    int32_t  start_pc, stop_pc;  /* < 0: no PC trigger */
+    uint64_t start_t, stop_t;
+    uint8_t  state;              /* Z80_TRACE_* */
+    unsigned long dropped;       /* Records lost to a full ring */
+    /* Called while the ring is full, until there is room; NULL drops
+       the record instead */
+    void (*wait)(struct z80_trace *tr);
+    void *ctx;
+} z80_trace_t;
+
+typedef struct z80_dcache z80_dcache_t;
+typedef struct z80_traps z80_traps_t;
+
+/* A 16-bit register pair and its two 8-bit halves, sharing storage */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define Z80_BIG_ENDIAN 1
+#endif
+#ifdef Z80_BIG_ENDIAN
+#define Z80_PAIR(rp, hi, lo) union { uint16_t rp; struct { uint8_t hi, lo; }; }
+#define Z80_HI 0
+#else
+#define Z80_PAIR(rp, hi, lo) union { uint16_t rp; struct { uint8_t lo, hi; }; }
+#define Z80_HI 1
+#endif
+#define Z80_LO (1 - Z80_HI)
+
+/* Where each 8-bit register sits in z80_t.reg[] */
+#define Z80_REG_B (0 + Z80_HI)
+#define Z80_REG_C (0 + Z80_LO)
+#define Z80_REG_D (2 + Z80_HI)
+#define Z80_REG_E (2 + Z80_LO)
+#define Z80_REG_H (4 + Z80_HI)
+#define Z80_REG_L (4 + Z80_LO)
+#define Z80_REG_A (6 + Z80_HI)
+#define Z80_REG_F (6 + Z80_LO)
+
+typedef struct {
+    /* What every instruction touches comes first, in one 64-byte cache
+       line: registers, interrupt state, the flat memory base, t_states
+       and the decode cache pointer. The page table starts right after
+       it, then the lazy flags and the callbacks. z80.c checks this. */
+
+    /* Main registers. cpu.HL and cpu.H/cpu.L name the same storage, as
+       do pair[2] and reg[Z80_REG_H]/reg[Z80_REG_L]. */
+    union {
+        struct {
+            Z80_PAIR(BC, B, C);
+            Z80_PAIR(DE, D, E);
+            Z80_PAIR(HL, H, L);
+            Z80_PAIR(AF, A, F);
+        };
+        uint16_t pair[4];  /* BC, DE, HL, AF */
+        uint8_t  reg[8];   /* Indexed by Z80_REG_* */
+    };
 
     /* Shadow registers */
-    uint8_t  A_, F_;
-    uint8_t  B_, C_;
-    uint8_t  D_, E_;
-    uint8_t  H_, L_;
+    Z80_PAIR(BC_, B_, C_);
+    Z80_PAIR(DE_, D_, E_);
+    Z80_PAIR(HL_, H_, L_);
+    Z80_PAIR(AF_, A_, F_);
 
     /* Index registers */
-    uint16_t IX, IY;
+    Z80_PAIR(IX, IXH, IXL);
+    Z80_PAIR(IY, IYH, IYL);
 
     /* Stack pointer and program counter */
     uint16_t SP, PC;
@@ -35,10 +184,50 @@ typedef struct {
     uint8_t  IM;          /* Interrupt mode: 0, 1, or 2 */
     uint8_t  halted;
     uint8_t  ei_delay;    /* EI takes effect after next instruction */
+    uint8_t  break_req;   /* Set by z80_break() to end z80_run() early */
+    uint8_t  blk_op;      /* ED opcode of a block repeat that just rewound PC */
+
+    /* Interrupt lines, sampled at instruction boundaries */
+    uint8_t  irq;         /* Z80_IRQ_INT while INT is held, | Z80_IRQ_NMI once
+                             NMI has had a rising edge not yet taken */
+    uint8_t  int_data;    /* Byte the device puts on the bus for INT */
+    uint8_t  nmi_line;    /* Current NMI level, for edge detection */
+
+    /* -DZ80_FLAT_MEMORY builds: all 64K, read, written and fetched from
+       directly. The page table and memory callbacks are then only used
+       for traps; there is no write protection and no decode cache. */
+    uint8_t *mem;
 
     /* Cycle counter */
     unsigned long t_states;
 
+    /* Decode cache, NULL unless enabled by z80_init_ex() */
+    z80_dcache_t *dcache;
+
+    /* Page table fast path. A non-NULL entry points at the host copy of
+       that 256-byte page and is accessed directly; NULL falls back to the
+       callbacks below (or drops the write for Z80_PAGE_RO pages). Filled
+       in by z80_map(); all NULL after z80_init(). */
+    uint8_t *page_read[Z80_PAGES];
+    uint8_t *page_write[Z80_PAGES];
+    uint8_t  page_flags[Z80_PAGES];
+
+    /* Lazy flags (-DZ80_LAZY_FLAGS): the last flag-setting op, when F
+       has not been worked out from it yet. Up to date on return from
+       z80_step() and z80_run(), see z80_get_f(). */
+    uint8_t  lf_op, lf_a, lf_b;
+    uint16_t lf_r;
+
+    /* PC traps and watches, NULL until the first z80_set_trap() or
+       z80_set_watch() */
+    z80_traps_t *traps;
+
+    /* Execution profile, NULL until z80_profile_start() */
+    z80_profile_t *prof;
+
+    /* Instruction trace ring, NULL unless attached by z80_set_trace() */
+    z80_trace_t *trace;
+
     /* Memory callbacks */
     z80_read_fn  mem_read;
     z80_write_fn mem_write;
@@ -51,6 +240,12 @@ typedef struct {
     void *ctx;
 } z80_t;
 
+/* Called as an instruction is about to start at a trapped address */
+typedef int (*z80_trap_fn)(z80_t *cpu, uint16_t addr);
+/* Called once a watched byte has been read or written: val is the byte,
+   kind Z80_WATCH_READ or Z80_WATCH_WRITE */
+typedef void (*z80_watch_fn)(z80_t *cpu, uint16_t addr, uint8_t val, int kind);
+
 /* Flag bit positions */
 #define Z80_CF  0x01  /* Carry */
 #define Z80_NF  0x02  /* Add/Subtract */
@@ -61,9 +256,101 @@ typedef struct {
 #define Z80_ZF  0x40  /* Zero */
 #define Z80_SF  0x80  /* Sign */
 
+/* irq bits */
+#define Z80_IRQ_INT 0x01
+#define Z80_IRQ_NMI 0x02
+
+/* z80_map() flags */
+#define Z80_MAP_READ    0x01  /* Reads come straight from host memory */
+#define Z80_MAP_WRITE   0x02  /* Writes go straight to host memory */
+#define Z80_MAP_NOWRITE 0x04  /* Writes are dropped without a callback */
+#define Z80_MAP_RAM     (Z80_MAP_READ | Z80_MAP_WRITE)
+#define Z80_MAP_ROM     (Z80_MAP_READ | Z80_MAP_NOWRITE)
+
+/* z80_init_ex() flags */
+#define Z80_INIT_DCACHE 0x01  /* Cache decoded prefixes per PC */
+#define Z80_INIT_BLOCKS 0x02  /* Also run hot basic blocks as threaded code */
+
 void z80_init(z80_t *cpu);
+/* z80_init() plus optional features. Allocates; pair with z80_free().
+   Returns 0, or -1 if an allocation failed (the CPU still works, without
+   the feature). */
+int  z80_init_ex(z80_t *cpu, int flags);
+void z80_free(z80_t *cpu);    /* Release z80_init_ex()/z80_set_trap() memory */
+/* Map [addr, addr+len) onto host memory at mem. addr and len must be
+   multiples of Z80_PAGE_SIZE. flags == 0 returns the range to the
+   callbacks. */
+void z80_map(z80_t *cpu, uint16_t addr, uint32_t len, uint8_t *mem, int flags);
+/* Tell the decode cache that [addr, addr+len) changed behind the CPU's
+   back (host writes into mapped memory). Writes made by the CPU itself
+   are tracked automatically. */
+void z80_invalidate(z80_t *cpu, uint16_t addr, uint32_t len);
+/* Copy out the decode cache counters; returns -1 if the cache is off */
+int  z80_dcache_stats(const z80_t *cpu, z80_dcache_stats_t *stats);
+/* Call fn(cpu, addr) whenever an instruction is about to start at addr;
+   fn == NULL removes the trap. fn returns 0 to run that instruction as
+   usual, or nonzero to skip it: it must then have moved PC on or called
+   z80_break(), and the T-states it added count as the step's. Only code
+   on a page holding a trap pays for the check. Allocates on first use,
+   pair with z80_free(). Returns -1 if Z80_MAX_TRAPS are already set or
+   the allocation failed. */
+int  z80_set_trap(z80_t *cpu, uint16_t addr, z80_trap_fn fn);
+z80_trap_fn z80_get_trap(const z80_t *cpu, uint16_t addr);  /* NULL: none */
+/* Call fn on each access of the given kinds (Z80_WATCH_READ and/or
+   Z80_WATCH_WRITE) to a byte in [addr, addr+len), len 1 to 65536,
+   wrapping at the top of memory. Reads include opcode and operand
+   fetches. fn runs mid-instruction, after the access: it may look at
+   memory and call z80_break() to stop once the instruction is done, but
+   PC and the registers are not yet those of an instruction boundary.
+   Pages holding watched bytes leave the fast path for those accesses, so
+   only code touching them slows down. fn == NULL removes the watch set
+   with the same addr, len and kind. Allocates as z80_set_trap() does.
+   Returns -1 if Z80_MAX_WATCHES are already set, the allocation failed
+   or the build is -DZ80_FLAT_MEMORY, which has no watches. */
+int  z80_set_watch(z80_t *cpu, uint16_t addr, uint32_t len, int kind,
+                   z80_watch_fn fn);
 int  z80_step(z80_t *cpu);    /* Execute one instruction, return T-states used */
+/* Execute until the budget is used up, the CPU enters HALT, or z80_break()
+   is called. Returns the T-states actually run (may overshoot the budget by
+   part of one instruction). A CPU that is already halted is waiting for an
+   interrupt: the whole budget is skipped in one jump, with t_states and R
+   ending where stepping through HALT would have left them. */
+unsigned long z80_run(z80_t *cpu, unsigned long tstate_budget);
+void z80_break(z80_t *cpu);   /* Make z80_run return after current instruction */
 void z80_interrupt(z80_t *cpu, uint8_t data);  /* Request maskable interrupt */
 void z80_nmi(z80_t *cpu);     /* Request non-maskable interrupt */
+/* Drive the INT line. While it is held, the CPU takes the interrupt at
+   the first instruction boundary where IFF1 is set and no EI is pending,
+   with data on the bus. It stays held until the device releases it. */
+void z80_set_int(z80_t *cpu, int level, uint8_t data);
+/* Drive the NMI line. A rising edge is latched and taken at the next
+   instruction boundary. */
+void z80_set_nmi(z80_t *cpu, int level);
+/* F as the program would see it. cpu->F itself is exact between calls
+   and in trap handlers, but a lazy-flags core may leave it stale while
+   memory and I/O callbacks run. */
+uint8_t z80_get_f(z80_t *cpu);
+void z80_set_f(z80_t *cpu, uint8_t f);
+/* Start keeping cpu->prof, from the current PC. -DZ80_PROFILE builds only,
+   which run without the decode cache so every instruction is seen.
+   Allocates, pair with z80_free(). Returns -1 in other builds or if the
+   allocation failed. */
+int  z80_profile_start(z80_t *cpu);
+/* Allocate tr's ring of size records (rounded up to a power of two) with
+   no triggers: trace from the first instruction on. Returns -1 if the
+   allocation failed. */
+int  z80_trace_init(z80_trace_t *tr, uint32_t size);
+void z80_trace_free(z80_trace_t *tr);
+/* Attach tr (NULL detaches). -DZ80_TRACE builds only, which run without
+   the decode cache or the block fast path so every instruction is seen.
+   Returns -1 in other builds. */
+int  z80_set_trace(z80_t *cpu, z80_trace_t *tr);
+/* Reader side: take up to max records, oldest first. Returns how many. */
+uint32_t z80_trace_read(z80_trace_t *tr, z80_trace_rec_t *out, uint32_t max);
+/* Copy the CPU's state out, or back in. Loading leaves memory, the page
+   table, traps and callbacks alone; if memory changed with it, tell the
+   decode cache with z80_invalidate(). */
+void z80_save_state(z80_t *cpu, z80_state_t *st);
+void z80_load_state(z80_t *cpu, const z80_state_t *st);
 
 #endif /* Z80_H */
@@ -0,0 +1,358 @@
+#include "machine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ── Workloads ───────────────────────────────────────────────────── */
+
+/* Each workload runs a fixed number of T-states from a fresh machine, so
+   the instruction stream is identical from one run (and commit) to the
+   next. BASIC workloads type a script into the ACIA, each line once the
+   expected prompt has appeared. */
+
+#define SLICE 7373  /* T-states between input polls, as in zxs */
+
+struct script_line {
+    const char *expect;  /* Wait for this output (NULL = don't wait) */
+    const char *send;
+};
+
+struct workload {
+    const char *name;
+    const char *desc;
+    const char *rom;           /* Image to load, or NULL for code[] */
+    int         port;          /* ACIA port for rom, -1 to detect */
+    const uint8_t *code;       /* Program at 0x0000 when rom is NULL */
+    size_t      code_len;
+    const struct script_line *script;
+    const char *check;         /* Output that proves the run worked */
+    unsigned long t_states;
+};
+
+/* ADD/ADC/SUB/AND/XOR/OR/CP/INC/DEC and rotates in a DJNZ loop */
+static const uint8_t alu_code[] = {
+    0x3E, 0x5A,        /* 0000  LD A,5Ah      */
+    0x0E, 0x13,        /* 0002  LD C,13h      */
+    0x06, 0x00,        /* 0004  LD B,0        */
+    0x81,              /* 0006  ADD A,C       */
+    0x89,              /* 0007  ADC A,C       */
+    0x91,              /* 0008  SUB C         */
+    0xA1,              /* 0009  AND C         */
+    0xA9,              /* 000A  XOR C         */
+    0xB1,              /* 000B  OR C          */
+    0xB9,              /* 000C  CP C          */
+    0x0C,              /* 000D  INC C         */
+    0x3D,              /* 000E  DEC A         */
+    0x07,              /* 000F  RLCA          */
+    0x1F,              /* 0010  RRA           */
+    0xC6, 0x07,        /* 0011  ADD A,7       */
+    0xEE, 0x3C,        /* 0013  XOR 3Ch       */
+    0x27,              /* 0015  DAA           */
+    0x10, 0xEE,        /* 0016  DJNZ 0006h    */
+    0x18, 0xEA,        /* 0018  JR 0004h      */
+};
+
+/* 8 KB forward copy, then the same block back down with LDDR */
+static const uint8_t ldir_code[] = {
+    0x21, 0x00, 0x40,  /* 0000  LD HL,4000h   */
+    0x11, 0x00, 0x80,  /* 0003  LD DE,8000h   */
+    0x01, 0x00, 0x20,  /* 0006  LD BC,2000h   */
+    0xED, 0xB0,        /* 0009  LDIR          */
+    0x21, 0xFF, 0x9F,  /* 000B  LD HL,9FFFh   */
+    0x11, 0xFF, 0x5F,  /* 000E  LD DE,5FFFh   */
+    0x01, 0x00, 0x20,  /* 0011  LD BC,2000h   */
+    0xED, 0xB8,        /* 0014  LDDR          */
+    0x18, 0xE8,        /* 0016  JR 0000h      */
+};
+
+/* Nested CALL/RET with PUSH/POP, the shape of compiled and ROM code */
+static const uint8_t call_code[] = {
+    0x31, 0x00, 0xF0,  /* 0000  LD SP,F000h   */
+    0xCD, 0x08, 0x00,  /* 0003  CALL 0008h    */
+    0x18, 0xFB,        /* 0006  JR 0003h      */
+    0xC5,              /* 0008  PUSH BC       */
+    0xD5,              /* 0009  PUSH DE       */
+    0xCD, 0x11, 0x00,  /* 000A  CALL 0011h    */
+    0xD1,              /* 000D  POP DE        */
+    0xC1,              /* 000E  POP BC        */
+    0xC9,              /* 000F  RET           */
+    0x00,              /* 0010  NOP           */
+    0xE5,              /* 0011  PUSH HL       */
+    0xCD, 0x19, 0x00,  /* 0012  CALL 0019h    */
+    0xCC, 0x19, 0x00,  /* 0015  CALL Z,0019h  */
+    0xE1,              /* 0018  POP HL        */
+    0xC9,              /* 0019  RET           */
+};
+
+static const struct script_line searle_boot[] = {
+    { "Memory top?", "\r" },
+    { NULL, NULL }
+};
+
+static const struct script_line rc2014_boot[] = {
+    { "Memory top?", "\r" },
+    { NULL, NULL }
+};
+
+static const struct script_line searle_prog[] = {
+    { "Memory top?", "\r" },
+    { "Ok", "10 S=0\r" },
+    { "\n", "20 FOR I=1 TO 500\r" },
+    { "\n", "30 S=S+SQR(I)*I/7\r" },
+    { "\n", "40 NEXT I\r" },
+    { "\n", "50 PRINT \"S=\";INT(S)\r" },
+    { "\n", "60 GOTO 10\r" },
+    { "\n", "RUN\r" },
+    { NULL, NULL }
+};
+
+static const struct workload workloads[] = {
+    { "alu", "8-bit ALU and rotates in a DJNZ loop",
+      NULL, -1, alu_code, sizeof(alu_code), NULL, NULL, 400000000ul },
+    { "ldir", "8 KB LDIR/LDDR block copies",
+      NULL, -1, ldir_code, sizeof(ldir_code), NULL, NULL, 400000000ul },
+    { "callret", "nested CALL/RET with PUSH/POP",
+      NULL, -1, call_code, sizeof(call_code), NULL, NULL, 400000000ul },
+    { "basic-boot", "basic.rom cold boot to the Ok prompt",
+      "basic.rom", -1, NULL, 0, searle_boot, "Ok", 100000000ul },
+    { "rc2014-boot", "rc2014_56k.hex cold boot to the Ok prompt",
+      "rc2014_56k.hex", 0x80, NULL, 0, rc2014_boot, "Ok", 100000000ul },
+    { "basic-prog", "basic.rom running a FOR/SQR benchmark program",
+      "basic.rom", -1, NULL, 0, searle_prog, "S=", 400000000ul },
+};
+
+#define NWORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+/* ── Running ─────────────────────────────────────────────────────── */
+
+static int contains(const char *buf, size_t len, size_t from, const char *s) {
+    size_t n = strlen(s);
+    for (size_t i = from; i + n <= len; i++)
+        if (memcmp(buf + i, s, n) == 0) return 1;
+    return 0;
+}
+
+static int cpu_flags;  /* z80_init_ex() flags for every machine */
+
+static int setup(machine_t *m, const struct workload *w) {
+    machine_init(m, cpu_flags);
+    m->in_fd = -1;
+    m->out_fd = -1;  /* Collect output */
+    if (!w->rom) {
+        memcpy(m->memory, w->code, w->code_len);
+        m->sys = SYS_CPM;  /* No serial port; runs from 0x0000 */
+        return 0;
+    }
+    enum system_type sys = SYS_BASIC;
+    int loaded = machine_load(m, w->rom, &sys, 0);
+    if (loaded < 0) return -1;
+    machine_start(m, SYS_BASIC, w->port, loaded);
+    return 0;
+}
+
+/* Run w to completion. With count, single-steps and returns the number
+   of instructions; otherwise goes through z80_run() like zxs does. */
+static unsigned long drive(machine_t *m, const struct workload *w, int count) {
+    z80_t *cpu = &m->cpu;
+    const struct script_line *line = w->script;
+    size_t pos = 0, mark = 0;
+    unsigned long insns = 0;
+
+    while (cpu->t_states < w->t_states) {
+        unsigned long target = cpu->t_states + SLICE;
+        if (target > w->t_states) target = w->t_states;
+        if (count) {
+            while (cpu->t_states < target) {
+                z80_step(cpu);
+                insns++;
+            }
+        } else {
+            while (cpu->t_states < target)
+                z80_run(cpu, target - cpu->t_states);
+        }
+
+        /* Type the script, one byte per poll while the ACIA is empty */
+        if (line && line->send && !m->acia_rx_ready) {
+            if (pos == 0 && line->expect &&
+                !contains(m->out_buf, m->out_len, mark, line->expect))
+                continue;
+            machine_rx(m, (uint8_t)line->send[pos++]);
+            if (!line->send[pos]) {
+                line++;
+                pos = 0;
+                mark = m->out_len;
+            }
+        }
+    }
+    return insns;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct result {
+    unsigned long insns;
+    unsigned long t_states;
+    double seconds;        /* Best of the timed runs */
+    double dcache_hits;    /* Decode cache hit rate, -1 if off */
+    unsigned long dcache_invalidations;
+    double block_share;    /* Instructions run from blocks, -1 if off */
+    unsigned long blocks;
+    int ok;
+};
+
+static int bench(const struct workload *w, int repeat, int show,
+                 struct result *r) {
+    static machine_t m;
+
+    /* Counting pass: fixes the instruction count and checks the output */
+    if (setup(&m, w) < 0) return -1;
+    r->insns = drive(&m, w, 1);
+    r->t_states = m.cpu.t_states;
+    r->ok = !w->check || contains(m.out_buf, m.out_len, 0, w->check);
+    if (show) {
+        fwrite(m.out_buf, 1, m.out_len, stdout);
+        putchar('\n');
+    }
+    machine_free(&m);
+
+    r->seconds = 0;
+    for (int i = 0; i < repeat; i++) {
+        setup(&m, w);
+        double t0 = now();
+        drive(&m, w, 0);
+        double dt = now() - t0;
+        if (m.cpu.t_states != r->t_states) r->ok = 0;
+        z80_dcache_stats_t st;
+        r->dcache_hits = -1;
+        r->block_share = -1;
+        if (z80_dcache_stats(&m.cpu, &st) == 0) {
+            unsigned long total = st.hits + st.misses;
+            r->dcache_hits = total ? (double)st.hits / total : 0;
+            r->dcache_invalidations = st.invalidations;
+            if (cpu_flags & Z80_INIT_BLOCKS) {
+                r->block_share = (double)st.block_insns / r->insns;
+                r->blocks = st.blocks;
+            }
+        }
+        machine_free(&m);
+        if (i == 0 || dt < r->seconds) r->seconds = dt;
+    }
+    return 0;
+}
+
+/* ── Output ──────────────────────────────────────────────────────── */
+
+static void write_json(FILE *f, const struct workload *const *run,
+                       const struct result *res, int n) {
+    fprintf(f, "{\n  \"workloads\": [\n");
+    for (int i = 0; i < n; i++) {
+        const struct result *r = &res[i];
+        fprintf(f, "    { \"name\": \"%s\", \"ok\": %s, "
+                   "\"instructions\": %lu, \"t_states\": %lu, "
+                   "\"seconds\": %.6f, \"ns_per_insn\": %.3f, "
+                   "\"mips\": %.2f, \"mhz\": %.2f",
+                run[i]->name, r->ok ? "true" : "false",
+                r->insns, r->t_states, r->seconds,
+                r->seconds * 1e9 / r->insns,
+                r->insns / r->seconds / 1e6,
+                r->t_states / r->seconds / 1e6);
+        if (r->dcache_hits >= 0)
+            fprintf(f, ", \"dcache_hit_rate\": %.4f, "
+                       "\"dcache_invalidations\": %lu",
+                    r->dcache_hits, r->dcache_invalidations);
+        if (r->block_share >= 0)
+            fprintf(f, ", \"block_share\": %.4f, \"blocks\": %lu",
+                    r->block_share, r->blocks);
+        fprintf(f, " }%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] [workload...]\n", argv0);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  --repeat N    Timed runs per workload, best is kept (default 3)\n");
+    fprintf(stderr, "  --json FILE   Also write results as JSON (- for stdout)\n");
+    fprintf(stderr, "  --show        Print each workload's console output\n");
+    fprintf(stderr, "  --dcache      Run with the decode cache, report its hit rate\n");
+    fprintf(stderr, "  --blocks      Run with the basic block tier, report its coverage\n");
+    fprintf(stderr, "  --list        List workloads\n");
+}
+
+int main(int argc, char **argv) {
+    const struct workload *run[NWORKLOADS];
+    struct result res[NWORKLOADS];
+    int nrun = 0, repeat = 3, show = 0;
+    const char *json = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            if (repeat < 1) repeat = 1;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--show") == 0) {
+            show = 1;
+        } else if (strcmp(argv[i], "--dcache") == 0) {
+            cpu_flags |= Z80_INIT_DCACHE;
+        } else if (strcmp(argv[i], "--blocks") == 0) {
+            cpu_flags |= Z80_INIT_BLOCKS;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            for (int w = 0; w < NWORKLOADS; w++)
+                printf("%-12s %s\n", workloads[w].name, workloads[w].desc);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            int w = 0;
+            while (w < NWORKLOADS && strcmp(workloads[w].name, argv[i]) != 0) w++;
+            if (w == NWORKLOADS) {
+                fprintf(stderr, "Unknown workload: %s\n", argv[i]);
+                return 1;
+            }
+            if (nrun < NWORKLOADS) run[nrun++] = &workloads[w];
+        }
+    }
+    if (nrun == 0)
+        for (int w = 0; w < NWORKLOADS; w++) run[nrun++] = &workloads[w];
+
+    printf("%-12s %12s %12s %9s %9s %9s\n",
+           "workload", "insns", "T-states", "ns/insn", "MIPS", "MHz");
+    int n = 0, failed = 0;
+    for (int i = 0; i < nrun; i++) {
+        struct result *r = &res[n];
+        if (bench(run[i], repeat, show, r) < 0) {
+            fprintf(stderr, "%s: skipped\n", run[i]->name);
+            continue;
+        }
+        printf("%-12s %12lu %12lu %9.2f %9.1f %9.1f%s\n",
+               run[i]->name, r->insns, r->t_states,
+               r->seconds * 1e9 / r->insns,
+               r->insns / r->seconds / 1e6,
+               r->t_states / r->seconds / 1e6,
+               r->ok ? "" : "  FAILED");
+        if (r->dcache_hits >= 0)
+            printf("%-12s dcache %.2f%% hits, %lu invalidations\n", "",
+                   100 * r->dcache_hits, r->dcache_invalidations);
+        if (r->block_share >= 0)
+            printf("%-12s blocks %.2f%% of instructions, %lu built\n", "",
+                   100 * r->block_share, r->blocks);
+        fflush(stdout);
+        if (!r->ok) failed++;
+        run[n++] = run[i];
+    }
+
+    if (json) {
+        FILE *f = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+        if (!f) { perror(json); return 1; }
+        write_json(f, run, res, n);
+        if (f != stdout) fclose(f);
+    }
+    return failed ? 1 : 0;
+}
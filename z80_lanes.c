@@ -0,0 +1,625 @@
+#include "z80_lanes.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* ── Vectors ─────────────────────────────────────────────────────── */
+
+/* GCC and clang vector extensions, as wide as the target's registers:
+   the compiler lowers each operation to SSE2 or NEON, or AVX2 where the
+   build enables it (-mavx2, -march=native). Other compilers, and
+   -DZ80_LANES_NO_SIMD builds, get vectors of one lane and the same code.
+   Every lane value is 16 bits, 8-bit registers included, so that one
+   vector type and one mask serve for all of them and an 8-bit result
+   keeps its carry in bit 8, as in z80.c. */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(Z80_LANES_NO_SIMD)
+#ifdef __AVX2__
+#define VL 16                    /* Lanes in a vector */
+#else
+#define VL 8
+#endif
+typedef uint16_t vw __attribute__((vector_size(VL * 2)));
+#define MASK(cond) ((vw)(cond))  /* A comparison as 0 or 0xFFFF per lane */
+#define LANE(v, e) ((v)[e])
+#else
+#define VL 1
+typedef uint16_t vw;
+#define MASK(cond) ((vw)-(cond))
+#define LANE(v, e) (v)
+#endif
+#define SPLAT(x) ((vw){0} + (uint16_t)(x))
+
+static inline vw ld(const uint16_t *p) {
+    vw v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void st(uint16_t *p, vw v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+/* Store v where m is set, keep the old value elsewhere */
+static inline void put(uint16_t *p, vw v, vw m) {
+    vw old = ld(p);
+    st(p, old ^ ((old ^ v) & m));
+}
+
+static inline int any(vw m) {
+    for (int e = 0; e < VL; e++)
+        if (LANE(m, e)) return 1;
+    return 0;
+}
+
+/* ── Flags ───────────────────────────────────────────────────────── */
+
+/* The definitions z80.c builds its flag tables from, worked out with
+   bit operations instead of lookups. r is the 9-bit result. */
+
+static inline vw sz53(vw r) {
+    return (r & (Z80_SF | Z80_F5 | Z80_F3)) | (MASK((r & 0xFF) == 0) & Z80_ZF);
+}
+
+static inline vw parity(vw r) {
+    vw x = r ^ (r >> 4);
+    x ^= x >> 2;
+    x ^= x >> 1;
+    return ((x & 1) ^ 1) << 2;  /* Z80_PF when the count is even */
+}
+
+static inline vw add_flags(vw a, vw b, vw r) {
+    return sz53(r) | ((a ^ b ^ r) & Z80_HF) |
+           ((((a ^ b ^ 0x80) & (a ^ r)) >> 5) & Z80_PF) | ((r >> 8) & Z80_CF);
+}
+
+static inline vw sub_flags(vw a, vw b, vw r) {
+    return sz53(r) | Z80_NF | ((a ^ b ^ r) & Z80_HF) |
+           ((((a ^ b) & (a ^ r)) >> 5) & Z80_PF) | ((r >> 8) & Z80_CF);
+}
+
+/* ── Lane state ──────────────────────────────────────────────────── */
+
+/* Operand field 6 is (HL), which no group instruction uses as a
+   register, so that row holds F */
+#define ROW_F 6
+#define ROW_A 7
+
+/* Lanes run in passes of at most this many instructions, so that the
+   T-states and R increments a pass owes each CPU fit in 16 bits */
+#define PASS_INSNS 2048
+
+struct z80_lanes_soa {
+    unsigned  width;                 /* n rounded up to whole vectors */
+    uint16_t *row[8];                /* Per lane B C D E H L F A */
+    uint16_t *sp, *pc;
+    uint16_t *left;                  /* Instructions to go in this pass */
+    uint16_t *t, *r;                 /* Owed to cpu[] for group steps */
+    uint16_t *ready;                 /* 0xFFFF if lane_ready() */
+    uint16_t *rows;                  /* What the above point into */
+    uint16_t  pc_min;                /* The lowest PC with lanes to go */
+    unsigned  at_min;                /* How many lanes are there */
+    int32_t   hot;                   /* Where the last big group went, -1 none */
+    const uint8_t *code[Z80_PAGES];  /* Pages every lane reads the same */
+};
+
+/* Could the lane run a group instruction next? z80_step() would take an
+   interrupt, clear an EI delay or sit in HALT. */
+static int lane_ready(const z80_t *c) {
+    return !c->halted && !c->ei_delay &&
+           !(c->irq & Z80_IRQ_NMI) && !((c->irq & Z80_IRQ_INT) && c->IFF1);
+}
+
+static void lane_load(z80_lanes_t *l, unsigned i) {
+    z80_lanes_soa_t *s = l->soa;
+    z80_t *c = &l->cpu[i];
+    s->row[0][i] = c->B;  s->row[1][i] = c->C;
+    s->row[2][i] = c->D;  s->row[3][i] = c->E;
+    s->row[4][i] = c->H;  s->row[5][i] = c->L;
+    s->row[ROW_F][i] = z80_get_f(c);
+    s->row[ROW_A][i] = c->A;
+    s->sp[i] = c->SP;
+    s->pc[i] = c->PC;
+    s->ready[i] = lane_ready(c) ? 0xFFFF : 0;
+}
+
+static void lane_store(z80_lanes_t *l, unsigned i) {
+    z80_lanes_soa_t *s = l->soa;
+    z80_t *c = &l->cpu[i];
+    c->B = (uint8_t)s->row[0][i];  c->C = (uint8_t)s->row[1][i];
+    c->D = (uint8_t)s->row[2][i];  c->E = (uint8_t)s->row[3][i];
+    c->H = (uint8_t)s->row[4][i];  c->L = (uint8_t)s->row[5][i];
+    z80_set_f(c, (uint8_t)s->row[ROW_F][i]);
+    c->A = (uint8_t)s->row[ROW_A][i];
+    c->SP = s->sp[i];
+    c->PC = s->pc[i];
+    c->t_states += s->t[i];
+#ifndef Z80_FAST
+    c->R = (c->R & 0x80) | ((c->R + s->r[i]) & 0x7F);
+#endif
+    s->t[i] = s->r[i] = 0;
+}
+
+static void lane_step(z80_lanes_t *l, unsigned i) {
+    z80_lanes_soa_t *s = l->soa;
+    z80_t *c = &l->cpu[i];
+    lane_store(l, i);
+    z80_step(c);
+    lane_load(l, i);
+    s->left[i] = c->break_req ? 0 : s->left[i] - 1;
+    l->stats.scalar_insns++;
+}
+
+static void share_pages(z80_lanes_t *l) {
+    z80_lanes_soa_t *s = l->soa;
+    memset(s->code, 0, sizeof(s->code));
+#ifndef Z80_FLAT_MEMORY
+    /* Profiles and traces have to see every instruction */
+    for (unsigned i = 0; i < l->n; i++)
+        if (l->cpu[i].prof || l->cpu[i].trace) return;
+    for (unsigned p = 0; l->n && p < Z80_PAGES; p++) {
+        const uint8_t *page = l->cpu[0].page_read[p];
+        for (unsigned i = 1; page && i < l->n; i++)
+            if (l->cpu[i].page_read[p] != page) page = NULL;
+        s->code[p] = page;
+    }
+#endif
+}
+
+/* The lowest PC among lanes with instructions to go, and how many are
+   there: min_add() over every vector of lanes, then min_end() */
+static inline void min_add(vw *mn, vw *cnt, vw pc, vw live) {
+    vw key = pc | ~live;  /* 0xFFFF for lanes that are done */
+    vw lt = MASK(key < *mn), eq = MASK(key == *mn) & live;
+    *mn = (key & lt) | (*mn & ~lt);
+    *cnt = (lt & 1) | (~lt & (*cnt + (eq & 1)));
+}
+
+static void min_end(z80_lanes_soa_t *s, vw mn, vw cnt) {
+    uint16_t pc = 0xFFFF;
+    unsigned n = 0;
+    for (int e = 0; e < VL; e++)
+        if (LANE(mn, e) < pc) pc = LANE(mn, e);
+    for (int e = 0; e < VL; e++)
+        if (LANE(mn, e) == pc) n += LANE(cnt, e);
+    s->pc_min = pc;
+    s->at_min = n;
+}
+
+/* z80_step() the lanes with PCs in [lo, hi] and find the lowest PC again.
+   Returns where the first of them went, or lo if there were none. */
+static uint16_t lanes_scan(z80_lanes_t *l, uint16_t lo, uint16_t hi) {
+    z80_lanes_soa_t *s = l->soa;
+    vw mn = SPLAT(0xFFFF), cnt = SPLAT(0);
+    int32_t first = -1;
+    for (unsigned i = 0; i < s->width; i += VL) {
+        vw pc = ld(s->pc + i), live = MASK(ld(s->left + i) != 0);
+        vw m = live & MASK(pc >= lo) & MASK(pc <= hi);
+        if (any(m)) {
+            for (int e = 0; e < VL; e++) {
+                if (!LANE(m, e)) continue;
+                lane_step(l, i + e);
+                if (first < 0) first = s->pc[i + e];
+            }
+            pc = ld(s->pc + i);
+            live = MASK(ld(s->left + i) != 0);
+        }
+        min_add(&mn, &cnt, pc, live);
+    }
+    min_end(s, mn, cnt);
+    return first < 0 ? lo : (uint16_t)first;
+}
+
+/* ── Group instructions ──────────────────────────────────────────── */
+
+/* Each works on every lane and keeps the results of the lanes in the
+   group: ready ones with instructions to go at its PC */
+#define EACH(i) for (unsigned i = 0; i < s->width; i += VL)
+
+static inline vw group_mask(const z80_lanes_soa_t *s, unsigned i, uint16_t pc) {
+    return MASK(ld(s->pc + i) == pc) & MASK(ld(s->left + i) != 0) & ld(s->ready + i);
+}
+
+/* ADD ADC SUB SBC AND XOR OR CP of A with src, or with n if src is NULL */
+static void alu(z80_lanes_soa_t *s, uint16_t pc, int op, const uint16_t *src,
+                uint8_t n) {
+    uint16_t *ap = s->row[ROW_A], *fp = s->row[ROW_F];
+    EACH(i) {
+        vw m = group_mask(s, i, pc);
+        vw a = ld(ap + i), f = ld(fp + i);
+        vw b = src ? ld(src + i) : SPLAT(n);
+        vw r;
+        switch (op) {
+        case 0: r = a + b;                  f = add_flags(a, b, r); break;
+        case 1: r = a + b + (f & Z80_CF);   f = add_flags(a, b, r); break;
+        case 2: r = a - b;                  f = sub_flags(a, b, r); break;
+        case 3: r = a - b - (f & Z80_CF);   f = sub_flags(a, b, r); break;
+        case 4: r = a & b; f = sz53(r) | parity(r) | Z80_HF; break;
+        case 5: r = a ^ b; f = sz53(r) | parity(r); break;
+        case 6: r = a | b; f = sz53(r) | parity(r); break;
+        default:
+            /* CP: F5 and F3 from the operand */
+            r = a;
+            f = (sub_flags(a, b, a - b) &
+                 (Z80_SF | Z80_ZF | Z80_HF | Z80_PF | Z80_NF | Z80_CF)) |
+                (b & (Z80_F5 | Z80_F3));
+            break;
+        }
+        put(ap + i, r & 0xFF, m);
+        put(fp + i, f & 0xFF, m);
+    }
+}
+
+static void inc_dec(z80_lanes_soa_t *s, uint16_t pc, uint16_t *p, int dec) {
+    uint16_t *fp = s->row[ROW_F];
+    EACH(i) {
+        vw m = group_mask(s, i, pc);
+        vw v = ld(p + i), f = ld(fp + i) & Z80_CF;
+        if (dec) {
+            v = (v - 1) & 0xFF;
+            f |= sz53(v) | Z80_NF | (MASK(v == 0x7F) & Z80_PF) |
+                 (MASK((v & 0x0F) == 0x0F) & Z80_HF);
+        } else {
+            v = (v + 1) & 0xFF;
+            f |= sz53(v) | (MASK(v == 0x80) & Z80_PF) |
+                 (MASK((v & 0x0F) == 0) & Z80_HF);
+        }
+        put(p + i, v, m);
+        put(fp + i, f, m);
+    }
+}
+
+/* The 00xxx111 opcodes by bits 3-5: RLCA RRCA RLA RRA DAA CPL SCF CCF */
+static void acc_op(z80_lanes_soa_t *s, uint16_t pc, int op) {
+    uint16_t *ap = s->row[ROW_A], *fp = s->row[ROW_F];
+    EACH(i) {
+        vw m = group_mask(s, i, pc);
+        vw a = ld(ap + i), f = ld(fp + i), c = f & Z80_CF;
+        switch (op) {
+        case 0: c = a >> 7; a = (a << 1) | c; break;         /* RLCA */
+        case 1: c = a & 1;  a = (a >> 1) | (c << 7); break;  /* RRCA */
+        case 2: { vw o = a >> 7; a = (a << 1) | c; c = o; break; }         /* RLA */
+        case 3: { vw o = a & 1;  a = (a >> 1) | (c << 7); c = o; break; }  /* RRA */
+        case 4: {                                           /* DAA */
+            vw lo = MASK((f & Z80_HF) != 0) | MASK((a & 0x0F) > 9);
+            vw hi = MASK(c != 0) | MASK(a > 0x99);
+            vw fix = (lo & 0x06) | (hi & 0x60);
+            vw n = MASK((f & Z80_NF) != 0);
+            vw r = (((a - fix) & n) | ((a + fix) & ~n)) & 0xFF;
+            f = sz53(r) | parity(r) | (hi & Z80_CF) | (f & Z80_NF) | ((a ^ r) & Z80_HF);
+            put(ap + i, r, m);
+            put(fp + i, f, m);
+            continue;
+        }
+        case 5: a = ~a; c |= Z80_HF | Z80_NF; break;        /* CPL */
+        case 6: c = SPLAT(Z80_CF); break;                   /* SCF */
+        case 7: c = (c << 4) | (c ^ Z80_CF); break;         /* CCF: H is the old C */
+        }
+        a &= 0xFF;
+        f = (f & (Z80_SF | Z80_ZF | Z80_PF)) | (a & (Z80_F5 | Z80_F3)) | c;
+        put(ap + i, a, m);
+        put(fp + i, f, m);
+    }
+}
+
+/* A register pair's rows as one 16-bit value per lane, and back */
+static inline vw pair(const uint16_t *hi, const uint16_t *lo, unsigned i) {
+    return (ld(hi + i) << 8) | ld(lo + i);
+}
+
+static inline void put_pair(uint16_t *hi, uint16_t *lo, unsigned i, vw v, vw m) {
+    put(hi + i, v >> 8, m);
+    put(lo + i, v & 0xFF, m);
+}
+
+/* INC/DEC rr, LD rr,nn (src NULL) and LD SP,HL (src pairs H and L) on a
+   pair's rows, or on sp if hi is NULL */
+static void op16(z80_lanes_soa_t *s, uint16_t pc, uint16_t *hi, uint16_t *lo,
+                 int add, const uint16_t *src, uint16_t nn) {
+    EACH(i) {
+        vw m = group_mask(s, i, pc), v;
+        if (add)
+            v = (hi ? pair(hi, lo, i) : ld(s->sp + i)) + SPLAT(add);
+        else if (src)
+            v = pair(s->row[4], s->row[5], i);
+        else
+            v = SPLAT(nn);
+        if (hi)
+            put_pair(hi, lo, i, v, m);
+        else
+            put(s->sp + i, v, m);
+    }
+}
+
+/* ADD HL,rr, rr's rows or sp if hi is NULL: H from bit 11, C from bit
+   15, F5 and F3 from the high byte */
+static void add_hl(z80_lanes_soa_t *s, uint16_t pc, const uint16_t *hi,
+                   const uint16_t *lo) {
+    uint16_t *hp = s->row[4], *lp = s->row[5], *fp = s->row[ROW_F];
+    EACH(i) {
+        vw m = group_mask(s, i, pc);
+        vw hl = pair(hp, lp, i), v = hi ? pair(hi, lo, i) : ld(s->sp + i);
+        vw r = hl + v;
+        vw f = (ld(fp + i) & (Z80_SF | Z80_ZF | Z80_PF)) |
+               ((r >> 8) & (Z80_F5 | Z80_F3)) | (((hl ^ v ^ r) >> 8) & Z80_HF) |
+               (MASK(r < hl) & Z80_CF);
+        put_pair(hp, lp, i, r, m);
+        put(fp + i, f, m);
+    }
+}
+
+/* LD dst,src, or LD dst,n if src is NULL */
+static void load(z80_lanes_soa_t *s, uint16_t pc, uint16_t *dst,
+                 const uint16_t *src, uint8_t n) {
+    EACH(i) put(dst + i, src ? ld(src + i) : SPLAT(n), group_mask(s, i, pc));
+}
+
+static void ex_de_hl(z80_lanes_soa_t *s, uint16_t pc) {
+    for (int r = 2; r < 4; r++) {
+        uint16_t *de = s->row[r], *hl = s->row[r + 2];
+        EACH(i) {
+            vw x = (ld(de + i) ^ ld(hl + i)) & group_mask(s, i, pc);
+            st(de + i, ld(de + i) ^ x);
+            st(hl + i, ld(hl + i) ^ x);
+        }
+    }
+}
+
+/* How the group moves on: to `to` in t_to T-states for lanes whose cond
+   row has bits of `bits` set (none, if !want), otherwise to next in t */
+struct group_move {
+    uint16_t next, to;
+    int t, t_to;
+    const uint16_t *cond;
+    uint16_t bits;
+    int want;
+};
+
+/* Move the group on, z80_step() the lanes at its PC that are not ready,
+   and find the lowest PC for the next step */
+static void group_commit(z80_lanes_t *l, uint16_t pc, const struct group_move *mv) {
+    z80_lanes_soa_t *s = l->soa;
+    vw mn = SPLAT(0xFFFF), cnt = SPLAT(0), taken = SPLAT(0), members = SPLAT(0);
+    vw flip = SPLAT(mv->want ? 0 : 0xFFFF);
+    EACH(i) {
+        vw p = ld(s->pc + i), left = ld(s->left + i);
+        vw at = MASK(p == pc) & MASK(left != 0);
+        vw m = at & ld(s->ready + i);
+        vw tk = SPLAT(0);
+        if (mv->cond) tk = m & (MASK((ld(mv->cond + i) & mv->bits) != 0) ^ flip);
+        vw to = MASK(tk != 0);
+        p = (p & ~m) | (((SPLAT(mv->to) & to) | (SPLAT(mv->next) & ~to)) & m);
+        st(s->pc + i, p);
+        st(s->t + i, ld(s->t + i) + (((SPLAT(mv->t_to) & to) | (SPLAT(mv->t) & ~to)) & m));
+        st(s->r + i, ld(s->r + i) + (m & 1));
+        left -= m & 1;
+        st(s->left + i, left);
+        taken += tk & 1;
+        members += m & 1;
+        if (any(at & ~m)) {
+            for (int e = 0; e < VL; e++)
+                if (LANE(at & ~m, e)) lane_step(l, i + e);
+            p = ld(s->pc + i);
+            left = ld(s->left + i);
+        }
+        min_add(&mn, &cnt, p, MASK(left != 0));
+    }
+    min_end(s, mn, cnt);
+
+    unsigned nt = 0, nm = 0;
+    for (int e = 0; e < VL; e++) {
+        nt += LANE(taken, e);
+        nm += LANE(members, e);
+    }
+    s->hot = nt * 2 > nm ? mv->to : mv->next;
+    l->stats.group_steps++;
+    l->stats.group_insns += nm;
+}
+
+/* Flags tested by JP/JR cc: NZ Z NC C PO PE P M */
+static const uint8_t cc_flag[4] = { Z80_ZF, Z80_CF, Z80_PF, Z80_SF };
+
+/* Does op run as a group instruction? */
+static int group_op(uint8_t op) {
+    unsigned x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0: return y != 1;                        /* All but EX AF,AF' */
+        case 1: case 3: return 1;                     /* LD/ADD/INC/DEC rr */
+        case 4: case 5: case 6: return y != 6;        /* INC/DEC/LD r */
+        case 7: return 1;
+        }
+        return 0;
+    case 1: return y != 6 && z != 6;                  /* LD r,r', not HALT */
+    case 2: return z != 6;
+    default:
+        return op == 0xC3 || op == 0xEB || op == 0xF9 ||  /* JP, EX DE,HL, LD SP,HL */
+               z == 2 || z == 6;                          /* JP cc,nn; ALU n */
+    }
+}
+
+/* One instruction for the group at pc, all of it at once. Returns 0,
+   having done nothing, if it is not a group instruction. */
+static int group_step(z80_lanes_t *l, uint16_t pc) {
+    z80_lanes_soa_t *s = l->soa;
+    if (!s->code[pc >> Z80_PAGE_SHIFT] ||
+        !s->code[(uint16_t)(pc + 2) >> Z80_PAGE_SHIFT])
+        return 0;
+#define CODE(a) (s->code[(uint16_t)(a) >> Z80_PAGE_SHIFT][(a) & Z80_PAGE_MASK])
+    uint8_t op = CODE(pc), n = CODE(pc + 1);
+    uint16_t nn = n | CODE(pc + 2) << 8;
+#undef CODE
+    if (!group_op(op)) return 0;
+
+    unsigned y = (op >> 3) & 7, z = op & 7;
+    struct group_move mv = { pc + 1, 0, 4, 0, NULL, 0, 0 };
+    switch (op >> 6) {
+    case 0:
+        switch (z) {
+        case 0:
+            if (y == 2) {                               /* DJNZ */
+                uint16_t *b = s->row[0];
+                EACH(i) put(b + i, (ld(b + i) - 1) & 0xFF, group_mask(s, i, pc));
+                mv.cond = b, mv.bits = 0xFF, mv.want = 1;
+            } else if (y >= 4) {                        /* JR cc,d */
+                mv.cond = s->row[ROW_F];
+                mv.bits = cc_flag[(y - 4) >> 1], mv.want = y & 1;
+            }
+            if (y == 3) {                               /* JR d */
+                mv.next = pc + 2 + (int8_t)n;
+                mv.t = 12;
+            } else if (y >= 2) {
+                mv.next = pc + 2;
+                mv.to = pc + 2 + (int8_t)n;
+                mv.t = y == 2 ? 8 : 7;
+                mv.t_to = mv.t + 5;
+            }
+            break;
+        case 1:
+            if (y & 1) {                                /* ADD HL,rr */
+                add_hl(s, pc, y < 7 ? s->row[y - 1] : NULL, s->row[y]);
+                mv.t = 11;
+            } else {                                    /* LD rr,nn */
+                op16(s, pc, y < 6 ? s->row[y] : NULL, s->row[y + 1 - (y == 6)],
+                     0, NULL, nn);
+                mv.next = pc + 3;
+                mv.t = 10;
+            }
+            break;
+        case 3:                                        /* INC/DEC rr */
+            op16(s, pc, y < 6 ? s->row[y & 6] : NULL, s->row[(y & 6) + (y < 6)],
+                 y & 1 ? 0xFFFF : 1, NULL, 0);
+            mv.t = 6;
+            break;
+        case 4: case 5:                                 /* INC/DEC r */
+            inc_dec(s, pc, s->row[y], z == 5);
+            break;
+        case 6:                                         /* LD r,n */
+            load(s, pc, s->row[y], NULL, n);
+            mv.next = pc + 2;
+            mv.t = 7;
+            break;
+        default:
+            acc_op(s, pc, y);
+            break;
+        }
+        break;
+    case 1:                                             /* LD r,r' */
+        if (y != z) load(s, pc, s->row[y], s->row[z], 0);
+        break;
+    case 2:                                             /* ALU A,r */
+        alu(s, pc, y, s->row[z], 0);
+        break;
+    default:
+        if (op == 0xC3) {                               /* JP nn */
+            mv.next = nn;
+            mv.t = 10;
+        } else if (op == 0xEB) {                        /* EX DE,HL */
+            ex_de_hl(s, pc);
+        } else if (op == 0xF9) {                        /* LD SP,HL */
+            op16(s, pc, NULL, NULL, 0, s->row[4], 0);
+            mv.t = 6;
+        } else if (z == 2) {                            /* JP cc,nn */
+            mv.cond = s->row[ROW_F];
+            mv.bits = cc_flag[y >> 1], mv.want = y & 1;
+            mv.next = pc + 3;
+            mv.to = nn;
+            mv.t = mv.t_to = 10;
+        } else {                                        /* ALU A,n */
+            alu(s, pc, y, NULL, n);
+            mv.next = pc + 2;
+            mv.t = 7;
+        }
+        break;
+    }
+    group_commit(l, pc, &mv);
+    return 1;
+}
+
+/* ── Stepping ────────────────────────────────────────────────────── */
+
+/* Is a group this big worth a pass over every lane? */
+static int group_dense(const z80_lanes_soa_t *s) {
+    return s->at_min >= 2 && s->at_min * 8 >= s->width;
+}
+
+/* Run every lane k instructions, lanes at the lowest PC first. Lanes that
+   went different ways from a branch meet again where the ways join: the
+   ones behind catch up while the others wait, there or at the exit of a
+   loop. With few lanes at the lowest PC, all those behind the last big
+   group step alone in one pass over the lanes; if such passes keep
+   finding next to nothing to do, the lanes are scattered and all of
+   them step once. */
+static void lanes_pass(z80_lanes_t *l, unsigned k) {
+    z80_lanes_soa_t *s = l->soa;
+    long waste = 0;  /* Scanning done, in lanes, that stepping has not paid for */
+    for (unsigned i = 0; i < l->n; i++) {
+        lane_load(l, i);
+        s->left[i] = l->cpu[i].break_req ? 0 : k;
+    }
+    s->hot = -1;
+    lanes_scan(l, 1, 0);
+
+    while (s->at_min) {
+        uint16_t pc = s->pc_min;
+        unsigned long before = l->stats.scalar_insns;
+        if (group_dense(s)) {
+            if (!group_step(l, pc)) s->hot = lanes_scan(l, pc, pc);
+            continue;
+        }
+        if (waste > (long)s->width) {
+            s->hot = -1;
+            lanes_scan(l, 0, 0xFFFF);
+            waste = 0;
+            continue;
+        }
+        if (s->hot <= pc) s->hot = -1;
+        lanes_scan(l, pc, s->hot < 0 ? pc : (uint16_t)(s->hot - 1));
+        waste += s->width / 8 - (long)(l->stats.scalar_insns - before);
+        if (waste < 0) waste = 0;
+    }
+    for (unsigned i = 0; i < l->n; i++) lane_store(l, i);
+}
+
+int z80_lanes_init(z80_lanes_t *l, z80_t *cpu, unsigned n) {
+    memset(l, 0, sizeof(*l));
+    z80_lanes_soa_t *s = calloc(1, sizeof(*s));
+    if (!s) return -1;
+    s->width = n ? (n + VL - 1) / VL * VL : VL;
+    s->rows = calloc(s->width, 15 * sizeof(uint16_t));
+    if (!s->rows) {
+        free(s);
+        return -1;
+    }
+    uint16_t *p = s->rows;
+    for (int r = 0; r < 8; r++, p += s->width) s->row[r] = p;
+    s->sp = p;    p += s->width;
+    s->pc = p;    p += s->width;
+    s->left = p;  p += s->width;
+    s->t = p;     p += s->width;
+    s->r = p;     p += s->width;
+    s->ready = p;
+    /* Lanes past n are never live: PC 0, no instructions to go */
+    l->cpu = cpu;
+    l->n = n;
+    l->soa = s;
+    return 0;
+}
+
+void z80_lanes_free(z80_lanes_t *l) {
+    if (!l->soa) return;
+    free(l->soa->rows);
+    free(l->soa);
+    l->soa = NULL;
+}
+
+unsigned z80_lanes_run(z80_lanes_t *l, unsigned long insns) {
+    unsigned running = 0;
+    share_pages(l);
+    while (insns) {
+        unsigned k = insns < PASS_INSNS ? (unsigned)insns : PASS_INSNS;
+        lanes_pass(l, k);
+        insns -= k;
+    }
+    for (unsigned i = 0; i < l->n; i++) running += !l->cpu[i].break_req;
+    return running;
+}
@@ -0,0 +1,62 @@
+#ifndef Z80_LANES_H
+#define Z80_LANES_H
+
+#include "z80.h"
+
+/* ── Lockstep lanes ──────────────────────────────────────────────── */
+
+/* Many CPUs running the same code at once, for fuzzing one ROM with many
+   input streams. Each lane is an ordinary z80_t with its own RAM and
+   callbacks, usually all loaded from one snapshot. Lanes at the same PC
+   run as a group: their registers are kept as structure of arrays (every
+   lane's B, then every lane's C, ...) and one SIMD operation does an
+   instruction's register and flag work for a whole vector of lanes. That
+   covers the instructions that touch nothing but registers: loads
+   between them, the 8-bit ALU and INC/DEC, the A rotates, DAA, CPL, SCF
+   and CCF, 16-bit loads, INC/DEC and ADD HL, EX DE,HL, LD SP,HL and the
+   jumps. Anything else runs through z80_step() lane by lane, as does a
+   lane that is halted, has an EI pending or an interrupt to take.
+
+   Each step runs the lanes at the lowest PC. Lanes a conditional jump
+   sends different ways meet again where the ways join: the ones behind
+   catch up while the rest wait, as they wait at the exit of a loop that
+   others go round more often. A group step costs a pass over all the
+   lanes, so a group needs an eighth of them to be worth one.
+
+   Group steps need the code to be in memory shared by every lane: pages
+   whose page_read[] entry is the same pointer in all of them, as when
+   each maps one ROM image. Pages with traps or read watches, profiling
+   or tracing lanes and -DZ80_FLAT_MEMORY builds run everything through
+   z80_step(). */
+
+/* Counters since z80_lanes_init(). Instructions are counted per lane. */
+typedef struct {
+    unsigned long group_steps;   /* Instructions run as vector operations */
+    unsigned long group_insns;   /* Lane instructions those covered */
+    unsigned long scalar_insns;  /* Lane instructions run by z80_step() */
+} z80_lanes_stats_t;
+
+typedef struct z80_lanes_soa z80_lanes_soa_t;
+
+typedef struct {
+    z80_t   *cpu;                /* The lanes, cpu[0] to cpu[n - 1] */
+    unsigned n;
+    z80_lanes_stats_t stats;
+    z80_lanes_soa_t  *soa;       /* Private to z80_lanes.c */
+} z80_lanes_t;
+
+/* Run the n CPUs at cpu as lanes. Allocates; pair with z80_lanes_free().
+   Returns 0, or -1 if the allocation failed. */
+int  z80_lanes_init(z80_lanes_t *l, z80_t *cpu, unsigned n);
+void z80_lanes_free(z80_lanes_t *l);
+/* Run every lane insns instructions, or until it is stopped: a lane
+   with break_req set, as z80_break() from one of its callbacks leaves
+   it, runs no further until that is cleared (z80_load_state() does).
+   Each lane ends where as many z80_step() calls would have left it, but
+   lanes take turns in no particular order. The CPUs are up to date
+   again on return and may be changed freely between calls, but not from
+   callbacks during one: memory maps, traps and watches must stay put.
+   Returns the number of lanes that are not stopped. */
+unsigned z80_lanes_run(z80_lanes_t *l, unsigned long insns);
+
+#endif /* Z80_LANES_H */
@@ -1,4 +1,6 @@
 #include "z80.h"
+#include "z80_lanes.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +39,7 @@ static uint8_t test_mem[65536];
 static uint8_t io_ports[256];
 static uint8_t last_out_port;
 static uint8_t last_out_val;
+static z80_t  *break_on_out;  /* If set, test_out calls z80_break() on it */
 
 static uint8_t test_read(void *ctx, uint16_t addr) {
     (void)ctx;
@@ -58,20 +61,59 @@ static void test_out(void *ctx, uint16_t port, uint8_t val) {
     last_out_port = port & 0xFF;
     last_out_val = val;
     io_ports[port & 0xFF] = val;
+    if (break_on_out) z80_break(break_on_out);
 }
 
+#ifdef Z80_TEST_BLOCKS
+/* Block tier build: every test CPU runs its mapped code through the basic
+   block tier. Each setup releases the previous test's cache. The tests
+   poke test_mem between calls, behind the CPU's back, so each call first
+   says so as a host would. */
+static z80_t bb_last;
+
+static int bb_test_step(z80_t *cpu) {
+    z80_invalidate(cpu, 0x0000, 0x10000);
+    return z80_step(cpu);
+}
+
+static unsigned long bb_test_run(z80_t *cpu, unsigned long budget) {
+    z80_invalidate(cpu, 0x0000, 0x10000);
+    return z80_run(cpu, budget);
+}
+
+/* A test that frees its CPU has freed the cache setup_cpu() kept */
+static void bb_test_free(z80_t *cpu) {
+    if (cpu != &bb_last && cpu->dcache == bb_last.dcache)
+        bb_last.dcache = NULL;
+    z80_free(cpu);
+}
+
+#define z80_step bb_test_step
+#define z80_run  bb_test_run
+#define z80_free bb_test_free
+#endif
+
 static void setup_cpu(z80_t *cpu) {
     memset(test_mem, 0, sizeof(test_mem));
     memset(io_ports, 0, sizeof(io_ports));
+#ifdef Z80_TEST_BLOCKS
+    z80_free(&bb_last);
+    z80_init_ex(cpu, Z80_INIT_BLOCKS);
+    z80_map(cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    bb_last = *cpu;
+#else
     z80_init(cpu);
+#endif
     cpu->mem_read = test_read;
     cpu->mem_write = test_write;
+    cpu->mem = test_mem;  /* -DZ80_FLAT_MEMORY */
     cpu->io_in = test_in;
     cpu->io_out = test_out;
     cpu->A = 0; cpu->F = 0;
     cpu->SP = 0xFFFF;
     last_out_port = 0;
     last_out_val = 0;
+    break_on_out = NULL;
 }
 
 
@@ -802,6 +844,35 @@ static int test_exx(void) {
     return 1;
 }
 
+static int test_register_views(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.BC = 0x1234;
+    ASSERT_EQ(cpu.B, 0x12, "B is the high half of BC");
+    ASSERT_EQ(cpu.C, 0x34, "C is the low half of BC");
+    cpu.H = 0x56; cpu.L = 0x78;
+    ASSERT_EQ(cpu.HL, 0x5678, "HL from H and L");
+    cpu.A = 0x9A; cpu.F = 0xBC;
+    ASSERT_EQ(cpu.AF, 0x9ABC, "AF from A and F");
+    ASSERT_EQ(cpu.reg[Z80_REG_B], 0x12, "reg[] B");
+    ASSERT_EQ(cpu.reg[Z80_REG_L], 0x78, "reg[] L");
+    ASSERT_EQ(cpu.reg[Z80_REG_A], 0x9A, "reg[] A");
+    ASSERT_EQ(cpu.pair[1], cpu.DE, "pair[] DE");
+    cpu.IX = 0x0000;
+    test_mem[0] = 0xDD; test_mem[1] = 0x26; test_mem[2] = 0xAB; /* LD IXH,0xAB */
+    test_mem[3] = 0xDD; test_mem[4] = 0x2C;                     /* INC IXL */
+    z80_step(&cpu);
+    z80_step(&cpu);
+    ASSERT_EQ(cpu.IX, 0xAB01, "IX after IXH/IXL writes");
+    ASSERT_EQ(cpu.IXH, 0xAB, "IXH");
+    /* Registers, interrupt state, mem, t_states and the cache pointer
+       share the first cache line, and the page table follows it */
+    ASSERT(offsetof(z80_t, mem) + sizeof(cpu.mem) <= 64, "hot fields in 64 bytes");
+    ASSERT(offsetof(z80_t, dcache) + sizeof(cpu.dcache) <= 64, "hot fields in 64 bytes");
+    ASSERT(offsetof(z80_t, page_read) <= 64, "page table after the first line");
+    return 1;
+}
+
 static int test_ex_de_hl(void) {
     z80_t cpu;
     setup_cpu(&cpu);
@@ -1039,6 +1110,84 @@ static int test_ei_delay(void) {
     return 1;
 }
 
+static int test_int_line(void) {
+    /* A held INT waits out DI and the EI delay instead of being dropped */
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.SP = 0xFFFE;
+    cpu.IM = 1;
+    test_mem[0] = 0xF3;      /* DI  */
+    test_mem[1] = 0xFB;      /* EI  */
+    test_mem[2] = 0x00;      /* NOP */
+    test_mem[3] = 0x00;      /* NOP */
+    test_mem[0x38] = 0x00;   /* NOP */
+
+    z80_set_int(&cpu, 1, 0xFF);
+    z80_step(&cpu);          /* DI */
+    z80_step(&cpu);          /* EI */
+    z80_step(&cpu);          /* NOP in the EI shadow */
+    ASSERT_EQ(cpu.PC, 3, "held off until after the EI shadow");
+
+    int t = z80_step(&cpu);  /* Acknowledge, then the NOP at 0x38 */
+    ASSERT_EQ(cpu.PC, 0x39, "ran from the vector");
+    ASSERT_EQ(t, 13 + 4, "acknowledge plus NOP");
+    ASSERT_EQ(test_mem[0xFFFC], 3, "return address");
+    ASSERT_EQ(cpu.IFF1, 0, "IFF1 cleared");
+
+    /* Still held, but masked now; release it and nothing more happens */
+    z80_set_int(&cpu, 0, 0xFF);
+    cpu.IFF1 = 1;
+    z80_step(&cpu);
+    ASSERT_EQ(cpu.PC, 0x3A, "released");
+    return 1;
+}
+
+static int test_nmi_edge(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.SP = 0xFFFE;
+    test_mem[0x66] = 0xC9;   /* RET */
+
+    /* Taken once per rising edge, with interrupts disabled */
+    z80_set_nmi(&cpu, 1);
+    z80_set_nmi(&cpu, 1);
+    z80_step(&cpu);
+    ASSERT_EQ(cpu.PC, 0, "NMI taken and RET run");
+    ASSERT_EQ(cpu.t_states, 11 + 10, "acknowledge plus RET");
+    z80_step(&cpu);
+    ASSERT_EQ(cpu.PC, 1, "level alone does not retrigger");
+
+    z80_set_nmi(&cpu, 0);
+    z80_set_nmi(&cpu, 1);
+    z80_step(&cpu);
+    ASSERT_EQ(cpu.PC, 1, "second edge taken");
+    return 1;
+}
+
+static int test_int_line_wakes_run(void) {
+    /* z80_run() leaves HALT for a line asserted between calls */
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.SP = 0xFFFE;
+    cpu.IM = 1;
+    cpu.IFF1 = cpu.IFF2 = 1;
+    test_mem[0] = 0x76;      /* HALT */
+    test_mem[0x38] = 0xFB;   /* EI  */
+    test_mem[0x39] = 0xC9;   /* RET */
+
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "halted");
+    z80_set_int(&cpu, 1, 0xFF);
+    z80_run(&cpu, 17);
+    ASSERT_EQ(cpu.halted, 0, "woken");
+    ASSERT_EQ(cpu.PC, 0x39, "in the handler");
+    z80_set_int(&cpu, 0, 0xFF);
+    z80_run(&cpu, 14);       /* RET, HALT */
+    ASSERT_EQ(cpu.PC, 0, "returned to HALT");
+    ASSERT(cpu.halted, "halted again");
+    return 1;
+}
+
 static int test_in_out_n(void) {
     z80_t cpu;
     setup_cpu(&cpu);
@@ -1809,6 +1958,1323 @@ static int test_t_state_accumulator(void) {
     return 1;
 }
 
+/* ── Batched execution ───────────────────────────────────────────── */
+
+static int test_run_budget(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    /* Memory is all NOPs (4T each) */
+    unsigned long ran = z80_run(&cpu, 40);
+    ASSERT_EQ((unsigned)ran, 40, "ran");
+    ASSERT_EQ(cpu.PC, 10, "10 NOPs");
+    ASSERT_EQ((unsigned)cpu.t_states, 40, "t_states");
+
+    /* Budget not a multiple of 4: finishes the last instruction */
+    ran = z80_run(&cpu, 5);
+    ASSERT_EQ((unsigned)ran, 8, "overshoot");
+    ASSERT_EQ(cpu.PC, 12, "PC");
+    return 1;
+}
+
+static int test_run_halt_exit(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    test_mem[2] = 0x76; /* HALT after two NOPs */
+    unsigned long ran = z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "halted");
+    ASSERT_EQ((unsigned)ran, 12, "stopped at HALT");
+
+    /* Already halted: burns the budget 4T at a time */
+    ran = z80_run(&cpu, 100);
+    ASSERT_EQ((unsigned)ran, 100, "burned");
+    ASSERT_EQ(cpu.PC, 2, "PC at HALT");
+    return 1;
+}
+
+static int test_run_halt_skip(void) {
+    z80_t a, b;
+    setup_cpu(&a);
+    test_mem[0] = 0x76; /* HALT */
+    z80_step(&a);
+    a.R = 0xFE;
+    b = a;
+
+    /* One jump must land where stepping 4T at a time does, R included */
+    unsigned long ran = z80_run(&a, 1001);
+    for (int i = 0; i < 251; i++) z80_step(&b);
+    ASSERT_EQ((unsigned)ran, 1004, "rounded up to whole refresh cycles");
+    ASSERT_EQ(a.t_states, b.t_states, "T-states");
+    ASSERT_EQ(a.R, b.R, "R (bit 7 kept)");
+    ASSERT(a.halted, "still halted");
+    return 1;
+}
+
+static int test_run_break(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    /* NOP; OUT (0x10), A; NOP ... */
+    test_mem[1] = 0xD3; test_mem[2] = 0x10;
+    break_on_out = &cpu;
+    unsigned long ran = z80_run(&cpu, 1000);
+    ASSERT_EQ((unsigned)ran, 15, "NOP + OUT");
+    ASSERT_EQ(cpu.PC, 3, "after OUT");
+    ASSERT_EQ(cpu.break_req, 0, "break cleared");
+    return 1;
+}
+
+static int test_run_matches_step(void) {
+    z80_t a, b;
+    static uint8_t copy[65536];
+    /* Small loop: LD B,10 / DJNZ -2 / LD A,B / HALT */
+    setup_cpu(&a);
+    test_mem[0] = 0x06; test_mem[1] = 0x0A;
+    test_mem[2] = 0x10; test_mem[3] = 0xFE;
+    test_mem[4] = 0x78; test_mem[5] = 0x76;
+    memcpy(copy, test_mem, sizeof(copy));
+    while (!a.halted) z80_step(&a);
+
+    setup_cpu(&b);
+    memcpy(test_mem, copy, sizeof(copy));
+    z80_run(&b, 100000);
+    ASSERT_EQ((unsigned)b.t_states, (unsigned)a.t_states, "t_states");
+    ASSERT_EQ(b.PC, a.PC, "PC");
+    ASSERT_EQ(b.R, a.R, "R");
+    ASSERT_EQ(b.B, 0, "B");
+    return 1;
+}
+
+/* ── Page-table fast path ────────────────────────────────────────── */
+
+static int cb_reads, cb_writes;
+
+static uint8_t counting_read(void *ctx, uint16_t addr) {
+    cb_reads++;
+    return test_read(ctx, addr);
+}
+
+static void counting_write(void *ctx, uint16_t addr, uint8_t val) {
+    cb_writes++;
+    test_write(ctx, addr, val);
+}
+
+static int test_map_ram(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.mem_read = counting_read;
+    cpu.mem_write = counting_write;
+    cb_reads = cb_writes = 0;
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    cpu.H = 0x50; cpu.L = 0x00;
+    test_mem[0x5000] = 0x41;
+    /* LD A,(HL) / INC A / LD (0x6000),A */
+    test_mem[0] = 0x7E; test_mem[1] = 0x3C;
+    test_mem[2] = 0x32; test_mem[3] = 0x00; test_mem[4] = 0x60;
+    z80_step(&cpu); z80_step(&cpu); z80_step(&cpu);
+    ASSERT_EQ(test_mem[0x6000], 0x42, "stored");
+    ASSERT_EQ(cb_reads, 0, "no read callbacks");
+    ASSERT_EQ(cb_writes, 0, "no write callbacks");
+    return 1;
+}
+
+/* Flat memory builds have no ROM mapping or memory callbacks */
+#ifndef Z80_FLAT_MEMORY
+static int test_map_rom(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.mem_read = counting_read;
+    cpu.mem_write = counting_write;
+    cb_reads = cb_writes = 0;
+    z80_map(&cpu, 0x0000, 0x2000, test_mem, Z80_MAP_ROM);
+    z80_map(&cpu, 0x2000, 0xE000, test_mem + 0x2000, Z80_MAP_RAM);
+    cpu.A = 0x99;
+    test_mem[0x1000] = 0x11;
+    /* LD (0x1000),A -- ROM: dropped without a callback */
+    test_mem[0] = 0x32; test_mem[1] = 0x00; test_mem[2] = 0x10;
+    /* LD (0x2000),A -- RAM */
+    test_mem[3] = 0x32; test_mem[4] = 0x00; test_mem[5] = 0x20;
+    z80_step(&cpu); z80_step(&cpu);
+    ASSERT_EQ(test_mem[0x1000], 0x11, "ROM unchanged");
+    ASSERT_EQ(test_mem[0x2000], 0x99, "RAM written");
+    ASSERT_EQ(cb_writes, 0, "no write callbacks");
+    ASSERT_EQ(cb_reads, 0, "no read callbacks");
+    return 1;
+}
+
+static int test_map_fallback(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.mem_read = counting_read;
+    cpu.mem_write = counting_write;
+    cb_reads = cb_writes = 0;
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    z80_map(&cpu, 0x8000, 0x0100, NULL, 0); /* MMIO page at 0x80xx */
+    cpu.A = 0x5A;
+    /* LD (0x8010),A / LD A,(0x8011) / LD (0x8110),A */
+    test_mem[0] = 0x32; test_mem[1] = 0x10; test_mem[2] = 0x80;
+    test_mem[3] = 0x3A; test_mem[4] = 0x11; test_mem[5] = 0x80;
+    test_mem[6] = 0x32; test_mem[7] = 0x10; test_mem[8] = 0x81;
+    test_mem[0x8011] = 0x77;
+    z80_step(&cpu); z80_step(&cpu); z80_step(&cpu);
+    ASSERT_EQ(cb_writes, 1, "one MMIO write");
+    ASSERT_EQ(cb_reads, 1, "one MMIO read");
+    ASSERT_EQ(test_mem[0x8010], 0x5A, "MMIO write landed");
+    ASSERT_EQ(test_mem[0x8110], 0x77, "direct write");
+    return 1;
+}
+#endif
+
+/* ── Block instruction fast path ─────────────────────────────────── */
+
+static uint8_t saved_mem[65536], run_mem[65536];
+
+/* Replay of z80_run() with single steps, for comparison */
+static void step_budget(z80_t *cpu, unsigned long budget) {
+    unsigned long end = cpu->t_states + budget;
+    while (cpu->t_states < end) {
+        z80_step(cpu);
+        if (cpu->halted) break;
+    }
+}
+
+/* Run the program in test_mem through z80_run() and through single steps
+   from the same state; both must end identical */
+static int run_matches_steps(z80_t *cpu, unsigned long budget) {
+    z80_t ref = *cpu;
+#ifdef Z80_TEST_BLOCKS
+    /* A copy would share cpu's cache; step on the plain interpreter */
+    ref.dcache = NULL;
+    memset(ref.page_flags, 0, sizeof(ref.page_flags));
+    z80_map(&ref, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+#endif
+    memcpy(saved_mem, test_mem, sizeof(test_mem));
+    z80_run(cpu, budget);
+    memcpy(run_mem, test_mem, sizeof(test_mem));
+    memcpy(test_mem, saved_mem, sizeof(test_mem));
+    step_budget(&ref, budget);
+    return cpu->PC == ref.PC && cpu->t_states == ref.t_states &&
+           cpu->R == ref.R && cpu->F == ref.F && cpu->A == ref.A &&
+           cpu->B == ref.B && cpu->C == ref.C && cpu->D == ref.D &&
+           cpu->E == ref.E && cpu->H == ref.H && cpu->L == ref.L &&
+           memcmp(run_mem, test_mem, sizeof(test_mem)) == 0;
+}
+
+static int test_run_ldir_bulk(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    for (int i = 0; i < 0x1234; i++) test_mem[0x4000 + i] = (uint8_t)(i * 7);
+    test_mem[0] = 0xED; test_mem[1] = 0xB0;  /* LDIR */
+    test_mem[2] = 0x76;                      /* HALT */
+    cpu.H = 0x40; cpu.L = 0x00;
+    cpu.D = 0x80; cpu.E = 0x00;
+    cpu.B = 0x12; cpu.C = 0x34;
+    z80_run(&cpu, 1000000);
+    ASSERT(memcmp(test_mem + 0x8000, test_mem + 0x4000, 0x1234) == 0, "copied");
+    ASSERT_EQ(cpu.H, 0x52, "H"); ASSERT_EQ(cpu.L, 0x34, "L");
+    ASSERT_EQ(cpu.D, 0x92, "D"); ASSERT_EQ(cpu.E, 0x34, "E");
+    ASSERT_EQ(cpu.B, 0x00, "B"); ASSERT_EQ(cpu.C, 0x00, "C");
+    ASSERT(!(cpu.F & Z80_PF), "PV clear");
+    ASSERT(cpu.halted, "reached HALT");
+    ASSERT_EQ(cpu.t_states, 21ul * 0x1233 + 16 + 4, "T-states");
+    ASSERT_EQ(cpu.R, (0x1234 + 1) & 0x7F, "R");
+    return 1;
+}
+
+static int test_run_ldir_fill(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    test_mem[0] = 0xED; test_mem[1] = 0xB0;  /* LDIR */
+    test_mem[2] = 0x76;
+    test_mem[0x4000] = 0xE5;
+    cpu.H = 0x40; cpu.L = 0x00;
+    cpu.D = 0x40; cpu.E = 0x01;
+    cpu.B = 0x0F; cpu.C = 0xFF;
+    z80_run(&cpu, 1000000);
+    for (int i = 0; i < 0x1000; i++)
+        ASSERT_EQ(test_mem[0x4000 + i], 0xE5, "filled");
+    ASSERT_EQ(test_mem[0x5000], 0x00, "stops at end");
+    return 1;
+}
+
+static int test_run_lddr_budget(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    for (int i = 0; i < 0x800; i++) test_mem[0x3000 + i] = (uint8_t)(i ^ 0x5A);
+    test_mem[0] = 0xED; test_mem[1] = 0xB8;  /* LDDR */
+    cpu.H = 0x37; cpu.L = 0xFF;
+    cpu.D = 0x38; cpu.E = 0x10;
+    cpu.B = 0x08; cpu.C = 0x00;
+    /* Stops partway with PC still on the LDDR, as single steps would */
+    ASSERT(run_matches_steps(&cpu, 1000), "first slice");
+    ASSERT_EQ(cpu.PC, 0x0000, "PC on LDDR");
+    ASSERT(run_matches_steps(&cpu, 12345), "second slice");
+    return 1;
+}
+
+static int test_run_cpir_bulk(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    memset(test_mem + 0x2000, 0x11, 0x3000);
+    test_mem[0x4321] = 0x42;
+    test_mem[0] = 0xED; test_mem[1] = 0xB1;  /* CPIR */
+    test_mem[2] = 0x76;
+    cpu.A = 0x42;
+    cpu.H = 0x20; cpu.L = 0x00;
+    cpu.B = 0x30; cpu.C = 0x00;
+    z80_run(&cpu, 1000000);
+    ASSERT_EQ(cpu.H, 0x43, "H"); ASSERT_EQ(cpu.L, 0x22, "L");
+    ASSERT_EQ(cpu.B, 0x0C, "B"); ASSERT_EQ(cpu.C, 0xDE, "C");
+    ASSERT(cpu.F & Z80_ZF, "Z set (found)");
+    ASSERT(cpu.F & Z80_PF, "PV set (BC != 0)");
+    ASSERT_EQ(cpu.t_states, 21ul * 0x2321 + 16 + 4, "T-states");
+    return 1;
+}
+
+static int test_run_ldir_overwrites_itself(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    /* LDIR at 0x0100 copies zeroes (NOPs) up over its own opcode */
+    test_mem[0x0100] = 0xED; test_mem[0x0101] = 0xB0;
+    test_mem[0x0102] = 0x76;
+    cpu.PC = 0x0100;
+    cpu.H = 0x60; cpu.L = 0x00;
+    cpu.D = 0x00; cpu.E = 0x80;
+    cpu.B = 0x01; cpu.C = 0x00;
+    ASSERT(run_matches_steps(&cpu, 100000), "matches single steps");
+    ASSERT_EQ(test_mem[0x0100], 0x00, "opcode overwritten");
+    return 1;
+}
+
+static int test_run_otir_break(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    test_mem[0] = 0xED; test_mem[1] = 0xB3;  /* OTIR */
+    test_mem[0x5000] = 0x31; test_mem[0x5001] = 0x32;
+    cpu.H = 0x50; cpu.L = 0x00;
+    cpu.B = 0x10; cpu.C = 0x07;
+    break_on_out = &cpu;
+    z80_run(&cpu, 100000);
+    ASSERT_EQ(last_out_val, 0x31, "one byte out");
+    ASSERT_EQ(cpu.B, 0x0F, "B");
+    ASSERT_EQ(cpu.PC, 0x0000, "PC on OTIR");
+    ASSERT_EQ(cpu.t_states, 21, "T-states");
+    return 1;
+}
+
+/* ── Decode cache ────────────────────────────────────────────────── */
+
+static void setup_dcache_cpu(z80_t *cpu, int flags) {
+    setup_cpu(cpu);
+    z80_init_ex(cpu, flags);
+    cpu->mem_read = test_read;
+    cpu->mem_write = test_write;
+    cpu->mem = test_mem;
+    cpu->io_in = test_in;
+    cpu->io_out = test_out;
+    cpu->A = 0; cpu->F = 0;
+    cpu->SP = 0xFFFF;
+    z80_map(cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+}
+
+static void load_prefixed_loop(void) {
+    static const uint8_t prog[] = {
+        0x06, 0x02,              /* LD B,2       */
+        0xDD, 0xCB, 0x05, 0x06,  /* RLC (IX+5)   */
+        0xDD, 0x7E, 0x05,        /* LD A,(IX+5)  */
+        0xFD, 0x23,              /* INC IY       */
+        0xED, 0x44,              /* NEG          */
+        0x10, 0xF3,              /* DJNZ 0002h   */
+        0x76,                    /* HALT         */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+    test_mem[0x4005] = 0x80;
+}
+
+static int test_dcache_matches_uncached(void) {
+    z80_t ref, cpu;
+    setup_cpu(&ref);
+    z80_map(&ref, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    load_prefixed_loop();
+    ref.IX = 0x4000;
+    z80_run(&ref, 1000);
+
+    setup_dcache_cpu(&cpu, Z80_INIT_DCACHE);
+    load_prefixed_loop();
+    cpu.IX = 0x4000;
+    z80_run(&cpu, 1000);
+
+    /* The switch reference decoder has no cache; stats report -1 */
+    z80_dcache_stats_t st;
+    if (z80_dcache_stats(&cpu, &st) == 0)
+        ASSERT(st.hits > 0, "second pass hits");
+    ASSERT_EQ(test_mem[0x4005], 0x02, "RLC twice");
+    ASSERT_EQ(cpu.A, ref.A, "A");
+    ASSERT_EQ(cpu.IY, ref.IY, "IY");
+    ASSERT_EQ(cpu.PC, ref.PC, "PC");
+    ASSERT_EQ(cpu.R, ref.R, "R");
+    ASSERT_EQ(cpu.t_states, ref.t_states, "T-states");
+    z80_free(&cpu);
+    return 1;
+}
+
+static int test_dcache_self_modifying(void) {
+    z80_t cpu;
+    setup_dcache_cpu(&cpu, Z80_INIT_DCACHE);
+    static const uint8_t prog[] = {
+        0xCD, 0x10, 0x00,        /* CALL 0010h   */
+        0x3E, 0x0C,              /* LD A,0Ch     (INC C) */
+        0x32, 0x10, 0x00,        /* LD (0010h),A */
+        0xCD, 0x10, 0x00,        /* CALL 0010h   */
+        0x76,                    /* HALT         */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+    test_mem[0x10] = 0x04;       /* INC B */
+    test_mem[0x11] = 0xC9;       /* RET   */
+    z80_run(&cpu, 1000);
+    ASSERT_EQ(cpu.B, 1, "first call ran INC B");
+    ASSERT_EQ(cpu.C, 1, "second call ran the new INC C");
+    z80_dcache_stats_t st;
+    if (z80_dcache_stats(&cpu, &st) == 0)
+        ASSERT(st.invalidations >= 1, "page invalidated");
+    z80_free(&cpu);
+    ASSERT(!(cpu.page_flags[0] & Z80_PAGE_CODE), "flags cleared by z80_free");
+    return 1;
+}
+
+/* Operands come from the cache too, so patching one must drop it, even
+   on a page holding no other code */
+static int test_dcache_operand_patch(void) {
+    z80_t cpu;
+    setup_dcache_cpu(&cpu, Z80_INIT_DCACHE);
+    static const uint8_t prog[] = {
+        0x06, 0x02,              /* 0000  LD B,2          */
+        0xC3, 0xFE, 0x00,        /* 0002  JP 00FEh        */
+    };
+    static const uint8_t body[] = {
+        0x0C,                    /* 0010  INC C           */
+        0x3E, 0x01,              /* 0011  LD A,01h        */
+        0x32, 0x00, 0x01,        /* 0013  LD (0100h),A    */
+        0x10, 0xEA,              /* 0016  DJNZ 0002h      */
+        0x76,                    /* 0018  HALT            */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+    memcpy(test_mem + 0x10, body, sizeof(body));
+    test_mem[0xFE] = 0xC3;       /* 00FE  JP 0010h, high byte in page 1 */
+    test_mem[0xFF] = 0x10;
+    test_mem[0x100] = 0x00;
+    test_mem[0x110] = 0x14;      /* 0110  INC D           */
+    test_mem[0x111] = 0x76;      /* 0111  HALT            */
+    z80_run(&cpu, 1000);
+    ASSERT_EQ(cpu.C, 1, "one pass before the patch");
+    ASSERT_EQ(cpu.D, 1, "patched JP went to 0110h");
+    z80_free(&cpu);
+    return 1;
+}
+
+static int test_dcache_host_invalidate(void) {
+    z80_t cpu;
+    setup_dcache_cpu(&cpu, Z80_INIT_DCACHE);
+    test_mem[0] = 0x04;         /* INC B */
+    test_mem[1] = 0x18;         /* JR 0000h */
+    test_mem[2] = 0xFD;
+    z80_step(&cpu);
+    z80_step(&cpu);
+    test_mem[0] = 0x0C;         /* Host patches it to INC C */
+    z80_invalidate(&cpu, 0x0000, 1);
+    z80_step(&cpu);
+    ASSERT_EQ(cpu.B, 1, "B");
+    ASSERT_EQ(cpu.C, 1, "patched instruction ran");
+    z80_free(&cpu);
+    return 1;
+}
+
+/* ── Basic block tier ────────────────────────────────────────────── */
+
+static void load_patching_loop(void) {
+    static const uint8_t prog[] = {
+        0x06, 0x40,              /* LD B,40h       */
+        0x78,                    /* LD A,B         */
+        0xFE, 0x20,              /* CP 20h         */
+        0x20, 0x05,              /* JR NZ,000Ch    */
+        0x3E, 0x14,              /* LD A,14h       (INC D) */
+        0x32, 0x0C, 0x00,        /* LD (000Ch),A   */
+        0x0C,                    /* INC C          */
+        0x10, 0xF3,              /* DJNZ 0002h     */
+        0x76,                    /* HALT           */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+}
+
+static int test_blocks_matches_uncached(void) {
+    z80_t ref, cpu;
+    setup_cpu(&ref);
+    z80_map(&ref, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    load_prefixed_loop();
+    test_mem[1] = 0x40;          /* More passes, so the loop gets hot */
+    ref.IX = 0x4000;
+    z80_run(&ref, 100000);
+
+    setup_dcache_cpu(&cpu, Z80_INIT_BLOCKS);
+    load_prefixed_loop();
+    test_mem[1] = 0x40;
+    cpu.IX = 0x4000;
+    z80_run(&cpu, 100000);
+
+    z80_dcache_stats_t st;
+    if (z80_dcache_stats(&cpu, &st) == 0) {
+        ASSERT(st.blocks > 0, "loop made a block");
+        ASSERT(st.block_insns > 0, "ran from blocks");
+    }
+    ASSERT_EQ(cpu.A, ref.A, "A");
+    ASSERT_EQ(cpu.IY, ref.IY, "IY");
+    ASSERT_EQ(cpu.PC, ref.PC, "PC");
+    ASSERT_EQ(cpu.R, ref.R, "R");
+    ASSERT_EQ(cpu.t_states, ref.t_states, "T-states");
+    z80_free(&cpu);
+    return 1;
+}
+
+static int test_blocks_patches_own_block(void) {
+    z80_t ref, cpu;
+    setup_cpu(&ref);
+    load_patching_loop();
+    z80_run(&ref, 100000);
+
+    /* Halfway through, the loop turns its own INC C into INC D */
+    setup_dcache_cpu(&cpu, Z80_INIT_BLOCKS);
+    load_patching_loop();
+    z80_run(&cpu, 100000);
+    ASSERT_EQ(cpu.C, 0x20, "INC C before the patch");
+    ASSERT_EQ(cpu.D, 0x20, "INC D after it");
+    ASSERT(cpu.halted, "reached HALT");
+    ASSERT_EQ(cpu.R, ref.R, "R");
+    ASSERT_EQ(cpu.t_states, ref.t_states, "T-states");
+    z80_free(&cpu);
+    return 1;
+}
+
+static int test_blocks_break_from_io(void) {
+    z80_t cpu;
+    setup_dcache_cpu(&cpu, Z80_INIT_BLOCKS);
+    test_mem[0] = 0xD3; test_mem[1] = 0x10;  /* OUT (10h),A */
+    test_mem[2] = 0x3C;                      /* INC A       */
+    test_mem[3] = 0x18; test_mem[4] = 0xFB;  /* JR 0000h    */
+    break_on_out = &cpu;
+    for (int i = 0; i < 64; i++) {
+        z80_run(&cpu, 1000);
+        ASSERT_EQ(cpu.PC, 0x0002, "stopped right after OUT");
+        ASSERT_EQ(last_out_val, i, "one OUT per run");
+    }
+    ASSERT_EQ(cpu.t_states, 11ul + 63 * (4 + 12 + 11), "T-states");
+    z80_free(&cpu);
+    return 1;
+}
+
+/* ── PC traps ────────────────────────────────────────────────────── */
+
+static int trap_hits;
+
+/* Stands in for a subroutine: counts the call and returns from it */
+static int trap_ret(z80_t *cpu, uint16_t addr) {
+    (void)addr;
+    trap_hits++;
+    cpu->PC = test_mem[cpu->SP] | (test_mem[(uint16_t)(cpu->SP + 1)] << 8);
+    cpu->SP += 2;
+    cpu->t_states += 10;
+    return 1;
+}
+
+/* Only watches: the instruction runs as usual */
+static int trap_count(z80_t *cpu, uint16_t addr) {
+    (void)cpu; (void)addr;
+    trap_hits++;
+    return 0;
+}
+
+static int test_trap_call(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.SP = 0xFFFE;
+    cpu.mem_read = counting_read;
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    test_mem[0] = 0x3A; test_mem[1] = 0x40; test_mem[2] = 0x12; /* LD A,(1240h) */
+    test_mem[3] = 0xCD; test_mem[4] = 0x34; test_mem[5] = 0x12; /* CALL 1234h   */
+    test_mem[6] = 0x76;                                         /* HALT         */
+    test_mem[0x1240] = 0x5A;
+    test_mem[0x1234] = 0x76; /* Never reached: the trap returns */
+
+    trap_hits = 0;
+    cb_reads = 0;
+    ASSERT_EQ(z80_set_trap(&cpu, 0x1234, trap_ret), 0, "set");
+    unsigned long ran = z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "halted");
+    ASSERT_EQ(cpu.PC, 6, "back after the CALL");
+    ASSERT_EQ(trap_hits, 1, "trap ran once");
+    ASSERT_EQ((unsigned)ran, 13 + 17 + 10 + 4, "trap's T-states counted");
+    ASSERT_EQ(cpu.A, 0x5A, "data read from the trap page");
+    ASSERT_EQ(cb_reads, 0, "and still from host memory");
+
+    ASSERT_EQ(z80_set_trap(&cpu, 0x1234, NULL), 0, "removed");
+    ASSERT(cpu.page_read[0x12] != NULL, "fast path back");
+    ASSERT(cpu.traps == NULL, "nothing left allocated");
+    return 1;
+}
+
+static int test_trap_continue(void) {
+    /* A trap that returns 0 sees each arrival and the code runs on */
+    z80_t cpu;
+    setup_cpu(&cpu);
+    test_mem[0] = 0x06; test_mem[1] = 0x03; /* LD B,3       */
+    test_mem[2] = 0x00;                     /* NOP          */
+    test_mem[3] = 0x10; test_mem[4] = 0xFD; /* DJNZ 0002h   */
+    test_mem[5] = 0x76;                     /* HALT         */
+
+    z80_run(&cpu, 1000);
+    unsigned long untrapped = cpu.t_states;
+
+    trap_hits = 0;
+    z80_set_trap(&cpu, 0x0002, trap_count);
+    cpu.PC = 0;
+    cpu.halted = 0;
+    cpu.t_states = 0;
+    z80_run(&cpu, 1000);
+    ASSERT_EQ(trap_hits, 3, "hit every time round");
+    ASSERT_EQ(cpu.t_states, untrapped, "same timing");
+    ASSERT_EQ(cpu.B, 0, "loop ran");
+    z80_set_trap(&cpu, 0x0002, NULL);
+    return 1;
+}
+
+static int test_trap_cached_code(void) {
+    /* Setting a trap in code the cache and block tier already hold */
+    z80_t cpu;
+    setup_dcache_cpu(&cpu, Z80_INIT_BLOCKS);
+    cpu.IX = 0x4000;
+    load_prefixed_loop();
+    for (int i = 0; i < 40; i++) {
+        cpu.PC = 0;
+        cpu.halted = 0;
+        z80_run(&cpu, 1000);
+    }
+
+    trap_hits = 0;
+    z80_set_trap(&cpu, 0x0009, trap_count); /* INC IY, mid-loop */
+    cpu.PC = 0;
+    cpu.halted = 0;
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "loop finished");
+    ASSERT_EQ(trap_hits, 2, "trap seen on both iterations");
+    z80_free(&cpu);
+    return 1;
+}
+
+/* ── Watches ─────────────────────────────────────────────────────── */
+
+#ifndef Z80_FLAT_MEMORY
+static int watch_hits;
+static uint16_t watch_addr;
+static uint8_t watch_val;
+static int watch_kind;
+
+static void watch_note(z80_t *cpu, uint16_t addr, uint8_t val, int kind) {
+    (void)cpu;
+    watch_hits++;
+    watch_addr = addr;
+    watch_val = val;
+    watch_kind = kind;
+}
+
+static void watch_stop(z80_t *cpu, uint16_t addr, uint8_t val, int kind) {
+    watch_note(cpu, addr, val, kind);
+    z80_break(cpu);
+}
+
+static int test_watch_read(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.mem_read = counting_read;
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    test_mem[0] = 0x3A; test_mem[1] = 0x40; test_mem[2] = 0x12; /* LD A,(1240h) */
+    test_mem[3] = 0x3A; test_mem[4] = 0x41; test_mem[5] = 0x12; /* LD A,(1241h) */
+    test_mem[6] = 0x32; test_mem[7] = 0x40; test_mem[8] = 0x12; /* LD (1240h),A */
+    test_mem[9] = 0x76;                                         /* HALT         */
+    test_mem[0x1240] = 0x5A;
+    test_mem[0x1241] = 0xA5;
+
+    watch_hits = 0;
+    cb_reads = 0;
+    ASSERT_EQ(z80_set_watch(&cpu, 0x1240, 1, Z80_WATCH_READ, watch_note), 0,
+              "set");
+    ASSERT(cpu.page_read[0x12] == NULL, "page off the fast path");
+    ASSERT(cpu.page_read[0x13] != NULL, "its neighbour still on it");
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "halted");
+    ASSERT_EQ(watch_hits, 1, "one read of the watched byte");
+    ASSERT_EQ(watch_addr, 0x1240, "address");
+    ASSERT_EQ(watch_val, 0x5A, "value read");
+    ASSERT_EQ(watch_kind, Z80_WATCH_READ, "kind");
+    ASSERT_EQ(cpu.A, 0xA5, "unwatched byte read as usual");
+    ASSERT_EQ(test_mem[0x1240], 0xA5, "and the write went in");
+    ASSERT_EQ(cb_reads, 0, "both from host memory");
+
+    ASSERT_EQ(z80_set_watch(&cpu, 0x1240, 1, Z80_WATCH_READ, NULL), 0,
+              "removed");
+    ASSERT(cpu.page_read[0x12] != NULL, "fast path back");
+    ASSERT(cpu.traps == NULL, "nothing left allocated");
+    return 1;
+}
+
+static int test_watch_write(void) {
+    /* Writes into a watched range, each seen once with the new byte */
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.H = 0x40; cpu.L = 0xFF;
+    test_mem[0] = 0x36; test_mem[1] = 0x07; /* LD (HL),7     */
+    test_mem[2] = 0x34;                     /* INC (HL)      */
+    test_mem[3] = 0x23;                     /* INC HL        */
+    test_mem[4] = 0x36; test_mem[5] = 0x09; /* LD (HL),9     */
+    test_mem[6] = 0x7E;                     /* LD A,(HL)     */
+    test_mem[7] = 0x76;                     /* HALT          */
+
+    watch_hits = 0;
+    /* Straddles two pages, traps and all */
+    z80_set_trap(&cpu, 0x4100, trap_count);
+    ASSERT_EQ(z80_set_watch(&cpu, 0x40FF, 2, Z80_WATCH_WRITE, watch_note), 0,
+              "set");
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "halted");
+    ASSERT_EQ(watch_hits, 3, "every write, no reads");
+    ASSERT_EQ(watch_addr, 0x4100, "last address");
+    ASSERT_EQ(watch_val, 0x09, "last value");
+    ASSERT_EQ(watch_kind, Z80_WATCH_WRITE, "kind");
+    ASSERT_EQ(test_mem[0x40FF], 0x08, "writes went in");
+    ASSERT_EQ(cpu.A, 0x09, "read back");
+
+    z80_set_watch(&cpu, 0x40FF, 2, Z80_WATCH_WRITE, NULL);
+    ASSERT(cpu.page_flags[0x41] & Z80_PAGE_TRAP, "trap kept");
+    ASSERT(z80_get_trap(&cpu, 0x4100) == trap_count, "with its fn");
+    z80_set_trap(&cpu, 0x4100, NULL);
+    ASSERT(cpu.traps == NULL, "nothing left allocated");
+    return 1;
+}
+
+static int test_watch_break(void) {
+    /* A watch that stops the run as the instruction finishes */
+    z80_t cpu;
+    setup_cpu(&cpu);
+    test_mem[0] = 0x3E; test_mem[1] = 0x01;                     /* LD A,1       */
+    test_mem[2] = 0x32; test_mem[3] = 0x00; test_mem[4] = 0x30; /* LD (3000h),A */
+    test_mem[5] = 0x3E; test_mem[6] = 0x02;                     /* LD A,2       */
+    test_mem[7] = 0x76;                                         /* HALT         */
+
+    watch_hits = 0;
+    z80_set_watch(&cpu, 0x3000, 0x100, Z80_WATCH_READ | Z80_WATCH_WRITE,
+                  watch_stop);
+    z80_run(&cpu, 1000);
+    ASSERT_EQ(watch_hits, 1, "stopped at the first hit");
+    ASSERT_EQ(cpu.PC, 5, "after the writing instruction");
+    ASSERT_EQ(cpu.A, 1, "before the next");
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "runs on");
+    z80_free(&cpu);
+    ASSERT(cpu.traps == NULL, "z80_free() drops watches");
+    return 1;
+}
+
+static int test_watch_cached_code(void) {
+    /* Code on a write-watched page still sees its own stores */
+    z80_t cpu;
+    setup_dcache_cpu(&cpu, Z80_INIT_BLOCKS);
+    test_mem[0] = 0x3E; test_mem[1] = 0x05; /* LD A,5        */
+    test_mem[2] = 0x3C;                     /* INC A         */
+    test_mem[3] = 0x77;                     /* LD (HL),A     */
+    test_mem[4] = 0x76;                     /* HALT          */
+    cpu.H = 0x10; cpu.L = 0x00;
+    for (int i = 0; i < 40; i++) {
+        cpu.PC = 0;
+        cpu.halted = 0;
+        z80_run(&cpu, 1000);
+    }
+
+    watch_hits = 0;
+    z80_set_watch(&cpu, 0x0002, 1, Z80_WATCH_WRITE, watch_note);
+    cpu.H = 0x00; cpu.L = 0x02;  /* INC A becomes LD B,77h */
+    cpu.PC = 0;
+    cpu.halted = 0;
+    z80_run(&cpu, 1000);
+    ASSERT_EQ(watch_hits, 1, "patch seen");
+    ASSERT_EQ(test_mem[2], 0x06, "patched");
+    cpu.PC = 0;
+    cpu.halted = 0;
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "halted");
+    ASSERT_EQ(cpu.A, 5, "new code ran");
+    ASSERT_EQ(cpu.B, 0x77, "all of it");
+    z80_free(&cpu);
+    return 1;
+}
+#endif
+
+/* ── Flags accessors ─────────────────────────────────────────────── */
+
+static z80_t *flags_cpu;
+static uint8_t f_at_out;
+
+/* Reads F mid-run, then hands the program a set carry */
+static void flags_out(void *ctx, uint16_t port, uint8_t val) {
+    (void)ctx; (void)port; (void)val;
+    f_at_out = z80_get_f(flags_cpu);
+    z80_set_f(flags_cpu, Z80_CF);
+}
+
+static int test_flags_from_callback(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    cpu.io_out = flags_out;
+    flags_cpu = &cpu;
+    test_mem[0x00] = 0x3E; test_mem[0x01] = 0x7F;  /* LD A,0x7F */
+    test_mem[0x02] = 0xC6; test_mem[0x03] = 0x01;  /* ADD A,1 */
+    test_mem[0x04] = 0xD3; test_mem[0x05] = 0x00;  /* OUT (0),A */
+    test_mem[0x06] = 0x3E; test_mem[0x07] = 0x00;  /* LD A,0 */
+    test_mem[0x08] = 0xCE; test_mem[0x09] = 0x00;  /* ADC A,0 */
+    test_mem[0x0A] = 0xFE; test_mem[0x0B] = 0x28;  /* CP 0x28 */
+    test_mem[0x0C] = 0x76;                         /* HALT */
+    z80_run(&cpu, 1000);
+    ASSERT(cpu.halted, "ran to HALT in one call");
+    ASSERT_EQ(f_at_out, Z80_SF | Z80_HF | Z80_PF, "ADD flags seen by the callback");
+    ASSERT_EQ(cpu.A, 0x01, "ADC used the carry the callback set");
+    /* CP takes F5 and F3 from the operand */
+    ASSERT_EQ(cpu.F, Z80_SF | Z80_F5 | Z80_HF | Z80_F3 | Z80_NF | Z80_CF,
+              "F exact after z80_run");
+    ASSERT_EQ(z80_get_f(&cpu), cpu.F, "accessor agrees");
+    z80_free(&cpu);
+    return 1;
+}
+
+/* ── State save/restore ──────────────────────────────────────────── */
+
+static uint8_t state_mem[65536];
+
+/* A CPU loaded from a saved state, with the memory of that moment, runs
+   on exactly as the original did */
+static int test_state_round_trip(void) {
+    z80_t cpu;
+    z80_state_t st, ref, got;
+    setup_cpu(&cpu);
+    static const uint8_t prog[] = {
+        0x31, 0x00, 0xF0,  /* LD SP,0xF000 */
+        0x21, 0x00, 0x80,  /* LD HL,0x8000 */
+        0x06, 0x00,        /* LD B,0       */
+        0x34,              /* INC (HL)     */
+        0x86,              /* ADD A,(HL)   */
+        0x08,              /* EX AF,AF'    */
+        0x23,              /* INC HL       */
+        0x10, 0xFA,        /* DJNZ -6      */
+        0x18, 0xF0,        /* JR 0x0000    */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+    test_mem[0x66] = 0xED; test_mem[0x67] = 0x45;  /* RETN */
+    z80_run(&cpu, 300);
+    z80_set_nmi(&cpu, 1);  /* Latched, taken after the restore */
+    z80_save_state(&cpu, &st);
+    memcpy(state_mem, test_mem, sizeof(test_mem));
+    z80_run(&cpu, 3000);
+    z80_save_state(&cpu, &ref);
+    memcpy(saved_mem, test_mem, sizeof(test_mem));
+
+    /* A fresh CPU picks up where the first left off */
+    z80_t fork;
+    setup_cpu(&fork);
+    memcpy(test_mem, state_mem, sizeof(test_mem));
+    z80_load_state(&fork, &st);
+    ASSERT_EQ(fork.irq, Z80_IRQ_NMI, "NMI still pending");
+    z80_run(&fork, 3000);
+    z80_save_state(&fork, &got);
+    ASSERT(memcmp(&got, &ref, sizeof(ref)) == 0, "same state");
+    ASSERT(memcmp(test_mem, saved_mem, sizeof(test_mem)) == 0, "same memory");
+    ASSERT_EQ(ref.irq, 0, "NMI taken");
+    z80_free(&fork);
+    return 1;
+}
+
+/* ── Profiler ────────────────────────────────────────────────────── */
+
+#ifdef Z80_PROFILE
+/* Two calls into a routine that calls a leaf: counts by PC and opcode,
+   and a call tree with each routine's own T-states */
+static int test_profile_counts(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    static const uint8_t prog[] = {
+        0x31, 0x00, 0xF0,  /* LD SP,0xF000 */
+        0xCD, 0x10, 0x00,  /* CALL 0x0010  */
+        0xCD, 0x10, 0x00,  /* CALL 0x0010  */
+        0x76,              /* HALT         */
+    };
+    static const uint8_t mid[] = {
+        0xCD, 0x20, 0x00,  /* CALL 0x0020  */
+        0xC9,              /* RET          */
+    };
+    static const uint8_t leaf[] = {
+        0x06, 0x03,              /* LD B,3          */
+        0x10, 0xFE,              /* DJNZ $          */
+        0xCB, 0x47,              /* BIT 0,A         */
+        0xDD, 0xCB, 0x01, 0x46,  /* BIT 0,(IX+1)    */
+        0xC9,                    /* RET             */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+    memcpy(test_mem + 0x10, mid, sizeof(mid));
+    memcpy(test_mem + 0x20, leaf, sizeof(leaf));
+    /* Opcodes are told from mapped pages only */
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    ASSERT_EQ(z80_profile_start(&cpu), 0, "started");
+    while (!cpu.halted) z80_step(&cpu);
+
+    const z80_profile_t *p = cpu.prof;
+    ASSERT_EQ(p->pc_count[0x0010], 2, "CALL 0x0020 twice");
+    ASSERT_EQ(p->pc_count[0x0022], 6, "DJNZ three times a call");
+    ASSERT_EQ(p->pc_tstates[0x0022], 2 * (13 + 13 + 8), "DJNZ T-states");
+    ASSERT_EQ(p->op_count[Z80_PROF_MAIN][0xCD], 4, "CALLs");
+    ASSERT_EQ(p->op_count[Z80_PROF_CB][0x47], 2, "BIT 0,A");
+    ASSERT_EQ(p->op_count[Z80_PROF_DDCB][0x46], 2, "BIT 0,(IX+d)");
+    ASSERT_EQ(p->op_tstates[Z80_PROF_DDCB][0x46], 2 * 20, "DDCB T-states");
+
+    ASSERT_EQ(p->depth, 0, "back at the top level");
+    ASSERT_EQ(p->nnodes, 3, "root, mid, leaf");
+    const z80_prof_node_t *mid_n = &p->node[p->node[0].child];
+    const z80_prof_node_t *leaf_n = &p->node[mid_n->child];
+    ASSERT_EQ(mid_n->addr, 0x0010, "mid entry");
+    ASSERT_EQ(mid_n->calls, 2, "mid called twice");
+    ASSERT_EQ(mid_n->tstates, 2 * (17 + 10), "mid's own T-states");
+    ASSERT_EQ(leaf_n->addr, 0x0020, "leaf entry");
+    ASSERT_EQ(leaf_n->tstates, 2 * (7 + 34 + 8 + 20 + 10), "leaf's own T-states");
+    ASSERT_EQ(p->node[0].tstates, 10 + 2 * 17 + 4, "top level");
+    z80_free(&cpu);
+
+    /* Through the callbacks the opcode is unknown: a PUSH there opens
+       no frame */
+    static const uint8_t push[] = {
+        0x31, 0x00, 0xF0,  /* LD SP,0xF000 */
+        0xC5,              /* PUSH BC      */
+        0xC1,              /* POP BC       */
+        0x76,              /* HALT         */
+    };
+    setup_cpu(&cpu);
+    memcpy(test_mem, push, sizeof(push));
+    ASSERT_EQ(z80_profile_start(&cpu), 0, "started");
+    while (!cpu.halted) z80_step(&cpu);
+    p = cpu.prof;
+    ASSERT_EQ(p->nnodes, 1, "root only");
+    ASSERT_EQ(p->depth, 0, "no frame");
+    z80_free(&cpu);
+    return 1;
+}
+#endif
+
+/* ── Instruction trace ───────────────────────────────────────────── */
+
+#ifdef Z80_TRACE
+/* Records between the PC triggers only, each taken before its
+   instruction runs; a full ring with no wait hook drops the rest */
+static int test_trace_triggers(void) {
+    z80_t cpu;
+    setup_cpu(&cpu);
+    static const uint8_t prog[] = {
+        0x3E, 0x01,  /* LD A,1  */
+        0x3C,        /* INC A   */
+        0x3C,        /* INC A   */
+        0x47,        /* LD B,A  */
+        0x76,        /* HALT    */
+    };
+    memcpy(test_mem, prog, sizeof(prog));
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+
+    z80_trace_t tr;
+    z80_trace_rec_t rec[8];
+    ASSERT_EQ(z80_trace_init(&tr, 5), 0, "ring allocated");
+    ASSERT_EQ(tr.size, 8, "rounded up");
+    tr.start_pc = 0x0002;
+    tr.stop_pc = 0x0004;
+    ASSERT_EQ(z80_set_trace(&cpu, &tr), 0, "attached");
+    while (!cpu.halted) z80_step(&cpu);
+    ASSERT_EQ(tr.state, Z80_TRACE_DONE, "stopped");
+    ASSERT_EQ(z80_trace_read(&tr, rec, 8), 2, "both INCs");
+    ASSERT_EQ(rec[0].pc, 0x0002, "first PC");
+    ASSERT_EQ(rec[0].af >> 8, 0x01, "A before the INC");
+    ASSERT_EQ(rec[0].t_states, 7, "after LD A,n");
+    ASSERT_EQ(rec[0].op[0], 0x3C, "opcode");
+    ASSERT_EQ(rec[0].op[2], 0x47, "following bytes");
+    ASSERT_EQ(rec[1].pc, 0x0003, "second PC");
+    ASSERT_EQ(rec[1].af >> 8, 0x02, "A after one INC");
+    ASSERT_EQ(rec[1].r, (rec[0].r + 1) & 0x7F, "R counts the fetch");
+    z80_trace_free(&tr);
+    z80_free(&cpu);
+
+    setup_cpu(&cpu);
+    memcpy(test_mem, prog, sizeof(prog));
+    z80_map(&cpu, 0x0000, 0x10000, test_mem, Z80_MAP_RAM);
+    ASSERT_EQ(z80_trace_init(&tr, 2), 0, "small ring");
+    z80_set_trace(&cpu, &tr);
+    while (!cpu.halted) z80_step(&cpu);
+    ASSERT_EQ(tr.dropped, 3, "overflow dropped");
+    ASSERT_EQ(z80_trace_read(&tr, rec, 8), 2, "ring kept the oldest");
+    ASSERT_EQ(rec[0].pc, 0x0000, "LD A,1");
+    ASSERT_EQ(rec[1].pc, 0x0002, "INC A");
+    z80_trace_free(&tr);
+    z80_free(&cpu);
+    return 1;
+}
+#endif
+
+/* ── Lockstep lanes ──────────────────────────────────────────────── */
+
+/* Each test runs n lanes against n reference CPUs stepped one by one.
+   Code is in one ROM image every CPU maps, each CPU has its own RAM
+   above it, and IN returns the next byte of the CPU's own random
+   stream, so lanes split on what they read. */
+
+#define LANES_ROM 0x1000
+
+static uint8_t lanes_rom[LANES_ROM];
+
+struct lane_io {
+    uint8_t *mem;      /* All 64K, the ROM copied in for flat builds */
+    uint32_t seed;     /* Input stream */
+    unsigned ins;      /* INs so far */
+    unsigned limit;    /* z80_break() at this many, 0 = never */
+    z80_t   *cpu;
+};
+
+static uint32_t xorshift(uint32_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static uint8_t lane_read(void *ctx, uint16_t addr) {
+    return ((struct lane_io *)ctx)->mem[addr];
+}
+
+static void lane_write(void *ctx, uint16_t addr, uint8_t val) {
+    if (addr >= LANES_ROM) ((struct lane_io *)ctx)->mem[addr] = val;
+}
+
+static uint8_t lane_in(void *ctx, uint16_t port) {
+    struct lane_io *io = ctx;
+    (void)port;
+    if (++io->ins == io->limit) z80_break(io->cpu);
+    return (uint8_t)xorshift(&io->seed);
+}
+
+static void lane_out(void *ctx, uint16_t port, uint8_t val) {
+    (void)ctx; (void)port; (void)val;
+}
+
+/* cpu[0..n-1] are the lanes and cpu[n..2n-1] their references, lane i
+   and cpu[n + i] alike down to the input stream. Returns 0 if out of
+   memory. */
+static int lanes_setup(z80_t *cpu, struct lane_io *io, unsigned n,
+                       uint32_t seed, int limit) {
+    for (unsigned k = 0; k < 2 * n; k++) {
+        unsigned i = k % n;
+        uint32_t regs = seed + i * 2654435761u;
+        z80_state_t st;
+        io[k].mem = calloc(1, 65536);
+        if (!io[k].mem) return 0;
+        memcpy(io[k].mem, lanes_rom, LANES_ROM);
+        io[k].seed = regs | 1;
+        io[k].ins = 0;
+        io[k].limit = limit && i % 3 == 0 ? 40 + i : 0;
+        io[k].cpu = &cpu[k];
+#ifdef Z80_TEST_BLOCKS
+        z80_init_ex(&cpu[k], Z80_INIT_BLOCKS);
+#else
+        z80_init(&cpu[k]);
+#endif
+        z80_map(&cpu[k], 0x0000, LANES_ROM, lanes_rom, Z80_MAP_ROM);
+        z80_map(&cpu[k], LANES_ROM, 0x10000 - LANES_ROM, io[k].mem + LANES_ROM,
+                Z80_MAP_RAM);
+        cpu[k].mem = io[k].mem;  /* -DZ80_FLAT_MEMORY */
+        cpu[k].mem_read = lane_read;
+        cpu[k].mem_write = lane_write;
+        cpu[k].io_in = lane_in;
+        cpu[k].io_out = lane_out;
+        cpu[k].ctx = &io[k];
+
+        /* The same snapshot but for the registers a fuzzer would seed */
+        memset(&st, 0, sizeof(st));
+        st.af = (uint16_t)xorshift(&regs);
+        st.bc = (uint16_t)xorshift(&regs);
+        st.de = (uint16_t)xorshift(&regs);
+        st.hl = (uint16_t)xorshift(&regs);
+        st.sp = 0xF000;
+        z80_load_state(&cpu[k], &st);
+    }
+    return 1;
+}
+
+static void lanes_teardown(z80_t *cpu, struct lane_io *io, unsigned n) {
+    for (unsigned k = 0; k < 2 * n; k++) {
+        z80_free(&cpu[k]);
+        free(io[k].mem);
+    }
+}
+
+/* Every lane where its reference is, registers, T-states, R and all */
+static int lanes_match(z80_t *cpu, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        z80_state_t a, b;
+        z80_save_state(&cpu[i], &a);
+        z80_save_state(&cpu[n + i], &b);
+        if (memcmp(&a, &b, sizeof(a)) != 0 ||
+            cpu[i].break_req != cpu[n + i].break_req) {
+            printf("  lane %u: PC %04X AF %04X BC %04X DE %04X HL %04X T %lu, "
+                   "expected PC %04X AF %04X BC %04X DE %04X HL %04X T %lu\n",
+                   i, a.pc, a.af, a.bc, a.de, a.hl, (unsigned long)a.t_states,
+                   b.pc, b.af, b.bc, b.de, b.hl, (unsigned long)b.t_states);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Step the references as z80_lanes_run() steps the lanes; returns how
+   many are not stopped */
+static unsigned lanes_reference(z80_t *cpu, unsigned n, unsigned long insns) {
+    unsigned live = 0;
+    for (unsigned i = 0; i < n; i++) {
+        z80_t *c = &cpu[n + i];
+        for (unsigned long k = 0; k < insns && !c->break_req; k++) z80_step(c);
+        live += !c->break_req;
+    }
+    return live;
+}
+
+/* Opcodes the lanes run as vectors when they agree: register loads and
+   ALU, INC/DEC, the 00xxx111 group, 16-bit INC/DEC and ADD HL, EX DE,HL
+   and LD SP,HL */
+static int lanes_vector_op(uint8_t op) {
+    unsigned y = (op >> 3) & 7, z = op & 7;
+    if (op == 0x00 || op == 0xEB || op == 0xF9) return 1;
+    if (op < 0x40) {
+        if (z == 7 || z == 3) return 1;
+        if (z == 4 || z == 5) return y != 6;
+        return z == 1 && (y & 1);           /* ADD HL,rr */
+    }
+    if (op < 0x80) return y != 6 && z != 6;
+    return op < 0xC0 && z != 6;
+}
+
+/* What the random programs are made of. Diamonds keep both ways the
+   same length, so lanes that split at one meet again after it. */
+static unsigned lanes_emit(uint8_t *p, uint32_t *s) {
+    static const uint8_t scalar_ops[] = {
+        0x7E, 0x77, 0x34, 0x35, 0x46, 0x70,  /* (HL) */
+        0xC5, 0xD5, 0xE5, 0xF5,              /* PUSH */
+        0xC1, 0xD1, 0xE1, 0xF1,              /* POP */
+        0xD9, 0x08, 0xE3,                    /* EXX EX AF,AF' EX (SP),HL */
+        0xFB, 0xF3,                          /* EI DI */
+    };
+    uint32_t r = xorshift(s);
+    uint8_t op;
+    switch (r % 16) {
+    case 0: case 1: case 2: case 3: case 4: case 5:
+        do op = (uint8_t)xorshift(s); while (!lanes_vector_op(op));
+        p[0] = op;
+        return 1;
+    case 6:       /* LD r,n and ALU n */
+        p[0] = (r & 0x100) ? 0xC6 + ((r >> 9) & 7) * 8 : 0x06 + ((r >> 9) & 7) * 8;
+        if (p[0] == 0x36) p[0] = 0x3E;
+        p[1] = (uint8_t)(r >> 16);
+        return 2;
+    case 7:       /* LD rr,nn */
+        p[0] = 0x01 + ((r >> 8) & 3) * 0x10;
+        p[1] = (uint8_t)(r >> 16);
+        p[2] = (uint8_t)(r >> 24);
+        if (p[0] == 0x31) p[2] |= 0x80;  /* Keep the stack in RAM */
+        return 3;
+    case 8: case 9:
+        p[0] = 0xDB;  /* IN A,(n) */
+        p[1] = (uint8_t)(r >> 8);
+        return 2;
+    case 10:
+        if (r & 0x100) {
+            p[0] = 0xCB;  /* Rotates, shifts, BIT/SET/RES */
+            p[1] = (uint8_t)(r >> 16);
+            return 2;
+        }
+        p[0] = scalar_ops[(r >> 16) % sizeof(scalar_ops)];
+        return 1;
+    case 11: case 12:
+        /* JR cc,L1 / X / JR L2 / L1: Y / NOP / L2: */
+        p[0] = 0x20 + ((r >> 8) & 3) * 8;
+        p[1] = 3;
+        do op = (uint8_t)xorshift(s); while (!lanes_vector_op(op));
+        p[2] = op;
+        p[3] = 0x18; p[4] = 2;
+        do op = (uint8_t)xorshift(s); while (!lanes_vector_op(op));
+        p[5] = op;
+        p[6] = 0x00;
+        return 7;
+    case 13:
+        /* JP cc,L1 / X / JR L2 / L1: Y / NOP / L2: */
+        p[0] = 0xC2 + ((r >> 8) & 7) * 8;
+        p[1] = 0; p[2] = 0;  /* Patched by the caller */
+        do op = (uint8_t)xorshift(s); while (!lanes_vector_op(op));
+        p[3] = op;
+        p[4] = 0x18; p[5] = 2;
+        do op = (uint8_t)xorshift(s); while (!lanes_vector_op(op));
+        p[6] = op;
+        p[7] = 0x00;
+        return 8;
+    case 14:      /* LD B,n / L: ALU A,r / DJNZ L */
+        p[0] = 0x06; p[1] = 1 + ((r >> 8) & 7);
+        do op = 0x80 + ((r >> 16) & 0x3F), r >>= 1; while ((op & 7) == 6);
+        p[2] = op;
+        p[3] = 0x10; p[4] = 0xFD;
+        return 5;
+    default:      /* The same loop run as many times as the input says */
+        p[0] = 0xDB; p[1] = 0x00;  /* IN A,(0) */
+        p[2] = 0xE6; p[3] = 0x03;  /* AND 3     */
+        p[4] = 0x3C;               /* INC A     */
+        p[5] = 0x47;               /* LD B,A    */
+        p[6] = 0x81;               /* ADD A,C   */
+        p[7] = 0x10; p[8] = 0xFD;  /* DJNZ -3   */
+        return 9;
+    }
+}
+
+static void lanes_program(uint32_t seed) {
+    unsigned a = 0;
+    memset(lanes_rom, 0, sizeof(lanes_rom));
+    while (a < LANES_ROM - 16) {
+        unsigned len = lanes_emit(lanes_rom + a, &seed);
+        if ((lanes_rom[a] & 0xC7) == 0xC2) {  /* JP cc: to L1 */
+            lanes_rom[a + 1] = (uint8_t)(a + 6);
+            lanes_rom[a + 2] = (uint8_t)((a + 6) >> 8);
+        }
+        a += len;
+    }
+    lanes_rom[a] = 0xC3;  /* JP 0000h */
+}
+
+/* Every group opcode over lanes whose registers differ: with nothing to
+   split them, the group runs the lot as vectors */
+static int test_lanes_every_op(void) {
+    enum { N = 100, TICKS = 2000 };
+    z80_t *cpu = calloc(2 * N, sizeof(z80_t));
+    struct lane_io *io = calloc(2 * N, sizeof(*io));
+    unsigned a = 0;
+    ASSERT(cpu && io, "allocated");
+
+    memset(lanes_rom, 0, sizeof(lanes_rom));
+    for (int op = 0; op < 256; op++)
+        if (lanes_vector_op((uint8_t)op)) lanes_rom[a++] = (uint8_t)op;
+    for (int y = 0; y < 8; y++) {
+        lanes_rom[a++] = 0xC6 + y * 8;           /* ALU A,n */
+        lanes_rom[a++] = (uint8_t)(0x35 * y + 0x80);
+        if (y == 6) continue;
+        lanes_rom[a++] = 0x06 + y * 8;           /* LD r,n */
+        lanes_rom[a++] = (uint8_t)(0x5A + y);
+    }
+    for (int p = 0; p < 3; p++) {
+        lanes_rom[a++] = 0x01 + p * 0x10;        /* LD rr,nn */
+        lanes_rom[a++] = 0x34;
+        lanes_rom[a++] = (uint8_t)(0x12 + p);
+    }
+    lanes_rom[a++] = 0x31; lanes_rom[a++] = 0x00; lanes_rom[a++] = 0xE0;
+    lanes_rom[a++] = 0x18; lanes_rom[a++] = 0x00;  /* JR +0 */
+    lanes_rom[a++] = 0xC3; lanes_rom[a++] = 0x00; lanes_rom[a++] = 0x00;
+    ASSERT(lanes_setup(cpu, io, N, 0xC0FFEE, 0), "set up");
+
+    z80_lanes_t l;
+    ASSERT_EQ(z80_lanes_init(&l, cpu, N), 0, "lanes allocated");
+    for (int k = 0; k < TICKS; k++) {
+        z80_lanes_run(&l, 1);
+        lanes_reference(cpu, N, 1);
+        ASSERT(lanes_match(cpu, N), "lanes match the reference");
+    }
+#ifndef Z80_FLAT_MEMORY
+    ASSERT_EQ(l.stats.group_steps, TICKS, "every instruction as vectors");
+    ASSERT_EQ(l.stats.group_insns, TICKS * N, "for every lane");
+    ASSERT_EQ(l.stats.scalar_insns, 0, "none stepped alone");
+#else
+    ASSERT_EQ(l.stats.scalar_insns, TICKS * N, "flat: all through z80_step()");
+#endif
+    z80_lanes_free(&l);
+    lanes_teardown(cpu, io, N);
+    free(cpu);
+    free(io);
+    return 1;
+}
+
+/* A random program, compared with the reference after every instruction:
+   lanes split on input and stop on breaks */
+static int test_lanes_lockstep(void) {
+    enum { N = 37, TICKS = 3000 };
+    z80_t *cpu = calloc(2 * N, sizeof(z80_t));
+    struct lane_io *io = calloc(2 * N, sizeof(*io));
+    ASSERT(cpu && io, "allocated");
+    lanes_program(0x12345678);
+    ASSERT(lanes_setup(cpu, io, N, 0xBEEF, 1), "set up");
+
+    z80_lanes_t l;
+    ASSERT_EQ(z80_lanes_init(&l, cpu, N), 0, "lanes allocated");
+    unsigned live = N;
+    for (int k = 0; k < TICKS && live; k++) {
+        live = z80_lanes_run(&l, 1);
+        ASSERT_EQ(live, lanes_reference(cpu, N, 1), "lanes still running");
+        ASSERT(lanes_match(cpu, N), "lanes match the reference");
+    }
+    for (unsigned i = 0; i < N; i++)
+        ASSERT(memcmp(io[i].mem, io[N + i].mem, 65536) == 0, "same memory");
+    ASSERT(live < N, "some lanes stopped");
+#ifndef Z80_FLAT_MEMORY
+    ASSERT(l.stats.group_steps > 0, "group ran vectors");
+#endif
+    z80_lanes_free(&l);
+    lanes_teardown(cpu, io, N);
+    free(cpu);
+    free(io);
+    return 1;
+}
+
+/* Longer runs, where lanes wait for the ones behind to catch up and
+   keep their registers in the rows between steps */
+static int test_lanes_batch(void) {
+    enum { N = 64 };
+    static const unsigned long runs[] = { 5000, 7, 1, 20000 };
+    z80_t *cpu = calloc(2 * N, sizeof(z80_t));
+    struct lane_io *io = calloc(2 * N, sizeof(*io));
+    ASSERT(cpu && io, "allocated");
+    lanes_program(0xFEEDFACE);
+    ASSERT(lanes_setup(cpu, io, N, 0x5EED, 1), "set up");
+
+    z80_lanes_t l;
+    ASSERT_EQ(z80_lanes_init(&l, cpu, N), 0, "lanes allocated");
+    for (unsigned k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) {
+        unsigned live = z80_lanes_run(&l, runs[k]);
+        ASSERT_EQ(live, lanes_reference(cpu, N, runs[k]), "lanes still running");
+        ASSERT(lanes_match(cpu, N), "lanes match the reference");
+    }
+    for (unsigned i = 0; i < N; i++)
+        ASSERT(memcmp(io[i].mem, io[N + i].mem, 65536) == 0, "same memory");
+#ifndef Z80_FLAT_MEMORY
+    ASSERT(l.stats.group_insns > 2 * l.stats.scalar_insns, "mostly as vectors");
+#endif
+    z80_lanes_free(&l);
+    lanes_teardown(cpu, io, N);
+    free(cpu);
+    free(io);
+    return 1;
+}
+
 /* ── Main ────────────────────────────────────────────────────────── */
 
 int main(void) {
@@ -1898,6 +3364,7 @@ int main(void) {
     RUN_TEST(test_exx);
     RUN_TEST(test_ex_de_hl);
     RUN_TEST(test_ex_sp_hl);
+    RUN_TEST(test_register_views);
 
     /* DAA, CPL, NEG, SCF, CCF */
     RUN_TEST(test_daa_add);
@@ -1913,6 +3380,9 @@ int main(void) {
     RUN_TEST(test_interrupt_im1);
     RUN_TEST(test_interrupt_im2);
     RUN_TEST(test_nmi);
+    RUN_TEST(test_int_line);
+    RUN_TEST(test_nmi_edge);
+    RUN_TEST(test_int_line_wakes_run);
     RUN_TEST(test_ei_delay);
     RUN_TEST(test_interrupt_unhalts);
 
@@ -1972,6 +3442,73 @@ int main(void) {
     RUN_TEST(test_r_register);
     RUN_TEST(test_r_bit7_preserved);
 
+    /* Batched execution */
+    RUN_TEST(test_run_budget);
+    RUN_TEST(test_run_halt_exit);
+    RUN_TEST(test_run_halt_skip);
+    RUN_TEST(test_run_break);
+    RUN_TEST(test_run_matches_step);
+
+    /* Page-table fast path */
+    RUN_TEST(test_map_ram);
+#ifndef Z80_FLAT_MEMORY
+    RUN_TEST(test_map_rom);
+    RUN_TEST(test_map_fallback);
+#endif
+
+    /* Block instruction fast path */
+    RUN_TEST(test_run_ldir_bulk);
+    RUN_TEST(test_run_ldir_fill);
+    RUN_TEST(test_run_lddr_budget);
+    RUN_TEST(test_run_cpir_bulk);
+    RUN_TEST(test_run_ldir_overwrites_itself);
+    RUN_TEST(test_run_otir_break);
+
+    /* Decode cache */
+    RUN_TEST(test_dcache_matches_uncached);
+    RUN_TEST(test_dcache_self_modifying);
+    RUN_TEST(test_dcache_operand_patch);
+    RUN_TEST(test_dcache_host_invalidate);
+
+    /* Basic block tier */
+    RUN_TEST(test_blocks_matches_uncached);
+    RUN_TEST(test_blocks_patches_own_block);
+    RUN_TEST(test_blocks_break_from_io);
+
+    /* PC traps */
+    RUN_TEST(test_trap_call);
+    RUN_TEST(test_trap_continue);
+    RUN_TEST(test_trap_cached_code);
+
+    /* Watches */
+#ifndef Z80_FLAT_MEMORY
+    RUN_TEST(test_watch_read);
+    RUN_TEST(test_watch_write);
+    RUN_TEST(test_watch_break);
+    RUN_TEST(test_watch_cached_code);
+#endif
+
+    /* Flags accessors */
+    RUN_TEST(test_flags_from_callback);
+
+    /* State save/restore */
+    RUN_TEST(test_state_round_trip);
+
+#ifdef Z80_PROFILE
+    /* Profiler */
+    RUN_TEST(test_profile_counts);
+#endif
+
+#ifdef Z80_TRACE
+    /* Instruction trace */
+    RUN_TEST(test_trace_triggers);
+#endif
+
+    /* Lockstep lanes */
+    RUN_TEST(test_lanes_every_op);
+    RUN_TEST(test_lanes_lockstep);
+    RUN_TEST(test_lanes_batch);
+
     printf("\n==================\n");
     printf("Results: %d/%d passed", tests_passed, tests_run);
     if (tests_failed) printf(", %d FAILED", tests_failed);
@@ -1,32 +1,24 @@
-#include "z80.h"
+#include "machine.h"
+#include "bdos.h"
+#include "gdb.h"
+#include "server.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <termios.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <signal.h>
-
-/* ── System types ────────────────────────────────────────────────── */
-
-enum system_type { SYS_AUTO, SYS_BASIC, SYS_CPM };
+#include <pthread.h>
+#include <time.h>
 
 /* ── Emulator state ──────────────────────────────────────────────── */
 
-static uint8_t memory[65536];
-static z80_t cpu;
-
-/* ACIA state */
-static uint8_t acia_rx_data;
-static int     acia_rx_ready;
-static int     acia_irq_enabled;
-static uint16_t serial_base = 0x80; /* Status port; data port = base+1 */
+static machine_t machine;  /* The interactive machine */
 
 /* Terminal state */
 static struct termios orig_termios;
 static int raw_mode = 0;
-static volatile sig_atomic_t quit_flag = 0;
 
 /* ── Terminal helpers ────────────────────────────────────────────── */
 
@@ -52,305 +44,276 @@ static void set_raw_mode(void) {
     raw_mode = 1;
 }
 
-static int char_available(void) {
-    unsigned char ch;
-    ssize_t n = read(STDIN_FILENO, &ch, 1);
-    if (n == 1) {
-        if (ch == 0x1D) { /* Ctrl+] exits emulator */
-            quit_flag = 1;
-            return 0;
-        }
-        acia_rx_data = ch;
-        return 1;
-    }
-    return 0;
-}
-
 /* ── Signal handler ──────────────────────────────────────────────── */
 
 static void sig_handler(int sig) {
     (void)sig;
-    quit_flag = 1;
-}
-
-/* ── Memory callbacks ────────────────────────────────────────────── */
-
-static uint8_t mem_read(void *ctx, uint16_t addr) {
-    (void)ctx;
-    return memory[addr];
-}
-
-static void mem_write(void *ctx, uint16_t addr, uint8_t val) {
-    (void)ctx;
-    memory[addr] = val;
+    machine.quit = 1;
 }
 
-/* ── BASIC SBC I/O callbacks ─────────────────────────────────────── */
-
-static uint8_t basic_io_in(void *ctx, uint16_t port) {
-    (void)ctx;
-    uint8_t p = port & 0xFF;
-    if (p == serial_base) {
-        /* ACIA status register */
-        uint8_t status = 0x02; /* TDRE always ready */
-        if (acia_rx_ready)
-            status |= 0x01; /* RDRF */
-        return status;
-    }
-    if (p == (uint8_t)(serial_base + 1)) {
-        /* ACIA data register */
-        acia_rx_ready = 0;
-        return acia_rx_data;
+/* ── Batch mode ──────────────────────────────────────────────────── */
+
+/* --jobs N: run a list of CP/M images on a pool of worker threads, one
+   machine per image. Console output of each image is collected and
+   printed in command-line order once all have finished. */
+
+struct batch_job {
+    const char *file;
+    char       *out;
+    size_t      out_len;
+    int         ok;
+};
+
+struct batch {
+    struct batch_job *jobs;
+    int               count;
+    int               next;   /* Next job to hand out */
+    enum system_type  sys;
+    int               cpu_flags;
+    const char       *disk_dir;
+    pthread_mutex_t   lock;
+};
+
+static void *batch_worker(void *arg) {
+    struct batch *b = arg;
+    machine_t *m = malloc(sizeof(*m));
+    if (!m) return NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->count) break;
+
+        struct batch_job *job = &b->jobs[i];
+        enum system_type sys = b->sys;
+        machine_init(m, b->cpu_flags);
+        m->disk_dir = b->disk_dir;
+        m->in_fd = -1;
+        m->out_fd = -1;  /* Collect output */
+        int loaded = machine_load(m, job->file, &sys, 0);
+        if (loaded >= 0 && sys != SYS_CPM)
+            fprintf(stderr, "%s: not a CP/M image\n", job->file);
+        if (loaded >= 0 && sys == SYS_CPM) {
+            machine_start(m, sys, -1, loaded);
+            machine_run(m);
+
+            job->out = m->out_buf;  /* Job takes over the buffer */
+            job->out_len = m->out_len;
+            job->ok = 1;
+            m->out_buf = NULL;
+        }
+        machine_free(m);
     }
-    return 0xFF;
+
+    free(m);
+    return NULL;
 }
 
-static void basic_io_out(void *ctx, uint16_t port, uint8_t val) {
-    (void)ctx;
-    uint8_t p = port & 0xFF;
-    if (p == serial_base) {
-        /* ACIA control register */
-        if (val == 0x03) {
-            /* Master reset */
-            acia_rx_ready = 0;
-            acia_irq_enabled = 0;
-        } else {
-            /* Check if receive interrupt enabled (bit 7) */
-            acia_irq_enabled = (val & 0x80) ? 1 : 0;
-        }
-        return;
+static int run_batch(char **files, int count, int nthreads,
+                     enum system_type sys, int cpu_flags,
+                     const char *disk_dir) {
+    struct batch b = { 0 };
+    b.jobs = calloc(count, sizeof(*b.jobs));
+    if (!b.jobs) { perror("calloc"); return 1; }
+    b.count = count;
+    b.sys = sys;
+    b.cpu_flags = cpu_flags;
+    b.disk_dir = disk_dir;
+    pthread_mutex_init(&b.lock, NULL);
+    for (int i = 0; i < count; i++) b.jobs[i].file = files[i];
+
+    if (nthreads > count) nthreads = count;
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    if (!threads) { perror("calloc"); return 1; }
+    int started = 0;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &b) != 0)
+            break;
     }
-    if (p == (uint8_t)(serial_base + 1)) {
-        /* ACIA data register - transmit */
-        if (val == '\r') {
-            write(STDOUT_FILENO, "\r\n", 2);
-        } else {
-            char ch = val;
-            write(STDOUT_FILENO, &ch, 1);
+    if (started == 0) batch_worker(&b);  /* No threads: run inline */
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&b.lock);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        struct batch_job *job = &b.jobs[i];
+        printf("==> %s <==\n", job->file);
+        if (job->out_len) {
+            fwrite(job->out, 1, job->out_len, stdout);
+            if (job->out[job->out_len - 1] != '\n') putchar('\n');
         }
-        return;
+        if (!job->ok) failed++;
+        free(job->out);
     }
-}
-
-/* ── CP/M I/O callbacks ──────────────────────────────────────────── */
-
-static uint8_t cpm_io_in(void *ctx, uint16_t port) {
-    (void)ctx; (void)port;
-    return 0xFF;
-}
-
-static void cpm_io_out(void *ctx, uint16_t port, uint8_t val) {
-    (void)ctx; (void)port; (void)val;
-}
-
-/* ── File loading ────────────────────────────────────────────────── */
+    free(b.jobs);
+    fflush(stdout);
 
-static int load_binary(const char *path, uint16_t addr) {
-    FILE *f = fopen(path, "rb");
-    if (!f) { perror(path); return -1; }
-    fseek(f, 0, SEEK_END);
-    long sz = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    if (sz > 65536 - addr) sz = 65536 - addr;
-    fread(&memory[addr], 1, sz, f);
-    fclose(f);
-    return (int)sz;
+    fprintf(stderr, "%d image%s, %d failed\n", count, count == 1 ? "" : "s",
+            failed);
+    return failed ? 1 : 0;
 }
 
-static int hex_nibble(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return -1;
-}
+/* ── Server mode ─────────────────────────────────────────────────── */
 
-static int hex_byte(const char *s) {
-    int hi = hex_nibble(s[0]);
-    int lo = hex_nibble(s[1]);
-    if (hi < 0 || lo < 0) return -1;
-    return (hi << 4) | lo;
+/* --listen PORT: the machine, loaded and started (or resumed) but not
+   yet run, is frozen once and every connection is forked from that */
+static int run_server(int port, int workers, int cpu_flags) {
+    if (machine.sys != SYS_BASIC) {
+        fprintf(stderr, "--listen serves BASIC machines only\n");
+        return 1;
+    }
+    machine_snapshot_t *boot = malloc(sizeof(*boot));
+    if (!boot) { perror("malloc"); return 1; }
+    machine_save(&machine, boot);
+    if (workers < 1) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    int rc = server_run(boot, port, workers, cpu_flags, &machine.quit);
+    free(boot);
+    machine_free(&machine);
+    return rc;
 }
 
-static int load_hex(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) { perror(path); return -1; }
-
-    char line[600];
-    int total = 0;
-    while (fgets(line, sizeof(line), f)) {
-        /* Skip lines that don't start with : */
-        if (line[0] != ':') continue;
+/* ── Profile report ──────────────────────────────────────────────── */
 
-        int len = hex_byte(&line[1]);
-        if (len < 0) continue;
+/* --profile FILE (-DZ80_PROFILE builds): the hottest PCs and opcodes go
+   to stderr at exit, and the call tree to FILE as folded stacks, one
+   "caller;callee;... T-states" line per routine, as flamegraph.pl and
+   speedscope read them */
 
-        int addr_hi = hex_byte(&line[3]);
-        int addr_lo = hex_byte(&line[5]);
-        if (addr_hi < 0 || addr_lo < 0) continue;
-        uint16_t addr = (addr_hi << 8) | addr_lo;
+#define PROFILE_TOP 20
 
-        int type = hex_byte(&line[7]);
-        if (type < 0) continue;
-
-        if (type == 0x01) break; /* EOF record */
-        if (type != 0x00) continue; /* Only process data records */
-
-        for (int i = 0; i < len; i++) {
-            int b = hex_byte(&line[9 + i * 2]);
-            if (b < 0) break;
-            memory[addr + i] = (uint8_t)b;
-            total++;
-        }
-    }
-    fclose(f);
-    return total;
-}
+struct prof_row {
+    unsigned      key;  /* PC, or table << 8 | opcode */
+    unsigned long count, tstates;
+};
 
-static int is_hex_file(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return 0;
-    if (strcasecmp(ext, ".hex") == 0) return 1;
-
-    /* Check if file starts with : (Intel HEX format) */
-    FILE *f = fopen(path, "r");
-    if (!f) return 0;
-    int ch = fgetc(f);
-    fclose(f);
-    return ch == ':';
+static int prof_row_cmp(const void *a, const void *b) {
+    const struct prof_row *x = a, *y = b;
+    return (x->tstates < y->tstates) - (x->tstates > y->tstates);
 }
 
-/* ── Serial port auto-detection ──────────────────────────────────── */
-
-static uint16_t detect_serial_port(int rom_size) {
-    /* Scan ROM for IN A,(n) [DB xx] and OUT (n),A [D3 xx] patterns */
-    int in_count[256] = {0};
-    int out_count[256] = {0};
-
-    for (int i = 0; i < rom_size - 1; i++) {
-        if (memory[i] == 0xDB)
-            in_count[memory[i + 1]]++;
-        else if (memory[i] == 0xD3)
-            out_count[memory[i + 1]]++;
+static void print_rows(const char *title, struct prof_row *rows, size_t n,
+                       unsigned long total, int opcodes) {
+    static const char *const table[Z80_PROF_TABLES] = {
+        "", "CB ", "ED ", "DD ", "FD ", "DDCB "
+    };
+    qsort(rows, n, sizeof(*rows), prof_row_cmp);
+    fprintf(stderr, "\r\n%-10s %12s %14s %7s\r\n", title, "count",
+            "T-states", "share");
+    for (size_t i = 0; i < n && i < PROFILE_TOP; i++) {
+        char name[16];
+        if (opcodes)
+            snprintf(name, sizeof(name), "%s%02X", table[rows[i].key >> 8],
+                     rows[i].key & 0xFF);
+        else
+            snprintf(name, sizeof(name), "0x%04X", rows[i].key);
+        fprintf(stderr, "%-10s %12lu %14lu %6.2f%%\r\n", name,
+                rows[i].count, rows[i].tstates,
+                total ? 100.0 * rows[i].tstates / total : 0.0);
     }
+}
 
-    /* Look for adjacent port pairs where both IN and OUT appear.
-       ACIA pattern: IN on status port + OUT on both ports.
-       Score pairs that have both IN and OUT activity. */
-    int best_port = 0x80;
-    int best_score = 0;
-
-    for (int p = 0; p < 255; p++) {
-        /* Need both IN and OUT on the pair to be a serial port */
-        int has_in  = in_count[p] + in_count[p + 1];
-        int has_out = out_count[p] + out_count[p + 1];
-        if (has_in == 0 || has_out == 0) continue;
-
-        int score = has_in + has_out;
-        if (score > best_score) {
-            best_score = score;
-            best_port = p;
+static void write_folded(const z80_profile_t *p, FILE *f) {
+    for (uint32_t i = 0; i < p->nnodes; i++) {
+        if (!p->node[i].tstates) continue;
+        uint16_t path[Z80_PROF_DEPTH + 1];
+        int depth = 0;
+        for (uint32_t n = i; depth <= Z80_PROF_DEPTH; n = p->node[n].parent) {
+            path[depth++] = p->node[n].addr;
+            if (n == 0) break;
         }
+        while (depth--)
+            fprintf(f, "0x%04X%c", path[depth], depth ? ';' : ' ');
+        fprintf(f, "%lu\n", p->node[i].tstates);
     }
-
-    if (best_score > 0)
-        return (uint16_t)best_port;
-    return 0x80; /* Default */
 }
 
-/* ── System detection ────────────────────────────────────────────── */
-
-static enum system_type detect_system(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return SYS_BASIC;
-
-    if (strcasecmp(ext, ".com") == 0) return SYS_CPM;
-    if (strcasecmp(ext, ".cim") == 0) return SYS_CPM;
-    return SYS_BASIC;
-}
-
-/* ── BDOS emulation ──────────────────────────────────────────────── */
-
-static int handle_bdos(void) {
-    uint8_t fn = cpu.C;
-    switch (fn) {
-        case 2: /* C_WRITE: output character in E */
-            {
-                char ch = cpu.E;
-                write(STDOUT_FILENO, &ch, 1);
-            }
-            break;
-        case 9: /* C_WRITESTR: output $-terminated string at DE */
-            {
-                uint16_t addr = ((uint16_t)cpu.D << 8) | cpu.E;
-                while (1) {
-                    uint8_t ch = memory[addr++];
-                    if (ch == '$') break;
-                    write(STDOUT_FILENO, &ch, 1);
-                    if (addr == 0) break; /* Wrapped */
-                }
-            }
-            break;
-        case 0: /* P_TERMCPM: terminate */
-            return 1;
-        default:
-            break;
+static int report_profile(const z80_profile_t *p, const char *path) {
+    size_t rows_max = 65536 > Z80_PROF_TABLES * 256 ? 65536
+                                                   : Z80_PROF_TABLES * 256;
+    struct prof_row *rows = malloc(rows_max * sizeof(*rows));
+    if (!rows) { perror("malloc"); return -1; }
+
+    unsigned long insns = 0, total = 0;
+    size_t n = 0;
+    for (unsigned pc = 0; pc < 65536; pc++) {
+        if (!p->pc_count[pc]) continue;
+        rows[n++] = (struct prof_row){ pc, p->pc_count[pc], p->pc_tstates[pc] };
+        insns += p->pc_count[pc];
+        total += p->pc_tstates[pc];
     }
-    /* Execute RET to return from CALL 5 */
-    cpu.PC = memory[cpu.SP] | ((uint16_t)memory[cpu.SP + 1] << 8);
-    cpu.SP += 2;
+    fprintf(stderr, "\r\nProfile: %lu instructions, %lu T-states\r\n",
+            insns, total);
+    print_rows("PC", rows, n, total, 0);
+
+    n = 0;
+    for (unsigned t = 0; t < Z80_PROF_TABLES; t++)
+        for (unsigned op = 0; op < 256; op++)
+            if (p->op_count[t][op])
+                rows[n++] = (struct prof_row){ t << 8 | op, p->op_count[t][op],
+                                               p->op_tstates[t][op] };
+    print_rows("Opcode", rows, n, total, 1);
+    free(rows);
+
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    write_folded(p, f);
+    if (fclose(f) != 0) { perror(path); return -1; }
+    fprintf(stderr, "Call stacks written to %s\r\n", path);
     return 0;
 }
 
-/* ── Run modes ───────────────────────────────────────────────────── */
-
-static void run_basic(void) {
-    set_raw_mode();
-    signal(SIGINT, sig_handler);
-    signal(SIGTERM, sig_handler);
-
-    while (!quit_flag) {
-        /* Run ~7373 cycles (approximately 2ms at 3.6864 MHz) */
-        unsigned long target = cpu.t_states + 7373;
-        while (cpu.t_states < target) {
-            z80_step(&cpu);
-        }
-
-        /* Poll for input */
-        if (char_available()) {
-            acia_rx_ready = 1;
-            /* Deliver interrupt if enabled */
-            if (acia_irq_enabled && cpu.IFF1) {
-                z80_interrupt(&cpu, 0xFF); /* RST 38h */
-            }
-        }
-    }
-
-    restore_terminal();
-}
-
-static void run_cpm(void) {
-    while (1) {
-        /* Check for exit conditions */
-        if (cpu.PC == 0x0000) break;
-        if (cpu.halted) break;
-
-        /* BDOS intercept at address 0x0005 */
-        if (cpu.PC == 0x0005) {
-            if (handle_bdos()) break;
-            continue;
-        }
-
-        z80_step(&cpu);
+/* ── Trace triggers ──────────────────────────────────────────────── */
+
+/* --trace-start / --trace-stop: "pc=ADDR" or "t=T-STATES" */
+static int parse_trigger(const char *s, int32_t *pc, uint64_t *t) {
+    char *end;
+    if (strncmp(s, "pc=", 3) == 0) {
+        long v = strtol(s + 3, &end, 0);
+        if (*end || end == s + 3 || v < 0 || v > 0xFFFF) return -1;
+        *pc = (int32_t)v;
+    } else if (strncmp(s, "t=", 2) == 0) {
+        unsigned long long v = strtoull(s + 2, &end, 0);
+        if (*end || end == s + 2) return -1;
+        *t = v;
+    } else {
+        return -1;
     }
+    return 0;
 }
 
 /* ── Usage ───────────────────────────────────────────────────────── */
 
 static void usage(const char *argv0) {
-    fprintf(stderr, "Usage: %s [options] <file>\n", argv0);
+    fprintf(stderr, "Usage: %s [options] <file> [CP/M command tail...]\n", argv0);
+    fprintf(stderr, "       %s --load-state <snapshot> [options]\n", argv0);
+    fprintf(stderr, "       %s --jobs N [options] <file>...\n", argv0);
+    fprintf(stderr, "       %s --listen <port> [--jobs N] [options] <file>\n", argv0);
     fprintf(stderr, "\nOptions:\n");
     fprintf(stderr, "  --system cpm|basic   Force system type\n");
+    fprintf(stderr, "  --disk <dir>         Host directory for CP/M files (default .)\n");
     fprintf(stderr, "  --port <hex>         Override serial port base (e.g. 0x80)\n");
+    fprintf(stderr, "  --jobs N             Run CP/M images in batch on N threads\n");
+    fprintf(stderr, "  --listen <port>      Serve a BASIC machine per TCP connection, on\n");
+    fprintf(stderr, "                       N worker threads (default: one per CPU)\n");
+    fprintf(stderr, "  --clock <MHz>|max    Run at that clock speed in real time (default max)\n");
+    fprintf(stderr, "  --gdb <port>         Wait for gdb on 127.0.0.1:<port> and run under it\n");
+    fprintf(stderr, "  --dcache             Enable the decode cache, report its hit rate\n");
+    fprintf(stderr, "  --blocks             Also run hot basic blocks as threaded code\n");
+    fprintf(stderr, "  --no-flow            Feed console input without flow control\n");
+    fprintf(stderr, "  --save-state <file>  Snapshot the machine to <file> when it stops\n");
+    fprintf(stderr, "  --load-state <file>  Resume a snapshot instead of loading an image\n");
+    fprintf(stderr, "  --record <file>      Record console input and output to <file>\n");
+    fprintf(stderr, "  --replay <file>      Rerun a recording flat out, check the output\n");
+    fprintf(stderr, "  --profile <file>     Report hot spots, write call stacks to <file>\n");
+    fprintf(stderr, "                       (needs a profiling build: make zxs_prof)\n");
+    fprintf(stderr, "  --trace <file>       Record every instruction to <file> (zxs_prof;\n");
+    fprintf(stderr, "                       read it back with zxs-trace)\n");
+    fprintf(stderr, "  --trace-start pc=<addr>|t=<n>  Start tracing there\n");
+    fprintf(stderr, "  --trace-stop pc=<addr>|t=<n>   Stop tracing there\n");
     fprintf(stderr, "\nAuto-detection:\n");
     fprintf(stderr, "  .com/.cim -> CP/M, everything else -> BASIC SBC\n");
     fprintf(stderr, "  Intel HEX files loaded by format, binary files at 0x0000\n");
@@ -361,7 +324,21 @@ static void usage(const char *argv0) {
 int main(int argc, char **argv) {
     enum system_type sys = SYS_AUTO;
     int port_override = -1;
-    const char *file = NULL;
+    int jobs = 0;
+    int listen_port = 0;
+    int gdb_port = 0;
+    unsigned long clock_hz = 0;
+    int cpu_flags = 0;
+    int rx_flow = 1;
+    const char *save_state = NULL, *load_state = NULL, *profile = NULL;
+    const char *trace = NULL;
+    const char *record = NULL, *replay = NULL;
+    const char *disk_dir = NULL;
+    int32_t trace_start_pc = -1, trace_stop_pc = -1;
+    uint64_t trace_start_t = 0, trace_stop_t = UINT64_MAX;
+    char **files = calloc(argc, sizeof(*files));
+    int nfiles = 0;
+    if (!files) { perror("calloc"); return 1; }
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--system") == 0 && i + 1 < argc) {
@@ -372,68 +349,209 @@ int main(int argc, char **argv) {
         } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
             i++;
             port_override = (int)strtol(argv[i], NULL, 16);
+        } else if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc) {
+            disk_dir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            i++;
+            jobs = atoi(argv[i]);
+            if (jobs < 1) { fprintf(stderr, "Bad job count: %s\n", argv[i]); return 1; }
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            i++;
+            listen_port = atoi(argv[i]);
+            if (listen_port < 1 || listen_port > 65535) {
+                fprintf(stderr, "Bad port: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc) {
+            i++;
+            gdb_port = atoi(argv[i]);
+            if (gdb_port < 1 || gdb_port > 65535) {
+                fprintf(stderr, "Bad port: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "max") != 0) {
+                char *end;
+                double mhz = strtod(argv[i], &end);
+                if (*end || mhz < 0.001 || mhz > 100000) {
+                    fprintf(stderr, "Bad clock: %s\n", argv[i]);
+                    return 1;
+                }
+                clock_hz = (unsigned long)(mhz * 1e6 + 0.5);
+            }
+        } else if (strcmp(argv[i], "--dcache") == 0) {
+            cpu_flags |= Z80_INIT_DCACHE;
+        } else if (strcmp(argv[i], "--blocks") == 0) {
+            cpu_flags |= Z80_INIT_BLOCKS;
+        } else if (strcmp(argv[i], "--no-flow") == 0) {
+            rx_flow = 0;
+        } else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+            save_state = argv[++i];
+        } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            load_state = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if ((strcmp(argv[i], "--trace-start") == 0 ||
+                    strcmp(argv[i], "--trace-stop") == 0) && i + 1 < argc) {
+            int start = strcmp(argv[i], "--trace-start") == 0;
+            i++;
+            if (parse_trigger(argv[i], start ? &trace_start_pc : &trace_stop_pc,
+                              start ? &trace_start_t : &trace_stop_t) < 0) {
+                fprintf(stderr, "Bad trace trigger: %s\n", argv[i]);
+                return 1;
+            }
         } else if (argv[i][0] == '-') {
             usage(argv[0]);
             return 1;
         } else {
-            file = argv[i];
+            files[nfiles++] = argv[i];
         }
     }
 
-    if (!file) {
+    if ((nfiles == 0) == !load_state ||
+        (jobs && !listen_port && (load_state || save_state || profile ||
+                                  trace || clock_hz || record || replay)) ||
+        (listen_port && (nfiles > 1 || save_state || profile || trace ||
+                         clock_hz || record || replay)) ||
+        (replay && (record || clock_hz)) ||
+        (gdb_port && (jobs || listen_port || clock_hz || record || replay))) {
         usage(argv[0]);
         return 1;
     }
 
-    /* Initialize CPU */
-    memset(memory, 0, sizeof(memory));
-    z80_init(&cpu);
-    cpu.mem_read = mem_read;
-    cpu.mem_write = mem_write;
-    cpu.ctx = NULL;
-
-    /* Load file */
-    int loaded;
-    if (is_hex_file(file)) {
-        loaded = load_hex(file);
-        if (loaded < 0) return 1;
-        fprintf(stderr, "Loaded %d bytes from HEX file\n", loaded);
+    if (jobs && !listen_port)
+        return run_batch(files, nfiles, jobs, sys, cpu_flags, disk_dir);
+
+    /* Initialize machine */
+    machine_init(&machine, cpu_flags);
+    machine.rx_flow = rx_flow;
+    machine.disk_dir = disk_dir;
+
+    if (load_state) {
+        /* Resume where the snapshot left off */
+        const machine_snapshot_t *snap = machine_map_snapshot(load_state);
+        if (!snap) return 1;
+        machine_restore(&machine, snap);
+        machine_unmap_snapshot(snap);
+        sys = machine.sys;
+        fprintf(stderr, "Resumed %s at PC=0x%04X, %lu T-states in\n",
+                load_state, machine.cpu.PC, machine.cpu.t_states);
     } else {
-        /* Detect system for loading address */
-        if (sys == SYS_AUTO) sys = detect_system(file);
-        uint16_t load_addr = (sys == SYS_CPM) ? 0x0100 : 0x0000;
-        loaded = load_binary(file, load_addr);
+        /* Load file */
+        int loaded = machine_load(&machine, files[0], &sys, 1);
         if (loaded < 0) return 1;
-        fprintf(stderr, "Loaded %d bytes at 0x%04X\n", loaded, load_addr);
-    }
-
-    /* Auto-detect system if needed */
-    if (sys == SYS_AUTO) sys = detect_system(file);
 
-    /* Configure system */
-    if (sys == SYS_BASIC) {
-        if (port_override >= 0) {
-            serial_base = (uint16_t)port_override;
-        } else {
-            serial_base = detect_serial_port(loaded);
+        /* Configure system */
+        machine_start(&machine, sys, port_override, loaded);
+        if (nfiles > 1 && (sys != SYS_CPM || listen_port)) {
+            usage(argv[0]);
+            return 1;
         }
-        fprintf(stderr, "BASIC SBC mode, serial port base: 0x%02X (Ctrl+] to exit)\n", serial_base);
-        cpu.io_in = basic_io_in;
-        cpu.io_out = basic_io_out;
-        cpu.PC = 0x0000;
-        run_basic();
+        if (sys == SYS_CPM) {
+            /* The rest of the command line is the program's */
+            size_t len = 1;
+            for (int i = 1; i < nfiles; i++) len += strlen(files[i]) + 1;
+            char *tail = calloc(1, len);
+            if (!tail) { perror("calloc"); return 1; }
+            for (int i = 1; i < nfiles; i++) {
+                if (i > 1) strcat(tail, " ");
+                strcat(tail, files[i]);
+            }
+            bdos_command_tail(&machine, tail);
+            free(tail);
+        }
+    }
+    if (listen_port)
+        return run_server(listen_port, jobs, cpu_flags);
+    if (profile && z80_profile_start(&machine.cpu) != 0) {
+        fprintf(stderr, "--profile needs a build with -DZ80_PROFILE "
+                "(make zxs_prof)\n");
+        return 1;
+    }
+    trace_writer_t *tw = NULL;
+    if (trace) {
+        if (!(tw = trace_writer_open(&machine.cpu, trace))) return 1;
+        tw->ring.start_pc = trace_start_pc;
+        tw->ring.start_t = trace_start_t;
+        tw->ring.stop_pc = trace_stop_pc;
+        tw->ring.stop_t = trace_stop_t;
+    }
+    machine_set_clock(&machine, clock_hz);
+    if ((record && machine_record(&machine, record) < 0) ||
+        (replay && machine_replay(&machine, replay) < 0))
+        return 1;
+    if (gdb_port && gdb_attach(&machine, gdb_port) < 0) return 1;
+    /* Terminal syscalls on their own thread; inline if that fails. Not
+       while recording, as its output backpressure isn't reproducible. */
+    if (!record && !replay) machine_io_start(&machine);
+    int status = 0;
+    if (replay) {
+        struct timespec t0, t1;
+        unsigned long t_start = machine.cpu.t_states;
+        fprintf(stderr, "Replaying %s\n", replay);
+        signal(SIGINT, sig_handler);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        machine_run(&machine);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+        unsigned long cycles = machine.cpu.t_states - t_start;
+        status = machine_log_close(&machine) != 0;
+        if (!status)
+            fprintf(stderr, "\r\nReplay matched: %lu T-states in %.3f s "
+                    "(%.1f MHz)\r\n", cycles, dt, cycles / dt / 1e6);
+    } else if (sys == SYS_BASIC) {
+        fprintf(stderr, "BASIC SBC mode, serial port base: 0x%02X (Ctrl+] to exit)\n",
+                machine.serial_base);
+        set_raw_mode();
+        signal(SIGINT, sig_handler);
+        signal(SIGTERM, sig_handler);
+        machine_run(&machine);
+        restore_terminal();
     } else {
         fprintf(stderr, "CP/M mode\n");
-        cpu.io_in = cpm_io_in;
-        cpu.io_out = cpm_io_out;
-        cpu.PC = 0x0100;
-        cpu.SP = 0xFFFE;
-        /* Push return address 0x0000 for clean exit */
-        cpu.SP -= 2;
-        memory[cpu.SP] = 0x00;
-        memory[cpu.SP + 1] = 0x00;
-        run_cpm();
+        machine_run(&machine);
+    }
+    gdb_detach(&machine);
+    if (record) {
+        if (machine_log_close(&machine) == 0)
+            fprintf(stderr, "\r\nRecorded to %s\r\n", record);
+        else
+            status = 1;
+    }
+    if (save_state && machine_save_file(&machine, save_state) == 0)
+        fprintf(stderr, "\r\nSaved state to %s\r\n", save_state);
+    if (machine.cpu.prof) report_profile(machine.cpu.prof, profile);
+    if (clock_hz)
+        fprintf(stderr, "\r\nClock %.4f MHz: %lu of %lu 1ms deadlines missed, "
+                "worst lag %.1f ms, %lu resyncs\r\n", clock_hz / 1e6,
+                machine.pace_late, machine.pace_batches,
+                machine.pace_lag_max_ns / 1e6, machine.pace_resyncs);
+    if (tw) {
+        long n = trace_writer_close(tw, &machine.cpu);
+        if (n >= 0)
+            fprintf(stderr, "\r\nTraced %ld instructions to %s\r\n", n, trace);
     }
 
-    return 0;
+    z80_dcache_stats_t st;
+    if (z80_dcache_stats(&machine.cpu, &st) == 0) {
+        unsigned long total = st.hits + st.misses;
+        fprintf(stderr, "\r\nDecode cache: %lu hits (%.1f%%), %lu misses, "
+                "%lu invalidations\r\n", st.hits,
+                total ? 100.0 * st.hits / total : 0.0, st.misses,
+                st.invalidations);
+        if (st.blocks)
+            fprintf(stderr, "Basic blocks: %lu built, %lu instructions "
+                    "run from them\r\n", st.blocks, st.block_insns);
+    }
+    machine_free(&machine);
+
+    free(files);
+    return status;
 }
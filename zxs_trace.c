@@ -0,0 +1,59 @@
+/* zxs-trace: print a zxs --trace file, one instruction per line */
+
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-s] <trace>\n", argv0);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -s   Also show the shadow registers AF' BC' DE' HL'\n");
+}
+
+int main(int argc, char **argv) {
+    int shadow = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            shadow = 1;
+        } else if (argv[i][0] == '-' || path) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    trace_reader_t *r = trace_reader_open(path);
+    if (!r) return 1;
+
+    printf("%14s  PC   OPCODES      AF   BC   DE   HL   IX   IY   SP  "
+           " I  R IFF IM", "T-STATES");
+    if (shadow) printf("  AF'  BC'  DE'  HL'");
+    putchar('\n');
+
+    z80_trace_rec_t rec;
+    int rc;
+    while ((rc = trace_reader_next(r, &rec)) > 0) {
+        printf("%14llu  %04X %02X %02X %02X %02X  %04X %04X %04X %04X "
+               "%04X %04X %04X  %02X %02X  %d%d  %d",
+               (unsigned long long)rec.t_states, rec.pc,
+               rec.op[0], rec.op[1], rec.op[2], rec.op[3],
+               rec.af, rec.bc, rec.de, rec.hl, rec.ix, rec.iy, rec.sp,
+               rec.i, rec.r, rec.iff & 1, rec.iff >> 1, rec.im);
+        if (shadow)
+            printf("  %04X %04X %04X %04X", rec.af_, rec.bc_, rec.de_,
+                   rec.hl_);
+        putchar('\n');
+    }
+    trace_reader_close(r);
+    if (rc < 0) {
+        fprintf(stderr, "%s: truncated\n", path);
+        return 1;
+    }
+    return 0;
+}